@@ -259,6 +259,24 @@ void nm_bsp_sleep(uint32 u32TimeMsec);
 void nm_bsp_register_isr(tpfNmBspIsr pfIsr);
 /**@}*/
 
+/** @defgroup NmBspRegisterNotifyFn nm_bsp_register_notify
+*     @ingroup BSPAPI
+*   Register an application function called inside the WINC interrupt, after the HIF handler.
+*/
+/**@{*/
+/*!
+ * @fn           void nm_bsp_register_notify(tpfNmBspIsr);
+ * @param [in]   tpfNmBspIsr  pfNotify
+ *               Pointer to the function, NULL to remove it
+ * @brief		 Lets a task that waits for work block until the WINC raises its IRQ, instead of polling
+ *				 \ref m2m_wifi_handle_events. The function runs in interrupt context and should only
+ *				 signal the task; the events themselves are still handled by \ref m2m_wifi_handle_events.
+ * @note         Implementation of this function is host dependent.
+ * @return       None
+ */
+void nm_bsp_register_notify(tpfNmBspIsr pfNotify);
+/**@}*/
+
   
 /** @defgroup NmBspInterruptCtrl nm_bsp_interrupt_ctrl
 *     @ingroup BSPAPI
@@ -39,12 +39,16 @@
 #include "conf_winc.h"
 
 static tpfNmBspIsr gpfIsr;
+static tpfNmBspIsr gpfNotify;
 
 static void chip_isr(void)
 {
 	if (gpfIsr) {
 		gpfIsr();
 	}
+	if (gpfNotify) {
+		gpfNotify();
+	}
 }
 
 /*
@@ -164,6 +168,17 @@ void nm_bsp_register_isr(tpfNmBspIsr pfIsr)
 			EXTINT_CALLBACK_TYPE_DETECT);
 }
 
+/*
+ *	@fn		nm_bsp_register_notify
+ *	@brief	Register an application function called from the WINC interrupt after the HIF handler
+ *	@param[IN]	pfNotify
+ *				Pointer to the function, NULL to remove it
+ */
+void nm_bsp_register_notify(tpfNmBspIsr pfNotify)
+{
+	gpfNotify = pfNotify;
+}
+
 /*
  *	@fn		nm_bsp_interrupt_ctrl
  *	@brief	Enable/Disable interrupts
@@ -0,0 +1,372 @@
+/**
+ * \file
+ *
+ * \brief Sector cache between the FatFs disk I/O port and the memory driver.
+ *
+ * See disk_cache.h. A line holds the sectors first .. first + count - 1 and
+ * at most one dirty run inside them. No sector is ever held by two lines:
+ * a line filled for a read stops short of the next cached sector, and a
+ * write only starts or extends a line for a sector no line holds.
+ */
+
+#include "disk_cache.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DISK_CACHE_SECTOR_SIZE 512
+
+#if DISK_CACHE_LINES > 0
+
+/** One line of the cache */
+struct disk_cache_line {
+	DWORD first;        /**< First sector held */
+	BYTE count;         /**< Sectors held, 0 for a free line */
+	BYTE dirty_first;   /**< First dirty sector, as an index into the line */
+	BYTE dirty_count;   /**< Dirty sectors from dirty_first, 0 if clean */
+	uint32_t used;      /**< Stamp of the last access, the oldest line is evicted */
+	uint32_t written;   /**< Stamp of the last write, dirty lines go back oldest first */
+	uint8_t data[DISK_CACHE_LINE_SECTORS * DISK_CACHE_SECTOR_SIZE] __attribute__((aligned(4)));
+};
+
+static struct disk_cache_line lines[DISK_CACHE_LINES];
+static BYTE cache_drv = 0xFF;      /**< Drive the lines belong to, 0xFF before disk_cache_init() */
+static DWORD cache_sectors;         /**< Sectors on the drive, read ahead stops there */
+static DWORD next_read;             /**< Sector after the last read, a read starting here is sequential */
+static uint32_t stamp;
+
+#endif
+
+static struct disk_cache_stats stats;
+
+#if DISK_CACHE_LINES > 0
+
+/**
+ * \brief Line holding sector, NULL if none does.
+ */
+static struct disk_cache_line *find_line(DWORD sector)
+{
+	for (int i = 0; i < DISK_CACHE_LINES; i++) {
+		if (lines[i].count > 0 && sector >= lines[i].first && sector - lines[i].first < lines[i].count) {
+			return &lines[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * \brief Consecutive sectors from sector, at most max, that no line holds.
+ */
+static BYTE uncached_run(DWORD sector, BYTE max)
+{
+	BYTE run = 0;
+
+	for (int i = 0; i < DISK_CACHE_LINES; i++) {
+		if (lines[i].count > 0 && lines[i].first > sector && lines[i].first - sector < max) {
+			max = (BYTE)(lines[i].first - sector);
+		}
+	}
+	while (run < max && find_line(sector + run) == NULL) {
+		run++;
+	}
+	return run;
+}
+
+/**
+ * \brief Writes the dirty run of line back to the card.
+ */
+static DRESULT flush_line(struct disk_cache_line *line)
+{
+	DRESULT res;
+
+	if (line->dirty_count == 0) {
+		return RES_OK;
+	}
+	res = disk_media_write(cache_drv, &line->data[line->dirty_first * DISK_CACHE_SECTOR_SIZE],
+			line->first + line->dirty_first, line->dirty_count);
+	stats.media_writes++;
+	stats.media_write_sectors += line->dirty_count;
+	if (res == RES_OK) {
+		line->dirty_count = 0;
+	}
+	return res;
+}
+
+/**
+ * \brief Frees the least recently used line, writing it back first if dirty.
+ * \return The free line, NULL if the write back failed.
+ */
+static struct disk_cache_line *evict_line(void)
+{
+	struct disk_cache_line *victim = &lines[0];
+
+	for (int i = 0; i < DISK_CACHE_LINES; i++) {
+		if (lines[i].count == 0) {
+			victim = &lines[i];
+			break;
+		}
+		if ((int32_t)(lines[i].used - victim->used) < 0) {
+			victim = &lines[i];
+		}
+	}
+	if (flush_line(victim) != RES_OK) {
+		return NULL;
+	}
+	victim->count = 0;
+	return victim;
+}
+
+/**
+ * \brief Marks the sector at index of line dirty.
+ * \details A sector that does not join the dirty run writes the run back
+ * first, so a line never has more than one.
+ */
+static DRESULT mark_dirty(struct disk_cache_line *line, BYTE index)
+{
+	DRESULT res = RES_OK;
+
+	if (line->dirty_count > 0 && index >= line->dirty_first && index < line->dirty_first + line->dirty_count) {
+		stats.write_hits++;
+	} else if (line->dirty_count > 0 && index == line->dirty_first + line->dirty_count) {
+		line->dirty_count++;
+	} else if (line->dirty_count > 0 && index + 1 == line->dirty_first) {
+		line->dirty_first--;
+		line->dirty_count++;
+	} else {
+		res = flush_line(line);
+		line->dirty_first = index;
+		line->dirty_count = 1;
+	}
+	line->written = ++stamp;
+	return res;
+}
+
+#endif
+
+/**
+ * \brief Drops every line and sets the drive the cache works for.
+ * \details Call from disk_initialize(). Lines still dirty are dropped, the
+ * card may have been changed.
+ * \param drv Physical drive number.
+ * \param sector_count Sectors on the drive.
+ */
+void disk_cache_init(BYTE drv, DWORD sector_count)
+{
+#if DISK_CACHE_LINES > 0
+	memset(lines, 0, sizeof(lines));
+	cache_drv = drv;
+	cache_sectors = sector_count;
+	next_read = 0;
+#else
+	(void)drv;
+	(void)sector_count;
+#endif
+}
+
+/**
+ * \brief Reads sectors through the cache.
+ * \param drv Physical drive number (0..).
+ * \param buff Data buffer to store read data.
+ * \param sector Sector address (LBA).
+ * \param count Number of sectors to read (1..255).
+ * \return RES_OK for success, otherwise DRESULT error code.
+ */
+DRESULT disk_cache_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count)
+{
+#if DISK_CACHE_LINES > 0
+	bool sequential = (sector == next_read);
+
+	if (drv != cache_drv) {
+		return disk_media_read(drv, buff, sector, count);
+	}
+
+	stats.reads += count;
+	next_read = sector + count;
+	while (count > 0) {
+		struct disk_cache_line *line = find_line(sector);
+		BYTE run;
+
+		if (line != NULL) {
+			BYTE index = (BYTE)(sector - line->first);
+
+			run = line->count - index;
+			if (run > count) {
+				run = count;
+			}
+			memcpy(buff, &line->data[index * DISK_CACHE_SECTOR_SIZE], run * DISK_CACHE_SECTOR_SIZE);
+			line->used = ++stamp;
+			stats.read_hits += run;
+		} else {
+			run = uncached_run(sector, count);
+			if (run > DISK_CACHE_LINE_SECTORS) {
+				/* Long enough to gain nothing from a line */
+				if (disk_media_read(drv, buff, sector, run) != RES_OK) {
+					return RES_ERROR;
+				}
+				stats.media_reads++;
+				stats.media_read_sectors += run;
+			} else {
+				BYTE fill = sequential ? DISK_CACHE_LINE_SECTORS : run;
+
+				if (fill > cache_sectors - sector) {
+					fill = (BYTE)(cache_sectors - sector);
+				}
+				fill = uncached_run(sector, fill);
+				line = evict_line();
+				if (line == NULL) {
+					return RES_ERROR;
+				}
+				if (disk_media_read(drv, line->data, sector, fill) != RES_OK) {
+					return RES_ERROR;
+				}
+				stats.media_reads++;
+				stats.media_read_sectors += fill;
+				line->first = sector;
+				line->count = fill;
+				line->used = ++stamp;
+				memcpy(buff, line->data, run * DISK_CACHE_SECTOR_SIZE);
+			}
+		}
+		buff += run * DISK_CACHE_SECTOR_SIZE;
+		sector += run;
+		count -= run;
+	}
+	return RES_OK;
+#else
+	stats.reads += count;
+	stats.media_reads++;
+	stats.media_read_sectors += count;
+	return disk_media_read(drv, buff, sector, count);
+#endif
+}
+
+/**
+ * \brief Writes sectors into the cache, or to the card for a long run.
+ * \param drv Physical drive number (0..).
+ * \param buff Data to be written.
+ * \param sector Sector address (LBA).
+ * \param count Number of sectors to write (1..255).
+ * \return RES_OK for success, otherwise DRESULT error code.
+ */
+DRESULT disk_cache_write(BYTE drv, BYTE const *buff, DWORD sector, BYTE count)
+{
+#if DISK_CACHE_LINES > 0
+	if (drv != cache_drv) {
+		return disk_media_write(drv, buff, sector, count);
+	}
+
+	stats.writes += count;
+	while (count > 0) {
+		struct disk_cache_line *line = find_line(sector);
+		BYTE run = 1;
+
+		if (line == NULL) {
+			run = uncached_run(sector, count);
+			if (run > DISK_CACHE_LINE_SECTORS) {
+				if (disk_media_write(drv, buff, sector, run) != RES_OK) {
+					return RES_ERROR;
+				}
+				stats.media_writes++;
+				stats.media_write_sectors += run;
+				buff += run * DISK_CACHE_SECTOR_SIZE;
+				sector += run;
+				count -= run;
+				continue;
+			}
+			run = 1;
+
+			/* Append to the line that ends right before sector, or start a new one */
+			for (int i = 0; i < DISK_CACHE_LINES; i++) {
+				if (lines[i].count > 0 && lines[i].count < DISK_CACHE_LINE_SECTORS &&
+						lines[i].first + lines[i].count == sector) {
+					line = &lines[i];
+					break;
+				}
+			}
+			if (line == NULL) {
+				line = evict_line();
+				if (line == NULL) {
+					return RES_ERROR;
+				}
+				line->first = sector;
+			}
+			line->count++;
+		}
+
+		BYTE index = (BYTE)(sector - line->first);
+
+		memcpy(&line->data[index * DISK_CACHE_SECTOR_SIZE], buff, DISK_CACHE_SECTOR_SIZE);
+		line->used = ++stamp;
+		if (mark_dirty(line, index) != RES_OK) {
+			return RES_ERROR;
+		}
+		buff += DISK_CACHE_SECTOR_SIZE;
+		sector += run;
+		count -= run;
+	}
+	return RES_OK;
+#else
+	stats.writes += count;
+	stats.media_writes++;
+	stats.media_write_sectors += count;
+	return disk_media_write(drv, buff, sector, count);
+#endif
+}
+
+/**
+ * \brief Writes every dirty line back, oldest write first.
+ * \param drv Physical drive number (0..).
+ * \return RES_OK for success, otherwise DRESULT error code.
+ */
+DRESULT disk_cache_sync(BYTE drv)
+{
+#if DISK_CACHE_LINES > 0
+	if (drv != cache_drv) {
+		return RES_OK;
+	}
+
+	for (;;) {
+		struct disk_cache_line *oldest = NULL;
+
+		for (int i = 0; i < DISK_CACHE_LINES; i++) {
+			if (lines[i].dirty_count > 0 &&
+					(oldest == NULL || (int32_t)(lines[i].written - oldest->written) < 0)) {
+				oldest = &lines[i];
+			}
+		}
+		if (oldest == NULL) {
+			return RES_OK;
+		}
+		if (flush_line(oldest) != RES_OK) {
+			return RES_ERROR;
+		}
+	}
+#else
+	(void)drv;
+	return RES_OK;
+#endif
+}
+
+/**
+ * \brief Copies the counters.
+ */
+void disk_cache_get_stats(struct disk_cache_stats *out)
+{
+	*out = stats;
+}
+
+/**
+ * \brief Starts the counters over, to measure one piece of work.
+ */
+void disk_cache_clear_stats(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+#ifdef __cplusplus
+}
+#endif
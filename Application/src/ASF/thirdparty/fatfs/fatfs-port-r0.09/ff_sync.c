@@ -0,0 +1,61 @@
+/**
+ * \file
+ *
+ * \brief FreeRTOS sync objects for FatFs built with _FS_REENTRANT.
+ *
+ * FatFs takes the volume's mutex on entry to every API function and gives
+ * it back on return, so one task at a time works on the FATFS sector window
+ * and on the sector cache underneath (disk_cache.c). f_mount() creates the
+ * mutex and deletes the one of a volume mounted before.
+ */
+
+#include "ff.h"
+
+#if _FS_REENTRANT
+
+/**
+ * \brief Creates the mutex of a volume, called from f_mount().
+ * \param vol Volume number.
+ * \param sobj Receives the mutex.
+ * \return 1 on success, 0 if the heap is exhausted.
+ */
+int ff_cre_syncobj(BYTE vol, _SYNC_t *sobj)
+{
+	(void)vol;
+	*sobj = xSemaphoreCreateMutex();
+	return (*sobj != NULL) ? 1 : 0;
+}
+
+/**
+ * \brief Deletes the mutex of a volume that is being unmounted.
+ * \param sobj Mutex to delete.
+ * \return 1.
+ */
+int ff_del_syncobj(_SYNC_t sobj)
+{
+	if (sobj != NULL) {
+		vSemaphoreDelete(sobj);
+	}
+	return 1;
+}
+
+/**
+ * \brief Takes the volume, waiting up to _FS_TIMEOUT milliseconds.
+ * \param sobj Mutex of the volume.
+ * \return 1 if taken, 0 on timeout; the FatFs call then fails with FR_TIMEOUT.
+ */
+int ff_req_grant(_SYNC_t sobj)
+{
+	return (xSemaphoreTake(sobj, pdMS_TO_TICKS(_FS_TIMEOUT)) == pdTRUE) ? 1 : 0;
+}
+
+/**
+ * \brief Gives the volume back.
+ * \param sobj Mutex of the volume.
+ */
+void ff_rel_grant(_SYNC_t sobj)
+{
+	xSemaphoreGive(sobj);
+}
+
+#endif
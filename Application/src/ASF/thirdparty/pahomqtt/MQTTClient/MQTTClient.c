@@ -15,6 +15,7 @@
  *    Microchip Technologies            - Fixed crash issues in subscribe function
  *******************************************************************************/
 #include "MQTTClient.h"
+#include <string.h>
 
 /*Function prototypes to remove build warnings*/
 int deliverMessage(MQTTClient* c, MQTTString* topicName, MQTTMessage* message);
@@ -74,6 +75,7 @@ void MQTTClientInit(MQTTClient* c, Network* network, unsigned int command_timeou
     c->isconnected = 0;
     c->ping_outstanding = 0;
     c->defaultMessageHandler = NULL;
+    c->pubackCallback = NULL;
 	c->next_packetid = 1;
     TimerInit(&c->ping_timer);
 #if defined(MQTT_TASK)
@@ -240,9 +242,17 @@ int cycle(MQTTClient* c, Timer* timer)
     switch (packet_type)
     {
         case CONNACK:
-        case PUBACK:
         case SUBACK:
             break;
+        case PUBACK:
+            if (c->pubackCallback != NULL)
+            {
+                unsigned short mypacketid;
+                unsigned char dup, type;
+                if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) == 1)
+                    c->pubackCallback(c, mypacketid);
+            }
+            break;
         case PUBLISH:
         {
             MQTTString topicName;
@@ -376,6 +386,8 @@ int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
     
     TimerInit(&connect_timer);
     TimerCountdownMS(&connect_timer, c->command_timeout_ms);
+    c->sessionPresent = 0;
+    c->ping_outstanding = 0;
 
     if (options == 0)
         options = &default_options; /* set default options if none were supplied */
@@ -393,7 +405,10 @@ int MQTTConnect(MQTTClient* c, MQTTPacket_connectData* options)
         unsigned char connack_rc = 255;
         unsigned char sessionPresent = 0;
         if (MQTTDeserialize_connack(&sessionPresent, &connack_rc, c->readbuf, c->readbuf_size) == 1)
+        {
             rc = connack_rc;
+            c->sessionPresent = sessionPresent;
+        }
         else
             rc = FAILURE;
     }
@@ -445,16 +460,23 @@ int MQTTSubscribe(MQTTClient* c, const char* topicFilter, enum QoS qos, messageH
             rc = grantedQoS; // 0, 1, 2 or 0x80 
         if (rc != 0x80)
         {
-            int i;
+            int i, slot = -1;
+            /* a resubscribe after a reconnect replaces its handler instead of taking another slot */
             for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
             {
-                if (c->messageHandlers[i].topicFilter == 0)
+                if (c->messageHandlers[i].topicFilter != 0 && strcmp(c->messageHandlers[i].topicFilter, topicFilter) == 0)
                 {
-                    c->messageHandlers[i].topicFilter = topicFilter;
-                    c->messageHandlers[i].fp = msgHandler;
-                    rc = 0;
+                    slot = i;
                     break;
                 }
+                if (slot < 0 && c->messageHandlers[i].topicFilter == 0)
+                    slot = i;
+            }
+            if (slot >= 0)
+            {
+                c->messageHandlers[slot].topicFilter = topicFilter;
+                c->messageHandlers[slot].fp = msgHandler;
+                rc = 0;
             }
         }
     }
@@ -535,29 +557,24 @@ int MQTTPublish(MQTTClient* c, const char* topicName, MQTTMessage* message)
     if ((rc = sendPacket(c, len, &timer)) != SUCCESS) // send the subscribe packet
         goto exit; // there was a problem
     
-    if (message->qos == QOS1)
-    {
-        if (waitfor(c, PUBACK, &timer) == PUBACK)
-        {
-            unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = FAILURE;
-        }
-        else
-            rc = FAILURE;
-    }
-    else if (message->qos == QOS2)
+    if (message->qos == QOS1 || message->qos == QOS2)
     {
-        if (waitfor(c, PUBCOMP, &timer) == PUBCOMP)
+        int ack_type = (message->qos == QOS1) ? PUBACK : PUBCOMP;
+
+        // Acks of publishes still in flight from MQTTPublishNoWait() arrive here too, wait for ours
+        rc = FAILURE;
+        while (waitfor(c, ack_type, &timer) == ack_type)
         {
             unsigned short mypacketid;
             unsigned char dup, type;
             if (MQTTDeserialize_ack(&type, &dup, &mypacketid, c->readbuf, c->readbuf_size) != 1)
-                rc = FAILURE;
+                break;
+            if (mypacketid == message->id)
+            {
+                rc = SUCCESS;
+                break;
+            }
         }
-        else
-            rc = FAILURE;
     }
     
 exit:
@@ -568,6 +585,40 @@ exit:
 }
 
 
+int MQTTPublishNoWait(MQTTClient* c, const char* topicName, MQTTMessage* message)
+{
+    int rc = FAILURE;
+    Timer timer;
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = (char *)topicName;
+    int len = 0;
+
+#if defined(MQTT_TASK)
+	MutexLock(&c->mutex);
+#endif
+	if (!c->isconnected)
+		goto exit;
+
+    TimerInit(&timer);
+    TimerCountdownMS(&timer, c->command_timeout_ms);
+
+    if ((message->qos == QOS1 || message->qos == QOS2) && !message->dup)
+        message->id = getNextPacketId(c);
+
+    len = MQTTSerialize_publish(c->buf, c->buf_size, message->dup, message->qos, message->retained, message->id,
+              topic, (unsigned char*)message->payload, message->payloadlen);
+    if (len <= 0)
+        goto exit;
+    rc = sendPacket(c, len, &timer);
+
+exit:
+#if defined(MQTT_TASK)
+	MutexUnlock(&c->mutex);
+#endif
+    return rc;
+}
+
+
 int MQTTDisconnect(MQTTClient* c)
 {  
     int rc = FAILURE;
@@ -94,6 +94,10 @@ typedef struct MessageData
 
 typedef void (*messageHandler)(MessageData*);
 
+struct MQTTClient;
+/** Called from MQTTYield for every PUBACK, lets a caller keep several QoS 1 publishes in flight */
+typedef void (*pubackHandler)(struct MQTTClient*, unsigned short packetid);
+
 typedef struct MQTTClient
 {
     unsigned int next_packetid,
@@ -105,6 +109,7 @@ typedef struct MQTTClient
     unsigned int keepAliveInterval;
     char ping_outstanding;
     int isconnected;
+    unsigned char sessionPresent;   /* Session present flag of the last CONNACK */
 
     struct MessageHandlers
     {
@@ -113,6 +118,7 @@ typedef struct MQTTClient
     } messageHandlers[MAX_MESSAGE_HANDLERS];      /* Message handlers are indexed by subscription topic */
 
     void (*defaultMessageHandler) (MessageData*);
+    pubackHandler pubackCallback;
 
     Network* ipstack;
     Timer ping_timer;
@@ -150,6 +156,16 @@ DLLExport int MQTTConnect(MQTTClient* client, MQTTPacket_connectData* options);
  */
 DLLExport int MQTTPublish(MQTTClient* client, const char*, MQTTMessage*);
 
+/** MQTT Publish without waiting - send an MQTT publish packet and return once it is written.
+ *  For QoS 1/2 a new packet id is assigned into message->id unless message->dup is set, in which
+ *  case message->id is reused for the retransmission. Acks are reported through pubackCallback.
+ *  @param client - the client object to use
+ *  @param topicName - the topic to publish to
+ *  @param message - the message to send
+ *  @return success code
+ */
+DLLExport int MQTTPublishNoWait(MQTTClient* client, const char* topicName, MQTTMessage* message);
+
 /** MQTT Subscribe - send an MQTT subscribe packet and wait for suback before returning.
  *  @param client - the client object to use
  *  @param topicFilter - the topic filter to subscribe to
@@ -31,6 +31,8 @@ static int32_t gi32MQTTBrokerIp=0;
 static int32_t gi32MQTTBrokerRxLen=0;
 static bool gbMQTTBrokerIpresolved=false;
 static bool gbMQTTBrokerConnected=false;
+static int8_t gi8MQTTBrokerConnectErr=0;
+static bool gbMQTTBrokerLinkLost=false;
 static bool gbMQTTBrokerSendDone=false;
 static bool gbMQTTBrokerRecvDone=false;
 static unsigned char gcMQTTRxFIFO[MQTT_RX_POOL_SIZE];
@@ -74,6 +76,8 @@ void tcpClientSocketEventHandler(SOCKET sock, uint8_t u8Msg, void *pvMsg)
 		switch (u8Msg) {
 			case SOCKET_MSG_CONNECT:
 			{
+				tstrSocketConnectMsg* pstrConnect = (tstrSocketConnectMsg*)pvMsg;
+				gi8MQTTBrokerConnectErr = (pstrConnect != NULL) ? pstrConnect->s8Error : 0;
 				gbMQTTBrokerConnected=true;
 				#ifdef MQTT_PLATFORM_DBG
 				printf("INFO >> Successfully connected Broker Socket.\r\n");
@@ -82,6 +86,9 @@ void tcpClientSocketEventHandler(SOCKET sock, uint8_t u8Msg, void *pvMsg)
 			break;
 			case SOCKET_MSG_SEND:
 			{
+				if((pvMsg != NULL) && (*(int16_t*)pvMsg < 0)) {
+					gbMQTTBrokerLinkLost=true;
+				}
 				gbMQTTBrokerSendDone=true;
 				#ifdef MQTT_PLATFORM_DBG
 				printf("INFO >> Successfully sent message via Broker Socket.\r\n");
@@ -93,6 +100,7 @@ void tcpClientSocketEventHandler(SOCKET sock, uint8_t u8Msg, void *pvMsg)
 				tstrSocketRecvMsg* pstrRx = (tstrSocketRecvMsg*)pvMsg;
 				gi32MQTTBrokerRxLen = pstrRx->s16BufferSize;
 				if((gi32MQTTBrokerRxLen<0) && (gi32MQTTBrokerRxLen!=SOCK_ERR_TIMEOUT)) {
+					gbMQTTBrokerLinkLost=true;
 					#ifdef MQTT_PLATFORM_DBG
 					printf("ERROR >> Receive error for broker socket (Err=%ld).\r\n",gi32MQTTBrokerRxLen);
 					#endif
@@ -207,6 +215,7 @@ static int WINC1500_read(Network* n, unsigned char* buffer, int len, int timeout
 static int WINC1500_write(Network* n, unsigned char* buffer, int len, int timeout_ms) {
   gbMQTTBrokerSendDone=false;
   if (SOCK_ERR_NO_ERROR!=send(n->socket,buffer,len,0)){
+	  gbMQTTBrokerLinkLost=true;
 	  #ifdef MQTT_PLATFORM_DBG
 	  printf("ERROR >> send error");
 	  #endif
@@ -233,9 +242,14 @@ static int WINC1500_write(Network* n, unsigned char* buffer, int len, int timeou
 
 
 static void WINC1500_disconnect(Network* n) {
-	close(n->socket);
+	if(n->socket >= 0)
+		close(n->socket);
 	n->socket=-1;
 	gbMQTTBrokerConnected=false;
+	gbMQTTBrokerLinkLost=false;
+	//bytes of the old connection must not be parsed as part of the next one
+	gu32MQTTRxFIFOLen=0;
+	gu32MQTTRxFIFOPtr=0;
 }
 
 
@@ -247,6 +261,7 @@ void NetworkInit(Network* n) {
 }
 
 int ConnectNetwork(Network* n, char* addr, int port, int TLSFlag){
+  TickType_t start = xTaskGetTickCount();
 
   //Resolve Server URL.
   gbMQTTBrokerIpresolved = false;
@@ -255,48 +270,87 @@ int ConnectNetwork(Network* n, char* addr, int port, int TLSFlag){
  
   //wait for resolver callback
   while (false==gbMQTTBrokerIpresolved){
+	  if ((xTaskGetTickCount() - start) > pdMS_TO_TICKS(MQTT_NETWORK_DNS_TIMEOUT_MS)) {
+		  #ifdef MQTT_PLATFORM_DBG
+		  printf("ERROR >> DNS timeout.\r\n");
+		  #endif
+		  return SOCK_ERR_TIMEOUT;
+	  }
 	  m2m_wifi_handle_events(NULL);
   }
+  if (gi32MQTTBrokerIp == 0) {
+	  return SOCK_ERR_INVALID_ADDRESS;
+  }
   
-  n->hostIP = gi32MQTTBrokerIp;
+  return ConnectNetworkIp(n, (uint32_t)gi32MQTTBrokerIp, port, TLSFlag);
+}
+
+/* Connects to an address that is already known, e.g. cached from an earlier ConnectNetwork() */
+int ConnectNetworkIp(Network* n, uint32_t ip, int port, int TLSFlag){
+  TickType_t start;
+
+  n->hostIP = (int)ip;
   
   //connect to socket
   struct sockaddr_in addr_in;
   addr_in.sin_family = AF_INET;
   addr_in.sin_port = _htons(port);
-  addr_in.sin_addr.s_addr = gi32MQTTBrokerIp;
+  addr_in.sin_addr.s_addr = ip;
 
   /* Create secure socket */ 
   if(n->socket < 0)
 	n->socket = socket(AF_INET, SOCK_STREAM, TLSFlag);
   
   /* Check if socket was created successfully */
-  if (n->socket == -1) {
+  if (n->socket < 0) {
    #ifdef MQTT_PLATFORM_DBG
    printf("ERROR >> socket error.\r\n");
    #endif
-   close(n->socket);
+   n->socket = -1;
    return SOCK_ERR_INVALID;
   }
   
+  gbMQTTBrokerConnected = false;
+  gi8MQTTBrokerConnectErr = 0;
+  
   /* If success, connect to socket */
   if (connect(n->socket, (struct sockaddr *)&addr_in, sizeof(struct sockaddr_in)) != SOCK_ERR_NO_ERROR) {
    #ifdef MQTT_PLATFORM_DBG  
    printf("ERROR >> connect error.\r\n");
    #endif
+   WINC1500_disconnect(n);
    return SOCK_ERR_INVALID;
   }
   
-  gbMQTTBrokerConnected = false;
-  
   /*wait for SOCKET_MSG_CONNECT event */
+  start = xTaskGetTickCount();
   while(false==gbMQTTBrokerConnected){
+    if ((xTaskGetTickCount() - start) > pdMS_TO_TICKS(MQTT_NETWORK_CONNECT_TIMEOUT_MS)) {
+      WINC1500_disconnect(n);
+      return SOCK_ERR_TIMEOUT;
+    }
     m2m_wifi_handle_events(NULL);
   }
   
+  /* A refused or unreachable broker also ends in SOCKET_MSG_CONNECT */
+  if (gi8MQTTBrokerConnectErr < 0) {
+    int err = gi8MQTTBrokerConnectErr;
+    WINC1500_disconnect(n);
+    return err;
+  }
+  
+  gbMQTTBrokerLinkLost = false;
+  gu32MQTTRxFIFOLen = 0;
+  gu32MQTTRxFIFOPtr = 0;
+  
   /* Success */
   #ifdef MQTT_PLATFORM_DBG
   printf("INFO >> ConnectNetwork successful\r\n");
   #endif
   return SOCK_ERR_NO_ERROR;
-}
\ No newline at end of file
+}
+
+/* Non zero once a send or receive on the connected socket failed, the connection is gone then */
+int NetworkLinkLost(Network* n){
+  return (n->socket >= 0) && gbMQTTBrokerLinkLost;
+}
@@ -25,6 +25,10 @@
 /* As WINC15x0 supports only 7 TCP sockets, maximum of 7 MQTT clients can be supported */
 #define MQTT_MAX_CLIENTS  TCP_SOCK_MAX
 
+/* Longest waits of ConnectNetwork(), so a dead network cannot block the caller forever */
+#define MQTT_NETWORK_DNS_TIMEOUT_MS		5000
+#define MQTT_NETWORK_CONNECT_TIMEOUT_MS	5000
+
 typedef struct Timer
 {
 	TickType_t xTicksToWait;
@@ -48,6 +52,8 @@ void winc1500_disconnect(Network*);
 void NetworkInit(Network* n);
 
 int ConnectNetwork(Network*, char*, int, int);
+int ConnectNetworkIp(Network*, uint32_t, int, int);
+int NetworkLinkLost(Network*);
 
 void tcpClientSocketEventHandler(SOCKET, uint8_t, void*);
 void dnsResolveCallback(uint8_t*, uint32_t);
@@ -147,6 +147,15 @@ int mqtt_connect(struct mqtt_module *module, const char *host)
 	return connResult.sock_connected.result;
 }
 
+int mqtt_connect_ip(struct mqtt_module *module, uint32_t ip)
+{
+	union mqtt_data connResult;
+	connResult.sock_connected.result = ConnectNetworkIp(&(module->network), ip, module->config.port, module->config.tls);
+	if(module->callback)
+		module->callback(module, MQTT_CALLBACK_SOCK_CONNECTED, &connResult);
+	return connResult.sock_connected.result;
+}
+
 int mqtt_connect_broker(struct mqtt_module *const module, uint8_t clean_session, const char *id, const char *password, const char *client_id, const char *will_topic, const char *will_msg, uint32_t will_msg_len, uint8_t will_qos, uint8_t will_retain)
 {
 	// Will Message length is not used by Paho MQTT. 
@@ -159,6 +168,7 @@ int mqtt_connect_broker(struct mqtt_module *const module, uint8_t clean_session,
 	connectData.username.cstring = (char *)id;
 	connectData.password.cstring = (char *)password;
 	connectData.cleansession = clean_session;
+	connectData.keepAliveInterval = module->config.keep_alive;
 	connectData.will.topicName.cstring = (char *)will_topic;
 	connectData.will.message.cstring = (char *)will_msg;
 	connectData.will.retained = will_retain;
@@ -170,20 +180,27 @@ int mqtt_connect_broker(struct mqtt_module *const module, uint8_t clean_session,
 	rc = MQTTConnect(module->client, &connectData);
 	
 	connBrokerResult.connected.result = rc;
+	connBrokerResult.connected.session_present = (rc == SUCCESS) ? module->client->sessionPresent : 0;
 	if(module->callback)
 		module->callback(module, MQTT_CALLBACK_CONNECTED, &connBrokerResult);
 	
-	module->isConnected = true;
+	module->isConnected = (rc == SUCCESS);
+	if(!module->isConnected)
+		module->network.disconnect(&(module->network));
 	return rc;
 }
 
 int mqtt_disconnect(struct mqtt_module *const module, int force_close)
 {
-	//force_close is not used by Paho MQTT
-	int rc;
+	int rc = SUCCESS;
 	union mqtt_data disconnectResult;
 	
-	rc = MQTTDisconnect(module->client);
+	//A forced close skips the DISCONNECT packet, the link is usually gone already
+	if(force_close)
+		module->client->isconnected = 0;
+	else
+		rc = MQTTDisconnect(module->client);
+	module->network.disconnect(&(module->network));
 	
 	disconnectResult.disconnected.reason = rc;
 	
@@ -212,6 +229,33 @@ int mqtt_publish(struct mqtt_module *const module, const char *topic, const char
 	return rc;
 }
 
+int mqtt_publish_nowait(struct mqtt_module *const module, const char *topic, const char *msg, uint32_t msg_len, uint8_t qos, uint8_t retain, uint8_t dup, uint16_t *packet_id)
+{
+	int rc;
+	MQTTMessage mqttMsg;
+
+	mqttMsg.qos = qos;
+	mqttMsg.payload = (char *)msg;
+	mqttMsg.payloadlen = (size_t)msg_len;
+	mqttMsg.retained = retain;
+	mqttMsg.dup = dup;
+	mqttMsg.id = *packet_id;
+
+	rc = MQTTPublishNoWait(module->client, topic, &mqttMsg);
+	*packet_id = mqttMsg.id;
+
+	return rc;
+}
+
+int mqtt_set_puback_handler(struct mqtt_module *module, pubackHandler handler)
+{
+	if(!module || !module->client)
+		return FAILURE;
+
+	module->client->pubackCallback = handler;
+	return SUCCESS;
+}
+
 int mqtt_subscribe(struct mqtt_module *module, const char *topic, uint8_t qos, messageHandler msgHandler)
 {
 	int rc;
@@ -236,6 +280,18 @@ int mqtt_unsubscribe(struct mqtt_module *module, const char *topic)
 	return rc;
 }
 
+int mqtt_link_lost(struct mqtt_module *module)
+{
+	MQTTClient *c = module->client;
+	
+	if(!module->isConnected || c == NULL)
+		return 0;
+	if(NetworkLinkLost(&(module->network)))
+		return 1;
+	//keepalive() re-arms ping_timer when it sends PINGREQ, expiring again means no PINGRESP for a whole interval
+	return c->ping_outstanding && TimerIsExpired(&c->ping_timer);
+}
+
 int mqtt_yield(struct mqtt_module *module, int timeout_ms)
 {
 	return MQTTYield(module->client, timeout_ms);
@@ -173,6 +173,8 @@ struct mqtt_data_sock_connected {
 struct mqtt_data_connected {
 	/** Result of operation. */
 	enum mqtt_conn_result result;
+	/** Broker still had the session of this client ID, its subscriptions are in place. */
+	uint8_t session_present;
 };
 
 /**
@@ -453,6 +455,18 @@ void mqtt_socket_resolve_handler(uint8_t *doamin_name, uint32_t server_ip);
  */
 int mqtt_connect(struct mqtt_module *const module, const char *host);
 
+/**
+ * \brief Connect to MQTT broker server at a known address, without a DNS lookup.
+ * If operation of this function is complete, MQTT_CALLBACK_SOCK_CONNECTED event will be sent through MQTT callback.
+ *
+ * \param[in]  module_inst     Instance of MQTT module.
+ * \param[in]  ip              Broker address in network byte order, as left in network.hostIP by \ref mqtt_connect.
+ *
+ * \return     0               Function succeeded
+ * \return     <0              Socket error or timeout.
+ */
+int mqtt_connect_ip(struct mqtt_module *const module, uint32_t ip);
+
 /**
  * \brief Send MQTT connect message to broker server with MQTT parameter.
  * If operation of this function is complete, MQTT_CALLBACK_CONNECTED event will be sent through MQTT callback.
@@ -512,6 +526,18 @@ int mqtt_connect_broker(struct mqtt_module *const module, uint8_t clean_session,
  */
 int mqtt_disconnect(struct mqtt_module *const module, int force_close);
 
+/**
+ * \brief Check whether an established connection has died.
+ * True after a failed send or receive on the socket, or when a PINGREQ got no answer for a keep alive interval.
+ * Call \ref mqtt_disconnect with force_close set to clean up.
+ *
+ * \param[in]  module_inst     Instance of MQTT module.
+ *
+ * \return     1               Connection is gone.
+ * \return     0               Connected, or not connected at all.
+ */
+int mqtt_link_lost(struct mqtt_module *module);
+
 /**
  * \brief Send publish message to MQTT broker server.
  * If operation of this function is complete, MQTT_CALLBACK_PUBLISHED event will be sent through MQTT callback.
@@ -541,6 +567,35 @@ int mqtt_disconnect(struct mqtt_module *const module, int force_close);
  */
 int mqtt_publish(struct mqtt_module *const module, const char *topic, const char *msg, uint32_t msg_len, uint8_t qos, uint8_t retain);
 
+/**
+ * \brief Send publish message to MQTT broker server without waiting for its acknowledgement.
+ * PUBACKs are delivered during \ref mqtt_yield to the handler set with \ref mqtt_set_puback_handler.
+ *
+ * \param[in]  module_inst     Instance of MQTT module.
+ * \param[in]  topic           Topic of this MQTT message.
+ * \param[in]  msg             Payload of this MQTT message.
+ * \param[in]  msg_len         Payload size of this MQTT message.
+ * \param[in]  qos             QOS level of this MQTT message. (0 <= qos <= 2)
+ * \param[in]  retain          Whether broker server will be store this MQTT message or not.
+ * \param[in]  dup             Non zero for a retransmission, *packet_id is then reused.
+ * \param[in,out] packet_id    Packet id of the message. Assigned here for a first transmission.
+ *
+ * \return     0               Function succeeded
+ * \return     -1              Not connected, or the message could not be written.
+ */
+int mqtt_publish_nowait(struct mqtt_module *const module, const char *topic, const char *msg, uint32_t msg_len, uint8_t qos, uint8_t retain, uint8_t dup, uint16_t *packet_id);
+
+/**
+ * \brief Register the function called for every PUBACK received by \ref mqtt_yield.
+ *
+ * \param[in]  module_inst     Instance of MQTT module, after \ref mqtt_init.
+ * \param[in]  handler         Function to call, NULL to stop.
+ *
+ * \return     0               Function succeeded
+ * \return     -1              The module has no client.
+ */
+int mqtt_set_puback_handler(struct mqtt_module *module, pubackHandler handler);
+
 /**
  * \brief Send subscribe message to MQTT broker server.
  * If operation of this function is complete, MQTT_CALLBACK_SUBSCRIBED event will be sent through MQTT callback.
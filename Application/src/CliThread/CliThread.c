@@ -12,6 +12,15 @@
 #include "CliThread.h"
 #include "IMU\lsm6dso_reg.h"
 #include "WifiHandlerThread/WifiHandler.h"
+#include "WifiHandlerThread/MqttPipeline.h"
+#include "WifiHandlerThread/MqttReconnect.h"
+#include "WifiHandlerThread/CommandDispatch.h"
+#include "WifiHandlerThread/OtaBoot.h"
+#include "WifiHandlerThread/TelemetryJournal.h"
+#include "WifiHandlerThread/TelemetryPolicy.h"
+#include "SerialConsole/FastFormat.h"
+
+#include <stdlib.h>
 
 /******************************************************************************
  * Defines
@@ -26,8 +35,6 @@ extern struct bme68x_dev bme; // Initialized in the main function.
 QueueHandle_t xQueueBmeCliBuffer = NULL;
 QueueHandle_t xQueueImuCliBuffer = NULL;
 
-char bootloader_flag[] = "0:boot_flag.txt";
-
 static const char pcWelcomeMessage[]  = "FreeRTOS CLI.\r\nType Help to view a list of registered commands.\r\n";
 
 static const CLI_Command_Definition_t xImuGetCommand = 
@@ -41,9 +48,9 @@ static const CLI_Command_Definition_t xImuGetCommand =
 static const CLI_Command_Definition_t xOTAUCommand = 
 {
 	"fw",
-	"fw: Download a file and perform an FW update\r\n",
+	"fw [share%]: Download a file and perform an FW update\r\n",
 	(const pdCOMMAND_LINE_CALLBACK) CLI_OTAU,
-	0};
+	-1};
 	
 static const CLI_Command_Definition_t xAirFlow =
 {
@@ -61,6 +68,30 @@ static const CLI_Command_Definition_t xEnvGetCommand =
 	0
 };
 
+static const CLI_Command_Definition_t xStackCommand =
+{
+	"stack",
+	"stack: Lists the stack high water mark of every task\r\n",
+	(const pdCOMMAND_LINE_CALLBACK) CLI_StackUsage,
+	0
+};
+
+static const CLI_Command_Definition_t xMqttStatsCommand =
+{
+	"mqtt",
+	"mqtt: Shows the publish pipeline, reconnect and command statistics\r\n",
+	(const pdCOMMAND_LINE_CALLBACK) CLI_MqttStats,
+	0
+};
+
+static const CLI_Command_Definition_t xPolicyCommand =
+{
+	"policy",
+	"policy [ch mode db min max rate]: Shows or sets a publish policy\r\n",
+	(const pdCOMMAND_LINE_CALLBACK) CLI_Policy,
+	-1
+};
+
 // Clear screen command
 const CLI_Command_Definition_t xClearScreen = {CLI_COMMAND_CLEAR_SCREEN, CLI_HELP_CLEAR_SCREEN, CLI_CALLBACK_CLEAR_SCREEN, CLI_PARAMS_CLEAR_SCREEN};
 
@@ -85,6 +116,9 @@ void vCommandConsoleTask(void *pvParameters)
     FreeRTOS_CLIRegisterCommand(&xClearScreen);
 	FreeRTOS_CLIRegisterCommand(&xAirFlow);
 	FreeRTOS_CLIRegisterCommand(&xEnvGetCommand);
+	FreeRTOS_CLIRegisterCommand(&xStackCommand);
+	FreeRTOS_CLIRegisterCommand(&xMqttStatsCommand);
+	FreeRTOS_CLIRegisterCommand(&xPolicyCommand);
 	
 	/* Created queues to get data from the data collection threads */
 	xQueueBmeCliBuffer = xQueueCreate(1, sizeof(struct bme68x_data));
@@ -268,7 +302,7 @@ BaseType_t CLI_GetEnvData( int8_t *pcWriteBuffer,size_t xWriteBufferLen,const in
 	struct bme68x_data data[BME68X_N_MEAS] = { { 0 } };
 	
 	if (pdPASS == xQueueReceive(xQueueBmeCliBuffer, &data[0], 0)) {
-		snprintf(pcWriteBuffer, xWriteBufferLen, "T: %0.2f H: %0.2f P: %0.2f \r\n", data[0].temperature, data[0].humidity, data[0].pressure);
+		FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "T: %0.2f H: %0.2f P: %0.2f \r\n", data[0].temperature, data[0].humidity, data[0].pressure);
 	}
 	
 	return pdFALSE;
@@ -280,7 +314,7 @@ BaseType_t CLI_GetImuData(int8_t *pcWriteBuffer, size_t xWriteBufferLen, const i
 	static struct ImuDataPacket_float mg;
 
 	if (pdPASS == xQueueReceive(xQueueImuCliBuffer, &mg, 0)) {
-		snprintf((char *)pcWriteBuffer, xWriteBufferLen, "Acc [mg]: %0.2f %0.2f %0.2f\r\n", mg.xmg, mg.ymg, mg.zmg);
+		FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "Acc [mg]: %0.2f %0.2f %0.2f\r\n", mg.xmg, mg.ymg, mg.zmg);
 	}
 	
     return pdFALSE;
@@ -293,32 +327,47 @@ static char bufCli[CLI_MSG_LEN];
 BaseType_t xCliClearTerminalScreen(char *pcWriteBuffer, size_t xWriteBufferLen, const int8_t *pcCommandString)
 {
     char clearScreen = ASCII_ESC;
-    snprintf(bufCli, CLI_MSG_LEN - 1, "%c[2J", clearScreen);
-    snprintf(pcWriteBuffer, xWriteBufferLen, bufCli);
+    FmtPrintf(bufCli, CLI_MSG_LEN - 1, "%c[2J", clearScreen);
+    FmtPrintf(pcWriteBuffer, xWriteBufferLen, "%s", bufCli);
     return pdFALSE;
 }
 
-// CLI_OTAU. Create a boot flag and changes the wifi state to download binary file and
-//                 waits till the file is downloaded to perform a reset
+// CLI_OTAU. Changes the wifi state to download binary file and waits till the file is
+//                 downloaded to perform a reset. The Wifi task writes the boot flag only once the
+//                 image matched its manifest, and the bootloader only looks at the SD card once
+//                 the update is flagged in NVM. The optional parameter is the share of the link
+//                 the download may use, MQTT keeps the rest.
 BaseType_t CLI_OTAU(int8_t *pcWriteBuffer, size_t xWriteBufferLen, const int8_t *pcCommandString)
 {
-	//f_unlink(bootloader_flag);
-	
-	FIL file_object;
-	
-	bootloader_flag[0] = LUN_ID_SD_MMC_0_MEM + '0';
-	FRESULT res = f_open(&file_object, (char const *)bootloader_flag, FA_CREATE_ALWAYS | FA_WRITE);
-
-	if (res != FR_OK) {
-		LogMessage(LOG_INFO_LVL, "[FAIL] res %d\r\n", res);
-		} else {
-		SerialConsoleWriteString("boot_flag.txt added!\r\n");
+	BaseType_t shareLen = 0;
+	const char *share = FreeRTOS_CLIGetParameter((const char *)pcCommandString, 1, &shareLen);
+
+	if (share != NULL) {
+		char *end = NULL;
+		long percent = strtol(share, &end, 10);
+
+		if (end != share + shareLen || percent < 1 || percent > 100) {
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "usage: fw [share%%], share 1 to 100\r\n");
+			return pdFALSE;
+		}
+		WifiSetDownloadShare((uint8_t)percent);
 	}
 	
 	WifiHandlerSetState(WIFI_DOWNLOAD_INIT);
-	const TickType_t xDelay= 70000 / portTICK_PERIOD_MS;
-	vTaskDelay( xDelay );
-	
+	// The download runs in the background next to MQTT, wait for it instead of a fixed time
+	TickType_t start = xTaskGetTickCount();
+	while (WifiDownloadInProgress() && (xTaskGetTickCount() - start) < pdMS_TO_TICKS(CLI_OTAU_TIMEOUT_MS)) {
+		vTaskDelay(pdMS_TO_TICKS(1000));
+	}
+
+	if (!WifiDownloadSucceeded()) {
+		FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "Download failed, no reset\r\n");
+		return pdFALSE;
+	}
+	if (!OtaBootRequestUpdate()) {
+		FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "Could not flag the update, no reset\r\n");
+		return pdFALSE;
+	}
 	SerialConsoleWriteString("Reseting for FW!\r\n");
 	system_reset();
 	
@@ -330,13 +379,131 @@ BaseType_t CLI_AirFlow(int8_t *pcWriteBuffer, size_t xWriteBufferLen, const int8
 {
 	float air_speed = FS3000_readMetersPerSecond();
 
-	snprintf(pcWriteBuffer, xWriteBufferLen, "AirFlow: %0.2f m/s \r\n", air_speed);
+	FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "AirFlow: %0.2f m/s \r\n", air_speed);
 	
 	WifiAddAirDataToQueue(&air_speed);
 
 	return pdFALSE;
 }
 
+// CLI_StackUsage. Prints one task per call with the fewest stack words it ever had free,
+//                 used to size the task stacks (and to compare FMT_USE_NEWLIB builds)
+BaseType_t CLI_StackUsage(int8_t *pcWriteBuffer, size_t xWriteBufferLen, const int8_t *pcCommandString)
+{
+	static UBaseType_t taskIndex = 0;
+	TaskStatus_t tasks[CLI_STACK_MAX_TASKS];
+	UBaseType_t taskCount = uxTaskGetSystemState(tasks, CLI_STACK_MAX_TASKS, NULL);
+
+	if (taskIndex >= taskCount) {
+		taskIndex = 0;
+		return pdFALSE;
+	}
+
+	FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "%-8s %u words free\r\n", tasks[taskIndex].pcTaskName, (unsigned int)tasks[taskIndex].usStackHighWaterMark);
+	taskIndex++;
+	if (taskIndex >= taskCount) {
+		taskIndex = 0;
+		return pdFALSE;
+	}
+	return pdTRUE;
+}
+
+// CLI_MqttStats. Prints the publish pipeline and reconnect counters, one line per call
+BaseType_t CLI_MqttStats(int8_t *pcWriteBuffer, size_t xWriteBufferLen, const int8_t *pcCommandString)
+{
+	static uint8_t line = 0;
+	struct MqttPipelineStats stats;
+
+	MqttPipelineGetStats(&stats);
+	switch (line) {
+		case 0:
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "inflight %u max %u\r\n", stats.inFlight, stats.maxInFlight);
+			break;
+		case 1:
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "pub %lu ack %lu full %lu\r\n", stats.published, stats.acked, stats.windowFull);
+			break;
+		case 2:
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "retx %lu drop %lu\r\n", stats.retransmits, stats.dropped);
+			break;
+		case 3: {
+			struct TelemetryJournalStats journal;
+			TelemetryJournalGetStats(&journal);
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "journal %s backlog %lu replayed %lu lost %lu\r\n",
+					  journal.ready ? "on" : "off", journal.backlogSamples, journal.replayed, journal.dropped);
+		} break;
+		case 4:
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "ack ms p50<%lu p90<%lu p99<%lu\r\n", stats.latencyP50Ms, stats.latencyP90Ms, stats.latencyP99Ms);
+			break;
+		case 5: {
+			struct MqttReconnectStats reconnect;
+			MqttReconnectGetStats(&reconnect);
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "reconn %lu resume %lu clean %lu reinit %lu\r\n",
+					  reconnect.reconnects, reconnect.sessionResumes, reconnect.cleanSessions, reconnect.fullReinits);
+		} break;
+		case 6: {
+			struct MqttReconnectStats reconnect;
+			MqttReconnectGetStats(&reconnect);
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "reconn ms %lu avg %lu max %lu dns %lu\r\n",
+					  reconnect.lastMs, reconnect.avgMs, reconnect.maxMs, reconnect.dnsLookups);
+		} break;
+		case 7: {
+			struct CommandDispatchStats command;
+			CommandDispatchGetStats(&command);
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "cmd %lu run %lu abort %lu exp %lu rej %lu\r\n",
+					  command.received, command.executed, command.aborted, command.expired, command.rejected);
+		} break;
+		default: {
+			struct CommandDispatchStats command;
+			CommandDispatchGetStats(&command);
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "cmd ms q %lu/%lu exec %lu/%lu\r\n",
+					  command.lastQueueMs, command.maxQueueMs, command.lastExecMs, command.maxExecMs);
+			line = 0;
+			return pdFALSE;
+		}
+	}
+	line++;
+	return pdTRUE;
+}
+
+// CLI_Policy. Without arguments prints each channel's policy and suppression ratio, one line per call.
+// With arguments applies one policy line, e.g. "policy env rel 0.002 0 60000 0".
+BaseType_t CLI_Policy(int8_t *pcWriteBuffer, size_t xWriteBufferLen, const int8_t *pcCommandString)
+{
+	static uint8_t line = 0;
+	BaseType_t paramLen = 0;
+	const char *param = FreeRTOS_CLIGetParameter((const char *)pcCommandString, 1, &paramLen);
+
+	if (param != NULL) {
+		if (TelemetryPolicyParse(param, strlen(param))) {
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "ok\r\n");
+		} else {
+			FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "usage: policy imu|env|air all|abs|rel ...\r\n");
+		}
+		return pdFALSE;
+	}
+
+	uint8_t channel = line / 2;
+	if (line % 2 == 0) {
+		struct TelemetryPolicy policy;
+		TelemetryPolicyGet(channel, &policy);
+		FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "%s %s %.3f %lu %lu %u\r\n",
+				  TelemetryPolicyChannelName(channel), TelemetryPolicyModeName(policy.mode), policy.deadband,
+				  policy.minIntervalMs, policy.maxIntervalMs, policy.ratePerMin);
+	} else {
+		struct TelemetryPolicyStats stats;
+		uint32_t suppression = TelemetryPolicySuppressionX10(channel);
+		TelemetryPolicyGetStats(channel, &stats);
+		FmtPrintf((char *)pcWriteBuffer, xWriteBufferLen, "  in %lu out %lu sup %lu.%lu%%\r\n",
+				  stats.offered, stats.published, suppression / 10, suppression % 10);
+	}
+
+	if (++line >= 2 * TELEMETRY_CHANNELS) {
+		line = 0;
+		return pdFALSE;
+	}
+	return pdTRUE;
+}
+
 // Helper function to add bme680 data to the CLI queue.
 int CLIAddBmeDataToQueue(struct bme68x_data *bmePacket)
 {
@@ -19,10 +19,12 @@
 #define CLI_PRIORITY (configMAX_PRIORITIES - 2) ///<STUDENT FILL
 #define CLI_TASK_DELAY 150	///STUDENT FILL
 
-#define MAX_INPUT_LENGTH_CLI            10	//STUDENT FILL
+#define MAX_INPUT_LENGTH_CLI            40	///< Fits "policy env rel 0.002 0 60000 0"
 #define MAX_OUTPUT_LENGTH_CLI           50	//STUDENT FILL
 
 #define CLI_MSG_LEN						16
+#define CLI_STACK_MAX_TASKS				8	///< Tasks the "stack" command can list
+#define CLI_OTAU_TIMEOUT_MS				600000	///< Longest the "fw" command waits for the paced download
 #define CLI_PC_ESCAPE_CODE_SIZE			4
 #define CLI_PC_MIN_ESCAPE_CODE_SIZE		2
 
@@ -47,6 +49,9 @@ BaseType_t CLI_GetImuData( int8_t *pcWriteBuffer,size_t xWriteBufferLen,const in
 BaseType_t CLI_OTAU( int8_t *pcWriteBuffer,size_t xWriteBufferLen,const int8_t *pcCommandString );
 BaseType_t CLI_AirFlow(int8_t *pcWriteBuffer, size_t xWriteBufferLen, const int8_t *pcCommandString);
 BaseType_t CLI_GetEnvData( int8_t *pcWriteBuffer,size_t xWriteBufferLen,const int8_t *pcCommandString );
+BaseType_t CLI_StackUsage(int8_t *pcWriteBuffer, size_t xWriteBufferLen, const int8_t *pcCommandString);
+BaseType_t CLI_MqttStats(int8_t *pcWriteBuffer, size_t xWriteBufferLen, const int8_t *pcCommandString);
+BaseType_t CLI_Policy(int8_t *pcWriteBuffer, size_t xWriteBufferLen, const int8_t *pcCommandString);
 void update_fimware(void);
 int CLIAddBmeDataToQueue(struct bme68x_data *bmePacket);
 int CLIAddImuDataToQueue(struct ImuDataPacket_float *imuPacket);
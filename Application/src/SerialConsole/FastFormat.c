@@ -0,0 +1,413 @@
+/**************************************************************************//**
+* @file      FastFormat.c
+* @brief     Small bounded number and string formatter without newlib's float printf
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "FastFormat.h"
+#include <string.h>
+#if FMT_USE_NEWLIB
+#include <stdio.h>
+#endif
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define FMT_UINT_DIGITS     10      ///< Digits in UINT32_MAX
+#define FMT_FLOAT_LIMIT     4294967040.0f   ///< Largest float below 2^32, bigger values print as "inf"
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static const uint32_t fmtPow10[FMT_MAX_DECIMALS + 1] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static void FmtAppendPadded(struct FmtBuffer *fmt, const char *str, size_t len, uint8_t width, bool left, char pad);
+static size_t FmtUintToDigits(char *digits, uint32_t value);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		void FmtBufferInit(struct FmtBuffer *fmt, char *buffer, size_t size)
+ * @brief	Starts an empty string in buffer
+ */
+void FmtBufferInit(struct FmtBuffer *fmt, char *buffer, size_t size)
+{
+	fmt->buffer = buffer;
+	fmt->size = size;
+	fmt->len = 0;
+	fmt->truncated = (size == 0);
+	if (size > 0) {
+		buffer[0] = '\0';
+	}
+}
+
+/**
+ * @fn		void FmtAppendChar(struct FmtBuffer *fmt, char c)
+ * @brief	Appends one character if there is room for it and the terminator
+ */
+void FmtAppendChar(struct FmtBuffer *fmt, char c)
+{
+	if (fmt->len + 1 >= fmt->size) {
+		fmt->truncated = true;
+		return;
+	}
+	fmt->buffer[fmt->len++] = c;
+	fmt->buffer[fmt->len] = '\0';
+}
+
+/**
+ * @fn		void FmtAppendString(struct FmtBuffer *fmt, const char *str)
+ * @brief	Appends a NUL terminated string, cut at the end of the buffer
+ */
+void FmtAppendString(struct FmtBuffer *fmt, const char *str)
+{
+	FmtAppendStringN(fmt, str, SIZE_MAX);
+}
+
+/**
+ * @fn		void FmtAppendStringN(struct FmtBuffer *fmt, const char *str, size_t maxLen)
+ * @brief	Appends at most maxLen characters of str
+ */
+void FmtAppendStringN(struct FmtBuffer *fmt, const char *str, size_t maxLen)
+{
+	if (fmt->size == 0) {
+		return;
+	}
+	while (maxLen-- > 0 && *str != '\0') {
+		if (fmt->len + 1 >= fmt->size) {
+			fmt->truncated = true;
+			break;
+		}
+		fmt->buffer[fmt->len++] = *str++;
+	}
+	fmt->buffer[fmt->len] = '\0';
+}
+
+/**
+ * @fn		void FmtAppendUint(struct FmtBuffer *fmt, uint32_t value, uint8_t width, char pad)
+ * @brief	Appends an unsigned decimal, right aligned in width with pad (' ' or '0')
+ */
+void FmtAppendUint(struct FmtBuffer *fmt, uint32_t value, uint8_t width, char pad)
+{
+	char digits[FMT_UINT_DIGITS];
+	size_t len = FmtUintToDigits(digits, value);
+
+	FmtAppendPadded(fmt, digits, len, width, false, pad);
+}
+
+/**
+ * @fn		void FmtAppendInt(struct FmtBuffer *fmt, int32_t value, uint8_t width, char pad)
+ * @brief	Appends a signed decimal, right aligned in width. Zero padding goes after the sign.
+ */
+void FmtAppendInt(struct FmtBuffer *fmt, int32_t value, uint8_t width, char pad)
+{
+	char digits[FMT_UINT_DIGITS + 1];
+	uint32_t magnitude = (value < 0) ? (uint32_t)0 - (uint32_t)value : (uint32_t)value;
+	size_t len;
+
+	if (value >= 0) {
+		len = FmtUintToDigits(digits, magnitude);
+		FmtAppendPadded(fmt, digits, len, width, false, pad);
+		return;
+	}
+
+	if (pad == '0') {
+		FmtAppendChar(fmt, '-');
+		len = FmtUintToDigits(digits, magnitude);
+		FmtAppendPadded(fmt, digits, len, (width > 0) ? width - 1 : 0, false, '0');
+	} else {
+		digits[0] = '-';
+		len = FmtUintToDigits(&digits[1], magnitude) + 1;
+		FmtAppendPadded(fmt, digits, len, width, false, pad);
+	}
+}
+
+/**
+ * @fn		void FmtAppendHex(struct FmtBuffer *fmt, uint32_t value, uint8_t width, char pad, bool upper)
+ * @brief	Appends value in hexadecimal without prefix
+ */
+void FmtAppendHex(struct FmtBuffer *fmt, uint32_t value, uint8_t width, char pad, bool upper)
+{
+	const char *hex = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+	char digits[8];
+	size_t len = 0;
+
+	do {
+		digits[7 - len++] = hex[value & 0xF];
+		value >>= 4;
+	} while (value != 0);
+
+	FmtAppendPadded(fmt, &digits[8 - len], len, width, false, pad);
+}
+
+/**
+ * @fn		void FmtAppendFixed(struct FmtBuffer *fmt, float value, uint8_t decimals)
+ * @brief	Appends value rounded to a fixed number of decimals, like "%.Nf"
+ * @details	Magnitudes of 2^32 and above print as "inf", NaN as "nan". Float has a
+ *			24 bit mantissa, so digits beyond ~7 significant places are noise just
+ *			as they are with printf.
+ * @param[in]	decimals Digits after the point, clamped to FMT_MAX_DECIMALS
+ */
+void FmtAppendFixed(struct FmtBuffer *fmt, float value, uint8_t decimals)
+{
+	if (decimals > FMT_MAX_DECIMALS) {
+		decimals = FMT_MAX_DECIMALS;
+	}
+	if (value != value) {
+		FmtAppendString(fmt, "nan");
+		return;
+	}
+	if (value < 0.0f) {
+		FmtAppendChar(fmt, '-');
+		value = -value;
+	}
+	if (value >= FMT_FLOAT_LIMIT) {
+		FmtAppendString(fmt, "inf");
+		return;
+	}
+
+	uint32_t integer = (uint32_t)value;
+	uint32_t fraction = (uint32_t)((value - (float)integer) * (float)fmtPow10[decimals] + 0.5f);
+	if (fraction >= fmtPow10[decimals]) {
+		integer++;
+		fraction -= fmtPow10[decimals];
+	}
+
+	FmtAppendUint(fmt, integer, 0, ' ');
+	if (decimals > 0) {
+		FmtAppendChar(fmt, '.');
+		FmtAppendUint(fmt, fraction, decimals, '0');
+	}
+}
+
+/**
+ * @fn		int FmtVPrintf(char *buffer, size_t size, const char *format, va_list ap)
+ * @brief	vsnprintf replacement for the conversions listed in FastFormat.h
+ * @details	Unsupported conversions are copied to the output unchanged. %f takes the
+ *			promoted double but formats it as float.
+ * @return	Characters written, excluding the terminator. Unlike vsnprintf this is
+ *			never more than size - 1.
+ */
+int FmtVPrintf(char *buffer, size_t size, const char *format, va_list ap)
+{
+#if FMT_USE_NEWLIB
+	int len = vsnprintf(buffer, size, format, ap);
+	if (len < 0) {
+		return len;
+	}
+	return ((size_t)len >= size) ? (int)(size ? size - 1 : 0) : len;
+#else
+	struct FmtBuffer fmt;
+
+	FmtBufferInit(&fmt, buffer, size);
+	while (*format != '\0') {
+		if (*format != '%') {
+			FmtAppendChar(&fmt, *format++);
+			continue;
+		}
+
+		const char *spec = format++;
+		bool left = false;
+		char pad = ' ';
+		uint8_t width = 0;
+		int precision = -1;
+		bool isLong = false;
+		uint8_t longs = 0;
+
+		for (;; format++) {
+			if (*format == '-') {
+				left = true;
+			} else if (*format == '0') {
+				pad = '0';
+			} else {
+				break;
+			}
+		}
+		if (*format == '*') {
+			int w = va_arg(ap, int);
+			if (w < 0) {
+				/* As in C, a negative width is a '-' flag */
+				left = true;
+				w = -w;
+			}
+			width = (w > UINT8_MAX) ? UINT8_MAX : (uint8_t)w;
+			format++;
+		} else {
+			while (*format >= '0' && *format <= '9') {
+				width = (uint8_t)(width * 10 + (*format++ - '0'));
+			}
+		}
+		if (*format == '.') {
+			format++;
+			precision = 0;
+			if (*format == '*') {
+				precision = va_arg(ap, int);
+				format++;
+			} else {
+				while (*format >= '0' && *format <= '9') {
+					precision = precision * 10 + (*format++ - '0');
+				}
+			}
+		}
+		while (*format == 'l' || *format == 'h' || *format == 'z') {
+			isLong |= (*format == 'l' || *format == 'z');
+			longs += (*format == 'l') ? 1 : 0;
+			format++;
+		}
+		if (left) {
+			pad = ' ';
+		}
+
+		/* Conversions C knows but this formatter does not print: take the argument so
+		   the ones after it stay in step, then echo the specification */
+		bool unsupported = true;
+		if (*format == '\0') {
+			unsupported = false;
+		} else if (longs >= 2 && strchr("diuxX", *format) != NULL) {
+			(void)va_arg(ap, long long);
+		} else if (*format == 'p') {
+			(void)va_arg(ap, void *);
+		} else if (strchr("eEgGaA", *format) != NULL) {
+			(void)va_arg(ap, double);
+		} else {
+			unsupported = false;
+		}
+		if (unsupported) {
+			FmtAppendStringN(&fmt, spec, (size_t)(format - spec) + 1);
+			format++;
+			continue;
+		}
+
+		char tmp[FMT_UINT_DIGITS + FMT_MAX_DECIMALS + 3];
+		struct FmtBuffer num;
+		FmtBufferInit(&num, tmp, sizeof(tmp));
+
+		switch (*format) {
+			case 'd':
+			case 'i': {
+				int32_t v = isLong ? (int32_t)va_arg(ap, long) : (int32_t)va_arg(ap, int);
+				FmtAppendInt(&num, v, 0, ' ');
+				break;
+			}
+			case 'u': {
+				uint32_t v = isLong ? (uint32_t)va_arg(ap, unsigned long) : (uint32_t)va_arg(ap, unsigned int);
+				FmtAppendUint(&num, v, 0, ' ');
+				break;
+			}
+			case 'x':
+			case 'X': {
+				uint32_t v = isLong ? (uint32_t)va_arg(ap, unsigned long) : (uint32_t)va_arg(ap, unsigned int);
+				FmtAppendHex(&num, v, 0, ' ', *format == 'X');
+				break;
+			}
+			case 'f':
+				FmtAppendFixed(&num, (float)va_arg(ap, double), (precision < 0) ? FMT_MAX_DECIMALS : (uint8_t)precision);
+				break;
+			case 'c':
+				FmtAppendChar(&num, (char)va_arg(ap, int));
+				break;
+			case 's': {
+				const char *str = va_arg(ap, const char *);
+				size_t len = 0;
+				if (str == NULL) {
+					str = "(null)";
+				}
+				/* With a precision the argument need not be NUL terminated, never look past it */
+				while ((precision < 0 || len < (size_t)precision) && str[len] != '\0') {
+					len++;
+				}
+				FmtAppendPadded(&fmt, str, len, width, left, ' ');
+				format++;
+				continue;
+			}
+			case '%':
+				FmtAppendChar(&fmt, '%');
+				format++;
+				continue;
+			default:
+				/* Unknown conversion, copy it through so the mistake is visible */
+				FmtAppendStringN(&fmt, spec, (size_t)(format - spec) + (*format != '\0'));
+				if (*format != '\0') {
+					format++;
+				}
+				continue;
+		}
+
+		if (pad == '0' && tmp[0] == '-') {
+			/* Zero padding goes between the sign and the digits */
+			FmtAppendChar(&fmt, '-');
+			FmtAppendPadded(&fmt, &tmp[1], num.len - 1, (width > 0) ? width - 1 : 0, false, '0');
+		} else {
+			FmtAppendPadded(&fmt, tmp, num.len, width, left, pad);
+		}
+		format++;
+	}
+	return (int)fmt.len;
+#endif
+}
+
+/**
+ * @fn		int FmtPrintf(char *buffer, size_t size, const char *format, ...)
+ * @brief	snprintf replacement, see FmtVPrintf()
+ */
+int FmtPrintf(char *buffer, size_t size, const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	int len = FmtVPrintf(buffer, size, format, ap);
+	va_end(ap);
+	return len;
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static void FmtAppendPadded(struct FmtBuffer *fmt, const char *str, size_t len, uint8_t width, bool left, char pad)
+ * @brief	Appends len characters of str padded to width on the left or right
+ */
+static void FmtAppendPadded(struct FmtBuffer *fmt, const char *str, size_t len, uint8_t width, bool left, char pad)
+{
+	size_t fill = (width > len) ? width - len : 0;
+
+	if (!left) {
+		while (fill-- > 0) {
+			FmtAppendChar(fmt, pad);
+		}
+	}
+	FmtAppendStringN(fmt, str, len);
+	if (left) {
+		while (fill-- > 0) {
+			FmtAppendChar(fmt, ' ');
+		}
+	}
+}
+
+/**
+ * @fn		static size_t FmtUintToDigits(char *digits, uint32_t value)
+ * @brief	Writes the decimal digits of value (no terminator) and returns how many
+ */
+static size_t FmtUintToDigits(char *digits, uint32_t value)
+{
+	char reversed[FMT_UINT_DIGITS];
+	size_t len = 0;
+
+	do {
+		uint32_t quotient = value / 10;
+		reversed[len++] = (char)('0' + (value - quotient * 10));
+		value = quotient;
+	} while (value != 0);
+
+	for (size_t i = 0; i < len; i++) {
+		digits[i] = reversed[len - 1 - i];
+	}
+	return len;
+}
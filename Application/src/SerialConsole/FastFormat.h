@@ -0,0 +1,69 @@
+/**************************************************************************//**
+* @file      FastFormat.h
+* @brief     Small bounded number and string formatter without newlib's float printf
+* @details   Floats are printed as fixed-point decimals: the value is split into an
+*            integer and a scaled fraction once and both are printed with the integer
+*            routine, so no dtoa, no double arithmetic and a shallow stack. Integers
+*            never touch float code. Every function writes into a bounded buffer,
+*            always NUL terminates and records truncation instead of overrunning.
+*
+*            FmtPrintf() understands the subset the firmware uses:
+*            %d %i %u %x %X %c %s %.*s %f %.Nf %% with optional '-', '0', width
+*            (or '*') and the l / h / z length modifiers. %p, %e, %g, %a and
+*            ll integers are not printed: their argument is skipped and the
+*            specification copied to the output, so the mistake is visible.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define FMT_MAX_DECIMALS    6   ///< Largest fraction FmtAppendFixed() prints, also the %f default
+
+/**
+ * 1 routes FmtPrintf() / FmtVPrintf() to newlib's vsnprintf so stack use can be
+ * compared on target with the CLI "stack" command. Needs -u _printf_float added
+ * back to the linker flags for the float conversions.
+ */
+#define FMT_USE_NEWLIB      0
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Output cursor over a caller supplied buffer
+struct FmtBuffer {
+	char *buffer;		///< Destination, always NUL terminated
+	size_t size;		///< Size of buffer including the terminator
+	size_t len;			///< Characters written so far
+	bool truncated;		///< Set once anything did not fit
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+void FmtBufferInit(struct FmtBuffer *fmt, char *buffer, size_t size);
+void FmtAppendChar(struct FmtBuffer *fmt, char c);
+void FmtAppendString(struct FmtBuffer *fmt, const char *str);
+void FmtAppendStringN(struct FmtBuffer *fmt, const char *str, size_t maxLen);
+void FmtAppendUint(struct FmtBuffer *fmt, uint32_t value, uint8_t width, char pad);
+void FmtAppendInt(struct FmtBuffer *fmt, int32_t value, uint8_t width, char pad);
+void FmtAppendHex(struct FmtBuffer *fmt, uint32_t value, uint8_t width, char pad, bool upper);
+void FmtAppendFixed(struct FmtBuffer *fmt, float value, uint8_t decimals);
+int FmtVPrintf(char *buffer, size_t size, const char *format, va_list ap);
+int FmtPrintf(char *buffer, size_t size, const char *format, ...);
+
+#ifdef __cplusplus
+}
+#endif
@@ -28,6 +28,7 @@
  ******************************************************************************/
 #include "SerialConsole.h"
 #include "CliThread/CliThread.h"
+#include "FastFormat.h"
 
 /******************************************************************************
  * Defines
@@ -185,7 +186,7 @@ void LogMessage(enum eDebugLogLevels level, const char *format, ...)
     if (getLogLevel() <= level) {
         va_list ap;
         va_start(ap, format);
-        vsnprintf(debugBuffer, 127, format, ap);
+        FmtVPrintf(debugBuffer, sizeof(debugBuffer), format, ap);
         SerialConsoleWriteString(debugBuffer);
         va_end(ap);
     }
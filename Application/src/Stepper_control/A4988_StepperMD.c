@@ -22,9 +22,13 @@
 static float AirVelocity;
 float compare = -1;
 int MaxSpeedDir = 0;
+static bool trackDirection = CLOCK_WISE;	///< Direction the hill-climb tracker probes next
+static volatile bool stopRequested = false;	///< Set by StepperRequestStop(), ends the running motion at the next step
 /******************************************************************************
 * Forward Declarations
 ******************************************************************************/
+static int StepMotor(bool direction, int steps);
+static float ReadAverageAirVelocity(int samples);
 
 /******************************************************************************
 * Callback Functions
@@ -32,20 +36,21 @@ int MaxSpeedDir = 0;
 
 
 /**************************************************************************//**
-* @fn		int ExampleFuncionComment(int inputInt, void *pvParameters)
-* @brief	An example function comment. Erase me!
-* @details 	Write details of function here.
+* @fn		void AutomateTurbine(int degree)
+* @brief	Sweeps the nacelle and parks it where the air velocity was highest.
+* @details 	Rotates clockwise over the requested angle sampling the FS3000 before
+*			every step, then turns back to the step that gave the maximum reading.
                 				
-* @param[in]	InputInt Use me to describe inputs to functions
-* @param[out]	*pvParameters Use me to describe outputs of functions passed as arguments
-* @return		Use me to explain the return of an argument.
-* @note         
+* @param[in]	degree Width of the sweep in degrees
+* @return		false if StepperRequestStop() ended the sweep, the nacelle then stays where it was
+* @note         Blocks for roughly 2 * degree / 1.8 * 100 ms.
 *****************************************************************************/
-void AutomateTurbine(int degree)  {
+bool AutomateTurbine(int degree)  {
     // get the number of steps 
-    int steps = ((float) degree / 1.8);
-    //set the direction and make sure the motor rotate in different directions each time  
-    port_pin_set_output_level(DIRECTION, (bool)1);
+    int steps = ((float) degree / STEP_ANGLE_DEG);
+    // every sweep looks for a fresh maximum, otherwise a windy earlier run masks this one
+    compare = -1;
+    MaxSpeedDir = 0;
     // rotate the motor 
     for(int i=0; i<steps;i++){
         // get data from air velocity sensor here and store in AirVelocity 
@@ -58,21 +63,110 @@ void AutomateTurbine(int degree)  {
         }
 
         // move the stepper motor the next angle 
-        port_pin_set_output_level(STEP,(bool)1);
-        delay_ms(50);
-        port_pin_set_output_level(STEP,(bool)0);
-        delay_ms(50);
+        if (StepMotor(CLOCK_WISE, 1) == 0) {
+            return false;
+        }
     }
 	
     int new_steps = steps - MaxSpeedDir;
     // position the turbine in the direction of maxi air velocity 
     //change the direction of the motor
-    port_pin_set_output_level(DIRECTION,(bool)0); 
-    for(int i=0; i < new_steps; i++){
+    return StepMotor(ANTI_CLOCK_WISE, new_steps) == new_steps;
+}
+
+/**************************************************************************//**
+* @fn		int YawTrackWind(int max_steps)
+* @brief	Perturb-and-observe yaw tracker.
+* @details 	Probes one step in the last successful direction and keeps going while the
+*			averaged air velocity improves. When a probe is worse it steps back and tries
+*			the other side once; if both neighbours are worse the nacelle is on the peak.
+                				
+* @param[in]	max_steps Upper bound of probes for this call
+* @return		Number of steps that improved the reading
+* @note         Meant to be called periodically, unlike the full sweep of AutomateTurbine.
+*****************************************************************************/
+int YawTrackWind(int max_steps)
+{
+    float current = ReadAverageAirVelocity(YAW_TRACK_SAMPLES);
+    bool reversed = false;
+    int improved = 0;
+
+    for (int i = 0; i < max_steps && !stopRequested; i++) {
+        StepMotor(trackDirection, 1);
+        float probe = ReadAverageAirVelocity(YAW_TRACK_SAMPLES);
+        if (probe > current) {
+            current = probe;
+            improved++;
+            reversed = false;
+            continue;
+        }
+
+        // worse than where we were - undo the probe and look the other way
+        trackDirection = !trackDirection;
+        StepMotor(trackDirection, 1);
+        if (reversed) {
+            break;
+        }
+        reversed = true;
+    }
+
+    return improved;
+}
+
+/**************************************************************************//**
+* @fn		void StepperRequestStop(void)
+* @brief	Ends the running motion after the current step and refuses new steps
+* @note         Safe to call from any task. Stays in effect until StepperClearStop().
+*****************************************************************************/
+void StepperRequestStop(void)
+{
+    stopRequested = true;
+}
+
+/**************************************************************************//**
+* @fn		void StepperClearStop(void)
+* @brief	Allows motion again after StepperRequestStop()
+*****************************************************************************/
+void StepperClearStop(void)
+{
+    stopRequested = false;
+}
+
+/******************************************************************************
+* Static Functions
+******************************************************************************/
+
+/**************************************************************************//**
+* @fn		static int StepMotor(bool direction, int steps)
+* @brief	Sets DIR and issues the requested number of STEP pulses
+* @return	Steps issued, fewer than asked when a stop was requested
+* @note         The pulse timing sleeps instead of spinning, so the calling task
+*			can run above the Wifi task without starving it during a sweep.
+*****************************************************************************/
+static int StepMotor(bool direction, int steps)
+{
+    int done = 0;
+
+    port_pin_set_output_level(DIRECTION, direction);
+    for (; done < steps && !stopRequested; done++) {
         // move the stepper motor the next angle 
         port_pin_set_output_level(STEP,(bool)1);
-        delay_ms(50);
+        vTaskDelay(pdMS_TO_TICKS(STEP_HALF_PERIOD_MS));
         port_pin_set_output_level(STEP,(bool)0);
-        delay_ms(50);
+        vTaskDelay(pdMS_TO_TICKS(STEP_HALF_PERIOD_MS));
+    }
+    return done;
+}
+
+/**************************************************************************//**
+* @fn		static float ReadAverageAirVelocity(int samples)
+* @brief	Averages a few FS3000 readings to keep sensor noise out of the tracker
+*****************************************************************************/
+static float ReadAverageAirVelocity(int samples)
+{
+    float sum = 0;
+    for (int i = 0; i < samples; i++) {
+        sum += FS3000_readMetersPerSecond();
     }
-}
\ No newline at end of file
+    return sum / samples;
+}
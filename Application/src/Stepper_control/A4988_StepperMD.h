@@ -25,6 +25,10 @@ extern "C" {
 #define CLOCK_WISE      1
 #define ANTI_CLOCK_WISE 0
 #define DEBUG_BUTTON PIN_PA10
+
+#define STEP_ANGLE_DEG        1.8  ///< Full step angle of the Nema17 motor
+#define STEP_HALF_PERIOD_MS   50   ///< STEP high/low time. One step takes twice this
+#define YAW_TRACK_SAMPLES     4    ///< Air velocity readings averaged per hill-climb probe
 /******************************************************************************
 * Structures and Enumerations
 ******************************************************************************/
@@ -33,7 +37,12 @@ extern "C" {
 * Global Function Declaration
 ******************************************************************************/
 // this function is to be called whenever the user sends the automate command
-void AutomateTurbine(int degree);
+bool AutomateTurbine(int degree);
+// hill-climb tracker: probes one step at a time and follows the air velocity gradient
+int YawTrackWind(int max_steps);
+// ends the running motion at the next step, until StepperClearStop()
+void StepperRequestStop(void);
+void StepperClearStop(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,338 @@
+/**************************************************************************//**
+* @file      CommandDispatch.c
+* @brief     Runs MQTT commands in their own task, ahead of telemetry
+* @details   The command queue has one slot more than COMMAND_QUEUE_LEN and only a
+*            stop may take the last one, so a stop is never refused because of
+*            queued motions. The stop flag in the stepper driver is raised as soon
+*            as the stop arrives, the queue entry only clears it again once the
+*            running motion has ended and the rest of the queue is dropped.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "CommandDispatch.h"
+#include "SerialConsole.h"
+#include "SerialConsole/FastFormat.h"
+#include "Stepper_control/A4988_StepperMD.h"
+#include <string.h>
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Queued command
+struct Command {
+	uint16_t seq;				///< Sequence number, echoed in the ack
+	uint8_t type;				///< enum CommandType
+	uint16_t arg;				///< Degrees of a sweep, steps of a track
+	TickType_t received;		///< Tick the message was read from the broker
+};
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static QueueHandle_t commandQueue = NULL;	///< Wifi task to command task, stops go to the front
+static QueueHandle_t ackQueue = NULL;		///< Command task to Wifi task
+static volatile bool executing = false;		///< A command is running in the command task
+static volatile bool stopping = false;		///< A stop arrived and has not been executed yet
+static uint16_t nextSeq = 0;
+static struct CommandDispatchStats stats;
+
+static const char *const commandNames[] = {"sweep", "track", "stop", "unknown"};
+static const char *const resultNames[] = {"done", "aborted", "expired", "busy", "invalid"};
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static bool CommandParse(const char *payload, size_t len, struct Command *cmd);
+static void CommandExecute(const struct Command *cmd);
+static void CommandDropQueued(TickType_t now);
+static void CommandPostAck(const struct Command *cmd, uint8_t result, uint32_t queueMs, uint32_t execMs);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		void vCommandTask(void *pvParameters)
+ * @brief	Creates the queues, then runs one command at a time as they arrive
+ */
+void vCommandTask(void *pvParameters)
+{
+	QueueHandle_t commands = xQueueCreate(COMMAND_QUEUE_LEN + 1, sizeof(struct Command));
+	QueueHandle_t acks = xQueueCreate(COMMAND_ACK_QUEUE_LEN, sizeof(struct CommandAck));
+
+	if (commands == NULL || acks == NULL) {
+		SerialConsoleWriteString("ERROR Initializing command queues!\r\n");
+		vTaskSuspend(NULL);
+	}
+	ackQueue = acks;
+	commandQueue = commands;
+
+	while (1) {
+		struct Command cmd;
+
+		if (xQueueReceive(commandQueue, &cmd, portMAX_DELAY) == pdPASS) {
+			CommandExecute(&cmd);
+		}
+	}
+}
+
+/**
+ * @fn		bool CommandDispatchSubmit(const char *payload, size_t len)
+ * @brief	Parses a command message and queues it, called from the subscribe handler
+ * @details	A stop takes effect here, before it is queued. Invalid payloads and
+ *			commands that find the queue full are answered right away.
+ * @return	true if the command was queued
+ */
+bool CommandDispatchSubmit(const char *payload, size_t len)
+{
+	struct Command cmd;
+	BaseType_t queued;
+
+	stats.received++;
+	cmd.seq = ++nextSeq;
+	cmd.received = xTaskGetTickCount();
+	if (commandQueue == NULL) {
+		return false;
+	}
+	if (!CommandParse(payload, len, &cmd)) {
+		stats.rejected++;
+		CommandPostAck(&cmd, COMMAND_INVALID, 0, 0);
+		return false;
+	}
+
+	if (cmd.type == COMMAND_STOP) {
+		stopping = true;
+		StepperRequestStop();
+		queued = xQueueSendToFront(commandQueue, &cmd, 0);
+	} else if (uxQueueSpacesAvailable(commandQueue) > 1) {
+		queued = xQueueSendToBack(commandQueue, &cmd, 0);
+	} else {
+		queued = pdFAIL;
+	}
+
+	if (queued != pdPASS) {
+		// For a stop this only happens while another stop is queued, that one clears the flag
+		stats.rejected++;
+		CommandPostAck(&cmd, COMMAND_BUSY, 0, 0);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @fn		bool CommandDispatchBusy(void)
+ * @brief	true while a command runs or waits, its ack will follow
+ */
+bool CommandDispatchBusy(void)
+{
+	return executing || (commandQueue != NULL && uxQueueMessagesWaiting(commandQueue) > 0);
+}
+
+/**
+ * @fn		bool CommandDispatchAckPending(void)
+ * @brief	true while acks wait to be published, telemetry holds back until then
+ */
+bool CommandDispatchAckPending(void)
+{
+	return ackQueue != NULL && uxQueueMessagesWaiting(ackQueue) > 0;
+}
+
+/**
+ * @fn		bool CommandDispatchPeekAck(struct CommandAck *ack)
+ * @brief	Copies the oldest ack without removing it, so a failed publish can retry it
+ */
+bool CommandDispatchPeekAck(struct CommandAck *ack)
+{
+	return ackQueue != NULL && xQueuePeek(ackQueue, ack, 0) == pdPASS;
+}
+
+/**
+ * @fn		void CommandDispatchConsumeAck(void)
+ * @brief	Removes the ack returned by the last CommandDispatchPeekAck()
+ */
+void CommandDispatchConsumeAck(void)
+{
+	struct CommandAck ack;
+
+	if (ackQueue != NULL) {
+		xQueueReceive(ackQueue, &ack, 0);
+	}
+}
+
+/**
+ * @fn		int CommandDispatchFormatAck(const struct CommandAck *ack, char *buffer, size_t size)
+ * @brief	Formats the ack payload
+ * @details	{"seq":12,"cmd":"sweep","result":"done","queue_ms":3,"exec_ms":4210}
+ * @return	Length written, or -1 if it did not fit
+ */
+int CommandDispatchFormatAck(const struct CommandAck *ack, char *buffer, size_t size)
+{
+	struct FmtBuffer fmt;
+
+	FmtBufferInit(&fmt, buffer, size);
+	FmtAppendString(&fmt, "{\"seq\":");
+	FmtAppendUint(&fmt, ack->seq, 0, ' ');
+	FmtAppendString(&fmt, ",\"cmd\":\"");
+	FmtAppendString(&fmt, commandNames[ack->type]);
+	FmtAppendString(&fmt, "\",\"result\":\"");
+	FmtAppendString(&fmt, resultNames[ack->result]);
+	FmtAppendString(&fmt, "\",\"queue_ms\":");
+	FmtAppendUint(&fmt, ack->queueMs, 0, ' ');
+	FmtAppendString(&fmt, ",\"exec_ms\":");
+	FmtAppendUint(&fmt, ack->execMs, 0, ' ');
+	FmtAppendChar(&fmt, '}');
+	return fmt.truncated ? -1 : (int)fmt.len;
+}
+
+/**
+ * @fn		void CommandDispatchGetStats(struct CommandDispatchStats *out)
+ * @brief	Copies the counters
+ */
+void CommandDispatchGetStats(struct CommandDispatchStats *out)
+{
+	*out = stats;
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static bool CommandParse(const char *payload, size_t len, struct Command *cmd)
+ * @brief	Reads a command word and an optional number, e.g. "1", "sweep 90", "track 5", "stop"
+ * @return	false if the word is unknown (cmd->type stays COMMAND_UNKNOWN) or the number is out of range
+ */
+static bool CommandParse(const char *payload, size_t len, struct Command *cmd)
+{
+	const char *end = payload + len;
+	const char *word = payload;
+	size_t wordLen = 0;
+	uint32_t number = 0;
+	bool haveNumber = false;
+
+	cmd->type = COMMAND_UNKNOWN;
+	cmd->arg = 0;
+	if (payload == NULL || len == 0 || len > COMMAND_PAYLOAD_MAX) {
+		return false;
+	}
+
+	while (word + wordLen < end && word[wordLen] != ' ' && word[wordLen] != '\r' && word[wordLen] != '\n') {
+		wordLen++;
+	}
+	for (const char *c = word + wordLen; c < end; c++) {
+		if (*c >= '0' && *c <= '9' && number < 10000) {
+			number = number * 10 + (uint32_t)(*c - '0');
+			haveNumber = true;
+		} else if (*c != ' ' && *c != '\r' && *c != '\n') {
+			return false;
+		}
+	}
+
+	if ((wordLen == 1 && word[0] == '1') || (wordLen == 5 && strncmp(word, "sweep", 5) == 0)) {
+		cmd->type = COMMAND_SWEEP;
+		number = haveNumber ? number : COMMAND_SWEEP_DEFAULT_DEG;
+		cmd->arg = (uint16_t)number;
+		return number > 0 && number <= COMMAND_SWEEP_MAX_DEG;
+	}
+	if (wordLen == 5 && strncmp(word, "track", 5) == 0) {
+		cmd->type = COMMAND_TRACK;
+		number = haveNumber ? number : COMMAND_TRACK_DEFAULT_STEPS;
+		cmd->arg = (uint16_t)number;
+		return number > 0 && number <= COMMAND_TRACK_MAX_STEPS;
+	}
+	if ((wordLen == 1 && word[0] == '0') || (wordLen == 4 && strncmp(word, "stop", 4) == 0)) {
+		cmd->type = COMMAND_STOP;
+		return !haveNumber;
+	}
+	return false;
+}
+
+/**
+ * @fn		static void CommandExecute(const struct Command *cmd)
+ * @brief	Runs one command and acks it with its queue and execution time
+ */
+static void CommandExecute(const struct Command *cmd)
+{
+	TickType_t start = xTaskGetTickCount();
+	uint32_t queueMs = (start - cmd->received) * portTICK_PERIOD_MS;
+	uint8_t result = COMMAND_DONE;
+
+	if (cmd->type != COMMAND_STOP && queueMs > COMMAND_MAX_WAIT_MS) {
+		stats.expired++;
+		CommandPostAck(cmd, COMMAND_EXPIRED, queueMs, 0);
+		return;
+	}
+
+	executing = true;
+	stats.executed++;
+	switch (cmd->type) {
+		case COMMAND_SWEEP:
+			SerialConsoleWriteString("Starting Wind Routine\r\n");
+			if (!AutomateTurbine(cmd->arg)) {
+				result = COMMAND_ABORTED;
+			}
+			break;
+		case COMMAND_TRACK:
+			YawTrackWind(cmd->arg);
+			if (stopping) {
+				result = COMMAND_ABORTED;
+			}
+			break;
+		case COMMAND_STOP:
+			CommandDropQueued(start);
+			stopping = false;
+			StepperClearStop();
+			break;
+	}
+	executing = false;
+
+	uint32_t execMs = (xTaskGetTickCount() - start) * portTICK_PERIOD_MS;
+	if (result == COMMAND_ABORTED) {
+		stats.aborted++;
+	}
+	stats.lastQueueMs = queueMs;
+	stats.lastExecMs = execMs;
+	if (queueMs > stats.maxQueueMs) {
+		stats.maxQueueMs = queueMs;
+	}
+	if (execMs > stats.maxExecMs) {
+		stats.maxExecMs = execMs;
+	}
+	CommandPostAck(cmd, result, queueMs, execMs);
+}
+
+/**
+ * @fn		static void CommandDropQueued(TickType_t now)
+ * @brief	Acks the motions still queued behind a stop as aborted
+ */
+static void CommandDropQueued(TickType_t now)
+{
+	struct Command queued;
+
+	while (xQueueReceive(commandQueue, &queued, 0) == pdPASS) {
+		uint32_t queueMs = (now - queued.received) * portTICK_PERIOD_MS;
+
+		// A second stop is served by this one
+		if (queued.type == COMMAND_STOP) {
+			CommandPostAck(&queued, COMMAND_DONE, queueMs, 0);
+		} else {
+			stats.aborted++;
+			CommandPostAck(&queued, COMMAND_ABORTED, queueMs, 0);
+		}
+	}
+}
+
+/**
+ * @fn		static void CommandPostAck(const struct Command *cmd, uint8_t result, uint32_t queueMs, uint32_t execMs)
+ * @brief	Hands an ack to the Wifi task, never blocks; counted as dropped when the queue is full
+ */
+static void CommandPostAck(const struct Command *cmd, uint8_t result, uint32_t queueMs, uint32_t execMs)
+{
+	struct CommandAck ack = {cmd->seq, cmd->type, result, queueMs, execMs};
+
+	if (ackQueue == NULL || xQueueSendToBack(ackQueue, &ack, 0) != pdPASS) {
+		stats.acksDropped++;
+	}
+}
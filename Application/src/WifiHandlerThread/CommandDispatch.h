@@ -0,0 +1,105 @@
+/**************************************************************************//**
+* @file      CommandDispatch.h
+* @brief     Runs MQTT commands in their own task, ahead of telemetry
+* @details   Command topics arrive through mqtt_yield() in the Wifi task like
+*            everything else. Their subscribe handlers only parse the payload
+*            and queue a command, the motion itself runs in the command task,
+*            which sits above the Wifi task. A stop goes to the front of the
+*            queue and ends a running motion at its next step. Commands that
+*            waited longer than COMMAND_MAX_WAIT_MS are not started, so a
+*            backlog cannot move the nacelle long after it was asked to.
+*
+*            Every command is answered on COMMAND_ACK_TOPIC with its sequence
+*            number, outcome, time spent queued and time spent executing. The
+*            Wifi task publishes acks before telemetry and holds telemetry
+*            back while any are waiting.
+*
+*            Automate payloads: "1" or "sweep [deg]", "track [steps]", "0" or "stop".
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <asf.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define COMMAND_TASK_SIZE               300     ///< Words, the sweep keeps a few floats and the I2C transfer on it
+#define COMMAND_PRIORITY                (configMAX_PRIORITIES - 2)  ///< Above the Wifi task so a queued command starts at once
+#define COMMAND_QUEUE_LEN               4       ///< Commands waiting behind the running one
+#define COMMAND_ACK_QUEUE_LEN           (COMMAND_QUEUE_LEN + 2)    ///< Acks waiting for the Wifi task: a stop acks the whole queue at once
+#define COMMAND_MAX_WAIT_MS             2000    ///< Commands queued longer than this expire instead of running
+#define COMMAND_PAYLOAD_MAX             24      ///< Longest command payload accepted
+#define COMMAND_SWEEP_DEFAULT_DEG       120     ///< Sweep width of a bare "1"
+#define COMMAND_SWEEP_MAX_DEG           360
+#define COMMAND_TRACK_DEFAULT_STEPS     10      ///< Probe budget of a bare "track"
+#define COMMAND_TRACK_MAX_STEPS         50
+#define COMMAND_ACK_TOPIC               "Automate_Ack"
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// What a command does
+enum CommandType {
+	COMMAND_SWEEP = 0,			///< AutomateTurbine()
+	COMMAND_TRACK = 1,			///< YawTrackWind()
+	COMMAND_STOP = 2,			///< Ends the running motion and drops everything queued
+	COMMAND_UNKNOWN = 3			///< Payload not understood, only seen in acks
+};
+
+/// Outcome reported in the ack
+enum CommandResult {
+	COMMAND_DONE = 0,			///< Ran to the end
+	COMMAND_ABORTED = 1,		///< Ended or dropped by a stop
+	COMMAND_EXPIRED = 2,		///< Waited longer than COMMAND_MAX_WAIT_MS, not started
+	COMMAND_BUSY = 3,			///< Queue full, not accepted
+	COMMAND_INVALID = 4			///< Payload not understood
+};
+
+/// One acknowledgement, filled by the command task and published by the Wifi task
+struct CommandAck {
+	uint16_t seq;				///< Sequence number given on arrival
+	uint8_t type;				///< enum CommandType
+	uint8_t result;				///< enum CommandResult
+	uint32_t queueMs;			///< Arrival to start
+	uint32_t execMs;			///< Start to end
+};
+
+/// Counters reported by CommandDispatchGetStats()
+struct CommandDispatchStats {
+	uint32_t received;			///< Command messages seen
+	uint32_t executed;			///< Commands started
+	uint32_t aborted;			///< Commands ended or dropped by a stop
+	uint32_t expired;			///< Commands that waited too long
+	uint32_t rejected;			///< Invalid payloads and full queue
+	uint32_t acksDropped;		///< Acks lost because the ack queue was full
+	uint32_t lastQueueMs;		///< Queue time of the latest command
+	uint32_t maxQueueMs;		///< Longest queue time of a command that ran
+	uint32_t lastExecMs;		///< Execution time of the latest command
+	uint32_t maxExecMs;			///< Longest execution time
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+void vCommandTask(void *pvParameters);
+bool CommandDispatchSubmit(const char *payload, size_t len);
+bool CommandDispatchBusy(void);
+bool CommandDispatchAckPending(void);
+bool CommandDispatchPeekAck(struct CommandAck *ack);
+void CommandDispatchConsumeAck(void);
+int CommandDispatchFormatAck(const struct CommandAck *ack, char *buffer, size_t size);
+void CommandDispatchGetStats(struct CommandDispatchStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,365 @@
+/**************************************************************************//**
+* @file      MqttPipeline.c
+* @brief     Keeps several QoS 1 publishes in flight instead of waiting for each PUBACK
+* @details   Everything runs in the Wifi task: MqttPipelinePublish() and
+*            MqttPipelineService() from MQTT_HandleTransactions(), and the PUBACK
+*            handler from inside mqtt_yield(), so no locking is needed.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "MqttPipeline.h"
+#include <stddef.h>
+#include <string.h>
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// One message waiting for its PUBACK
+struct MqttPipelineSlot {
+	bool used;					///< Slot holds a message
+	bool sentOnce;				///< Written at least once, resends carry DUP and keep packetId
+	bool needsSend;				///< Write failed or the connection dropped, send on next service
+	uint8_t retries;			///< Timeout resends so far
+	uint8_t retain;				///< Retain flag of the message
+	uint16_t packetId;			///< Packet id assigned on the first write
+	uint16_t len;				///< Payload length
+	TickType_t firstSent;		///< Tick of the first write, for the ack latency
+	TickType_t lastSent;		///< Tick of the latest write, for the retransmit timer
+	const char *topic;			///< Topic, must be a string with static lifetime
+	MqttPipelineDoneHook done;	///< Outcome callback, NULL for fire-and-forget messages
+	uint32_t tag;				///< Passed back to done
+	char payload[MQTT_PIPELINE_PAYLOAD_MAX];
+};
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static struct mqtt_module *pipelineModule = NULL;
+static struct MqttPipelineSlot slots[MQTT_PIPELINE_DEPTH];
+static struct MqttPipelineStats stats;
+
+/// Upper bound (ms) of each ack latency bucket, the last one catches everything slower
+static const uint32_t latencyBucketMs[MQTT_PIPELINE_LATENCY_BUCKETS] = {20, 50, 100, 200, 300, 500, 750, 1000, 1500, 2000, 3000, UINT32_MAX};
+static uint32_t latencyHistogram[MQTT_PIPELINE_LATENCY_BUCKETS];
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static void MqttPipelinePuback(MQTTClient *client, unsigned short packetId);
+static void MqttPipelineSend(struct MqttPipelineSlot *slot, TickType_t now);
+static void MqttPipelineRelease(struct MqttPipelineSlot *slot, bool acked);
+static uint8_t MqttPipelineInFlight(void);
+static uint16_t MqttPipelineIdDistance(uint16_t from, uint16_t to);
+static bool MqttPipelineIdInUse(uint16_t packetId);
+static uint32_t MqttPipelinePercentile(uint8_t percent);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		void MqttPipelineInit(struct mqtt_module *module)
+ * @brief	Hooks the PUBACK handler into module
+ * @note	Call after mqtt_init(), the handler lives in the Paho client. The Wifi task
+ *			re-initializes the client in WIFI_MQTT_INIT; messages still in the
+ *			window are kept and resent on the new connection like after a disconnect.
+ *			They keep their packet ids for the DUP resend, so the client's id counter,
+ *			which mqtt_init() restarts at 1, continues after the highest of them.
+ */
+void MqttPipelineInit(struct mqtt_module *module)
+{
+	struct MqttPipelineSlot *highest = NULL;
+
+	pipelineModule = module;
+	MqttPipelineDisconnected();
+	mqtt_set_puback_handler(module, MqttPipelinePuback);
+
+	for (uint8_t i = 0; i < MQTT_PIPELINE_DEPTH; i++) {
+		if (slots[i].used && slots[i].sentOnce &&
+			(highest == NULL || MqttPipelineIdDistance(highest->packetId, slots[i].packetId) < MAX_PACKET_ID / 2)) {
+			highest = &slots[i];
+		}
+	}
+	if (highest != NULL && module->client != NULL) {
+		module->client->next_packetid = highest->packetId;
+	}
+}
+
+/**
+ * @fn		bool MqttPipelineHasRoom(void)
+ * @brief	True if MqttPipelinePublish() would find a free slot
+ */
+bool MqttPipelineHasRoom(void)
+{
+	return MqttPipelineInFlight() < MQTT_PIPELINE_DEPTH;
+}
+
+/**
+ * @fn		bool MqttPipelineIsIdle(void)
+ * @brief	True when no message is waiting for its PUBACK
+ */
+bool MqttPipelineIsIdle(void)
+{
+	return MqttPipelineInFlight() == 0;
+}
+
+/**
+ * @fn		int MqttPipelinePublish(const char *topic, const char *payload, uint32_t len, uint8_t retain)
+ * @brief	Copies a QoS 1 message into the window and writes it without waiting for the ack
+ * @details	Once this returns SUCCESS the pipeline owns the message: it is resent until
+ *			acked or MQTT_PIPELINE_MAX_RETRIES is used up, even across a reconnect.
+ * @param[in]	topic Topic with static lifetime, only the pointer is kept
+ * @return	SUCCESS if the message was taken, FAILURE if the window is full or it is too big
+ */
+int MqttPipelinePublish(const char *topic, const char *payload, uint32_t len, uint8_t retain)
+{
+	return MqttPipelinePublishTracked(topic, payload, len, retain, NULL, 0);
+}
+
+/**
+ * @fn		int MqttPipelinePublishTracked(const char *topic, const char *payload, uint32_t len, uint8_t retain, MqttPipelineDoneHook done, uint32_t tag)
+ * @brief	MqttPipelinePublish() that reports the outcome through done(tag, acked)
+ * @details	done is not called when this returns FAILURE.
+ */
+int MqttPipelinePublishTracked(const char *topic, const char *payload, uint32_t len, uint8_t retain, MqttPipelineDoneHook done, uint32_t tag)
+{
+	struct MqttPipelineSlot *slot = NULL;
+
+	if (pipelineModule == NULL || len > MQTT_PIPELINE_PAYLOAD_MAX) {
+		return FAILURE;
+	}
+	for (uint8_t i = 0; i < MQTT_PIPELINE_DEPTH; i++) {
+		if (!slots[i].used) {
+			slot = &slots[i];
+			break;
+		}
+	}
+	if (slot == NULL) {
+		stats.windowFull++;
+		return FAILURE;
+	}
+
+	memset(slot, 0, offsetof(struct MqttPipelineSlot, payload));
+	memcpy(slot->payload, payload, len);
+	slot->used = true;
+	slot->needsSend = true;
+	slot->retain = retain;
+	slot->len = (uint16_t)len;
+	slot->topic = topic;
+	slot->done = done;
+	slot->tag = tag;
+	stats.published++;
+
+	if (pipelineModule->isConnected) {
+		MqttPipelineSend(slot, xTaskGetTickCount());
+	}
+
+	uint8_t inFlight = MqttPipelineInFlight();
+	if (inFlight > stats.maxInFlight) {
+		stats.maxInFlight = inFlight;
+	}
+	return SUCCESS;
+}
+
+/**
+ * @fn		void MqttPipelineService(TickType_t now)
+ * @brief	Writes pending messages and retransmits the ones whose PUBACK is late
+ * @note	Call once per Wifi task loop, after mqtt_yield() delivered the acks.
+ */
+void MqttPipelineService(TickType_t now)
+{
+	if (pipelineModule == NULL || !pipelineModule->isConnected) {
+		return;
+	}
+
+	for (uint8_t i = 0; i < MQTT_PIPELINE_DEPTH; i++) {
+		struct MqttPipelineSlot *slot = &slots[i];
+
+		if (!slot->used) {
+			continue;
+		}
+		if (slot->needsSend) {
+			MqttPipelineSend(slot, now);
+		} else if ((now - slot->lastSent) >= pdMS_TO_TICKS(MQTT_PIPELINE_RETRY_MS)) {
+			if (slot->retries >= MQTT_PIPELINE_MAX_RETRIES) {
+				stats.dropped++;
+				MqttPipelineRelease(slot, false);
+				continue;
+			}
+			slot->retries++;
+			MqttPipelineSend(slot, now);
+		}
+	}
+}
+
+/**
+ * @fn		void MqttPipelineDisconnected(void)
+ * @brief	Marks every message in flight for a resend once the connection is back
+ */
+void MqttPipelineDisconnected(void)
+{
+	for (uint8_t i = 0; i < MQTT_PIPELINE_DEPTH; i++) {
+		if (slots[i].used && slots[i].sentOnce) {
+			slots[i].needsSend = true;
+		}
+	}
+}
+
+/**
+ * @fn		void MqttPipelineGetStats(struct MqttPipelineStats *out)
+ * @brief	Copies the counters and computes the ack latency percentiles
+ */
+void MqttPipelineGetStats(struct MqttPipelineStats *out)
+{
+	*out = stats;
+	out->inFlight = MqttPipelineInFlight();
+	out->latencyP50Ms = MqttPipelinePercentile(50);
+	out->latencyP90Ms = MqttPipelinePercentile(90);
+	out->latencyP99Ms = MqttPipelinePercentile(99);
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static void MqttPipelinePuback(MQTTClient *client, unsigned short packetId)
+ * @brief	Frees the slot the PUBACK belongs to and records its latency
+ * @note	Acks for ids not in the window (a late ack after a drop, or a blocking
+ *			mqtt_publish) are ignored.
+ */
+static void MqttPipelinePuback(MQTTClient *client, unsigned short packetId)
+{
+	if (pipelineModule == NULL || client != pipelineModule->client) {
+		return;
+	}
+
+	for (uint8_t i = 0; i < MQTT_PIPELINE_DEPTH; i++) {
+		struct MqttPipelineSlot *slot = &slots[i];
+
+		if (slot->used && slot->sentOnce && slot->packetId == packetId) {
+			uint32_t latencyMs = (xTaskGetTickCount() - slot->firstSent) * portTICK_PERIOD_MS;
+			uint8_t bucket = 0;
+
+			while (latencyMs > latencyBucketMs[bucket]) {
+				bucket++;
+			}
+			latencyHistogram[bucket]++;
+			stats.acked++;
+			MqttPipelineRelease(slot, true);
+			return;
+		}
+	}
+}
+
+/**
+ * @fn		static void MqttPipelineSend(struct MqttPipelineSlot *slot, TickType_t now)
+ * @brief	Writes the slot's PUBLISH, with DUP and the same packet id if it went out before
+ */
+static void MqttPipelineSend(struct MqttPipelineSlot *slot, TickType_t now)
+{
+	if (!slot->sentOnce) {
+		/* The client hands out the id after next_packetid, never one still in the window */
+		MQTTClient *client = pipelineModule->client;
+		while (client != NULL &&
+			   MqttPipelineIdInUse((client->next_packetid == MAX_PACKET_ID) ? 1 : (uint16_t)(client->next_packetid + 1))) {
+			client->next_packetid = (client->next_packetid == MAX_PACKET_ID) ? 1 : client->next_packetid + 1;
+		}
+	}
+
+	int rc = mqtt_publish_nowait(pipelineModule, slot->topic, slot->payload, slot->len, 1, slot->retain, slot->sentOnce, &slot->packetId);
+
+	if (rc != SUCCESS) {
+		slot->needsSend = true;
+		return;
+	}
+	if (!slot->sentOnce) {
+		slot->firstSent = now;
+		slot->sentOnce = true;
+	} else {
+		stats.retransmits++;
+	}
+	slot->lastSent = now;
+	slot->needsSend = false;
+}
+
+/**
+ * @fn		static void MqttPipelineRelease(struct MqttPipelineSlot *slot, bool acked)
+ * @brief	Frees the slot, then tells its publisher how it ended
+ * @note	Acks are delivered from inside mqtt_yield(), so hooks only record the outcome
+ *			and must not publish from there.
+ */
+static void MqttPipelineRelease(struct MqttPipelineSlot *slot, bool acked)
+{
+	MqttPipelineDoneHook done = slot->done;
+
+	slot->used = false;
+	if (done != NULL) {
+		done(slot->tag, acked);
+	}
+}
+
+/**
+ * @fn		static uint8_t MqttPipelineInFlight(void)
+ * @brief	Number of occupied slots
+ */
+static uint8_t MqttPipelineInFlight(void)
+{
+	uint8_t count = 0;
+
+	for (uint8_t i = 0; i < MQTT_PIPELINE_DEPTH; i++) {
+		count += slots[i].used ? 1 : 0;
+	}
+	return count;
+}
+
+/**
+ * @fn		static uint16_t MqttPipelineIdDistance(uint16_t from, uint16_t to)
+ * @brief	Steps from one packet id to another, counting up through MAX_PACKET_ID back to 1
+ */
+static uint16_t MqttPipelineIdDistance(uint16_t from, uint16_t to)
+{
+	return (uint16_t)((to >= from) ? (to - from) : (MAX_PACKET_ID - from + to));
+}
+
+/**
+ * @fn		static bool MqttPipelineIdInUse(uint16_t packetId)
+ * @brief	True if a message in the window went out with packetId
+ */
+static bool MqttPipelineIdInUse(uint16_t packetId)
+{
+	for (uint8_t i = 0; i < MQTT_PIPELINE_DEPTH; i++) {
+		if (slots[i].used && slots[i].sentOnce && slots[i].packetId == packetId) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @fn		static uint32_t MqttPipelinePercentile(uint8_t percent)
+ * @brief	Upper bound of the latency bucket holding the given percentile, 0 without data
+ */
+static uint32_t MqttPipelinePercentile(uint8_t percent)
+{
+	uint32_t total = 0;
+	uint32_t seen = 0;
+
+	for (uint8_t i = 0; i < MQTT_PIPELINE_LATENCY_BUCKETS; i++) {
+		total += latencyHistogram[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+
+	uint32_t target = (total * percent + 99) / 100;
+	for (uint8_t i = 0; i < MQTT_PIPELINE_LATENCY_BUCKETS; i++) {
+		seen += latencyHistogram[i];
+		if (seen >= target) {
+			return latencyBucketMs[i];
+		}
+	}
+	return latencyBucketMs[MQTT_PIPELINE_LATENCY_BUCKETS - 1];
+}
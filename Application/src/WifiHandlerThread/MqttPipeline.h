@@ -0,0 +1,73 @@
+/**************************************************************************//**
+* @file      MqttPipeline.h
+* @brief     Keeps several QoS 1 publishes in flight instead of waiting for each PUBACK
+* @details   mqtt_publish() blocks until its PUBACK arrives, so throughput is one
+*            message per broker round trip. The pipeline writes the PUBLISH with
+*            mqtt_publish_nowait(), keeps a copy of the payload in a slot until the
+*            matching PUBACK comes back through mqtt_yield(), and retransmits with
+*            the DUP flag when an ack is late. Slots survive a disconnect and are
+*            resent once the broker is back. A publisher that needs to know the
+*            outcome passes a MqttPipelineDoneHook, called once per message.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <asf.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "MQTTClient/Wrapper/mqtt.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define MQTT_PIPELINE_DEPTH             4       ///< QoS 1 messages allowed in flight
+#define MQTT_PIPELINE_PAYLOAD_MAX       256     ///< Largest payload a slot can hold
+#define MQTT_PIPELINE_RETRY_MS          3000    ///< Resend when no PUBACK arrived within this time
+#define MQTT_PIPELINE_MAX_RETRIES       3       ///< Resends before a message is dropped
+#define MQTT_PIPELINE_LATENCY_BUCKETS   12      ///< Ack latency histogram size, see MqttPipeline.c
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/**
+ * Called from the Wifi task when a tracked message leaves the window.
+ * @param tag Value given to MqttPipelinePublishTracked()
+ * @param acked true on PUBACK, false when the message was dropped after its retries
+ */
+typedef void (*MqttPipelineDoneHook)(uint32_t tag, bool acked);
+
+/// Counters reported by MqttPipelineGetStats()
+struct MqttPipelineStats {
+	uint8_t inFlight;			///< Messages waiting for their PUBACK now
+	uint8_t maxInFlight;		///< Highest inFlight seen
+	uint32_t published;			///< Messages accepted into the window
+	uint32_t acked;				///< Messages whose PUBACK arrived
+	uint32_t retransmits;		///< DUP resends written after a timeout or reconnect
+	uint32_t dropped;			///< Messages given up after MQTT_PIPELINE_MAX_RETRIES
+	uint32_t windowFull;		///< Publishes refused because every slot was busy
+	uint32_t latencyP50Ms;		///< Ack latency percentiles (bucket upper bound, ms)
+	uint32_t latencyP90Ms;
+	uint32_t latencyP99Ms;
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+void MqttPipelineInit(struct mqtt_module *module);
+bool MqttPipelineHasRoom(void);
+bool MqttPipelineIsIdle(void);
+int MqttPipelinePublish(const char *topic, const char *payload, uint32_t len, uint8_t retain);
+int MqttPipelinePublishTracked(const char *topic, const char *payload, uint32_t len, uint8_t retain, MqttPipelineDoneHook done, uint32_t tag);
+void MqttPipelineService(TickType_t now);
+void MqttPipelineDisconnected(void);
+void MqttPipelineGetStats(struct MqttPipelineStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,241 @@
+/**************************************************************************//**
+* @file      MqttReconnect.c
+* @brief     Brings a lost MQTT connection back without rebuilding the socket layer
+* @details   mqtt_connect() and mqtt_connect_ip() run the whole socket connect
+*            and CONNECT/CONNACK exchange before they return, so an attempt is
+*            finished, one way or the other, when MqttReconnectAttempt() looks
+*            at isConnected.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "MqttReconnect.h"
+#include "SerialConsole.h"
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static struct mqtt_module *reconnectModule = NULL;
+static const char *brokerHost = NULL;
+static uint32_t brokerIp = 0;			///< Cached broker address, 0 until a lookup succeeded
+static uint8_t ipFailures = 0;			///< Failed attempts in a row on brokerIp
+static uint8_t attemptsSinceReinit = 0;	///< Failed attempts since the last connect or rebuild
+static bool connected = false;			///< Connection state as last seen here
+static bool everConnected = false;		///< The first connect is not counted as a reconnect
+static bool handlersLost = true;		///< Paho client has no message handlers, subscribe even if the session survived
+static TickType_t lostAt = 0;			///< Tick the connection was lost
+static TickType_t nextAttempt = 0;		///< Tick of the next attempt
+static uint32_t jitterState = 0;		///< xorshift32 state for the backoff jitter
+static uint32_t totalMs = 0;			///< Sum of all reconnect times, for the mean
+static struct MqttReconnectStats stats;
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static void MqttReconnectAttempt(void);
+static TickType_t MqttReconnectBackoff(uint8_t failures);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		void MqttReconnectInit(struct mqtt_module *module, const char *host)
+ * @brief	Takes over connecting module to host, the first attempt is due right away
+ * @param[in]	host Broker name with static lifetime
+ */
+void MqttReconnectInit(struct mqtt_module *module, const char *host)
+{
+	TickType_t now = xTaskGetTickCount();
+
+	reconnectModule = module;
+	brokerHost = host;
+	jitterState = 0x9E3779B9UL ^ (uint32_t)now;
+	connected = false;
+	handlersLost = true;
+	lostAt = now;
+	nextAttempt = now;
+}
+
+/**
+ * @fn		bool MqttReconnectService(TickType_t now, bool networkUp)
+ * @brief	Makes the next connect attempt once it is due
+ * @note	An attempt blocks for up to the DNS, TCP and CONNACK timeouts.
+ * @return	true when the attempts keep failing and the caller should rebuild the socket
+ *			layer, then call MqttReconnectReinitialized()
+ */
+bool MqttReconnectService(TickType_t now, bool networkUp)
+{
+	if (reconnectModule == NULL || reconnectModule->isConnected || !networkUp) {
+		return false;
+	}
+	if ((int32_t)(now - nextAttempt) < 0) {
+		return false;
+	}
+	if (attemptsSinceReinit >= MQTT_RECONNECT_REINIT_AFTER) {
+		return true;
+	}
+	MqttReconnectAttempt();
+	return false;
+}
+
+/**
+ * @fn		void MqttReconnectLost(TickType_t now)
+ * @brief	Starts the reconnect clock, the first attempt is made without delay
+ * @note	Called for every MQTT_CALLBACK_DISCONNECTED, repeats are ignored.
+ */
+void MqttReconnectLost(TickType_t now)
+{
+	if (!connected) {
+		return;
+	}
+	connected = false;
+	lostAt = now;
+	nextAttempt = now;
+}
+
+/**
+ * @fn		void MqttReconnectKick(void)
+ * @brief	The network is back, try now instead of waiting out the backoff
+ */
+void MqttReconnectKick(void)
+{
+	nextAttempt = xTaskGetTickCount();
+}
+
+/**
+ * @fn		bool MqttReconnectNeedsSubscribe(bool sessionPresent)
+ * @brief	Decides on CONNACK whether the subscriptions have to be sent again
+ * @return	false when the broker kept the session and the client still has its handlers
+ */
+bool MqttReconnectNeedsSubscribe(bool sessionPresent)
+{
+	bool needed = !sessionPresent || handlersLost;
+
+	handlersLost = false;
+	if (needed) {
+		stats.cleanSessions++;
+	} else {
+		stats.sessionResumes++;
+	}
+	return needed;
+}
+
+/**
+ * @fn		void MqttReconnectReinitialized(void)
+ * @brief	The socket layer and client were rebuilt; handlers are gone and the address may be stale
+ */
+void MqttReconnectReinitialized(void)
+{
+	stats.fullReinits++;
+	handlersLost = true;
+	brokerIp = 0;
+	ipFailures = 0;
+	attemptsSinceReinit = 0;
+	connected = false;
+	nextAttempt = xTaskGetTickCount();
+}
+
+/**
+ * @fn		TickType_t MqttReconnectTicksUntilRetry(TickType_t now)
+ * @brief	Ticks until the next attempt, portMAX_DELAY while connected
+ */
+TickType_t MqttReconnectTicksUntilRetry(TickType_t now)
+{
+	if (reconnectModule == NULL || reconnectModule->isConnected) {
+		return portMAX_DELAY;
+	}
+	if ((int32_t)(now - nextAttempt) >= 0) {
+		return 0;
+	}
+	return nextAttempt - now;
+}
+
+/**
+ * @fn		void MqttReconnectGetStats(struct MqttReconnectStats *out)
+ * @brief	Copies the counters
+ */
+void MqttReconnectGetStats(struct MqttReconnectStats *out)
+{
+	*out = stats;
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static void MqttReconnectAttempt(void)
+ * @brief	One connect, on the cached address when there is one, then books the outcome
+ */
+static void MqttReconnectAttempt(void)
+{
+	bool cached = (brokerIp != 0);
+	int rc;
+
+	stats.attempts++;
+	if (cached) {
+		rc = mqtt_connect_ip(reconnectModule, brokerIp);
+	} else {
+		stats.dnsLookups++;
+		rc = mqtt_connect(reconnectModule, brokerHost);
+	}
+
+	TickType_t now = xTaskGetTickCount();
+	if (reconnectModule->isConnected) {
+		if (!cached) {
+			brokerIp = (uint32_t)reconnectModule->network.hostIP;
+		}
+		if (everConnected) {
+			uint32_t ms = (now - lostAt) * portTICK_PERIOD_MS;
+
+			stats.reconnects++;
+			stats.lastMs = ms;
+			totalMs += ms;
+			stats.avgMs = totalMs / stats.reconnects;
+			if (ms > stats.maxMs) {
+				stats.maxMs = ms;
+			}
+			LogMessage(LOG_DEBUG_LVL, "MQTT back after %lu ms, %lu attempts\r\n", ms, (unsigned long)stats.failures + 1);
+		}
+		everConnected = true;
+		connected = true;
+		ipFailures = 0;
+		attemptsSinceReinit = 0;
+		stats.failures = 0;
+		return;
+	}
+
+	// Only a failed socket connect says anything about the address, a refused CONNECT does not
+	if (cached && rc < 0 && ++ipFailures >= MQTT_RECONNECT_IP_RETRIES) {
+		brokerIp = 0;
+		ipFailures = 0;
+	}
+	if (stats.failures < UINT8_MAX) {
+		stats.failures++;
+	}
+	attemptsSinceReinit++;
+	nextAttempt = now + MqttReconnectBackoff(stats.failures);
+}
+
+/**
+ * @fn		static TickType_t MqttReconnectBackoff(uint8_t failures)
+ * @brief	Delay after the given number of failures: the exponential step halved, plus up to that half again at random
+ */
+static TickType_t MqttReconnectBackoff(uint8_t failures)
+{
+	uint32_t step = MQTT_RECONNECT_MAX_MS;
+
+	if (failures <= 16) {
+		step = (uint32_t)MQTT_RECONNECT_BASE_MS << (failures - 1);
+		if (step > MQTT_RECONNECT_MAX_MS) {
+			step = MQTT_RECONNECT_MAX_MS;
+		}
+	}
+
+	jitterState ^= jitterState << 13;
+	jitterState ^= jitterState >> 17;
+	jitterState ^= jitterState << 5;
+	return pdMS_TO_TICKS(step / 2 + jitterState % (step / 2 + 1));
+}
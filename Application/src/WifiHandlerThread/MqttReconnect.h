@@ -0,0 +1,69 @@
+/**************************************************************************//**
+* @file      MqttReconnect.h
+* @brief     Brings a lost MQTT connection back without rebuilding the socket layer
+* @details   A dead connection (socket error or unanswered PINGREQ) is closed
+*            and reopened on the running socket layer and Paho client. Attempts
+*            back off exponentially with jitter, so a broker outage is not met by
+*            a reconnect storm. The client connects with clean session off, so
+*            when the broker still holds the session the subscriptions stay in
+*            place and nothing is resubscribed. The broker address from the
+*            first DNS lookup is reused until connecting to it keeps failing.
+*
+*            Only after MQTT_RECONNECT_REINIT_AFTER failed attempts in a row does
+*            the Wifi task fall back to MQTT_InitRoutine(), which restarts the
+*            sockets and the client. Everything here runs in the Wifi task.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <asf.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "MQTTClient/Wrapper/mqtt.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define MQTT_RECONNECT_BASE_MS          500     ///< Backoff after the first failed attempt
+#define MQTT_RECONNECT_MAX_MS           30000   ///< Backoff cap
+#define MQTT_RECONNECT_REINIT_AFTER     6       ///< Failed attempts in a row before the socket layer is rebuilt
+#define MQTT_RECONNECT_IP_RETRIES       2       ///< Failed attempts on the cached broker address before it is looked up again
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Counters reported by MqttReconnectGetStats()
+struct MqttReconnectStats {
+	uint32_t attempts;			///< Connect attempts since boot
+	uint32_t reconnects;		///< Connections brought back after a loss
+	uint32_t sessionResumes;	///< Connects where the broker still had the session, no resubscribe
+	uint32_t cleanSessions;		///< Connects that had to subscribe again, including the first one
+	uint32_t fullReinits;		///< Times the socket layer and client were rebuilt
+	uint32_t dnsLookups;		///< Attempts that resolved the broker name
+	uint32_t lastMs;			///< Link loss to CONNACK of the latest reconnect
+	uint32_t avgMs;				///< Mean of lastMs over all reconnects
+	uint32_t maxMs;				///< Slowest reconnect
+	uint8_t failures;			///< Failed attempts since the last connect
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+void MqttReconnectInit(struct mqtt_module *module, const char *host);
+bool MqttReconnectService(TickType_t now, bool networkUp);
+void MqttReconnectLost(TickType_t now);
+void MqttReconnectKick(void);
+bool MqttReconnectNeedsSubscribe(bool sessionPresent);
+void MqttReconnectReinitialized(void);
+TickType_t MqttReconnectTicksUntilRetry(TickType_t now);
+void MqttReconnectGetStats(struct MqttReconnectStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,283 @@
+/**************************************************************************//**
+* @file      OtaBoot.c
+* @brief     Update request for the bootloader and the time it took to reach the application
+* @details   SysTick after reset runs from the same clock as the CPU, OSC8M
+*            divided by its prescaler, so the count converts to microseconds
+*            without knowing what system_init() will set up later.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "OtaBoot.h"
+#include "SerialConsole/FastFormat.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include <stddef.h>
+#include <string.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define OTA_BOOT_OSC8M_HZ           8000000UL
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static uint32_t bootTimeUs = 0;		///< Bootloader main() to application main(), 0 when not timed
+static const char *const profilePhaseNames[OTA_BOOT_PROFILE_PHASES] = {"periph", "sdInit", "mount", "selfTest", "update"};
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static int OtaBootStateCurrent(struct OtaBootState *state);
+static bool OtaBootStateRow(int row, struct OtaBootState *state);
+static uint32_t OtaBootStateCrc(const struct OtaBootState *state);
+static uint32_t OtaBootProfileCrc(const struct OtaBootProfile *profile);
+static bool OtaBootWriteRow(uint32_t address, const uint8_t *data, uint32_t len);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		void OtaBootCaptureTime(void)
+ * @brief	Reads the SysTick count the bootloader left running, call before system_init()
+ * @details	SysTick is off after a reset, so it only runs here if the bootloader took
+ *			the fast path. After an update the bootloader stops it and nothing is timed.
+ */
+void OtaBootCaptureTime(void)
+{
+	if ((SysTick->CTRL & SysTick_CTRL_ENABLE_Msk) != 0 && SysTick->LOAD == SysTick_LOAD_RELOAD_Msk) {
+		uint32_t cycles = SysTick_LOAD_RELOAD_Msk - SysTick->VAL;
+		uint32_t hz = OTA_BOOT_OSC8M_HZ >> SYSCTRL->OSC8M.bit.PRESC;
+
+		bootTimeUs = (uint32_t)(((uint64_t)cycles * 1000000UL) / hz);
+	}
+	SysTick->CTRL = 0;
+}
+
+/**
+ * @fn		uint32_t OtaBootGetTimeUs(void)
+ * @brief	Time from bootloader main() to application main(), 0 after an update boot
+ */
+uint32_t OtaBootGetTimeUs(void)
+{
+	return bootTimeUs;
+}
+
+/**
+ * @fn		bool OtaBootRequestUpdate(void)
+ * @brief	Tells the bootloader to look for an update on the next reset
+ * @details	Call only once the downloaded file has passed its manifest check.
+ * @return	true if the request row was written and reads back
+ */
+bool OtaBootRequestUpdate(void)
+{
+	uint32_t pending = OTA_BOOT_REQUEST_PENDING;
+
+	return OtaBootWriteRow(OTA_BOOT_REQUEST_ADDRESS, (const uint8_t *)&pending, sizeof(pending));
+}
+
+/**
+ * @fn		bool OtaBootGetState(struct OtaBootState *state)
+ * @brief	Reads the trial state and boot counters the bootloader keeps
+ * @return	false if the bootloader has not written a valid record yet
+ */
+bool OtaBootGetState(struct OtaBootState *state)
+{
+	return OtaBootStateCurrent(state) >= 0;
+}
+
+/**
+ * @fn		bool OtaBootConfirm(void)
+ * @brief	Records that this image booted healthy and stops the bootloader's watchdog
+ * @details	Call once the application is up. Does nothing unless the image is on
+ *			trial, a confirmed image runs without the watchdog.
+ * @return	true if the image is confirmed, false if the record could not be written
+ */
+bool OtaBootConfirm(void)
+{
+	struct OtaBootState state;
+	int row = OtaBootStateCurrent(&state);
+
+	if (row < 0 || state.trial != OTA_BOOT_TRIAL_PENDING) {
+		return true;
+	}
+
+	//The record goes to the other row, a reset while writing it keeps the current one
+	state.trial = 0;
+	state.confirms++;
+	state.confirmMs = xTaskGetTickCount() * portTICK_PERIOD_MS;
+	state.sequence++;
+	state.recordCrc = OtaBootStateCrc(&state);
+	if (!OtaBootWriteRow(OTA_BOOT_STATE_ADDRESS + (row == 0 ? NVMCTRL_ROW_SIZE : 0), (const uint8_t *)&state, sizeof(state))) {
+		// Leave the watchdog running, an image that cannot confirm gets rolled back
+		return false;
+	}
+
+	WDT->CTRL.reg = 0;
+	while (WDT->STATUS.reg & WDT_STATUS_SYNCBUSY) {
+	}
+	return true;
+}
+
+/**
+ * @fn		bool OtaBootReadProfile(struct OtaBootProfile *profile)
+ * @brief	Reads the phase times the bootloader left on the SD card, call with the card mounted
+ * @return	false after a fast path boot, or if the record is missing or corrupt
+ */
+bool OtaBootReadProfile(struct OtaBootProfile *profile)
+{
+	FIL file;
+	UINT read = 0;
+	FRESULT res;
+
+	if (f_open(&file, OTA_BOOT_PROFILE_FILE, FA_OPEN_EXISTING | FA_READ) != FR_OK) {
+		return false;
+	}
+	res = f_read(&file, profile, sizeof(*profile), &read);
+	f_close(&file);
+	return res == FR_OK && read == sizeof(*profile) && profile->magic == OTA_BOOT_PROFILE_MAGIC &&
+		   OtaBootProfileCrc(profile) == profile->recordCrc;
+}
+
+/**
+ * @fn		int OtaBootFormatProfile(const struct OtaBootProfile *profile, char *buffer, size_t size)
+ * @brief	Writes a boot profile as JSON for OTA_BOOT_PROFILE_TOPIC
+ * @details	{"path":"sd","image":7,"result":0,"ms":{"periph":9,"sdInit":212,...},"totalMs":4931,
+ *			"flashed":61440,"unchanged":2048,"flashMs":4120}, or {"path":"fast","image":7,"us":1830}
+ *			when profile is NULL. An update boot that could not be timed gives "us":0.
+ * @return	Length written, or -1 if it did not fit
+ */
+int OtaBootFormatProfile(const struct OtaBootProfile *profile, char *buffer, size_t size)
+{
+	struct FmtBuffer fmt;
+	struct OtaBootState state;
+	uint32_t generation = profile ? profile->generation : (OtaBootGetState(&state) ? state.generation : 0);
+
+	FmtBufferInit(&fmt, buffer, size);
+	FmtAppendString(&fmt, profile ? "{\"path\":\"sd\",\"image\":" : "{\"path\":\"fast\",\"image\":");
+	FmtAppendUint(&fmt, generation, 0, ' ');
+	if (profile == NULL) {
+		FmtAppendString(&fmt, ",\"us\":");
+		FmtAppendUint(&fmt, bootTimeUs, 0, ' ');
+		FmtAppendChar(&fmt, '}');
+		return fmt.truncated ? -1 : (int)fmt.len;
+	}
+
+	FmtAppendString(&fmt, ",\"result\":");
+	FmtAppendUint(&fmt, profile->result, 0, ' ');
+	FmtAppendString(&fmt, ",\"ms\":{");
+	for (uint8_t i = 0; i < OTA_BOOT_PROFILE_PHASES; i++) {
+		FmtAppendString(&fmt, i ? ",\"" : "\"");
+		FmtAppendString(&fmt, profilePhaseNames[i]);
+		FmtAppendString(&fmt, "\":");
+		FmtAppendUint(&fmt, profile->phaseMs[i], 0, ' ');
+	}
+	FmtAppendString(&fmt, "},\"totalMs\":");
+	FmtAppendUint(&fmt, profile->totalMs, 0, ' ');
+	FmtAppendString(&fmt, ",\"flashed\":");
+	FmtAppendUint(&fmt, profile->bytesFlashed, 0, ' ');
+	FmtAppendString(&fmt, ",\"unchanged\":");
+	FmtAppendUint(&fmt, profile->bytesUnchanged, 0, ' ');
+	FmtAppendString(&fmt, ",\"flashMs\":");
+	FmtAppendUint(&fmt, profile->flashMs, 0, ' ');
+	FmtAppendChar(&fmt, '}');
+	return fmt.truncated ? -1 : (int)fmt.len;
+}
+
+/**
+ * @fn		void OtaBootClearProfile(void)
+ * @brief	Removes the bootloader's profile once it has been published
+ */
+void OtaBootClearProfile(void)
+{
+	f_unlink(OTA_BOOT_PROFILE_FILE);
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static int OtaBootStateCurrent(struct OtaBootState *state)
+ * @brief	Reads the valid record with the higher sequence, as the bootloader picks it
+ * @return	Its row, -1 if neither row holds a valid record
+ */
+static int OtaBootStateCurrent(struct OtaBootState *state)
+{
+	struct OtaBootState other;
+	bool valid = OtaBootStateRow(0, state);
+
+	if (OtaBootStateRow(1, &other) && (!valid || (int32_t)(other.sequence - state->sequence) > 0)) {
+		memcpy(state, &other, sizeof(*state));
+		return 1;
+	}
+	return valid ? 0 : -1;
+}
+
+/**
+ * @fn		static bool OtaBootStateRow(int row, struct OtaBootState *state)
+ * @brief	Reads the record in one of the OTA_BOOT_STATE_ROWS rows
+ */
+static bool OtaBootStateRow(int row, struct OtaBootState *state)
+{
+	memcpy(state, (const void *)(OTA_BOOT_STATE_ADDRESS + row * NVMCTRL_ROW_SIZE), sizeof(*state));
+	return state->magic == OTA_BOOT_STATE_MAGIC && OtaBootStateCrc(state) == state->recordCrc;
+}
+
+/**
+ * @fn		static uint32_t OtaBootStateCrc(const struct OtaBootState *state)
+ * @brief	CRC32 of the record without its last word, as the bootloader computes it
+ */
+static uint32_t OtaBootStateCrc(const struct OtaBootState *state)
+{
+	crc32_t crc = 0;
+
+	crc32_recalculate(state, offsetof(struct OtaBootState, recordCrc), &crc);
+	return crc;
+}
+
+/**
+ * @fn		static uint32_t OtaBootProfileCrc(const struct OtaBootProfile *profile)
+ * @brief	CRC32 of the profile without its last word, as the bootloader computes it
+ */
+static uint32_t OtaBootProfileCrc(const struct OtaBootProfile *profile)
+{
+	crc32_t crc = 0;
+
+	crc32_recalculate(profile, offsetof(struct OtaBootProfile, recordCrc), &crc);
+	return crc;
+}
+
+/**
+ * @fn		static bool OtaBootWriteRow(uint32_t address, const uint8_t *data, uint32_t len)
+ * @brief	Erases the row at address and programs len bytes, at most one page
+ * @return	true if the data reads back
+ */
+static bool OtaBootWriteRow(uint32_t address, const uint8_t *data, uint32_t len)
+{
+	struct nvm_config config;
+	enum status_code status;
+
+	nvm_get_config_defaults(&config);
+	config.manual_page_write = false;
+	do {
+		status = nvm_set_config(&config);
+	} while (status == STATUS_BUSY);
+
+	do {
+		status = nvm_erase_row(address);
+	} while (status == STATUS_BUSY);
+	if (status != STATUS_OK) {
+		return false;
+	}
+
+	do {
+		status = nvm_write_buffer(address, data, len);
+	} while (status == STATUS_BUSY);
+	while (!nvm_is_ready()) {
+	}
+	return status == STATUS_OK && memcmp((const void *)address, data, len) == 0;
+}
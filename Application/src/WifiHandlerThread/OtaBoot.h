@@ -0,0 +1,100 @@
+/**************************************************************************//**
+* @file      OtaBoot.h
+* @brief     Update request for the bootloader and the time it took to reach the application
+* @details   The bootloader only mounts the SD card when the last flash row holds
+*            OTA_BOOT_REQUEST_PENDING, otherwise it jumps to the application at
+*            once. OtaBootRequestUpdate() writes that word after a verified
+*            download; the bootloader erases the row again once it has looked for
+*            the update. The row lies above any application image, so flashing
+*            the application never touches it.
+*
+*            On the fast path the bootloader leaves SysTick counting down from
+*            its full reload at the reset clock. OtaBootCaptureTime(), the first
+*            call in main(), reads it back before system_init() changes the
+*            clocks, giving the time from bootloader main() to application main().
+*
+*            After an install the new image is on trial: the bootloader starts the
+*            watchdog before each of its first boots, and OtaBootConfirm() has to
+*            record a healthy boot and stop it before it runs out. An image that
+*            does not confirm within BOOT_TRIAL_ATTEMPTS boots is replaced by the
+*            last confirmed one, see BootState.h in the bootloader.
+*
+*            A boot that went through the SD card leaves the time of each of its
+*            phases in OTA_BOOT_PROFILE_FILE. The Wifi task publishes it, or the
+*            fast path time when there is none, once per boot on
+*            OTA_BOOT_PROFILE_TOPIC and then removes the file.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <asf.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define OTA_BOOT_REQUEST_ADDRESS    0x3FF00UL       ///< Last NVM row, must match BOOT_REQUEST_ADDRESS in the bootloader
+#define OTA_BOOT_REQUEST_PENDING    0x54445055UL    ///< "UPDT", an update waits on the SD card
+#define OTA_BOOT_STATE_ADDRESS      0x3FD00UL       ///< Two rows below, must match BOOT_STATE_ADDRESS in the bootloader
+#define OTA_BOOT_STATE_ROWS         2               ///< Written in turn, the record with the higher sequence is current
+#define OTA_BOOT_STATE_MAGIC        0x32545342UL    ///< "BST2"
+#define OTA_BOOT_TRIAL_PENDING      1               ///< OtaBootState.trial of an image that has not confirmed yet
+#define OTA_BOOT_PROFILE_FILE       "0:boot_profile.bin"    ///< Must match BOOT_PROFILE_FILE in the bootloader
+#define OTA_BOOT_PROFILE_MAGIC      0x464F5250UL    ///< "PROF"
+#define OTA_BOOT_PROFILE_PHASES     5               ///< Peripherals, SD init, mount, self test, update
+#define OTA_BOOT_PROFILE_TOPIC      "Boot_Profile"
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Trial state and boot counters kept by the bootloader, must match struct BootState there
+struct OtaBootState {
+	uint32_t magic;				///< OTA_BOOT_STATE_MAGIC
+	uint32_t generation;		///< Version of the image in flash, the install that wrote it
+	uint32_t imageLength;
+	uint32_t imageCrc;
+	uint32_t trial;				///< OTA_BOOT_TRIAL_PENDING until confirmed, 0 after
+	uint32_t trialBoots;		///< Boots of the image on trial so far, this one included
+	uint32_t installs;			///< Updates installed
+	uint32_t confirms;			///< Trials confirmed
+	uint32_t rollbacks;			///< Trials given up and restored from the saved image
+	uint32_t watchdogResets;	///< Watchdog resets while an image was on trial
+	uint32_t confirmMs;			///< Scheduler start to confirmation in the last trial
+	uint32_t rollbackMs;		///< Time the last rollback spent flashing
+	uint32_t sequence;			///< Counts writes, see OTA_BOOT_STATE_ROWS
+	uint32_t recordCrc;			///< CRC32 of the fields above
+};
+
+/// Phase times of the last boot through the SD card, must match struct BootProfile in the bootloader
+struct OtaBootProfile {
+	uint32_t magic;				///< OTA_BOOT_PROFILE_MAGIC
+	uint32_t generation;		///< Image the bootloader went on to start
+	uint32_t result;			///< 0 if it started the image, 1 if it reset to try again
+	uint32_t phaseMs[OTA_BOOT_PROFILE_PHASES];
+	uint32_t totalMs;			///< From the bootloader's first tick to the record being written
+	uint32_t bytesFlashed;		///< Bytes erased and programmed
+	uint32_t bytesUnchanged;	///< Bytes the update did not have to program
+	uint32_t flashMs;			///< Part of the update phase spent flashing
+	uint32_t recordCrc;			///< CRC32 of the fields above
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+void OtaBootCaptureTime(void);
+uint32_t OtaBootGetTimeUs(void);
+bool OtaBootRequestUpdate(void);
+bool OtaBootGetState(struct OtaBootState *state);
+bool OtaBootConfirm(void);
+bool OtaBootReadProfile(struct OtaBootProfile *profile);
+int OtaBootFormatProfile(const struct OtaBootProfile *profile, char *buffer, size_t size);
+void OtaBootClearProfile(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,169 @@
+/**************************************************************************//**
+* @file      OtaVerify.c
+* @brief     CRC32 of the OTA image computed while it is written, and the manifest it is checked against
+* @details   The word aligned bulk of each block goes through the DSU, which does
+*            the CRC in hardware; odd bytes at either end go through the ASF
+*            software CRC. Both compute the same polynomial, the DSU just keeps the
+*            register uncomplemented.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "OtaVerify.h"
+#include "ASF/sam0/drivers/dsu/crc32/crc32.h"
+#include <string.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+/// Register touched around every DSU CRC of a RAM source, see SAM D21 errata 1.8.3
+#define OTA_DSU_ERRATA_REG      (*((volatile unsigned int *)0x41007058))
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static bool OtaParseNumber(const char *text, const char *end, uint8_t base, uint32_t *value);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		void OtaVerifyInit(void)
+ * @brief	Clocks the DSU for OtaVerifyUpdate()
+ */
+void OtaVerifyInit(void)
+{
+	dsu_crc32_init();
+}
+
+/**
+ * @fn		uint32_t OtaVerifyUpdate(uint32_t crc, const uint8_t *data, uint32_t len)
+ * @brief	Continues a CRC32 over the next len bytes
+ * @param[in]	crc CRC32 of everything before data, 0 for the first block
+ * @return	CRC32 of everything up to and including data
+ * @note	The DSU runs with interrupts off, so keep blocks to a few KB.
+ */
+uint32_t OtaVerifyUpdate(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	crc32_t soft = crc;
+	uint32_t head = (4 - ((uintptr_t)data & 3)) & 3;
+
+	if (head > len) {
+		head = len;
+	}
+	if (head > 0) {
+		crc32_recalculate(data, head, &soft);
+		data += head;
+		len -= head;
+	}
+
+	uint32_t words = len & ~3UL;
+	if (words > 0) {
+		uint32_t state = ~soft;
+
+		OTA_DSU_ERRATA_REG &= ~0x30000UL;
+		enum status_code status = dsu_crc32_cal((uint32_t)data, words, &state);
+		OTA_DSU_ERRATA_REG |= 0x20000UL;
+
+		if (status == STATUS_OK) {
+			soft = ~state;
+		} else {
+			crc32_recalculate(data, words, &soft);
+		}
+		data += words;
+		len -= words;
+	}
+
+	if (len > 0) {
+		crc32_recalculate(data, len, &soft);
+	}
+	return soft;
+}
+
+/**
+ * @fn		bool OtaManifestParse(const char *text, size_t len, struct OtaManifest *manifest)
+ * @brief	Reads the length, crc32 and format lines of a manifest
+ * @param[in]	text Manifest body, need not be terminated
+ * @return	true if both were found, manifest->valid is set to the same
+ */
+bool OtaManifestParse(const char *text, size_t len, struct OtaManifest *manifest)
+{
+	bool haveLength = false;
+	bool haveCrc = false;
+
+	memset(manifest, 0, sizeof(*manifest));
+	if (text == NULL || len > OTA_MANIFEST_MAX) {
+		return false;
+	}
+
+	const char *end = text + len;
+
+	while (text < end) {
+		const char *lineEnd = text;
+		const char *value = NULL;
+
+		while (lineEnd < end && *lineEnd != '\n') {
+			if (value == NULL && *lineEnd == ' ') {
+				value = lineEnd + 1;
+			}
+			lineEnd++;
+		}
+		if (value != NULL) {
+			size_t keyLen = (size_t)(value - 1 - text);
+
+			if (keyLen == 6 && strncmp(text, "length", 6) == 0) {
+				haveLength = OtaParseNumber(value, lineEnd, 10, &manifest->length);
+			} else if (keyLen == 5 && strncmp(text, "crc32", 5) == 0) {
+				haveCrc = OtaParseNumber(value, lineEnd, 16, &manifest->crc32);
+			} else if (keyLen == 6 && strncmp(text, "format", 6) == 0) {
+				manifest->patch = (lineEnd - value >= 5 && strncmp(value, "patch", 5) == 0);
+			}
+		}
+		text = lineEnd + 1;
+	}
+
+	manifest->valid = haveLength && haveCrc && manifest->length > 0;
+	return manifest->valid;
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static bool OtaParseNumber(const char *text, const char *end, uint8_t base, uint32_t *value)
+ * @brief	Parses an unsigned decimal or hex number up to end, a trailing '\r' is allowed
+ * @return	false if there are no digits or anything else on the line
+ */
+static bool OtaParseNumber(const char *text, const char *end, uint8_t base, uint32_t *value)
+{
+	uint32_t result = 0;
+	uint8_t digits = 0;
+
+	if (end > text && end[-1] == '\r') {
+		end--;
+	}
+	if (base == 16 && end - text > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+		text += 2;
+	}
+	for (; text < end; text++) {
+		char c = *text;
+		uint8_t digit;
+
+		if (c >= '0' && c <= '9') {
+			digit = (uint8_t)(c - '0');
+		} else if (base == 16 && c >= 'a' && c <= 'f') {
+			digit = (uint8_t)(c - 'a' + 10);
+		} else if (base == 16 && c >= 'A' && c <= 'F') {
+			digit = (uint8_t)(c - 'A' + 10);
+		} else {
+			return false;
+		}
+		result = result * base + digit;
+		digits++;
+	}
+	*value = result;
+	return digits > 0 && digits <= ((base == 16) ? 8 : 10);
+}
@@ -0,0 +1,57 @@
+/**************************************************************************//**
+* @file      OtaVerify.h
+* @brief     CRC32 of the OTA image computed while it is written, and the manifest it is checked against
+* @details   The Wifi task fetches a small text manifest before the image and
+*            feeds every block it writes to the card through OtaVerifyUpdate().
+*            When the last block is written the running CRC32 and the length are
+*            compared with the manifest, so the image is never read back from the
+*            SD card. The bootloader flag is written only on a match.
+*
+*            The manifest is one "key value" pair per line, unknown keys are
+*            skipped so later fields do not break older firmware:
+*
+*              length 123456
+*              crc32 1a2b3c4d
+*              format patch
+*
+*            Tools/OtaManifest builds it from Application.bin. "format patch"
+*            says the file is a delta patch for the bootloader (Tools/DeltaPatch)
+*            rather than the whole image; length and crc32 then describe the patch.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <asf.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define OTA_MANIFEST_MAX        256     ///< Longest manifest accepted, it must arrive with the response
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Expected image, parsed by OtaManifestParse()
+struct OtaManifest {
+	bool valid;					///< Both fields below were present
+	uint32_t length;			///< Image length in bytes
+	uint32_t crc32;				///< IEEE 802.3 CRC32 of the image, as zlib and the DSU compute it
+	bool patch;					///< The file is a delta patch, fetched from MAIN_HTTP_PATCH_URL
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+void OtaVerifyInit(void);
+uint32_t OtaVerifyUpdate(uint32_t crc, const uint8_t *data, uint32_t len);
+bool OtaManifestParse(const char *text, size_t len, struct OtaManifest *manifest);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,350 @@
+/**************************************************************************//**
+* @file      TelemetryBatch.c
+* @brief     Accumulates sensor samples into one framed MQTT message per interval
+* @details   Frame layout (JSON):
+*            {"seq":7,"t0":123456,"s":[[ch,dt,v0,v1,v2],[ch,dt,v0],...]}
+*            seq counts published batches, t0 is the tick (ms) of the first sample
+*            and dt is each sample's offset from t0 in ms.
+*            The binary frame carries the same fields, layout in TelemetryBatch.h.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "TelemetryBatch.h"
+#include "iot/stream_writer.h"
+#include "SerialConsole/FastFormat.h"
+#include <string.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define BATCH_TRAILER_LEN 2	///< "]}" closing the frame
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static struct TelemetrySample samples[TELEMETRY_BATCH_MAX_SAMPLES];	///< Pending samples, oldest first
+static uint8_t sampleCount = 0;		///< Number of valid entries in samples
+static uint32_t batchSeq = 0;		///< Sequence number of the next batch
+static uint32_t droppedSamples = 0;	///< Samples refused because the batch was full
+
+static const uint8_t channelValues[TELEMETRY_CHANNELS] = {3, 3, 1};
+
+/// Binary schema scale factors, value on the wire = value * scale (see TelemetryBatch.h)
+static const float channelScale[TELEMETRY_CHANNELS][TELEMETRY_MAX_VALUES] = {
+	{1.0f, 1.0f, 1.0f},			///< IMU mg
+	{100.0f, 100.0f, 0.1f},		///< degC, %, Pa
+	{100.0f, 0.0f, 0.0f}		///< m/s
+};
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static int TelemetryEncodeJson(const struct TelemetrySample *list, uint8_t count, uint32_t seq, char *buffer, size_t size, uint8_t *consumed);
+static int TelemetryEncodeBinary(const struct TelemetrySample *list, uint8_t count, uint32_t seq, char *buffer, size_t size, uint8_t *consumed);
+static int16_t TelemetryScale(float value, float scale);
+static int TelemetryWriterOverflow(void *module, char *buffer, size_t buffer_len);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		void TelemetryBatchInit(void)
+ * @brief	Empties the batch and restarts the sequence numbering
+ */
+void TelemetryBatchInit(void)
+{
+	sampleCount = 0;
+	batchSeq = 0;
+	droppedSamples = 0;
+}
+
+/**
+ * @fn		bool TelemetryBatchAdd(uint8_t channel, const float *values, TickType_t tick)
+ * @brief	Appends one reading to the pending batch
+ * @param[in]	channel One of enum TelemetryChannel
+ * @param[in]	values TelemetryChannelValues(channel) floats
+ * @param[in]	tick Tick the reading was taken
+ * @return	false if the batch is full or the channel is unknown (the sample is dropped)
+ */
+bool TelemetryBatchAdd(uint8_t channel, const float *values, TickType_t tick)
+{
+	if (channel >= TELEMETRY_CHANNELS) {
+		return false;
+	}
+	if (sampleCount >= TELEMETRY_BATCH_MAX_SAMPLES) {
+		droppedSamples++;
+		return false;
+	}
+
+	struct TelemetrySample *sample = &samples[sampleCount++];
+	sample->tick = tick;
+	sample->channel = channel;
+	memset(sample->value, 0, sizeof(sample->value));
+	memcpy(sample->value, values, channelValues[channel] * sizeof(float));
+	return true;
+}
+
+/**
+ * @fn		bool TelemetryBatchIsDue(TickType_t now)
+ * @brief	True when the oldest pending sample has waited an interval, or the batch is full
+ */
+bool TelemetryBatchIsDue(TickType_t now)
+{
+	if (sampleCount == 0) {
+		return false;
+	}
+	if (sampleCount >= TELEMETRY_BATCH_MAX_SAMPLES) {
+		return true;
+	}
+	return (now - samples[0].tick) >= pdMS_TO_TICKS(TELEMETRY_BATCH_INTERVAL_MS);
+}
+
+/**
+ * @fn		TickType_t TelemetryBatchTicksUntilDue(TickType_t now)
+ * @brief	Ticks until TelemetryBatchIsDue() turns true, portMAX_DELAY while the batch is empty
+ */
+TickType_t TelemetryBatchTicksUntilDue(TickType_t now)
+{
+	if (sampleCount == 0) {
+		return portMAX_DELAY;
+	}
+	if (TelemetryBatchIsDue(now)) {
+		return 0;
+	}
+	return pdMS_TO_TICKS(TELEMETRY_BATCH_INTERVAL_MS) - (now - samples[0].tick);
+}
+
+/**
+ * @fn		uint8_t TelemetryBatchCount(void)
+ * @brief	Number of samples waiting to be published
+ */
+uint8_t TelemetryBatchCount(void)
+{
+	return sampleCount;
+}
+
+/**
+ * @fn		uint32_t TelemetryBatchDropped(void)
+ * @brief	Samples lost because the batch was full when they arrived
+ */
+uint32_t TelemetryBatchDropped(void)
+{
+	return droppedSamples;
+}
+
+/**
+ * @fn		uint8_t TelemetryChannelValues(uint8_t channel)
+ * @brief	Number of values a sample of the given channel carries
+ */
+uint8_t TelemetryChannelValues(uint8_t channel)
+{
+	return (channel < TELEMETRY_CHANNELS) ? channelValues[channel] : 0;
+}
+
+/**
+ * @fn		uint8_t TelemetryBatchPeek(const struct TelemetrySample **list)
+ * @brief	Gives read access to the pending samples, oldest first
+ * @details	Used to move the batch somewhere else (the offline journal) instead of
+ *			publishing it; follow with TelemetryBatchConsume() once it is stored.
+ * @return	Number of samples list points to
+ */
+uint8_t TelemetryBatchPeek(const struct TelemetrySample **list)
+{
+	*list = samples;
+	return sampleCount;
+}
+
+/**
+ * @fn		int TelemetryBatchEncode(char *buffer, size_t size, uint8_t *consumed)
+ * @brief	Frames as many pending samples as fit in buffer
+ * @details	Samples that do not fit stay pending for the next batch. Nothing is removed
+ *			until TelemetryBatchConsume() is called, so a failed publish loses nothing.
+ * @param[out]	buffer Destination for the frame
+ * @param[in]	size Size of buffer, the frame never exceeds size - 1 characters
+ * @param[out]	consumed Number of samples in the frame
+ * @return	Length of the frame, or -1 if not even one sample fits
+ */
+int TelemetryBatchEncode(char *buffer, size_t size, uint8_t *consumed)
+{
+	return TelemetryEncodeJson(samples, sampleCount, batchSeq, buffer, size, consumed);
+}
+
+/**
+ * @fn		int TelemetryBatchEncodeBinary(char *buffer, size_t size, uint8_t *consumed)
+ * @brief	Same as TelemetryBatchEncode() using the binary schema
+ */
+int TelemetryBatchEncodeBinary(char *buffer, size_t size, uint8_t *consumed)
+{
+	return TelemetryEncodeBinary(samples, sampleCount, batchSeq, buffer, size, consumed);
+}
+
+/**
+ * @fn		int TelemetryEncodeFrame(const struct TelemetrySample *list, uint8_t count, uint32_t seq, char *buffer, size_t size, uint8_t *consumed)
+ * @brief	Frames samples kept outside the batch, in the format TELEMETRY_BINARY selects
+ * @details	Same contract as TelemetryBatchEncode(), for callers with their own samples
+ *			and sequence numbers (journal replay).
+ */
+int TelemetryEncodeFrame(const struct TelemetrySample *list, uint8_t count, uint32_t seq, char *buffer, size_t size, uint8_t *consumed)
+{
+#if TELEMETRY_BINARY
+	return TelemetryEncodeBinary(list, count, seq, buffer, size, consumed);
+#else
+	return TelemetryEncodeJson(list, count, seq, buffer, size, consumed);
+#endif
+}
+
+/**
+ * @fn		void TelemetryBatchConsume(uint8_t consumed)
+ * @brief	Removes the samples of a successfully published frame and advances the sequence
+ */
+void TelemetryBatchConsume(uint8_t consumed)
+{
+	if (consumed > sampleCount) {
+		consumed = sampleCount;
+	}
+	memmove(&samples[0], &samples[consumed], (sampleCount - consumed) * sizeof(samples[0]));
+	sampleCount -= consumed;
+	batchSeq++;
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static int TelemetryEncodeJson(const struct TelemetrySample *list, uint8_t count, uint32_t seq, char *buffer, size_t size, uint8_t *consumed)
+ * @brief	Writes the first samples of list that fit as a JSON frame
+ */
+static int TelemetryEncodeJson(const struct TelemetrySample *list, uint8_t count, uint32_t seq, char *buffer, size_t size, uint8_t *consumed)
+{
+	*consumed = 0;
+	if (count == 0 || size <= BATCH_TRAILER_LEN) {
+		return -1;
+	}
+
+	TickType_t t0 = list[0].tick;
+	struct FmtBuffer fmt;
+
+	/* Keep room for the trailer so it always fits once the header did */
+	FmtBufferInit(&fmt, buffer, size - BATCH_TRAILER_LEN);
+	FmtAppendString(&fmt, "{\"seq\":");
+	FmtAppendUint(&fmt, seq, 0, ' ');
+	FmtAppendString(&fmt, ",\"t0\":");
+	FmtAppendUint(&fmt, t0, 0, ' ');
+	FmtAppendString(&fmt, ",\"s\":[");
+	if (fmt.truncated) {
+		return -1;
+	}
+
+	for (uint8_t i = 0; i < count; i++) {
+		const struct TelemetrySample *sample = &list[i];
+		size_t sampleStart = fmt.len;
+
+		FmtAppendString(&fmt, i ? ",[" : "[");
+		FmtAppendUint(&fmt, sample->channel, 0, ' ');
+		FmtAppendChar(&fmt, ',');
+		FmtAppendUint(&fmt, sample->tick - t0, 0, ' ');
+		for (uint8_t v = 0; v < channelValues[sample->channel]; v++) {
+			FmtAppendChar(&fmt, ',');
+			FmtAppendFixed(&fmt, sample->value[v], 2);
+		}
+		FmtAppendChar(&fmt, ']');
+
+		if (fmt.truncated) {
+			/* Drop the partial sample, it goes out with the next frame */
+			fmt.len = sampleStart;
+			break;
+		}
+		(*consumed)++;
+	}
+
+	if (*consumed == 0) {
+		return -1;
+	}
+
+	int len = (int)fmt.len;
+	buffer[len++] = ']';
+	buffer[len++] = '}';
+	buffer[len] = '\0';
+	return len;
+}
+
+/**
+ * @fn		static int TelemetryEncodeBinary(const struct TelemetrySample *list, uint8_t count, uint32_t seq, char *buffer, size_t size, uint8_t *consumed)
+ * @brief	Writes the first samples of list that fit as a binary frame
+ * @details	Samples are fixed size per channel, so the fit is decided before anything
+ *			is written and the stream writer never has to flush. A sample whose dt
+ *			does not fit the u16 field starts the next frame instead.
+ */
+static int TelemetryEncodeBinary(const struct TelemetrySample *list, uint8_t count, uint32_t seq, char *buffer, size_t size, uint8_t *consumed)
+{
+	struct stream_writer writer;
+	size_t len = TELEMETRY_BIN_HEADER_LEN;
+	uint8_t fit = 0;
+
+	*consumed = 0;
+	while (fit < count) {
+		size_t sampleLen = TELEMETRY_BIN_SAMPLE_LEN(channelValues[list[fit].channel]);
+		if (len + sampleLen > size || (list[fit].tick - list[0].tick) > UINT16_MAX) {
+			break;
+		}
+		len += sampleLen;
+		fit++;
+	}
+	if (fit == 0) {
+		return -1;
+	}
+
+	TickType_t t0 = list[0].tick;
+	stream_writer_init(&writer, buffer, size, TelemetryWriterOverflow, NULL);
+	stream_writer_send_8(&writer, TELEMETRY_SCHEMA_ID);
+	stream_writer_send_8(&writer, fit);
+	stream_writer_send_16LE(&writer, (int16_t)seq);
+	stream_writer_send_32LE(&writer, (int32_t)t0);
+
+	for (uint8_t i = 0; i < fit; i++) {
+		const struct TelemetrySample *sample = &list[i];
+		TickType_t dt = sample->tick - t0;
+
+		stream_writer_send_8(&writer, sample->channel);
+		stream_writer_send_16LE(&writer, (int16_t)dt);
+		for (uint8_t v = 0; v < channelValues[sample->channel]; v++) {
+			stream_writer_send_16LE(&writer, TelemetryScale(sample->value[v], channelScale[sample->channel][v]));
+		}
+	}
+
+	*consumed = fit;
+	return (int)writer.written;
+}
+
+/**
+ * @fn		static int16_t TelemetryScale(float value, float scale)
+ * @brief	Scales a reading to its wire integer, rounded and saturated to int16
+ */
+static int16_t TelemetryScale(float value, float scale)
+{
+	float scaled = value * scale;
+
+	if (scaled >= (float)INT16_MAX) {
+		return INT16_MAX;
+	}
+	if (scaled <= (float)INT16_MIN) {
+		return INT16_MIN;
+	}
+	return (int16_t)(scaled + ((scaled >= 0.0f) ? 0.5f : -0.5f));
+}
+
+/**
+ * @fn		static int TelemetryWriterOverflow(void *module, char *buffer, size_t buffer_len)
+ * @brief	Stream writer flush callback. The frame size is checked up front so this never runs.
+ */
+static int TelemetryWriterOverflow(void *module, char *buffer, size_t buffer_len)
+{
+	(void)module;
+	(void)buffer;
+	(void)buffer_len;
+	return 0;
+}
@@ -0,0 +1,85 @@
+/**************************************************************************//**
+* @file      TelemetryBatch.h
+* @brief     Accumulates sensor samples into one framed MQTT message per interval
+* @details   Instead of one QoS 1 publish per reading, the Wifi task drops every
+*            IMU, environmental and air velocity sample in here and publishes a
+*            single batch on TELEMETRY_TOPIC. Each batch carries a sequence number
+*            and the tick of its first sample; samples carry their offset from it.
+*            Batches go out either as JSON or as a compact little endian binary
+*            frame (see TELEMETRY_SCHEMA_ID), selected with TELEMETRY_BINARY.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <asf.h>
+#include "FreeRTOS.h"
+#include "task.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define TELEMETRY_TOPIC                 "Telemetry_Batch"
+#define TELEMETRY_BATCH_INTERVAL_MS     5000    ///< Publish at most this often while samples are pending
+#define TELEMETRY_BATCH_MAX_SAMPLES     16      ///< Samples held between publishes
+#define TELEMETRY_MAX_VALUES            3       ///< Largest sample (IMU x/y/z, env T/H/P)
+
+#define TELEMETRY_BINARY                1       ///< 1 publishes binary frames, 0 publishes JSON frames
+
+/**
+ * Binary frame, all fields little endian:
+ *   u8 schema, u8 count, u16 seq, u32 t0
+ *   count x { u8 channel, u16 dt, TelemetryChannelValues(channel) x i16 }
+ * Values are scaled to integers with the per channel factors in TelemetryBatch.c:
+ *   IMU mg x1, temperature degC x100, humidity % x100, pressure Pa x0.1, air m/s x100.
+ * Change the schema ID whenever the layout or a scale factor changes.
+ */
+#define TELEMETRY_SCHEMA_ID             1
+#define TELEMETRY_BIN_HEADER_LEN        8       ///< schema, count, seq, t0
+#define TELEMETRY_BIN_SAMPLE_LEN(n)     (3 + 2 * (n))   ///< channel, dt, n values
+
+/** Room Paho needs next to the payload in the send buffer: fixed header, topic length, topic, packet id. */
+#define TELEMETRY_MQTT_OVERHEAD         (5 + 2 + (sizeof(TELEMETRY_TOPIC) - 1) + 2)
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Channel identifiers. The numbers are part of the wire format, only append.
+enum TelemetryChannel {
+	TELEMETRY_IMU = 0,	///< x, y, z in mg
+	TELEMETRY_ENV = 1,	///< temperature, humidity, pressure
+	TELEMETRY_AIR = 2,	///< air velocity in m/s
+	TELEMETRY_CHANNELS
+};
+
+/// One buffered reading
+struct TelemetrySample {
+	TickType_t tick;					///< Tick the sample was taken
+	uint8_t channel;					///< enum TelemetryChannel
+	float value[TELEMETRY_MAX_VALUES];	///< Unused entries are ignored
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+void TelemetryBatchInit(void);
+bool TelemetryBatchAdd(uint8_t channel, const float *values, TickType_t tick);
+bool TelemetryBatchIsDue(TickType_t now);
+TickType_t TelemetryBatchTicksUntilDue(TickType_t now);
+uint8_t TelemetryBatchCount(void);
+uint32_t TelemetryBatchDropped(void);
+int TelemetryBatchEncode(char *buffer, size_t size, uint8_t *consumed);
+int TelemetryBatchEncodeBinary(char *buffer, size_t size, uint8_t *consumed);
+int TelemetryEncodeFrame(const struct TelemetrySample *list, uint8_t count, uint32_t seq, char *buffer, size_t size, uint8_t *consumed);
+uint8_t TelemetryBatchPeek(const struct TelemetrySample **list);
+void TelemetryBatchConsume(uint8_t consumed);
+uint8_t TelemetryChannelValues(uint8_t channel);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,509 @@
+/**************************************************************************//**
+* @file      TelemetryJournal.c
+* @brief     SD card store-and-forward journal for telemetry taken while the broker is unreachable
+* @details   The journal file is a sequence of TELEMETRY_JOURNAL_SECTOR_SIZE records,
+*            each holding up to JOURNAL_SECTOR_SAMPLES samples. Records are only
+*            ever written whole at sector aligned offsets, so FatFs hands them to
+*            the card as single block writes and a torn write can only damage the
+*            last record. One sector buffer is shared: it collects samples while
+*            offline and caches the record being replayed while online.
+*
+*            The position file holds the next record and sample to replay. It is
+*            rewritten after a replay frame is acked and after every appended record;
+*            once everything is replayed both files are deleted.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "TelemetryJournal.h"
+#include "MqttPipeline.h"
+#include "SerialConsole.h"
+#include "SerialConsole/FastFormat.h"
+#include "ASF/thirdparty/fatfs/fatfs-port-r0.09/disk_cache.h"
+#include <string.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define JOURNAL_SECTOR_MAGIC    0x314A4C54	///< "TLJ1", change with the record layout
+#define JOURNAL_POS_MAGIC       0x31504C54	///< "TLP1"
+#define JOURNAL_HEADER_LEN      8			///< magic, count, reserved
+#define JOURNAL_SECTOR_SAMPLES  ((TELEMETRY_JOURNAL_SECTOR_SIZE - JOURNAL_HEADER_LEN) / sizeof(struct TelemetrySample))
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// One journal record, exactly one sector
+union JournalSector {
+	struct {
+		uint32_t magic;
+		uint16_t count;			///< Valid entries in sample
+		uint16_t reserved;
+		struct TelemetrySample sample[JOURNAL_SECTOR_SAMPLES];
+	} rec;
+	uint8_t raw[TELEMETRY_JOURNAL_SECTOR_SIZE];
+};
+
+/// Contents of TELEMETRY_JOURNAL_POS_FILE
+struct JournalPosition {
+	uint32_t magic;
+	uint32_t readSector;		///< Record holding the next sample to replay
+	uint16_t readIndex;			///< Next sample to replay within readSector
+	uint16_t reserved;
+	uint32_t backlogSamples;	///< Samples stored and not yet acked
+	uint32_t replaySeq;			///< Sequence number of the next replay frame
+	uint32_t check;				///< See JournalPositionCheck()
+};
+
+/// What the shared sector buffer currently holds
+enum JournalBufferState {
+	JOURNAL_BUF_EMPTY,			///< Nothing
+	JOURNAL_BUF_WRITE,			///< Samples not yet on the card
+	JOURNAL_BUF_READ			///< A copy of record bufferSector
+};
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static union JournalSector sectorBuffer;
+static uint8_t bufferState = JOURNAL_BUF_EMPTY;
+static uint32_t bufferSector;			///< Record held while JOURNAL_BUF_READ
+static TickType_t bufferFirstTick;		///< Tick the first unwritten sample was buffered
+
+static FIL journalFile;
+static bool journalReady = false;
+static uint32_t journalSectors = 0;		///< Whole records in the journal file
+static struct JournalPosition position;
+
+static bool replayInFlight = false;		///< A replay frame is in the pipeline
+static bool replayAcked = false;		///< Its PUBACK arrived, advance on the next service
+static uint8_t replayConsumed = 0;		///< Samples in the frame in flight
+static TickType_t lastReplay = 0;
+static TickType_t lastStatus = 0;
+static uint32_t replayedAtLastStatus = 0;
+static bool statusPending = false;		///< Report once more after the backlog changed
+static struct TelemetryJournalStats stats;
+static uint32_t recordsWritten = 0;		///< Records written since boot, for writeKBps
+static TickType_t writeTicks = 0;		///< Ticks those writes and their position saves took
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static bool JournalWriteSector(void);
+static bool JournalReadSector(uint32_t sector);
+static bool JournalSavePosition(void);
+static bool JournalLoadPosition(void);
+static uint32_t JournalPositionCheck(const struct JournalPosition *pos);
+static void JournalReset(void);
+static void JournalAdvance(void);
+static void JournalReplayNext(TickType_t now, char *scratch, size_t scratchSize);
+static void JournalReplayDone(uint32_t tag, bool acked);
+static void JournalPublishStatus(TickType_t now, char *scratch, size_t scratchSize);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		void TelemetryJournalInit(void)
+ * @brief	Picks up a journal left by a previous run
+ * @note	Call once the SD card is mounted. Without a card the journal stays disabled
+ *			and TelemetryJournalAppend() drops what it is given.
+ */
+void TelemetryJournalInit(void)
+{
+	FRESULT res;
+
+	journalReady = false;
+	journalSectors = 0;
+	bufferState = JOURNAL_BUF_EMPTY;
+
+	res = f_open(&journalFile, TELEMETRY_JOURNAL_FILE, FA_OPEN_EXISTING | FA_READ);
+	if (res == FR_OK) {
+		journalSectors = f_size(&journalFile) / TELEMETRY_JOURNAL_SECTOR_SIZE;
+		f_close(&journalFile);
+	} else if (res != FR_NO_FILE) {
+		LogMessage(LOG_DEBUG_LVL, "Telemetry journal: SD card not usable (res %d)\r\n", res);
+		return;
+	}
+
+	if (!JournalLoadPosition() || position.readSector > journalSectors) {
+		/* No usable position: replay everything, counting what is there */
+		memset(&position, 0, sizeof(position));
+		for (uint32_t sector = 0; sector < journalSectors; sector++) {
+			if (JournalReadSector(sector)) {
+				position.backlogSamples += sectorBuffer.rec.count;
+			}
+		}
+		bufferState = JOURNAL_BUF_EMPTY;
+	}
+
+	journalReady = true;
+	if (position.readSector >= journalSectors) {
+		JournalReset();
+	} else {
+		statusPending = true;
+		LogMessage(LOG_DEBUG_LVL, "Telemetry journal: %lu samples to replay\r\n", (unsigned long)position.backlogSamples);
+	}
+}
+
+/**
+ * @fn		bool TelemetryJournalAppend(const struct TelemetrySample *list, uint8_t count, TickType_t now)
+ * @brief	Stores samples that could not be published
+ * @details	Samples collect in the sector buffer and go to the card as soon as a record
+ *			is full, or TELEMETRY_JOURNAL_FLUSH_MS after the first one arrived.
+ * @return	false if some samples were dropped (no card, journal full or write error)
+ */
+bool TelemetryJournalAppend(const struct TelemetrySample *list, uint8_t count, TickType_t now)
+{
+	bool ok = true;
+
+	if (!journalReady) {
+		stats.dropped += count;
+		return false;
+	}
+	if (bufferState == JOURNAL_BUF_READ) {
+		bufferState = JOURNAL_BUF_EMPTY;
+	}
+
+	for (uint8_t i = 0; i < count; i++) {
+		if (bufferState == JOURNAL_BUF_EMPTY) {
+			if (journalSectors >= TELEMETRY_JOURNAL_MAX_SECTORS) {
+				stats.dropped += count - i;
+				return false;
+			}
+			memset(&sectorBuffer, 0, sizeof(sectorBuffer));
+			sectorBuffer.rec.magic = JOURNAL_SECTOR_MAGIC;
+			bufferState = JOURNAL_BUF_WRITE;
+			bufferFirstTick = now;
+		}
+
+		sectorBuffer.rec.sample[sectorBuffer.rec.count++] = list[i];
+		if (sectorBuffer.rec.count >= JOURNAL_SECTOR_SAMPLES) {
+			ok = JournalWriteSector() && ok;
+		}
+	}
+	return ok;
+}
+
+/**
+ * @fn		void TelemetryJournalService(TickType_t now, bool online, char *scratch, size_t scratchSize)
+ * @brief	Flushes, replays and reports, call once per Wifi task loop
+ * @details	Offline this only bounds how long samples sit in RAM. Online it first writes
+ *			any buffered samples so the journal stays in order, then sends at most one
+ *			replay frame per TELEMETRY_JOURNAL_REPLAY_MS with only one in flight, and
+ *			never while a live batch is due, so live data keeps priority.
+ * @param[in]	online Broker connected
+ * @param	scratch Buffer to encode frames in, the pipeline copies them out
+ */
+void TelemetryJournalService(TickType_t now, bool online, char *scratch, size_t scratchSize)
+{
+	if (!journalReady) {
+		return;
+	}
+
+	if (!online) {
+		if (bufferState == JOURNAL_BUF_WRITE && (now - bufferFirstTick) >= pdMS_TO_TICKS(TELEMETRY_JOURNAL_FLUSH_MS)) {
+			JournalWriteSector();
+		}
+		return;
+	}
+
+	if (bufferState == JOURNAL_BUF_WRITE) {
+		JournalWriteSector();
+	}
+	if (replayAcked) {
+		replayAcked = false;
+		JournalAdvance();
+	}
+
+	if (!replayInFlight && position.readSector < journalSectors && (now - lastReplay) >= pdMS_TO_TICKS(TELEMETRY_JOURNAL_REPLAY_MS) &&
+		MqttPipelineHasRoom() && !TelemetryBatchIsDue(now)) {
+		JournalReplayNext(now, scratch, scratchSize);
+	}
+
+	if ((statusPending || position.backlogSamples > 0) && (now - lastStatus) >= pdMS_TO_TICKS(TELEMETRY_JOURNAL_STATUS_MS) && MqttPipelineHasRoom()) {
+		JournalPublishStatus(now, scratch, scratchSize);
+	}
+}
+
+/**
+ * @fn		bool TelemetryJournalIsIdle(void)
+ * @brief	True when nothing is buffered, waiting for replay or waiting to be reported
+ */
+bool TelemetryJournalIsIdle(void)
+{
+	return !journalReady || (bufferState != JOURNAL_BUF_WRITE && position.backlogSamples == 0 && !statusPending && !replayInFlight);
+}
+
+/**
+ * @fn		void TelemetryJournalGetStats(struct TelemetryJournalStats *out)
+ * @brief	Copies the journal counters
+ */
+void TelemetryJournalGetStats(struct TelemetryJournalStats *out)
+{
+	struct disk_cache_stats cache;
+	uint32_t writeMs = writeTicks * portTICK_PERIOD_MS;
+
+	disk_cache_get_stats(&cache);
+	*out = stats;
+	out->ready = journalReady;
+	out->writeKBps = (writeMs > 0) ? (recordsWritten * (TELEMETRY_JOURNAL_SECTOR_SIZE * 1000UL / 1024)) / writeMs : 0;
+	out->sdReadHitPct = (cache.reads > 0) ? (uint32_t)((cache.read_hits * 100ULL) / cache.reads) : 0;
+	out->backlogSamples = position.backlogSamples + ((bufferState == JOURNAL_BUF_WRITE) ? sectorBuffer.rec.count : 0);
+	out->backlogBytes = (journalSectors - position.readSector) * TELEMETRY_JOURNAL_SECTOR_SIZE;
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static bool JournalWriteSector(void)
+ * @brief	Appends the buffered record at the next sector aligned offset
+ * @details	The offset comes from the record count, not the file size, so a record torn
+ *			by a reset is overwritten by the next one. The samples are dropped on error.
+ */
+static bool JournalWriteSector(void)
+{
+	uint16_t count = sectorBuffer.rec.count;
+	TickType_t start = xTaskGetTickCount();
+	UINT written = 0;
+	FRESULT res;
+
+	bufferState = JOURNAL_BUF_EMPTY;
+	res = f_open(&journalFile, TELEMETRY_JOURNAL_FILE, FA_OPEN_ALWAYS | FA_WRITE);
+	if (res == FR_OK) {
+		res = f_lseek(&journalFile, journalSectors * TELEMETRY_JOURNAL_SECTOR_SIZE);
+		if (res == FR_OK) {
+			res = f_write(&journalFile, sectorBuffer.raw, TELEMETRY_JOURNAL_SECTOR_SIZE, &written);
+		}
+		f_close(&journalFile);
+	}
+	if (res != FR_OK || written != TELEMETRY_JOURNAL_SECTOR_SIZE) {
+		LogMessage(LOG_DEBUG_LVL, "Telemetry journal: write failed (res %d), %u samples lost\r\n", res, count);
+		stats.dropped += count;
+		return false;
+	}
+
+	journalSectors++;
+	position.backlogSamples += count;
+	stats.journaled += count;
+	statusPending = true;
+	JournalSavePosition();
+	recordsWritten++;
+	writeTicks += xTaskGetTickCount() - start;
+	return true;
+}
+
+/**
+ * @fn		static bool JournalReadSector(uint32_t sector)
+ * @brief	Loads a record into the sector buffer
+ * @return	false on a read error or if the record is not valid
+ */
+static bool JournalReadSector(uint32_t sector)
+{
+	UINT read = 0;
+	FRESULT res;
+
+	if (bufferState == JOURNAL_BUF_READ && bufferSector == sector) {
+		return true;
+	}
+
+	bufferState = JOURNAL_BUF_EMPTY;
+	res = f_open(&journalFile, TELEMETRY_JOURNAL_FILE, FA_OPEN_EXISTING | FA_READ);
+	if (res == FR_OK) {
+		res = f_lseek(&journalFile, sector * TELEMETRY_JOURNAL_SECTOR_SIZE);
+		if (res == FR_OK) {
+			res = f_read(&journalFile, sectorBuffer.raw, TELEMETRY_JOURNAL_SECTOR_SIZE, &read);
+		}
+		f_close(&journalFile);
+	}
+	if (res != FR_OK || read != TELEMETRY_JOURNAL_SECTOR_SIZE || sectorBuffer.rec.magic != JOURNAL_SECTOR_MAGIC ||
+		sectorBuffer.rec.count == 0 || sectorBuffer.rec.count > JOURNAL_SECTOR_SAMPLES) {
+		return false;
+	}
+
+	bufferState = JOURNAL_BUF_READ;
+	bufferSector = sector;
+	return true;
+}
+
+/**
+ * @fn		static bool JournalSavePosition(void)
+ * @brief	Rewrites the position file from position
+ */
+static bool JournalSavePosition(void)
+{
+	UINT written = 0;
+	FRESULT res;
+
+	position.magic = JOURNAL_POS_MAGIC;
+	position.check = JournalPositionCheck(&position);
+	res = f_open(&journalFile, TELEMETRY_JOURNAL_POS_FILE, FA_CREATE_ALWAYS | FA_WRITE);
+	if (res == FR_OK) {
+		res = f_write(&journalFile, &position, sizeof(position), &written);
+		f_close(&journalFile);
+	}
+	return (res == FR_OK && written == sizeof(position));
+}
+
+/**
+ * @fn		static bool JournalLoadPosition(void)
+ * @brief	Reads the position file into position
+ * @return	false if it is missing or does not pass the check
+ */
+static bool JournalLoadPosition(void)
+{
+	UINT read = 0;
+	FRESULT res;
+
+	res = f_open(&journalFile, TELEMETRY_JOURNAL_POS_FILE, FA_OPEN_EXISTING | FA_READ);
+	if (res == FR_OK) {
+		res = f_read(&journalFile, &position, sizeof(position), &read);
+		f_close(&journalFile);
+	}
+	return (res == FR_OK && read == sizeof(position) && position.magic == JOURNAL_POS_MAGIC &&
+			position.check == JournalPositionCheck(&position));
+}
+
+/**
+ * @fn		static uint32_t JournalPositionCheck(const struct JournalPosition *pos)
+ * @brief	Check word over the position fields, catches a torn or stale write
+ */
+static uint32_t JournalPositionCheck(const struct JournalPosition *pos)
+{
+	return ~(pos->magic ^ pos->readSector ^ ((uint32_t)pos->readIndex << 16) ^ pos->backlogSamples ^ pos->replaySeq);
+}
+
+/**
+ * @fn		static void JournalReset(void)
+ * @brief	Deletes both files once everything is replayed, keeping the sequence running
+ */
+static void JournalReset(void)
+{
+	uint32_t replaySeq = position.replaySeq;
+
+	f_unlink(TELEMETRY_JOURNAL_FILE);
+	f_unlink(TELEMETRY_JOURNAL_POS_FILE);
+	memset(&position, 0, sizeof(position));
+	position.replaySeq = replaySeq;
+	journalSectors = 0;
+	if (bufferState == JOURNAL_BUF_READ) {
+		bufferState = JOURNAL_BUF_EMPTY;
+	}
+}
+
+/**
+ * @fn		static void JournalAdvance(void)
+ * @brief	Moves the read position past the acked frame and persists it
+ */
+static void JournalAdvance(void)
+{
+	position.readIndex += replayConsumed;
+	position.backlogSamples -= (replayConsumed < position.backlogSamples) ? replayConsumed : position.backlogSamples;
+	position.replaySeq++;
+	stats.replayed += replayConsumed;
+
+	/* The record is still cached from the replay unless offline samples took the buffer */
+	if (!JournalReadSector(position.readSector) || position.readIndex >= sectorBuffer.rec.count) {
+		position.readSector++;
+		position.readIndex = 0;
+	}
+
+	if (position.readSector >= journalSectors) {
+		LogMessage(LOG_DEBUG_LVL, "Telemetry journal: replay complete, %lu samples\r\n", (unsigned long)stats.replayed);
+		JournalReset();
+		statusPending = true;
+	} else {
+		JournalSavePosition();
+	}
+}
+
+/**
+ * @fn		static void JournalReplayNext(TickType_t now, char *scratch, size_t scratchSize)
+ * @brief	Hands the next frame of the journal to the pipeline
+ * @note	A record that cannot be read is skipped and counted as dropped so one bad
+ *			sector cannot stall the replay.
+ */
+static void JournalReplayNext(TickType_t now, char *scratch, size_t scratchSize)
+{
+	uint8_t consumed = 0;
+
+	lastReplay = now;
+	if (!JournalReadSector(position.readSector) || position.readIndex >= sectorBuffer.rec.count) {
+		LogMessage(LOG_DEBUG_LVL, "Telemetry journal: record %lu unreadable, skipped\r\n", (unsigned long)position.readSector);
+		position.readSector++;
+		position.readIndex = 0;
+		if (position.readSector >= journalSectors) {
+			JournalReset();
+			statusPending = true;
+		} else {
+			JournalSavePosition();
+		}
+		return;
+	}
+
+	int len = TelemetryEncodeFrame(&sectorBuffer.rec.sample[position.readIndex],
+								   (uint8_t)(sectorBuffer.rec.count - position.readIndex),
+								   position.replaySeq,
+								   scratch,
+								   scratchSize,
+								   &consumed);
+	if (len <= 0) {
+		return;
+	}
+	if (MqttPipelinePublishTracked(TELEMETRY_JOURNAL_TOPIC, scratch, len, 0, JournalReplayDone, position.replaySeq) == SUCCESS) {
+		replayInFlight = true;
+		replayConsumed = consumed;
+	}
+}
+
+/**
+ * @fn		static void JournalReplayDone(uint32_t tag, bool acked)
+ * @brief	Pipeline hook for replay frames, the position moves on the next service
+ * @note	A dropped frame is simply sent again from the same position.
+ */
+static void JournalReplayDone(uint32_t tag, bool acked)
+{
+	if (tag != position.replaySeq) {
+		return;
+	}
+	replayInFlight = false;
+	replayAcked = acked;
+}
+
+/**
+ * @fn		static void JournalPublishStatus(TickType_t now, char *scratch, size_t scratchSize)
+ * @brief	Publishes and logs backlog size and the drain rate since the last report
+ */
+static void JournalPublishStatus(TickType_t now, char *scratch, size_t scratchSize)
+{
+	struct TelemetryJournalStats current;
+	uint32_t elapsedMs = (now - lastStatus) * portTICK_PERIOD_MS;
+
+	stats.drainRateX10 = (elapsedMs > 0) ? ((stats.replayed - replayedAtLastStatus) * 10000UL) / elapsedMs : 0;
+	TelemetryJournalGetStats(&current);
+
+	int len = FmtPrintf(scratch, scratchSize,
+						"{\"backlog\":%lu,\"bytes\":%lu,\"drain\":%lu.%lu,\"dropped\":%lu,\"write_kbs\":%lu,\"sd_hit\":%lu}",
+						(unsigned long)current.backlogSamples,
+						(unsigned long)current.backlogBytes,
+						(unsigned long)(current.drainRateX10 / 10),
+						(unsigned long)(current.drainRateX10 % 10),
+						(unsigned long)current.dropped,
+						(unsigned long)current.writeKBps,
+						(unsigned long)current.sdReadHitPct);
+	if (len <= 0 || MqttPipelinePublish(TELEMETRY_JOURNAL_STATUS_TOPIC, scratch, len, 1) != SUCCESS) {
+		return;
+	}
+
+	LogMessage(LOG_DEBUG_LVL, "Telemetry journal: %lu samples backlog, draining %lu.%lu/s\r\n",
+			   (unsigned long)current.backlogSamples,
+			   (unsigned long)(current.drainRateX10 / 10),
+			   (unsigned long)(current.drainRateX10 % 10));
+	lastStatus = now;
+	replayedAtLastStatus = stats.replayed;
+	statusPending = false;
+}
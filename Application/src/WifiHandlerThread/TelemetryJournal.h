@@ -0,0 +1,71 @@
+/**************************************************************************//**
+* @file      TelemetryJournal.h
+* @brief     SD card store-and-forward journal for telemetry taken while the broker is unreachable
+* @details   While MQTT is down, due telemetry batches are appended to an
+*            append-only journal file on the SD card instead of being thrown
+*            away. Once the broker is back, the journal is replayed on
+*            TELEMETRY_JOURNAL_TOPIC, one frame at a time and rate limited, while
+*            live batches keep going out on TELEMETRY_TOPIC. The read position is
+*            kept in a second file and only moves when a replay frame is acked,
+*            so a reset or another outage resumes where replay stopped.
+*            Backlog size and drain rate are published on TELEMETRY_JOURNAL_STATUS_TOPIC.
+*
+*            FatFs locks the card per call (_FS_REENTRANT), the journal state
+*            here has no lock: every function must be called from the Wifi task.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <asf.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "WifiHandlerThread/TelemetryBatch.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define TELEMETRY_JOURNAL_FILE          "0:telem.jnl"       ///< Sector records, oldest first
+#define TELEMETRY_JOURNAL_POS_FILE      "0:telem.pos"       ///< Replay position, rewritten after each ack
+#define TELEMETRY_JOURNAL_TOPIC         "Telemetry_Replay"
+#define TELEMETRY_JOURNAL_STATUS_TOPIC  "Telemetry_Journal"
+
+#define TELEMETRY_JOURNAL_SECTOR_SIZE   512     ///< One record per SD sector, written whole and aligned
+#define TELEMETRY_JOURNAL_MAX_SECTORS   2048    ///< 1 MB cap, about 7 h of samples at the default rates
+#define TELEMETRY_JOURNAL_FLUSH_MS      30000   ///< Write a partly filled sector after this long offline
+#define TELEMETRY_JOURNAL_REPLAY_MS     250     ///< At most one replay frame per interval
+#define TELEMETRY_JOURNAL_STATUS_MS     10000   ///< Backlog report interval while there is a backlog
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Counters reported by TelemetryJournalGetStats()
+struct TelemetryJournalStats {
+	bool ready;					///< SD card mounted and journal usable
+	uint32_t backlogSamples;	///< Samples stored and not yet acked
+	uint32_t backlogBytes;		///< Journal file bytes still to replay
+	uint32_t journaled;			///< Samples written since boot
+	uint32_t replayed;			///< Samples acked since boot
+	uint32_t dropped;			///< Samples lost to a full journal or an SD error
+	uint32_t drainRateX10;		///< Replayed samples per second over the last status interval, x10
+	uint32_t writeKBps;			///< Record bytes per second spent in record and position writes since boot, in KB
+	uint32_t sdReadHitPct;		///< SD sector reads served by the disk cache since boot, in percent
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+void TelemetryJournalInit(void);
+bool TelemetryJournalAppend(const struct TelemetrySample *list, uint8_t count, TickType_t now);
+void TelemetryJournalService(TickType_t now, bool online, char *scratch, size_t scratchSize);
+bool TelemetryJournalIsIdle(void);
+void TelemetryJournalGetStats(struct TelemetryJournalStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
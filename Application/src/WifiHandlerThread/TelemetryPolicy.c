@@ -0,0 +1,473 @@
+/**************************************************************************//**
+* @file      TelemetryPolicy.c
+* @brief     Per channel report-by-exception filter applied before samples enter the telemetry batch
+* @details   TelemetryPolicyAccept() runs in the Wifi task; the policies can be
+*            changed from the CLI task, so they are copied in and out under a
+*            critical section. The filter state (last published values, token
+*            bucket) is only touched by the Wifi task.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "TelemetryPolicy.h"
+#include "SerialConsole/FastFormat.h"
+#include <string.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define POLICY_TOKEN        1000	///< Token bucket fixed point scale, one publish costs POLICY_TOKEN
+#define POLICY_MAX_FIELDS   6		///< channel mode deadband min max rate
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Filter state of one channel
+struct PolicyState {
+	bool hasLast;							///< Something was published since boot
+	float last[TELEMETRY_MAX_VALUES];		///< Values of the last published reading
+	TickType_t lastTick;					///< When it was published
+	uint32_t tokens;						///< Rate limit bucket, in 1/POLICY_TOKEN publishes
+	TickType_t lastRefill;					///< Tick the bucket was last topped up
+};
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+/// Defaults: IMU in mg, environment relative (0.2 % is ~0.05 degC, ~0.1 %RH, ~2 hPa), air in m/s
+static const struct TelemetryPolicy defaultPolicy[TELEMETRY_CHANNELS] = {
+	{TELEMETRY_POLICY_ABS, 20.0f, 0, 10000, 30},
+	{TELEMETRY_POLICY_REL, 0.002f, 0, 60000, 0},
+	{TELEMETRY_POLICY_ABS, 0.1f, 0, 30000, 0}
+};
+
+static const char *const channelNames[TELEMETRY_CHANNELS] = {"imu", "env", "air"};
+static const char *const modeNames[] = {"all", "abs", "rel"};
+
+static struct TelemetryPolicy policies[TELEMETRY_CHANNELS];
+static struct PolicyState states[TELEMETRY_CHANNELS];
+static struct TelemetryPolicyStats stats[TELEMETRY_CHANNELS];
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static bool PolicyChanged(const struct TelemetryPolicy *policy, const struct PolicyState *state, uint8_t channel, const float *values);
+static void PolicyRefill(const struct TelemetryPolicy *policy, struct PolicyState *state, TickType_t now);
+static size_t PolicyNextToken(const char *line, size_t len, size_t *pos, const char **token);
+static bool PolicyTokenEquals(const char *token, size_t tokenLen, const char *word);
+static bool PolicyParseUint(const char *token, size_t tokenLen, uint32_t *out);
+static bool PolicyParseFloat(const char *token, size_t tokenLen, float *out);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		void TelemetryPolicyInit(void)
+ * @brief	Loads the default policies and clears the filter state and counters
+ */
+void TelemetryPolicyInit(void)
+{
+	memcpy(policies, defaultPolicy, sizeof(policies));
+	memset(states, 0, sizeof(states));
+	memset(stats, 0, sizeof(stats));
+	for (uint8_t i = 0; i < TELEMETRY_CHANNELS; i++) {
+		states[i].tokens = TELEMETRY_POLICY_BURST * POLICY_TOKEN;
+	}
+}
+
+/**
+ * @fn		bool TelemetryPolicyAccept(uint8_t channel, const float *values, TickType_t now)
+ * @brief	Decides whether a reading is published
+ * @details	The first reading after boot always passes. After that a reading passes
+ *			when the heartbeat interval expired, or when it is outside the deadband,
+ *			the minimum interval has elapsed and the rate limit has a token left.
+ * @param[in]	values TelemetryChannelValues(channel) floats
+ * @return	true if the reading should go into the telemetry batch
+ */
+bool TelemetryPolicyAccept(uint8_t channel, const float *values, TickType_t now)
+{
+	struct TelemetryPolicy policy;
+	struct PolicyState *state;
+
+	if (channel >= TELEMETRY_CHANNELS) {
+		return false;
+	}
+	TelemetryPolicyGet(channel, &policy);
+	state = &states[channel];
+	stats[channel].offered++;
+	PolicyRefill(&policy, state, now);
+
+	if (state->hasLast) {
+		uint32_t elapsedMs = (now - state->lastTick) * portTICK_PERIOD_MS;
+
+		if (policy.maxIntervalMs != 0 && elapsedMs >= policy.maxIntervalMs) {
+			stats[channel].heartbeats++;
+		} else {
+			if (elapsedMs < policy.minIntervalMs || !PolicyChanged(&policy, state, channel, values)) {
+				return false;
+			}
+			if (policy.ratePerMin != 0) {
+				if (state->tokens < POLICY_TOKEN) {
+					stats[channel].rateLimited++;
+					return false;
+				}
+				state->tokens -= POLICY_TOKEN;
+			}
+		}
+	}
+
+	memcpy(state->last, values, TelemetryChannelValues(channel) * sizeof(float));
+	state->lastTick = now;
+	state->hasLast = true;
+	stats[channel].published++;
+	return true;
+}
+
+/**
+ * @fn		void TelemetryPolicySet(uint8_t channel, const struct TelemetryPolicy *policy)
+ * @brief	Replaces the policy of a channel, callable from any task
+ */
+void TelemetryPolicySet(uint8_t channel, const struct TelemetryPolicy *policy)
+{
+	if (channel >= TELEMETRY_CHANNELS) {
+		return;
+	}
+	taskENTER_CRITICAL();
+	policies[channel] = *policy;
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @fn		void TelemetryPolicyGet(uint8_t channel, struct TelemetryPolicy *policy)
+ * @brief	Copies the policy of a channel, callable from any task
+ */
+void TelemetryPolicyGet(uint8_t channel, struct TelemetryPolicy *policy)
+{
+	if (channel >= TELEMETRY_CHANNELS) {
+		memset(policy, 0, sizeof(*policy));
+		return;
+	}
+	taskENTER_CRITICAL();
+	*policy = policies[channel];
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * @fn		void TelemetryPolicyGetStats(uint8_t channel, struct TelemetryPolicyStats *out)
+ * @brief	Copies the counters of a channel
+ */
+void TelemetryPolicyGetStats(uint8_t channel, struct TelemetryPolicyStats *out)
+{
+	if (channel >= TELEMETRY_CHANNELS) {
+		memset(out, 0, sizeof(*out));
+		return;
+	}
+	*out = stats[channel];
+}
+
+/**
+ * @fn		uint32_t TelemetryPolicySuppressionX10(uint8_t channel)
+ * @brief	Share of offered readings that were not published, in tenths of a percent
+ */
+uint32_t TelemetryPolicySuppressionX10(uint8_t channel)
+{
+	struct TelemetryPolicyStats s;
+
+	TelemetryPolicyGetStats(channel, &s);
+	if (s.offered == 0) {
+		return 0;
+	}
+	return (uint32_t)(((uint64_t)(s.offered - s.published) * 1000) / s.offered);
+}
+
+/**
+ * @fn		bool TelemetryPolicyParse(const char *line, size_t len)
+ * @brief	Applies one policy line: "<channel> <mode> [deadband [minMs [maxMs [perMin]]]]"
+ * @details	channel is imu, env or air; mode is all, abs or rel. Fields left out keep
+ *			their current value, e.g. "env rel 0.005" only changes mode and deadband.
+ *			The line does not have to be NUL terminated.
+ * @return	false if the line is malformed, nothing is changed then
+ */
+bool TelemetryPolicyParse(const char *line, size_t len)
+{
+	const char *token[POLICY_MAX_FIELDS];
+	size_t tokenLen[POLICY_MAX_FIELDS];
+	size_t pos = 0;
+	uint8_t fields = 0;
+	uint8_t channel = TELEMETRY_CHANNELS;
+	struct TelemetryPolicy policy;
+	const char *extra;
+	uint32_t value;
+
+	while (fields < POLICY_MAX_FIELDS && (tokenLen[fields] = PolicyNextToken(line, len, &pos, &token[fields])) != 0) {
+		fields++;
+	}
+	if (fields < 2 || PolicyNextToken(line, len, &pos, &extra) != 0) {
+		return false;
+	}
+
+	for (uint8_t i = 0; i < TELEMETRY_CHANNELS; i++) {
+		if (PolicyTokenEquals(token[0], tokenLen[0], channelNames[i])) {
+			channel = i;
+		}
+	}
+	if (channel >= TELEMETRY_CHANNELS) {
+		return false;
+	}
+	TelemetryPolicyGet(channel, &policy);
+
+	policy.mode = 0xFF;
+	for (uint8_t i = 0; i < sizeof(modeNames) / sizeof(modeNames[0]); i++) {
+		if (PolicyTokenEquals(token[1], tokenLen[1], modeNames[i])) {
+			policy.mode = i;
+		}
+	}
+	if (policy.mode == 0xFF) {
+		return false;
+	}
+	if (fields > 2 && (!PolicyParseFloat(token[2], tokenLen[2], &policy.deadband) || policy.deadband < 0.0f)) {
+		return false;
+	}
+	if (fields > 3 && !PolicyParseUint(token[3], tokenLen[3], &policy.minIntervalMs)) {
+		return false;
+	}
+	if (fields > 4 && !PolicyParseUint(token[4], tokenLen[4], &policy.maxIntervalMs)) {
+		return false;
+	}
+	if (fields > 5) {
+		if (!PolicyParseUint(token[5], tokenLen[5], &value) || value > UINT16_MAX) {
+			return false;
+		}
+		policy.ratePerMin = (uint16_t)value;
+	}
+
+	TelemetryPolicySet(channel, &policy);
+	return true;
+}
+
+/**
+ * @fn		int TelemetryPolicyApplyConfig(const char *config, size_t len)
+ * @brief	Applies several policy lines separated by ';' or newlines
+ * @return	Number of lines applied, or -1 if any line was rejected
+ */
+int TelemetryPolicyApplyConfig(const char *config, size_t len)
+{
+	int applied = 0;
+	bool failed = false;
+	size_t start = 0;
+
+	for (size_t i = 0; i <= len; i++) {
+		if (i == len || config[i] == ';' || config[i] == '\n' || config[i] == '\r') {
+			const char *line = &config[start];
+			size_t lineLen = i - start;
+			size_t pos = 0;
+			const char *first;
+
+			/* Blank lines are fine, anything else has to parse */
+			if (PolicyNextToken(line, lineLen, &pos, &first) != 0) {
+				if (TelemetryPolicyParse(line, lineLen)) {
+					applied++;
+				} else {
+					failed = true;
+				}
+			}
+			start = i + 1;
+		}
+	}
+	return failed ? -1 : applied;
+}
+
+/**
+ * @fn		const char *TelemetryPolicyChannelName(uint8_t channel)
+ * @brief	Name used for the channel in policy lines and reports
+ */
+const char *TelemetryPolicyChannelName(uint8_t channel)
+{
+	return (channel < TELEMETRY_CHANNELS) ? channelNames[channel] : "?";
+}
+
+/**
+ * @fn		const char *TelemetryPolicyModeName(uint8_t mode)
+ * @brief	Name used for the mode in policy lines
+ */
+const char *TelemetryPolicyModeName(uint8_t mode)
+{
+	return (mode < sizeof(modeNames) / sizeof(modeNames[0])) ? modeNames[mode] : "?";
+}
+
+/**
+ * @fn		int TelemetryPolicyFormatStats(char *buffer, size_t size)
+ * @brief	Writes the per channel counters as JSON for TELEMETRY_POLICY_STATS_TOPIC
+ * @details	{"imu":{"in":120,"out":14,"sup":88.3},"env":{...},"air":{...}}
+ * @return	Length written, or -1 if it did not fit
+ */
+int TelemetryPolicyFormatStats(char *buffer, size_t size)
+{
+	struct FmtBuffer fmt;
+
+	FmtBufferInit(&fmt, buffer, size);
+	FmtAppendChar(&fmt, '{');
+	for (uint8_t i = 0; i < TELEMETRY_CHANNELS; i++) {
+		struct TelemetryPolicyStats s;
+		uint32_t suppression = TelemetryPolicySuppressionX10(i);
+
+		TelemetryPolicyGetStats(i, &s);
+		FmtAppendString(&fmt, i ? ",\"" : "\"");
+		FmtAppendString(&fmt, channelNames[i]);
+		FmtAppendString(&fmt, "\":{\"in\":");
+		FmtAppendUint(&fmt, s.offered, 0, ' ');
+		FmtAppendString(&fmt, ",\"out\":");
+		FmtAppendUint(&fmt, s.published, 0, ' ');
+		FmtAppendString(&fmt, ",\"sup\":");
+		FmtAppendUint(&fmt, suppression / 10, 0, ' ');
+		FmtAppendChar(&fmt, '.');
+		FmtAppendUint(&fmt, suppression % 10, 0, ' ');
+		FmtAppendChar(&fmt, '}');
+	}
+	FmtAppendChar(&fmt, '}');
+	return fmt.truncated ? -1 : (int)fmt.len;
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static bool PolicyChanged(const struct TelemetryPolicy *policy, const struct PolicyState *state, uint8_t channel, const float *values)
+ * @brief	True if any value of the reading is outside the deadband around the last published one
+ */
+static bool PolicyChanged(const struct TelemetryPolicy *policy, const struct PolicyState *state, uint8_t channel, const float *values)
+{
+	if (policy->mode == TELEMETRY_POLICY_ALL) {
+		return true;
+	}
+
+	for (uint8_t v = 0; v < TelemetryChannelValues(channel); v++) {
+		float delta = values[v] - state->last[v];
+		float band = policy->deadband;
+
+		if (delta < 0.0f) {
+			delta = -delta;
+		}
+		if (policy->mode == TELEMETRY_POLICY_REL) {
+			band *= (state->last[v] < 0.0f) ? -state->last[v] : state->last[v];
+		}
+		if (delta > band) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @fn		static void PolicyRefill(const struct TelemetryPolicy *policy, struct PolicyState *state, TickType_t now)
+ * @brief	Tops up the rate limit bucket for the time since the last call
+ */
+static void PolicyRefill(const struct TelemetryPolicy *policy, struct PolicyState *state, TickType_t now)
+{
+	uint32_t elapsedMs = (now - state->lastRefill) * portTICK_PERIOD_MS;
+	uint32_t capacity = TELEMETRY_POLICY_BURST * POLICY_TOKEN;
+
+	state->lastRefill = now;
+	if (policy->ratePerMin == 0) {
+		state->tokens = capacity;
+		return;
+	}
+
+	/* POLICY_TOKEN per 60000 / ratePerMin ms; clamp the interval so the product cannot overflow */
+	if (elapsedMs > 60000) {
+		elapsedMs = 60000;
+	}
+	state->tokens += (elapsedMs * policy->ratePerMin) / (60000 / POLICY_TOKEN);
+	if (state->tokens > capacity) {
+		state->tokens = capacity;
+	}
+}
+
+/**
+ * @fn		static size_t PolicyNextToken(const char *line, size_t len, size_t *pos, const char **token)
+ * @brief	Finds the next space or tab separated word at or after *pos
+ * @return	Length of the word, 0 at the end of the line
+ */
+static size_t PolicyNextToken(const char *line, size_t len, size_t *pos, const char **token)
+{
+	size_t start;
+
+	while (*pos < len && (line[*pos] == ' ' || line[*pos] == '\t' || line[*pos] == '\0')) {
+		(*pos)++;
+	}
+	start = *pos;
+	while (*pos < len && line[*pos] != ' ' && line[*pos] != '\t' && line[*pos] != '\0') {
+		(*pos)++;
+	}
+	*token = &line[start];
+	return *pos - start;
+}
+
+/**
+ * @fn		static bool PolicyTokenEquals(const char *token, size_t tokenLen, const char *word)
+ * @brief	Case sensitive compare of a length bounded token against a string
+ */
+static bool PolicyTokenEquals(const char *token, size_t tokenLen, const char *word)
+{
+	return strlen(word) == tokenLen && strncmp(token, word, tokenLen) == 0;
+}
+
+/**
+ * @fn		static bool PolicyParseUint(const char *token, size_t tokenLen, uint32_t *out)
+ * @brief	Parses a decimal unsigned integer that fills the whole token
+ */
+static bool PolicyParseUint(const char *token, size_t tokenLen, uint32_t *out)
+{
+	uint32_t value = 0;
+
+	for (size_t i = 0; i < tokenLen; i++) {
+		if (token[i] < '0' || token[i] > '9' || value > (UINT32_MAX - 9) / 10) {
+			return false;
+		}
+		value = value * 10 + (uint32_t)(token[i] - '0');
+	}
+	*out = value;
+	return true;
+}
+
+/**
+ * @fn		static bool PolicyParseFloat(const char *token, size_t tokenLen, float *out)
+ * @brief	Parses [-]digits[.digits] without pulling in strtof
+ */
+static bool PolicyParseFloat(const char *token, size_t tokenLen, float *out)
+{
+	float value = 0.0f;
+	float scale = 1.0f;
+	bool negative = false;
+	bool fraction = false;
+	bool digits = false;
+	size_t i = 0;
+
+	if (i < tokenLen && token[i] == '-') {
+		negative = true;
+		i++;
+	}
+	for (; i < tokenLen; i++) {
+		if (token[i] == '.' && !fraction) {
+			fraction = true;
+		} else if (token[i] >= '0' && token[i] <= '9') {
+			digits = true;
+			if (fraction) {
+				scale *= 0.1f;
+				value += (token[i] - '0') * scale;
+			} else {
+				value = value * 10.0f + (token[i] - '0');
+			}
+		} else {
+			return false;
+		}
+	}
+	if (!digits) {
+		return false;
+	}
+	*out = negative ? -value : value;
+	return true;
+}
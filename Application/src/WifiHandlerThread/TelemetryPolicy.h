@@ -0,0 +1,82 @@
+/**************************************************************************//**
+* @file      TelemetryPolicy.h
+* @brief     Per channel report-by-exception filter applied before samples enter the telemetry batch
+* @details   Every channel has a policy deciding whether a new reading is worth
+*            publishing: it must differ from the last published one by more than
+*            a deadband (absolute, or relative to the last value), the channel
+*            must not have published within its minimum interval, and an optional
+*            token bucket caps the publishes per minute. When nothing changes, a
+*            reading still goes out after the maximum interval as a heartbeat.
+*
+*            Policies are set from the CLI ("policy") and from the retained
+*            TELEMETRY_POLICY_TOPIC, both in the text form of TelemetryPolicyParse().
+*            Offered and published counts per channel give the suppression ratio.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <asf.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "WifiHandlerThread/TelemetryBatch.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define TELEMETRY_POLICY_TOPIC          "Telemetry_Policy"          ///< Retained config, lines as in TelemetryPolicyParse()
+#define TELEMETRY_POLICY_STATS_TOPIC    "Telemetry_Policy_Stats"
+#define TELEMETRY_POLICY_REPORT_MS      60000   ///< Suppression report interval
+#define TELEMETRY_POLICY_BURST          5       ///< Token bucket depth of the rate limit
+#define TELEMETRY_POLICY_CONFIG_MAX     160     ///< Longest config payload accepted from MQTT
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// How a new reading is compared against the last published one
+enum TelemetryPolicyMode {
+	TELEMETRY_POLICY_ALL = 0,	///< No deadband, every reading passes (interval and rate limits still apply)
+	TELEMETRY_POLICY_ABS = 1,	///< Publish when any value moved more than deadband
+	TELEMETRY_POLICY_REL = 2	///< Publish when any value moved more than deadband x |last value|
+};
+
+/// Policy of one channel
+struct TelemetryPolicy {
+	uint8_t mode;				///< enum TelemetryPolicyMode
+	float deadband;				///< Absolute units of the channel, or a fraction for TELEMETRY_POLICY_REL
+	uint32_t minIntervalMs;		///< Never publish more often than this, 0 for no limit
+	uint32_t maxIntervalMs;		///< Heartbeat, publish after this long even without change, 0 for none
+	uint16_t ratePerMin;		///< Token bucket rate limit, 0 for none
+};
+
+/// Counters of one channel
+struct TelemetryPolicyStats {
+	uint32_t offered;			///< Readings that reached the filter
+	uint32_t published;			///< Readings let through
+	uint32_t heartbeats;		///< Of those, sent only because maxIntervalMs expired
+	uint32_t rateLimited;		///< Changes held back by the token bucket
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+void TelemetryPolicyInit(void);
+bool TelemetryPolicyAccept(uint8_t channel, const float *values, TickType_t now);
+void TelemetryPolicySet(uint8_t channel, const struct TelemetryPolicy *policy);
+void TelemetryPolicyGet(uint8_t channel, struct TelemetryPolicy *policy);
+void TelemetryPolicyGetStats(uint8_t channel, struct TelemetryPolicyStats *stats);
+bool TelemetryPolicyParse(const char *line, size_t len);
+int TelemetryPolicyApplyConfig(const char *config, size_t len);
+uint32_t TelemetryPolicySuppressionX10(uint8_t channel);
+const char *TelemetryPolicyChannelName(uint8_t channel);
+const char *TelemetryPolicyModeName(uint8_t mode);
+int TelemetryPolicyFormatStats(char *buffer, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -12,6 +12,15 @@
 #include "WifiHandlerThread/WifiHandler.h"
 #include "BME680/bme68x_defs.h"
 #include "BME680/bme68x.h"
+#include "WifiHandlerThread/TelemetryBatch.h"
+#include "WifiHandlerThread/MqttPipeline.h"
+#include "WifiHandlerThread/MqttReconnect.h"
+#include "WifiHandlerThread/TelemetryJournal.h"
+#include "WifiHandlerThread/TelemetryPolicy.h"
+#include "WifiHandlerThread/OtaVerify.h"
+#include "WifiHandlerThread/CommandDispatch.h"
+#include "WifiHandlerThread/OtaBoot.h"
+#include "SerialConsole/FastFormat.h"
 
 #include <errno.h>
 
@@ -32,9 +41,12 @@ QueueHandle_t xQueueImuBuffer = NULL;       ///< Queue to send IMU data to the c
 QueueHandle_t xQueueAirBuffer = NULL;       ///< Queue to send Air Velociy data to the cloud
 QueueHandle_t xQueueBmeBuffer = NULL;       ///< Queue to send BME data to the cloud
 
+static QueueSetHandle_t xWifiEventSet = NULL;       ///< Everything the Wifi task waits for: the queues above and the WINC IRQ
+static SemaphoreHandle_t xWincIrqSemaphore = NULL;  ///< Given from the WINC interrupt
+
 /*HTTP DOWNLOAD RELATED DEFINES AND VARIABLES*/
 
-uint8_t do_download_flag = false;  // Flag that when true initializes a download. False to connect to MQTT broker
+volatile uint8_t do_download_flag = false;  // Flag that is true from the download request until the download finished or failed
 /** File download processing state. */
 static download_state down_state = NOT_READY;
 /** SD/MMC mount. */
@@ -47,6 +59,36 @@ static uint32_t http_file_size = 0;
 static uint32_t received_file_size = 0;
 /** File name to download. */
 static char save_file_name[MAIN_MAX_FILE_NAME_LENGTH + 1] = "0:";
+/** Share of WIFI_OTA_LINK_BPS the download may use, in percent. */
+static volatile uint8_t download_share = WIFI_OTA_SHARE_PCT;
+/** Download byte budget, negative after a receive that was bigger than what was left. */
+static int32_t download_tokens = 0;
+/** Tick the budget was last topped up. */
+static TickType_t download_refill = 0;
+/** Tick the download was started, for the transfer rate. */
+static TickType_t download_start = 0;
+/** Received data waiting to be written as whole sectors. */
+COMPILER_WORD_ALIGNED static uint8_t download_stage[WIFI_OTA_STAGE_SIZE];
+/** Bytes in download_stage. */
+static uint16_t download_staged = 0;
+/** received_file_size at the last progress line. */
+static uint32_t download_reported = 0;
+/** Bytes written to the download file, staged bytes not counted. */
+static uint32_t download_written = 0;
+/** download_written at the last saved resume point. */
+static uint32_t download_checkpoint = 0;
+/** Reconnects since data last arrived. */
+static uint8_t download_retries = 0;
+/** Where the download continues, mirrors WIFI_OTA_RESUME_FILE. */
+static struct DownloadResume download_resume;
+/** File handle for WIFI_OTA_RESUME_FILE, file_object holds the download. */
+static FIL resume_file;
+/** Length and CRC32 the image must have, fetched from MAIN_HTTP_MANIFEST_URL before it. */
+static struct OtaManifest download_manifest;
+/** The manifest arrived, HTTP_DownloadFileTransaction() requests the image next. */
+static bool download_image_pending = false;
+/** CRC32 of the download_written bytes on the card. */
+static uint32_t download_crc = 0;
 
 /** UART module for debug. */
 // static struct usart_module cdc_uart_module;
@@ -69,6 +111,9 @@ static struct mqtt_module mqtt_inst;
 static unsigned char mqtt_read_buffer[MAIN_MQTT_BUFFER_SIZE];
 static unsigned char mqtt_send_buffer[MAIN_MQTT_BUFFER_SIZE];
 
+/* Framed telemetry batch, also the journal's replay frame. Sized to a pipeline slot, and so payload plus PUBLISH header fit in mqtt_send_buffer. */
+static char telemetry_msg[Min(MQTT_PIPELINE_PAYLOAD_MAX, MAIN_MQTT_BUFFER_SIZE - TELEMETRY_MQTT_OVERHEAD)];
+
 /******************************************************************************
  * Forward Declarations
  ******************************************************************************/
@@ -77,9 +122,29 @@ static void MQTT_HandleGameMessages(void);
 static void MQTT_HandleImuMessages(void);
 static void	MQTT_HandleBmeMessages(void);
 static void	MQTT_HandleAirMessages(void);
+static void MQTT_PublishCommandAcks(void);
+static void MQTT_PublishTelemetryBatch(void);
+static void MQTT_PublishPolicyStats(void);
+static void MQTT_PublishBootProfile(void);
 static void HTTP_DownloadFileInit(void);
 static void HTTP_DownloadFileTransaction(void);
+static void suspend_file_download(void);
+static void retry_download(void);
+static bool load_download_resume(void);
+static void save_download_resume(uint32_t offset, uint32_t crc);
+static void clear_download_resume(void);
+static uint32_t DownloadResumeCheck(const struct DownloadResume *resume);
+static bool flush_file_stage(void);
+static void report_file_progress(void);
+static void finish_file_download(void);
+static void HTTP_DownloadPace(TickType_t now);
+static void HTTP_DownloadDebit(uint32_t length);
+static TickType_t HTTP_DownloadTicksUntilResume(void);
 static void MQTT_HandleAirMessages(void);
+static bool WifiCreateEventQueues(void);
+static void WifiWaitForEvents(void);
+static TickType_t WifiNextTimeout(TickType_t now);
+static void WifiWincIrqNotify(void);
 /******************************************************************************
  * Callback Functions
  ******************************************************************************/
@@ -124,91 +189,12 @@ static inline bool is_state_set(download_state mask)
 }
 
 /**
- * \brief File existing check.
- * \param[in] fp The file pointer to check.
- * \param[in] file_path_name The file name to check.
- * \return true if this file name is exist, false otherwise.
- */
-static bool is_exist_file(FIL *fp, const char *file_path_name)
-{
-    if (fp == NULL || file_path_name == NULL) {
-        return false;
-    }
-
-    FRESULT ret = f_open(&file_object, (char const *)file_path_name, FA_OPEN_EXISTING);
-    f_close(&file_object);
-    return (ret == FR_OK);
-}
-
-/**
- * \brief Make to unique file name.
- * \param[in] fp The file pointer to check.
- * \param[out] file_path_name The file name change to uniquely and changed name is returned to this buffer.
- * \param[in] max_len Maximum file name length.
- * \return true if this file name is unique, false otherwise.
+ * \brief URL of the file the manifest describes, the whole image or a delta patch.
+ * \note The file keeps the URL's name on the card, the bootloader looks for both.
  */
-static bool rename_to_unique(FIL *fp, char *file_path_name, uint8_t max_len)
+static const char *download_url(void)
 {
-#define NUMBRING_MAX (3)
-#define ADDITION_SIZE (NUMBRING_MAX + 1) /* '-' character is added before the number. */
-    uint16_t i = 1, name_len = 0, ext_len = 0, count = 0;
-    char name[MAIN_MAX_FILE_NAME_LENGTH + 1] = {0};
-    char ext[MAIN_MAX_FILE_EXT_LENGTH + 1] = {0};
-    char numbering[NUMBRING_MAX + 1] = {0};
-    char *p = NULL;
-    bool valid_ext = false;
-
-    if (file_path_name == NULL) {
-        return false;
-    }
-
-    if (!is_exist_file(fp, file_path_name)) {
-        return true;
-    } else if (strlen(file_path_name) > MAIN_MAX_FILE_NAME_LENGTH) {
-        return false;
-    }
-
-    p = strrchr(file_path_name, '.');
-    if (p != NULL) {
-        ext_len = strlen(p);
-        if (ext_len < MAIN_MAX_FILE_EXT_LENGTH) {
-            valid_ext = true;
-            strcpy(ext, p);
-            if (strlen(file_path_name) - ext_len > MAIN_MAX_FILE_NAME_LENGTH - ADDITION_SIZE) {
-                name_len = MAIN_MAX_FILE_NAME_LENGTH - ADDITION_SIZE - ext_len;
-                strncpy(name, file_path_name, name_len);
-            } else {
-                name_len = (p - file_path_name);
-                strncpy(name, file_path_name, name_len);
-            }
-        } else {
-            name_len = MAIN_MAX_FILE_NAME_LENGTH - ADDITION_SIZE;
-            strncpy(name, file_path_name, name_len);
-        }
-    } else {
-        name_len = MAIN_MAX_FILE_NAME_LENGTH - ADDITION_SIZE;
-        strncpy(name, file_path_name, name_len);
-    }
-
-    name[name_len++] = '-';
-
-    for (i = 0, count = 1; i < NUMBRING_MAX; i++) {
-        count *= 10;
-    }
-    for (i = 1; i < count; i++) {
-        sprintf(numbering, MAIN_ZERO_FMT(NUMBRING_MAX), i);
-        strncpy(&name[name_len], numbering, NUMBRING_MAX);
-        if (valid_ext) {
-            strcpy(&name[name_len + NUMBRING_MAX], ext);
-        }
-
-        if (!is_exist_file(fp, name)) {
-            memset(file_path_name, 0, max_len);
-            strcpy(file_path_name, name);
-            return true;
-        }
-    }
-    return false;
+    return download_manifest.patch ? MAIN_HTTP_PATCH_URL : MAIN_HTTP_FILE_URL;
 }
 
 /**
@@ -236,9 +222,33 @@ static void start_download(void)
         return;
     }
 
+    /* The manifest comes first, the image is checked against it while it is written. */
+    if (!download_manifest.valid) {
+        LogMessage(LOG_DEBUG_LVL, "start_download: requesting manifest...\r\n");
+        http_client_send_request(&http_client_module_inst, MAIN_HTTP_MANIFEST_URL, HTTP_METHOD_GET, NULL, NULL);
+        return;
+    }
+    download_image_pending = false;
+
+    if (download_resume.offset > 0 && (download_resume.image_crc != download_manifest.crc32 || download_resume.total != download_manifest.length)) {
+        LogMessage(LOG_DEBUG_LVL, "start_download: partial file belongs to another image, starting over.\r\n");
+        clear_download_resume();
+    }
+
+    /* Continue an unfinished file, If-Range makes the server send all of it if the file changed. */
+    char range[32 + HTTP_MAX_ETAG_LENGTH];
+    const char *ext_header = NULL;
+    if (download_resume.offset > 0) {
+        int len = FmtPrintf(range, sizeof(range), "Range: bytes=%lu-\r\n", (unsigned long)download_resume.offset);
+        if (download_resume.etag[0] != '\0') {
+            FmtPrintf(&range[len], sizeof(range) - len, "If-Range: %s\r\n", download_resume.etag);
+        }
+        ext_header = range;
+    }
+
     /* Send the HTTP request. */
-    LogMessage(LOG_DEBUG_LVL, "start_download: sending HTTP request...\r\n");
-    int http_req_status = http_client_send_request(&http_client_module_inst, MAIN_HTTP_FILE_URL, HTTP_METHOD_GET, NULL, NULL);
+    LogMessage(LOG_DEBUG_LVL, "start_download: sending HTTP request from byte %lu...\r\n", (unsigned long)download_resume.offset);
+    int http_req_status = http_client_send_request(&http_client_module_inst, download_url(), HTTP_METHOD_GET, NULL, ext_header);
 }
 
 /**
@@ -258,7 +268,7 @@ static void store_file_packet(char *data, uint32_t length)
         char *cp = NULL;
         save_file_name[0] = LUN_ID_SD_MMC_0_MEM + '0';
         save_file_name[1] = ':';
-        cp = (char *)(MAIN_HTTP_FILE_URL + strlen(MAIN_HTTP_FILE_URL));
+        cp = (char *)(download_url() + strlen(download_url()));
         while (*cp != '/') {
             cp--;
         }
@@ -271,38 +281,260 @@ static void store_file_packet(char *data, uint32_t length)
             return;
         }
 
-        rename_to_unique(&file_object, save_file_name, MAIN_MAX_FILE_NAME_LENGTH);
-        LogMessage(LOG_DEBUG_LVL, "store_file_packet: creating file [%s]\r\n", save_file_name);
-        ret = f_open(&file_object, (char const *)save_file_name, FA_CREATE_ALWAYS | FA_WRITE);
-        if (ret != FR_OK) {
-            LogMessage(LOG_DEBUG_LVL, "store_file_packet: file creation error! ret:%d\r\n", ret);
-            return;
+        if (received_file_size > 0) {
+            // Resumed: the file was preallocated to its full length by the first attempt
+            LogMessage(LOG_DEBUG_LVL, "store_file_packet: resuming [%s] at %lu\r\n", save_file_name, (unsigned long)received_file_size);
+            ret = f_open(&file_object, (char const *)save_file_name, FA_OPEN_EXISTING | FA_WRITE);
+            if (ret == FR_OK && f_size(&file_object) != http_file_size) {
+                f_close(&file_object);
+                ret = FR_INVALID_OBJECT;
+            }
+            if (ret == FR_OK) {
+                ret = f_lseek(&file_object, received_file_size);
+            }
+            download_crc = download_resume.crc;
+            if (ret != FR_OK) {
+                LogMessage(LOG_DEBUG_LVL, "store_file_packet: partial file unusable (%d), download canceled.\r\n", ret);
+                clear_download_resume();
+                add_state(CANCELED);
+                return;
+            }
+        } else {
+            LogMessage(LOG_DEBUG_LVL, "store_file_packet: creating file [%s]\r\n", save_file_name);
+            // The bootloader tries a patch before the whole image, a file left from an older release must not win
+            f_unlink(download_manifest.patch ? MAIN_SD_FILE_NAME : MAIN_SD_PATCH_NAME);
+            ret = f_open(&file_object, (char const *)save_file_name, FA_CREATE_ALWAYS | FA_WRITE);
+            if (ret != FR_OK) {
+                LogMessage(LOG_DEBUG_LVL, "store_file_packet: file creation error! ret:%d\r\n", ret);
+                add_state(CANCELED);
+                return;
+            }
+
+            // Allocate the whole file up front when its size is known, so the writes need no cluster allocation
+            if (http_file_size > 0) {
+                ret = f_lseek(&file_object, http_file_size);
+                if (ret != FR_OK || f_tell(&file_object) != http_file_size) {
+                    LogMessage(LOG_DEBUG_LVL, "store_file_packet: no room for %lu bytes, download canceled.\r\n", (unsigned long)http_file_size);
+                    f_close(&file_object);
+                    add_state(CANCELED);
+                    return;
+                }
+                f_lseek(&file_object, 0);
+                f_sync(&file_object);
+                save_download_resume(0, 0);
+            }
+            download_crc = 0;
         }
 
-        received_file_size = 0;
+        download_written = received_file_size;
+        download_checkpoint = received_file_size;
+        download_reported = received_file_size;
+        download_staged = 0;
         add_state(DOWNLOADING);
     }
 
-    if (data != NULL) {
-        UINT wsize = 0;
-        ret = f_write(&file_object, (const void *)data, length, &wsize);
-        if (ret != FR_OK) {
-            f_close(&file_object);
-            add_state(CANCELED);
-            LogMessage(LOG_DEBUG_LVL, "store_file_packet: file write error, download canceled.\r\n");
+    download_retries = 0;
+
+    while (length > 0) {
+        uint32_t room = WIFI_OTA_STAGE_SIZE - download_staged;
+        uint32_t take = (length < room) ? length : room;
+
+        memcpy(&download_stage[download_staged], data, take);
+        download_staged += take;
+        received_file_size += take;
+        data += take;
+        length -= take;
+        if (download_staged == WIFI_OTA_STAGE_SIZE && !flush_file_stage()) {
             return;
         }
+    }
 
-        received_file_size += wsize;
-        LogMessage(LOG_DEBUG_LVL, "store_file_packet: received[%lu], file size[%lu]\r\n", (unsigned long)received_file_size, (unsigned long)http_file_size);
-        if (received_file_size >= http_file_size) {
-            f_close(&file_object);
-            LogMessage(LOG_DEBUG_LVL, "store_file_packet: file downloaded successfully.\r\n");
-            port_pin_set_output_level(LED_0_PIN, false);
-            add_state(COMPLETED);
-            return;
+    report_file_progress();
+    if (http_file_size > 0 && received_file_size >= http_file_size) {
+        finish_file_download();
+    }
+}
+
+/**
+ * \brief Write the staged data to the download file.
+ * \return false if the write failed, the download is canceled then.
+ */
+static bool flush_file_stage(void)
+{
+    UINT wsize = 0;
+
+    if (download_staged == 0) {
+        return true;
+    }
+    FRESULT ret = f_write(&file_object, (const void *)download_stage, download_staged, &wsize);
+    if (ret != FR_OK || wsize != download_staged) {
+        f_close(&file_object);
+        download_staged = 0;
+        add_state(CANCELED);
+        LogMessage(LOG_DEBUG_LVL, "store_file_packet: file write error, download canceled.\r\n");
+        return false;
+    }
+    // Hash what went to the card, so the image never has to be read back
+    download_crc = OtaVerifyUpdate(download_crc, download_stage, wsize);
+    download_staged = 0;
+    download_written += wsize;
+
+    // Data before the saved offset must be on the card, so sync the file first
+    if (http_file_size > 0 && download_written - download_checkpoint >= WIFI_OTA_CHECKPOINT_BYTES) {
+        if (f_sync(&file_object) == FR_OK) {
+            save_download_resume(download_written, download_crc);
+            download_checkpoint = download_written;
         }
     }
+    return true;
+}
+
+/**
+ * \brief Close the partial file and keep its resume point after the connection was lost.
+ * \note Staged bytes are dropped, the next Range request asks for them again.
+ */
+static void suspend_file_download(void)
+{
+    if (is_state_set(DOWNLOADING) && !is_state_set(COMPLETED | CANCELED)) {
+        f_close(&file_object);
+        download_staged = 0;
+        if (http_file_size > 0) {
+            save_download_resume(download_written, download_crc);
+        }
+        LogMessage(LOG_DEBUG_LVL, "download: suspended at %lu of %lu bytes\r\n", (unsigned long)download_resume.offset, (unsigned long)http_file_size);
+    }
+    clear_state(DOWNLOADING | GET_REQUESTED);
+}
+
+/**
+ * \brief Request the rest of the file again, up to WIFI_OTA_MAX_RETRIES times without new data.
+ * \note Without Wi-Fi nothing is sent, wifi_cb() restarts the download once the network is back.
+ */
+static void retry_download(void)
+{
+    if (!is_state_set(WIFI_CONNECTED)) {
+        return;
+    }
+    if (download_retries >= WIFI_OTA_MAX_RETRIES) {
+        LogMessage(LOG_DEBUG_LVL, "download: giving up, \"fw\" continues at byte %lu\r\n", (unsigned long)download_resume.offset);
+        add_state(CANCELED);
+        return;
+    }
+    download_retries++;
+    start_download();
+}
+
+/**
+ * \brief Read WIFI_OTA_RESUME_FILE into download_resume.
+ * \return false if there is no usable resume point.
+ */
+static bool load_download_resume(void)
+{
+    UINT read = 0;
+    FRESULT res = f_open(&resume_file, WIFI_OTA_RESUME_FILE, FA_OPEN_EXISTING | FA_READ);
+
+    if (res == FR_OK) {
+        res = f_read(&resume_file, &download_resume, sizeof(download_resume), &read);
+        f_close(&resume_file);
+    }
+    if (res != FR_OK || read != sizeof(download_resume) || download_resume.magic != WIFI_OTA_RESUME_MAGIC ||
+        download_resume.check != DownloadResumeCheck(&download_resume) || download_resume.offset >= download_resume.total) {
+        memset(&download_resume, 0, sizeof(download_resume));
+        return false;
+    }
+    download_resume.etag[HTTP_MAX_ETAG_LENGTH - 1] = '\0';
+    return true;
+}
+
+/**
+ * \brief Rewrite WIFI_OTA_RESUME_FILE with the given offset and the CRC32 of the bytes before it.
+ */
+static void save_download_resume(uint32_t offset, uint32_t crc)
+{
+    UINT written = 0;
+
+    download_resume.magic = WIFI_OTA_RESUME_MAGIC;
+    download_resume.offset = offset;
+    download_resume.crc = crc;
+    download_resume.image_crc = download_manifest.crc32;
+    download_resume.check = DownloadResumeCheck(&download_resume);
+    if (f_open(&resume_file, WIFI_OTA_RESUME_FILE, FA_CREATE_ALWAYS | FA_WRITE) == FR_OK) {
+        f_write(&resume_file, &download_resume, sizeof(download_resume), &written);
+        f_close(&resume_file);
+    }
+}
+
+/**
+ * \brief Forget the resume point, the next request asks for the whole file.
+ */
+static void clear_download_resume(void)
+{
+    memset(&download_resume, 0, sizeof(download_resume));
+    f_unlink(WIFI_OTA_RESUME_FILE);
+}
+
+/**
+ * \brief Check word over the resume record, catches a torn write or a record of another layout.
+ */
+static uint32_t DownloadResumeCheck(const struct DownloadResume *resume)
+{
+    uint32_t check = ~(resume->magic ^ resume->offset ^ resume->total ^ resume->crc ^ resume->image_crc);
+
+    for (uint8_t i = 0; i < HTTP_MAX_ETAG_LENGTH; i++) {
+        check = (check << 5) + check + (uint8_t)resume->etag[i];
+    }
+    return check;
+}
+
+/**
+ * \brief Log the download progress in steps of a tenth of the file, or every WIFI_OTA_PROGRESS_BYTES without a length.
+ */
+static void report_file_progress(void)
+{
+    uint32_t step = (http_file_size > 0) ? (http_file_size + 9) / 10 : WIFI_OTA_PROGRESS_BYTES;
+
+    if (received_file_size - download_reported < step) {
+        return;
+    }
+    download_reported = received_file_size;
+    if (http_file_size > 0) {
+        LogMessage(LOG_DEBUG_LVL, "download: %lu%% (%lu of %lu bytes)\r\n", (unsigned long)(received_file_size * 10 / http_file_size * 10),
+                   (unsigned long)received_file_size, (unsigned long)http_file_size);
+    } else {
+        LogMessage(LOG_DEBUG_LVL, "download: %lu bytes\r\n", (unsigned long)received_file_size);
+    }
+}
+
+/**
+ * \brief Write the last partial sector, cut the preallocated file to its length, close it and check it against the manifest.
+ * \note A mismatch deletes the file and cancels, so the boot flag is never written for it.
+ */
+static void finish_file_download(void)
+{
+    if (!flush_file_stage()) {
+        return;
+    }
+    f_truncate(&file_object);
+    f_close(&file_object);
+    clear_download_resume();
+
+    if (download_written != download_manifest.length || download_crc != download_manifest.crc32) {
+        LogMessage(LOG_DEBUG_LVL, "store_file_packet: image check failed, %lu bytes crc32 %x, manifest %lu bytes crc32 %x\r\n", (unsigned long)download_written,
+                   (unsigned int)download_crc, (unsigned long)download_manifest.length, (unsigned int)download_manifest.crc32);
+        f_unlink(save_file_name);
+        port_pin_set_output_level(LED_0_PIN, false);
+        add_state(CANCELED);
+        return;
+    }
+
+    LogMessage(LOG_DEBUG_LVL, "store_file_packet: image matches manifest, crc32 %x\r\n", (unsigned int)download_crc);
+
+    uint32_t elapsedMs = (xTaskGetTickCount() - download_start) * portTICK_PERIOD_MS;
+    uint32_t kbpsX10 = (received_file_size * 10 / 1024) * 1000 / (elapsedMs > 0 ? elapsedMs : 1);
+    LogMessage(LOG_DEBUG_LVL, "store_file_packet: %lu bytes in %lu ms, %lu.%lu KB/s\r\n", (unsigned long)received_file_size, (unsigned long)elapsedMs,
+               (unsigned long)(kbpsX10 / 10), (unsigned long)(kbpsX10 % 10));
+    port_pin_set_output_level(LED_0_PIN, false);
+    add_state(COMPLETED);
 }
 
 /**
@@ -326,23 +558,69 @@ static void http_client_callback(struct http_client_module *module_inst, int typ
 
         case HTTP_CLIENT_CALLBACK_RECV_RESPONSE:
             LogMessage(LOG_DEBUG_LVL, "http_client_callback: received response %u data size %u\r\n", (unsigned int)data->recv_response.response_code, (unsigned int)data->recv_response.content_length);
-            if ((unsigned int)data->recv_response.response_code == 200) {
-                http_file_size = data->recv_response.content_length;
+            if (!download_manifest.valid) {
+                /* The manifest fits the receive buffer, so it always comes whole with the response. */
+                if ((unsigned int)data->recv_response.response_code != 200 || data->recv_response.content == NULL ||
+                    !OtaManifestParse(data->recv_response.content, data->recv_response.content_length, &download_manifest)) {
+                    LogMessage(LOG_DEBUG_LVL, "http_client_callback: no valid manifest, download canceled.\r\n");
+                    add_state(CANCELED);
+                    return;
+                }
+                LogMessage(LOG_DEBUG_LVL, "http_client_callback: manifest %lu bytes crc32 %x\r\n", (unsigned long)download_manifest.length, (unsigned int)download_manifest.crc32);
+                clear_state(GET_REQUESTED);
+                download_image_pending = true;
+                return;
+            }
+            if ((unsigned int)data->recv_response.response_code == 206 && download_resume.offset > 0) {
+                /* Only continue if the server sends exactly the missing part of the same file. */
+                struct http_client_data_recv_response *resp = &data->recv_response;
+                if (resp->range_start != download_resume.offset || resp->range_total != download_resume.total ||
+                    (resp->etag[0] != '\0' && download_resume.etag[0] != '\0' && strcmp(resp->etag, download_resume.etag) != 0)) {
+                    LogMessage(LOG_DEBUG_LVL, "http_client_callback: range %lu/%lu does not match, download canceled.\r\n",
+                               (unsigned long)resp->range_start, (unsigned long)resp->range_total);
+                    clear_download_resume();
+                    add_state(CANCELED);
+                    return;
+                }
+                http_file_size = download_resume.total;
+                received_file_size = download_resume.offset;
+            } else if ((unsigned int)data->recv_response.response_code == 200) {
+                if (download_resume.offset > 0) {
+                    LogMessage(LOG_DEBUG_LVL, "http_client_callback: file changed or no range support, starting over.\r\n");
+                }
+                clear_download_resume();
+                http_file_size = data->recv_response.is_chunked ? 0 : data->recv_response.content_length;
+                if (http_file_size > 0 && http_file_size != download_manifest.length) {
+                    LogMessage(LOG_DEBUG_LVL, "http_client_callback: file is not the one in the manifest, download canceled.\r\n");
+                    add_state(CANCELED);
+                    return;
+                }
                 received_file_size = 0;
+                download_resume.total = http_file_size;
+                strncpy(download_resume.etag, data->recv_response.etag, HTTP_MAX_ETAG_LENGTH - 1);
             } else {
+                if ((unsigned int)data->recv_response.response_code == 416) {
+                    /* Range Not Satisfiable, the file on the server got shorter. */
+                    clear_download_resume();
+                }
                 add_state(CANCELED);
                 return;
             }
-            if (data->recv_response.content_length <= MAIN_BUFFER_MAX_SIZE) {
+            // Small bodies arrive whole with the response, bigger ones follow as chunked data
+            if (data->recv_response.content != NULL) {
+                HTTP_DownloadDebit(data->recv_response.content_length);
                 store_file_packet(data->recv_response.content, data->recv_response.content_length);
-                add_state(COMPLETED);
             }
             break;
 
         case HTTP_CLIENT_CALLBACK_RECV_CHUNKED_DATA:
+            if (!download_manifest.valid || is_state_set(CANCELED)) {
+                break;
+            }
+            HTTP_DownloadDebit(data->recv_chunked_data.length);
             store_file_packet(data->recv_chunked_data.data, data->recv_chunked_data.length);
-            if (data->recv_chunked_data.is_complete) {
-                add_state(COMPLETED);
+            if (data->recv_chunked_data.is_complete && is_state_set(DOWNLOADING) && !is_state_set(COMPLETED | CANCELED)) {
+                finish_file_download();
             }
 
             break;
@@ -350,70 +628,18 @@ static void http_client_callback(struct http_client_module *module_inst, int typ
         case HTTP_CLIENT_CALLBACK_DISCONNECTED:
             LogMessage(LOG_DEBUG_LVL, "http_client_callback: disconnection reason:%d\r\n", data->disconnected.reason);
 
-            /* If disconnect reason is equal to -ECONNRESET(-104),
-             * It means the server has closed the connection (timeout).
-             * This is normal operation.
+            /* A server timeout (-EAGAIN) or any other loss of an unfinished transfer
+             * continues with a Range request from what is on the card.
              */
-            if (data->disconnected.reason == -EAGAIN) {
-                /* Server has not responded. Retry immediately. */
-                if (is_state_set(DOWNLOADING)) {
-                    f_close(&file_object);
-                    clear_state(DOWNLOADING);
-                }
-
-                if (is_state_set(GET_REQUESTED)) {
-                    clear_state(GET_REQUESTED);
-                }
-
-                start_download();
+            if (do_download_flag && !is_state_set(COMPLETED | CANCELED)) {
+                suspend_file_download();
+                retry_download();
             }
 
             break;
     }
 }
 
-/**
- * \brief Callback to get the data from socket.
- *
- * \param[in] sock socket handler.
- * \param[in] u8Msg socket event type. Possible values are:
- *  - SOCKET_MSG_BIND
- *  - SOCKET_MSG_LISTEN
- *  - SOCKET_MSG_ACCEPT
- *  - SOCKET_MSG_CONNECT
- *  - SOCKET_MSG_RECV
- *  - SOCKET_MSG_SEND
- *  - SOCKET_MSG_SENDTO
- *  - SOCKET_MSG_RECVFROM
- * \param[in] pvMsg is a pointer to message structure. Existing types are:
- *  - tstrSocketBindMsg
- *  - tstrSocketListenMsg
- *  - tstrSocketAcceptMsg
- *  - tstrSocketConnectMsg
- *  - tstrSocketRecvMsg
- */
-static void socket_cb(SOCKET sock, uint8_t u8Msg, void *pvMsg)
-{
-    http_client_socket_event_handler(sock, u8Msg, pvMsg);
-}
-
-/**
- * \brief Callback for the gethostbyname function (DNS Resolution callback).
- * \param[in] pu8DomainName Domain name of the host.
- * \param[in] u32ServerIP Server IPv4 address encoded in NW byte order format. If it is Zero, then the DNS resolution failed.
- */
-static void resolve_cb(uint8_t *pu8DomainName, uint32_t u32ServerIP)
-{
-    LogMessage(LOG_DEBUG_LVL,
-               "resolve_cb: %s IP address is %d.%d.%d.%d\r\n\r\n",
-               pu8DomainName,
-               (int)IPV4_BYTE(u32ServerIP, 0),
-               (int)IPV4_BYTE(u32ServerIP, 1),
-               (int)IPV4_BYTE(u32ServerIP, 2),
-               (int)IPV4_BYTE(u32ServerIP, 3));
-    http_client_socket_resolve_handler(pu8DomainName, u32ServerIP);
-}
-
 /**
  * \brief Callback to get the Wi-Fi status update.
  *
@@ -450,14 +676,7 @@ static void wifi_cb(uint8_t u8MsgType, void *pvMsg)
             } else if (pstrWifiState->u8CurrState == M2M_WIFI_DISCONNECTED) {
                 LogMessage(LOG_DEBUG_LVL, "wifi_cb: M2M_WIFI_DISCONNECTED\r\n");
                 clear_state(WIFI_CONNECTED);
-                if (is_state_set(DOWNLOADING)) {
-                    f_close(&file_object);
-                    clear_state(DOWNLOADING);
-                }
-
-                if (is_state_set(GET_REQUESTED)) {
-                    clear_state(GET_REQUESTED);
-                }
+                suspend_file_download();
 
                 /* Disconnect from MQTT broker. */
                 /* Force close the MQTT connection, because cannot send a disconnect message to the broker when network is broken. */
@@ -474,14 +693,11 @@ static void wifi_cb(uint8_t u8MsgType, void *pvMsg)
             LogMessage(LOG_DEBUG_LVL, "wifi_cb: IP address is %u.%u.%u.%u\r\n", pu8IPAddress[0], pu8IPAddress[1], pu8IPAddress[2], pu8IPAddress[3]);
             add_state(WIFI_CONNECTED);
 
-            if (do_download_flag == 1) {
+            /* Connect to the MQTT broker from the Wifi task, without waiting out the backoff. */
+            MqttReconnectKick();
+            /* A download that lost the network picks up again next to MQTT. */
+            if (do_download_flag && is_state_set(STORAGE_READY)) {
                 start_download();
-
-            } else {
-                /* Try to connect to MQTT broker when Wi-Fi was connected. */
-                if (mqtt_connect(&mqtt_inst, main_mqtt_broker)) {
-                    LogMessage(LOG_DEBUG_LVL, "Error connecting to MQTT Broker!\r\n");
-                }
             }
         } break;
 
@@ -595,7 +811,7 @@ static void configure_http_client(void)
 void SubscribeHandler(MessageData *msgData);
 
 /**
- * \brief Callback to get the Socket event.
+ * \brief Callback to get the Socket event, shared by the MQTT and the HTTP client.
  *
  * \param[in] Socket descriptor.
  * \param[in] msg_type type of Socket notification. Possible types are:
@@ -611,7 +827,9 @@ void SubscribeHandler(MessageData *msgData);
  */
 static void socket_event_handler(SOCKET sock, uint8_t msg_type, void *msg_data)
 {
+    // Each client only acts on events of its own sockets
     mqtt_socket_event_handler(sock, msg_type, msg_data);
+    http_client_socket_event_handler(sock, msg_type, msg_data);
 }
 
 /**
@@ -623,19 +841,34 @@ static void socket_event_handler(SOCKET sock, uint8_t msg_type, void *msg_data)
 static void socket_resolve_handler(uint8_t *doamin_name, uint32_t server_ip)
 {
     mqtt_socket_resolve_handler(doamin_name, server_ip);
+    http_client_socket_resolve_handler(doamin_name, server_ip);
 }
 
+/**
+ * \brief Queues the command for the command task, the motion must not run inside mqtt_yield().
+ */
 void SubscribeHandlerAutoma(MessageData *msgData)
 {
 	LogMessage(LOG_DEBUG_LVL, "%.*s\r\n", msgData->topicName->lenstring.len, msgData->topicName->lenstring.data);
-	if (strncmp(msgData->message->payload, "1", 1) ==  0)
-	{
-		SerialConsoleWriteString("Starting Wind Routine\r\n");
-		
-		//vTaskSuspendAll();
-		AutomateTurbine(120);
-		//xTaskResumeAll();
-		//port_pin_set_output_level(LED0, true);
+	CommandDispatchSubmit((const char *)msgData->message->payload, msgData->message->payloadlen);
+}
+
+/**
+ * \brief Applies the retained publish policy config, see TelemetryPolicyParse() for the syntax.
+ */
+void SubscribeHandlerPolicy(MessageData *msgData)
+{
+	size_t len = msgData->message->payloadlen;
+
+	if (len > TELEMETRY_POLICY_CONFIG_MAX) {
+		LogMessage(LOG_DEBUG_LVL, "Telemetry policy config too long (%u)\r\n", len);
+		return;
+	}
+	int applied = TelemetryPolicyApplyConfig((const char *)msgData->message->payload, len);
+	if (applied < 0) {
+		LogMessage(LOG_DEBUG_LVL, "Telemetry policy config has errors, valid lines applied\r\n");
+	} else {
+		LogMessage(LOG_DEBUG_LVL, "Telemetry policy config: %d channels updated\r\n", applied);
 	}
 }
 
@@ -663,25 +896,29 @@ static void mqtt_callback(struct mqtt_module *module_inst, int type, union mqtt_
              */
             if (data->sock_connected.result >= 0) {
                 LogMessage(LOG_DEBUG_LVL, "\r\nConnecting to Broker...");
-                if (0 != mqtt_connect_broker(module_inst, 1, CLOUDMQTT_USER_ID, CLOUDMQTT_USER_PASSWORD, CLOUDMQTT_USER_ID, NULL, NULL, 0, 0, 0)) {
+                /* Clean session off: the broker keeps the subscriptions and queued messages across a reconnect. */
+                if (0 != mqtt_connect_broker(module_inst, 0, CLOUDMQTT_USER_ID, CLOUDMQTT_USER_PASSWORD, CLOUDMQTT_USER_ID, NULL, NULL, 0, 0, 0)) {
                     LogMessage(LOG_DEBUG_LVL, "MQTT  Error - NOT Connected to broker\r\n");
                 } else {
                     LogMessage(LOG_DEBUG_LVL, "MQTT Connected to broker\r\n");
                 }
             } else {
-                LogMessage(LOG_DEBUG_LVL, "Connect fail to server(%s)! retry it automatically.\r\n", main_mqtt_broker);
-                mqtt_connect(module_inst, main_mqtt_broker); /* Retry that. */
+                /* MqttReconnectService() tries again after the backoff. */
+                LogMessage(LOG_DEBUG_LVL, "Connect fail to server(%s)! (%d)\r\n", main_mqtt_broker, data->sock_connected.result);
             }
         } break;
 
         case MQTT_CALLBACK_CONNECTED:
-            if (data->connected.result == MQTT_CONN_RESULT_ACCEPT) {
+            if (data->connected.result == MQTT_CONN_RESULT_ACCEPT && !MqttReconnectNeedsSubscribe(data->connected.session_present)) {
+                LogMessage(LOG_DEBUG_LVL, "MQTT Connected, session resumed\r\n");
+            } else if (data->connected.result == MQTT_CONN_RESULT_ACCEPT) {
                 /* Subscribe chat topic. */
                 //mqtt_subscribe(module_inst, GAME_TOPIC_IN, 2, SubscribeHandlerGameTopic);
                 //mqtt_subscribe(module_inst, LED_TOPIC, 2, SubscribeHandlerLedTopic);
                 //mqtt_subscribe(module_inst, IMU_TOPIC, 2, SubscribeHandlerImuTopic);
 				//mqtt_subscribe(module_inst, AIR_VELOCITY, 2, SubscribeHandlerAirTopic);
 				mqtt_subscribe(module_inst, AUTOMATE_TOPIC, 1, SubscribeHandlerAutoma);
+				mqtt_subscribe(module_inst, TELEMETRY_POLICY_TOPIC, 1, SubscribeHandlerPolicy);
                 /* Enable USART receiving callback. */
                 LogMessage(LOG_DEBUG_LVL, "MQTT Connected\r\n");
             } else {
@@ -694,6 +931,8 @@ static void mqtt_callback(struct mqtt_module *module_inst, int type, union mqtt_
         case MQTT_CALLBACK_DISCONNECTED:
             /* Stop timer and USART callback. */
             LogMessage(LOG_DEBUG_LVL, "MQTT disconnected\r\n");
+            MqttPipelineDisconnected();
+            MqttReconnectLost(xTaskGetTickCount());
             // usart_disable_callback(&cdc_uart_module, USART_CALLBACK_BUFFER_RECEIVED);
             break;
     }
@@ -714,7 +953,7 @@ static void configure_mqtt(void)
     mqtt_conf.send_buffer = mqtt_send_buffer;
     mqtt_conf.send_buffer_size = MAIN_MQTT_BUFFER_SIZE;
     mqtt_conf.port = CLOUDMQTT_PORT;
-    mqtt_conf.keep_alive = 6000;
+    mqtt_conf.keep_alive = WIFI_MQTT_KEEPALIVE_S;
 
     result = mqtt_init(&mqtt_inst, &mqtt_conf);
     if (result < 0) {
@@ -729,6 +968,8 @@ static void configure_mqtt(void)
         while (1) {
         }
     }
+
+    MqttPipelineInit(&mqtt_inst);
 }
 
 // SETUP FOR EXTERNAL BUTTON INTERRUPT -- Used to send an MQTT Message
@@ -758,24 +999,34 @@ void extint_detection_callback(void)
 
 /**
  static void HTTP_DownloadFileInit(void)
- * @brief	Routine to initialize HTTP download of the OTAU file
- * @note
+ * @brief	Starts the download of the OTAU file next to the running MQTT session
+ * @note	Both clients share the socket layer, the download is paced in HTTP_DownloadFileTransaction().
 */
 static void HTTP_DownloadFileInit(void)
 {
-    if (mqtt_disconnect(&mqtt_inst, main_mqtt_broker)) {
-        LogMessage(LOG_DEBUG_LVL, "Error connecting to MQTT Broker!\r\n");
+    if (!is_state_set(STORAGE_READY)) {
+        LogMessage(LOG_DEBUG_LVL, "HTTP_DownloadFileInit: MMC storage not ready.\r\n");
+        do_download_flag = false;
+        wifiStateMachine = WIFI_MQTT_HANDLE;
+        return;
     }
-    while ((mqtt_inst.isConnected)) {
-        m2m_wifi_handle_events(NULL);
+
+    // A stale flag must not let the bootloader flash the half written file after a reset
+    f_unlink(WIFI_OTA_FLAG_FILE);
+    if (load_download_resume()) {
+        LogMessage(LOG_DEBUG_LVL, "HTTP_DownloadFileInit: resuming at %lu of %lu bytes\r\n", (unsigned long)download_resume.offset, (unsigned long)download_resume.total);
     }
-    socketDeinit();
-    // DOWNLOAD A FILE
+
+    OtaVerifyInit();
+    memset(&download_manifest, 0, sizeof(download_manifest));
+    download_image_pending = false;
     do_download_flag = true;
-    /* Register socket callback function. */
-    registerSocketCallback(socket_cb, resolve_cb);
-    /* Initialize socket module. */
-    socketInit();
+    download_retries = 0;
+    clear_state(COMPLETED | CANCELED);
+    download_start = xTaskGetTickCount();
+    download_refill = download_start;
+    download_tokens = WIFI_OTA_BURST_BYTES;
+    http_client_hold_recv(&http_client_module_inst, 0);
 
     start_download();
     wifiStateMachine = WIFI_DOWNLOAD_HANDLE;
@@ -783,40 +1034,104 @@ static void HTTP_DownloadFileInit(void)
 
 /**
  static void HTTP_DownloadFileTransaction(void)
- * @brief	Routine to handle the HTTP transaction of downloading a file
- * @note
-
+ * @brief	Paces the running download and finishes it once the file is complete
+ * @note	Runs after MQTT_HandleTransactions(), which handles the socket events of both clients.
+ *			The image request goes out from here, the client is still busy inside the manifest callback.
 */
 static void HTTP_DownloadFileTransaction(void)
 {
-    /* Connect to router. */
-    while (!(is_state_set(COMPLETED)) || is_state_set(CANCELED)) {
-        /* Handle pending events from network controller. */
-        m2m_wifi_handle_events(NULL);
-        /* Checks the timer timeout. */
-        sw_timer_task(&swt_module_inst);
-        vTaskDelay(5);
+    HTTP_DownloadPace(xTaskGetTickCount());
+
+    if (download_image_pending && is_state_set(WIFI_CONNECTED) && !is_state_set(CANCELED)) {
+        start_download();
     }
 
-    // Disable socket for HTTP Transfer
-    socketDeinit();
-    vTaskDelay(1000);
-    // CONNECT TO MQTT BROKER
-    do_download_flag = false;
+    if (is_state_set(CANCELED)) {
+        LogMessage(LOG_DEBUG_LVL, "HTTP_DownloadFileTransaction: download canceled.\r\n");
+        http_client_close(&http_client_module_inst);
+        http_client_hold_recv(&http_client_module_inst, 0);
+        do_download_flag = false;
+        wifiStateMachine = WIFI_MQTT_HANDLE;
+        return;
+    }
+    if (!is_state_set(COMPLETED)) {
+        return;
+    }
+
+    http_client_hold_recv(&http_client_module_inst, 0);
 
-    // Write Flag
-    char test_file_name[] = "0:FlagA.txt";
-    test_file_name[0] = LUN_ID_SD_MMC_0_MEM + '0';
-    FRESULT res = f_open(&file_object, (char const *)test_file_name, FA_CREATE_ALWAYS | FA_WRITE);
+    // COMPLETED is only set once the image matched its manifest, the flag is what the bootloader gates on
+    FRESULT res = f_open(&file_object, WIFI_OTA_FLAG_FILE, FA_CREATE_ALWAYS | FA_WRITE);
 
+    if (res == FR_OK) {
+        res = f_close(&file_object);
+    }
     if (res != FR_OK) {
-        LogMessage(LOG_INFO_LVL, "[FAIL] res %d\r\n", res);
+        LogMessage(LOG_INFO_LVL, "Boot flag not written, res %d\r\n", res);
+        f_unlink(WIFI_OTA_FLAG_FILE);
+        clear_state(COMPLETED);
+        add_state(CANCELED);
     } else {
-        SerialConsoleWriteString("FlagA.txt added!\r\n");
+        SerialConsoleWriteString("boot_flag.txt added!\r\n");
     }
 
-    f_close(&file_object);
-    wifiStateMachine = WIFI_MQTT_INIT;
+    do_download_flag = false;
+    wifiStateMachine = WIFI_MQTT_HANDLE;
+}
+
+/**
+ static void HTTP_DownloadPace(TickType_t now)
+ * @brief	Tops up the download budget and releases a held receive once it is positive again
+ * @details	The budget grows by download_share percent of WIFI_OTA_LINK_BPS, so the rest of
+ *			the link stays free for MQTT. Held data waits in the WINC and TCP flow control
+ *			slows the server down.
+*/
+static void HTTP_DownloadPace(TickType_t now)
+{
+    uint32_t rate = (uint32_t)WIFI_OTA_LINK_BPS * download_share / 100;
+    uint32_t elapsedMs = (now - download_refill) * portTICK_PERIOD_MS;
+
+    if (elapsedMs > 1000) {
+        elapsedMs = 1000;
+    }
+    int32_t refill = (int32_t)(elapsedMs * rate / 1000);
+    if (refill > 0) {
+        download_refill = now;
+        download_tokens += refill;
+        if (download_tokens > WIFI_OTA_BURST_BYTES) {
+            download_tokens = WIFI_OTA_BURST_BYTES;
+        }
+    }
+    if (download_tokens > 0) {
+        http_client_hold_recv(&http_client_module_inst, 0);
+    }
+}
+
+/**
+ static void HTTP_DownloadDebit(uint32_t length)
+ * @brief	Charges received download bytes to the budget, holds the next receive when it is used up
+*/
+static void HTTP_DownloadDebit(uint32_t length)
+{
+    download_tokens -= (int32_t)length;
+    if (download_tokens <= 0) {
+        http_client_hold_recv(&http_client_module_inst, 1);
+    }
+}
+
+/**
+ static TickType_t HTTP_DownloadTicksUntilResume(void)
+ * @brief	Ticks until a held download may receive again, portMAX_DELAY when it is not held
+*/
+static TickType_t HTTP_DownloadTicksUntilResume(void)
+{
+    uint32_t rate = (uint32_t)WIFI_OTA_LINK_BPS * download_share / 100;
+
+    if (!http_client_module_inst.recv_hold) {
+        return portMAX_DELAY;
+    }
+    TickType_t ticks = pdMS_TO_TICKS((uint32_t)(1 - download_tokens) * 1000 / rate + 1);
+    return (ticks > 0) ? ticks : 1;
 }
 
 /**
@@ -827,21 +1142,24 @@ static void HTTP_DownloadFileTransaction(void)
 */
 static void MQTT_InitRoutine(void)
 {
+    // The socket layer restarts under both clients, a running download ends here
+    if (do_download_flag) {
+        suspend_file_download();
+        add_state(CANCELED);
+        http_client_close(&http_client_module_inst);
+        http_client_hold_recv(&http_client_module_inst, 0);
+        do_download_flag = false;
+    }
+    // Give the client slot back, configure_mqtt() takes one again
+    mqtt_deinit(&mqtt_inst);
     socketDeinit();
     configure_mqtt();
     // Re-enable socket for MQTT Transfer
     registerSocketCallback(socket_event_handler, socket_resolve_handler);
     socketInit();
-    /* Connect to router. */
-    if (!(mqtt_inst.isConnected)) {
-        if (mqtt_connect(&mqtt_inst, main_mqtt_broker)) {
-            LogMessage(LOG_DEBUG_LVL, "Error connecting to MQTT Broker!\r\n");
-        }
-    }
-
-    if (mqtt_inst.isConnected) {
-        LogMessage(LOG_DEBUG_LVL, "Connected to MQTT Broker!\r\n");
-    }
+    /* MQTT_HandleTransactions() connects on the fresh socket layer. */
+    MqttReconnectReinitialized();
+    LogMessage(LOG_DEBUG_LVL, "MQTT socket layer restarted\r\n");
     wifiStateMachine = WIFI_MQTT_HANDLE;
 }
 
@@ -857,21 +1175,36 @@ static void MQTT_HandleTransactions(void)
     m2m_wifi_handle_events(NULL);
     sw_timer_task(&swt_module_inst);
 
-    // Check if data has to be sent!	
-	MQTT_HandleBmeMessages();
-	MQTT_HandleImuMessages();
-	MQTT_HandleAirMessages();
+    // A dead link is closed here and brought back by the reconnect manager, normally on the running sockets
+    if (mqtt_link_lost(&mqtt_inst)) {
+        LogMessage(LOG_DEBUG_LVL, "MQTT link lost\r\n");
+        mqtt_disconnect(&mqtt_inst, 1);
+    }
+    if (MqttReconnectService(xTaskGetTickCount(), is_state_set(WIFI_CONNECTED))) {
+        wifiStateMachine = WIFI_MQTT_INIT;
+    }
 
-    // Handle MQTT messages
-    if (mqtt_inst.isConnected) mqtt_yield(&mqtt_inst, 100);
+    // Handle MQTT messages, PUBACKs for the pipeline and commands arrive in here
+    if (mqtt_inst.isConnected) mqtt_yield(&mqtt_inst, WIFI_MQTT_YIELD_MS);
+
+    // Command acks take pipeline slots before telemetry. Samples were moved into the
+    // telemetry batch by WifiWaitForEvents()
+	MQTT_PublishCommandAcks();
+	MQTT_PublishTelemetryBatch();
+	MQTT_PublishPolicyStats();
+	MQTT_PublishBootProfile();
+	MqttPipelineService(xTaskGetTickCount());
+	TelemetryJournalService(xTaskGetTickCount(), mqtt_inst.isConnected, telemetry_msg, sizeof(telemetry_msg));
 }
 
 static void MQTT_HandleImuMessages(void)
 {
     struct ImuDataPacket_float imuDataVar;
     if (pdPASS == xQueueReceive(xQueueImuBuffer, &imuDataVar, 0)) {
-        sprintf(mqtt_msg, "{\"X\":%f, \"Y\":%f, \"Z\": %f}", imuDataVar.xmg, imuDataVar.ymg, imuDataVar.zmg);
-        mqtt_publish(&mqtt_inst, IMU_TOPIC, mqtt_msg, strlen(mqtt_msg), 1, 0);
+        float values[TELEMETRY_MAX_VALUES] = {imuDataVar.xmg, imuDataVar.ymg, imuDataVar.zmg};
+        if (TelemetryPolicyAccept(TELEMETRY_IMU, values, xTaskGetTickCount())) {
+            TelemetryBatchAdd(TELEMETRY_IMU, values, xTaskGetTickCount());
+        }
     }
 }
 
@@ -879,8 +1212,9 @@ static void MQTT_HandleAirMessages(void)
 {
 	float air_data;
 	if (pdPASS == xQueueReceive(xQueueAirBuffer, &air_data, 0)) {
-		sprintf(mqtt_msg, "%0.2f", air_data);
-		mqtt_publish(&mqtt_inst, AIR_TOPIC, mqtt_msg, strlen(mqtt_msg), 1, 0);
+		if (TelemetryPolicyAccept(TELEMETRY_AIR, &air_data, xTaskGetTickCount())) {
+			TelemetryBatchAdd(TELEMETRY_AIR, &air_data, xTaskGetTickCount());
+		}
 	}
 }
 
@@ -889,8 +1223,119 @@ static void MQTT_HandleBmeMessages(void)
 	struct bme68x_data bme_data;
 	
 	if (pdPASS == xQueueReceive(xQueueBmeBuffer, &bme_data, 0)) {
-		sprintf(mqtt_msg,"{\"T\":%0.2f, \"H\":%0.2f, \"P\":%0.2f}", bme_data.temperature, bme_data.humidity, bme_data.pressure);
-		mqtt_publish(&mqtt_inst, BME_TOPIC, mqtt_msg, strlen(mqtt_msg), 1, 0);
+		float values[TELEMETRY_MAX_VALUES] = {bme_data.temperature, bme_data.humidity, bme_data.pressure};
+		if (TelemetryPolicyAccept(TELEMETRY_ENV, values, xTaskGetTickCount())) {
+			TelemetryBatchAdd(TELEMETRY_ENV, values, xTaskGetTickCount());
+		}
+	}
+}
+
+/**
+ static void MQTT_PublishCommandAcks(void)
+ * @brief	Publishes the acks of finished commands, as many as the pipeline takes
+ * @note	An ack stays queued until the pipeline accepted it, telemetry waits meanwhile.
+*/
+static void MQTT_PublishCommandAcks(void)
+{
+	struct CommandAck ack;
+
+	while (mqtt_inst.isConnected && MqttPipelineHasRoom() && CommandDispatchPeekAck(&ack)) {
+		int len = CommandDispatchFormatAck(&ack, telemetry_msg, sizeof(telemetry_msg));
+		if (len <= 0) {
+			CommandDispatchConsumeAck();
+			continue;
+		}
+		if (MqttPipelinePublish(COMMAND_ACK_TOPIC, telemetry_msg, len, 0) != SUCCESS) {
+			break;
+		}
+		CommandDispatchConsumeAck();
+	}
+}
+
+/**
+ static void MQTT_PublishTelemetryBatch(void)
+ * @brief	Publishes the pending samples as one framed message once the batch interval elapsed
+ * @note	Samples stay in the batch while the pipeline window is full. Once the pipeline
+ *			took the frame it owns it until the PUBACK arrives. While the broker is
+ *			unreachable due batches go to the SD card journal and are replayed later.
+*/
+static void MQTT_PublishTelemetryBatch(void)
+{
+	uint8_t consumed = 0;
+	TickType_t now = xTaskGetTickCount();
+
+	if (!mqtt_inst.isConnected) {
+		if (TelemetryBatchIsDue(now)) {
+			const struct TelemetrySample *pending;
+			uint8_t count = TelemetryBatchPeek(&pending);
+			TelemetryJournalAppend(pending, count, now);
+			TelemetryBatchConsume(count);
+		}
+		return;
+	}
+	if (CommandDispatchAckPending() || !MqttPipelineHasRoom() || !TelemetryBatchIsDue(now)) {
+		return;
+	}
+
+#if TELEMETRY_BINARY
+	int len = TelemetryBatchEncodeBinary(telemetry_msg, sizeof(telemetry_msg), &consumed);
+#else
+	int len = TelemetryBatchEncode(telemetry_msg, sizeof(telemetry_msg), &consumed);
+#endif
+	if (len <= 0) {
+		return;
+	}
+
+	if (MqttPipelinePublish(TELEMETRY_TOPIC, telemetry_msg, len, 0) == SUCCESS) {
+		TelemetryBatchConsume(consumed);
+	} else {
+		LogMessage(LOG_DEBUG_LVL, "Telemetry batch publish failed, %u samples kept\r\n", TelemetryBatchCount());
+	}
+}
+
+/**
+ static void MQTT_PublishPolicyStats(void)
+ * @brief	Publishes the per channel suppression counters every TELEMETRY_POLICY_REPORT_MS
+*/
+static void MQTT_PublishPolicyStats(void)
+{
+	static TickType_t lastReport = 0;
+	TickType_t now = xTaskGetTickCount();
+
+	if (!mqtt_inst.isConnected || (now - lastReport) < pdMS_TO_TICKS(TELEMETRY_POLICY_REPORT_MS) || CommandDispatchAckPending() ||
+		!MqttPipelineHasRoom()) {
+		return;
+	}
+
+	int len = TelemetryPolicyFormatStats(telemetry_msg, sizeof(telemetry_msg));
+	if (len > 0 && MqttPipelinePublish(TELEMETRY_POLICY_STATS_TOPIC, telemetry_msg, len, 1) == SUCCESS) {
+		lastReport = now;
+	}
+}
+
+/**
+ static void MQTT_PublishBootProfile(void)
+ * @brief	Publishes how long this boot took, once, after the SD card is mounted
+ * @details	The bootloader's phase times if it left them on the card, which is
+ *			removed once they are out, otherwise the fast path time.
+*/
+static void MQTT_PublishBootProfile(void)
+{
+	static bool bootProfileSent = false;
+	struct OtaBootProfile profile;
+
+	if (bootProfileSent || !mqtt_inst.isConnected || !is_state_set(STORAGE_READY) || CommandDispatchAckPending() ||
+		!MqttPipelineHasRoom()) {
+		return;
+	}
+
+	bool fromCard = OtaBootReadProfile(&profile);
+	int len = OtaBootFormatProfile(fromCard ? &profile : NULL, telemetry_msg, sizeof(telemetry_msg));
+	if (len > 0 && MqttPipelinePublish(OTA_BOOT_PROFILE_TOPIC, telemetry_msg, len, 1) == SUCCESS) {
+		if (fromCard) {
+			OtaBootClearProfile();
+		}
+		bootProfileSent = true;
 	}
 }
 
@@ -909,12 +1354,9 @@ void vWifiTask(void *pvParameters)
     init_state();
 	
     // Create buffers to send data
-    xQueueWifiState = xQueueCreate(5, sizeof(uint32_t));
-    xQueueImuBuffer = xQueueCreate(5, sizeof(struct ImuDataPacket_float));
-    xQueueAirBuffer = xQueueCreate(2, sizeof(float));
-    xQueueBmeBuffer = xQueueCreate(5, sizeof(struct bme68x_data));
-
-    if (xQueueWifiState == NULL || xQueueImuBuffer == NULL || xQueueAirBuffer == NULL || xQueueBmeBuffer == NULL) {
+    TelemetryBatchInit();
+    TelemetryPolicyInit();
+    if (!WifiCreateEventQueues()) {
         SerialConsoleWriteString("ERROR Initializing Wifi Data queues!\r\n");
     }
 
@@ -928,9 +1370,13 @@ void vWifiTask(void *pvParameters)
 
     /* Initialize the MQTT service. */
     configure_mqtt();
+    MqttReconnectInit(&mqtt_inst, main_mqtt_broker);
 
     /* Initialize SD/MMC storage. */
     init_storage();
+    if (is_state_set(STORAGE_READY)) {
+        TelemetryJournalInit();
+    }
 
     /*Initialize BUTTON 0 as an external interrupt*/
     configure_extint_channel();
@@ -940,6 +1386,7 @@ void vWifiTask(void *pvParameters)
     memset((uint8_t *)&param, 0, sizeof(tstrWifiInitParam));
 
     nm_bsp_init();
+    nm_bsp_register_notify(WifiWincIrqNotify);
 
     /* Initialize Wi-Fi driver with data and status callbacks. */
     param.pfAppWifiCb = wifi_cb;
@@ -987,6 +1434,7 @@ void vWifiTask(void *pvParameters)
             }
 
             case (WIFI_DOWNLOAD_HANDLE): {
+                MQTT_HandleTransactions();
                 HTTP_DownloadFileTransaction();
                 break;
             }
@@ -996,35 +1444,190 @@ void vWifiTask(void *pvParameters)
                 break;
         }
 
-        // Check if a new state was called
-        uint8_t DataToReceive = 0;
-        if (pdPASS == xQueueReceive(xQueueWifiState, &DataToReceive, 0)) {
-            wifiStateMachine = DataToReceive;  // Update new state
+        // Sleep until a sample, a state change, a WINC interrupt or the next deadline
+        WifiWaitForEvents();
+    }
+    return;
+}
+
+/**
+ static bool WifiCreateEventQueues(void)
+ * @brief	Creates the Wifi task queues and the queue set the task blocks on
+ * @note	Queues can only join a set while empty, so the handles are made public
+ *			only after they are in the set; producers check them for NULL first.
+ * @return	false if anything could not be allocated
+*/
+static bool WifiCreateEventQueues(void)
+{
+    QueueHandle_t state = xQueueCreate(WIFI_STATE_QUEUE_LEN, sizeof(uint8_t));
+    QueueHandle_t imu = xQueueCreate(WIFI_IMU_QUEUE_LEN, sizeof(struct ImuDataPacket_float));
+    QueueHandle_t air = xQueueCreate(WIFI_AIR_QUEUE_LEN, sizeof(float));
+    QueueHandle_t bme = xQueueCreate(WIFI_BME_QUEUE_LEN, sizeof(struct bme68x_data));
+
+    xWincIrqSemaphore = xSemaphoreCreateBinary();
+    xWifiEventSet = xQueueCreateSet(WIFI_EVENT_SET_LEN);
+    if (state == NULL || imu == NULL || air == NULL || bme == NULL || xWincIrqSemaphore == NULL || xWifiEventSet == NULL) {
+        return false;
+    }
+
+    xQueueAddToSet(state, xWifiEventSet);
+    xQueueAddToSet(imu, xWifiEventSet);
+    xQueueAddToSet(air, xWifiEventSet);
+    xQueueAddToSet(bme, xWifiEventSet);
+    xQueueAddToSet(xWincIrqSemaphore, xWifiEventSet);
+
+    xQueueWifiState = state;
+    xQueueImuBuffer = imu;
+    xQueueAirBuffer = air;
+    xQueueBmeBuffer = bme;
+    return true;
+}
+
+/**
+ static void WifiWaitForEvents(void)
+ * @brief	Blocks on the event set, then handles everything that is ready without blocking again
+ * @note	Each set member is read exactly once per selection so the set stays in step
+ *			with the queues. In the init states the state machine has work of its
+ *			own, so this only collects what is already there.
+*/
+static void WifiWaitForEvents(void)
+{
+    bool mayBlock = (wifiStateMachine == WIFI_MQTT_HANDLE || wifiStateMachine == WIFI_DOWNLOAD_HANDLE);
+    TickType_t timeout = mayBlock ? WifiNextTimeout(xTaskGetTickCount()) : 0;
+    QueueSetMemberHandle_t member = xQueueSelectFromSet(xWifiEventSet, timeout);
+
+    while (member != NULL) {
+        if (member == xQueueImuBuffer) {
+            MQTT_HandleImuMessages();
+        } else if (member == xQueueBmeBuffer) {
+            MQTT_HandleBmeMessages();
+        } else if (member == xQueueAirBuffer) {
+            MQTT_HandleAirMessages();
+        } else if (member == xWincIrqSemaphore) {
+            // The events themselves are handled by m2m_wifi_handle_events() in the state machine
+            xSemaphoreTake(xWincIrqSemaphore, 0);
+        } else if (member == xQueueWifiState) {
+            uint8_t newState;
+            if (pdPASS == xQueueReceive(xQueueWifiState, &newState, 0)) {
+                wifiStateMachine = newState;
+            }
         }
+        member = xQueueSelectFromSet(xWifiEventSet, 0);
+    }
+}
+
+/**
+ static TickType_t WifiNextTimeout(TickType_t now)
+ * @brief	How long the Wifi task may sleep when nothing arrives
+ * @details	The batch deadline is exact. While PUBACKs are outstanding, a command runs or the
+ *			journal is replaying the task wakes often enough to read acks and pace the replay, and a
+ *			held download wakes it when its budget allows the next receive. Otherwise it
+ *			only wakes to read subscribed topics and keep the session alive.
+*/
+static TickType_t WifiNextTimeout(TickType_t now)
+{
+    TickType_t timeout = pdMS_TO_TICKS(WIFI_MQTT_POLL_MS);
+    TickType_t due = TelemetryBatchTicksUntilDue(now);
 
-        vTaskDelay(100);
+    if (mqtt_inst.isConnected) {
+        if (!MqttPipelineIsIdle() && timeout > pdMS_TO_TICKS(WIFI_ACK_POLL_MS)) {
+            timeout = pdMS_TO_TICKS(WIFI_ACK_POLL_MS);
+        }
+        if (!TelemetryJournalIsIdle() && timeout > pdMS_TO_TICKS(TELEMETRY_JOURNAL_REPLAY_MS)) {
+            timeout = pdMS_TO_TICKS(TELEMETRY_JOURNAL_REPLAY_MS);
+        }
+        // The command task does not wake this task, poll for its ack instead
+        if ((CommandDispatchBusy() || CommandDispatchAckPending()) && timeout > pdMS_TO_TICKS(WIFI_ACK_POLL_MS)) {
+            timeout = pdMS_TO_TICKS(WIFI_ACK_POLL_MS);
+        }
     }
-    return;
+    if (is_state_set(WIFI_CONNECTED)) {
+        TickType_t retry = MqttReconnectTicksUntilRetry(now);
+        if (retry < timeout) {
+            timeout = retry;
+        }
+    }
+    if (wifiStateMachine == WIFI_DOWNLOAD_HANDLE) {
+        TickType_t resume = HTTP_DownloadTicksUntilResume();
+        if (resume < timeout) {
+            timeout = resume;
+        }
+    }
+    return (due < timeout) ? due : timeout;
+}
+
+/**
+ static void WifiWincIrqNotify(void)
+ * @brief	Runs in the WINC interrupt after the driver's own handler, wakes the Wifi task
+*/
+static void WifiWincIrqNotify(void)
+{
+    BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+
+    if (xWincIrqSemaphore != NULL) {
+        xSemaphoreGiveFromISR(xWincIrqSemaphore, &xHigherPriorityTaskWoken);
+    }
+    portYIELD_FROM_ISR(xHigherPriorityTaskWoken);
 }
 
 void WifiHandlerSetState(uint8_t state)
 {
-    if (state <= WIFI_DOWNLOAD_HANDLE) {
+    if (state <= WIFI_DOWNLOAD_HANDLE && xQueueWifiState != NULL) {
+        if (state == WIFI_DOWNLOAD_INIT) {
+            // Set here so WifiDownloadInProgress() is true as soon as the request is queued
+            do_download_flag = true;
+        }
         xQueueSend(xQueueWifiState, &state, (TickType_t)10);
     }
 }
 
+/**
+ void WifiSetDownloadShare(uint8_t percent)
+ * @brief	Sets the share of WIFI_OTA_LINK_BPS the background download may use, 1 to 100 percent
+*/
+void WifiSetDownloadShare(uint8_t percent)
+{
+    if (percent < 1) {
+        percent = 1;
+    } else if (percent > 100) {
+        percent = 100;
+    }
+    download_share = percent;
+}
+
+/**
+ bool WifiDownloadInProgress(void)
+ * @brief	True from WifiHandlerSetState(WIFI_DOWNLOAD_INIT) until the download finished or failed
+*/
+bool WifiDownloadInProgress(void)
+{
+    return do_download_flag;
+}
+
+/**
+ bool WifiDownloadSucceeded(void)
+ * @brief	True once the last download completed, matched its manifest and the boot flag was written
+*/
+bool WifiDownloadSucceeded(void)
+{
+    return !do_download_flag && is_state_set(COMPLETED);
+}
+
 /**
  void WifiAddImuDataToQueue(struct ImuDataPacket* imuPacket)
  * @brief	Adds an IMU struct to the queue to send via MQTT
  * @param[in]
 
- * @return	Returns pdTrue if data can be added to queue, pdFalse if queue is full
+ * @return	Returns pdTrue if data can be added to queue, pdFalse if queue is full,
+ *			WIFI_QUEUE_NOT_READY if the Wifi task has not created the queue yet
  * @note
 
 */
 int WifiAddImuDataToQueue(struct ImuDataPacket_float *imuPacket)
 {
+    if (xQueueImuBuffer == NULL) {
+        return WIFI_QUEUE_NOT_READY;
+    }
     int error = xQueueSend(xQueueImuBuffer, imuPacket, (TickType_t)10);
     return error;
 }
@@ -1034,12 +1637,16 @@ int WifiAddImuDataToQueue(struct ImuDataPacket_float *imuPacket)
  * @brief	Adds an Air data to the queue to send via MQTT
  * @param[in]
 
- * @return	Returns pdTrue if data can be added to queue, pdFalse if queue is full
+ * @return	Returns pdTrue if data can be added to queue, pdFalse if queue is full,
+ *			WIFI_QUEUE_NOT_READY if the Wifi task has not created the queue yet
  * @note
 
 */
 int WifiAddAirDataToQueue(float *air_ms)
 {
+    if (xQueueAirBuffer == NULL) {
+        return WIFI_QUEUE_NOT_READY;
+    }
     int error = xQueueSend(xQueueAirBuffer, air_ms, (TickType_t)10);
     return error;
 }
@@ -1049,12 +1656,16 @@ int WifiAddAirDataToQueue(float *air_ms)
  * @brief	Adds an BME data to the queue to send via MQTT.
  * @param[in]
 
- * @return	Returns pdTrue if data can be added to queue, pdFalse if queue is full
+ * @return	Returns pdTrue if data can be added to queue, pdFalse if queue is full,
+ *			WIFI_QUEUE_NOT_READY if the Wifi task has not created the queue yet
  * @note
 
 */
 int WifiAddBmeDataToQueue(struct bme68x_data *bmePacket)
 {
+    if (xQueueBmeBuffer == NULL) {
+        return WIFI_QUEUE_NOT_READY;
+    }
     int error = xQueueSend(xQueueBmeBuffer, bmePacket, (TickType_t)10);
     return error;
 }
\ No newline at end of file
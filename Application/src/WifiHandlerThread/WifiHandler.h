@@ -35,12 +35,37 @@ extern "C" {
  ******************************************************************************/
 #define WIFI_MQTT_INIT 0        ///< State for Wifi handler to Initialize MQTT Connection
 #define WIFI_MQTT_HANDLE 1      ///< State for Wifi handler to Handle MQTT Connection
-#define WIFI_DOWNLOAD_INIT 2    ///< State for Wifi handler to Initialize Download Connection
-#define WIFI_DOWNLOAD_HANDLE 3  ///< State for Wifi handler to Handle Download Connection
+#define WIFI_DOWNLOAD_INIT 2    ///< State for Wifi handler to start the background download
+#define WIFI_DOWNLOAD_HANDLE 3  ///< State for Wifi handler to Handle MQTT while the download runs
 
 #define WIFI_TASK_SIZE 800     
+
+#define WIFI_STATE_QUEUE_LEN 5  ///< Pending state changes
+#define WIFI_IMU_QUEUE_LEN 5    ///< IMU samples waiting for the Wifi task
+#define WIFI_AIR_QUEUE_LEN 2    ///< Air velocity samples waiting for the Wifi task
+#define WIFI_BME_QUEUE_LEN 5    ///< Environmental samples waiting for the Wifi task
+/** Queue set length: every queue slot plus the WINC IRQ semaphore. */
+#define WIFI_EVENT_SET_LEN (WIFI_STATE_QUEUE_LEN + WIFI_IMU_QUEUE_LEN + WIFI_AIR_QUEUE_LEN + WIFI_BME_QUEUE_LEN + 1)
+#define WIFI_QUEUE_NOT_READY (-1)   ///< WifiAdd*DataToQueue() before the Wifi task created its queues
+
+#define WIFI_MQTT_YIELD_MS 10   ///< mqtt_yield() budget per pass, the WINC read spins for at least 10 ms
+#define WIFI_ACK_POLL_MS 20     ///< Wake interval while PUBACKs are outstanding
+#define WIFI_MQTT_POLL_MS 250   ///< Wake interval when idle, to read subscribed topics and keep the session alive
+#define WIFI_MQTT_KEEPALIVE_S 30    ///< MQTT keep alive, also the Paho command timeout; a dead link is noticed within two of these
 #define WIFI_PRIORITY (configMAX_PRIORITIES - 3)
 
+#define WIFI_OTA_LINK_BPS 65536     ///< Bytes/s the Wifi task plans with, the base of the download share
+#define WIFI_OTA_SHARE_PCT 50       ///< Default share of WIFI_OTA_LINK_BPS the background download may use
+#define WIFI_OTA_BURST_BYTES (2 * MAIN_BUFFER_MAX_SIZE)  ///< Download bytes that may go out back to back
+#define WIFI_OTA_SECTOR_SIZE 512    ///< SD sector, the download file is written in whole sectors
+#define WIFI_OTA_STAGE_SIZE (2 * WIFI_OTA_SECTOR_SIZE)  ///< Received data is collected to this size before each f_write
+#define WIFI_OTA_PROGRESS_BYTES (32 * 1024UL)  ///< Progress log step when the server sent no Content-Length
+#define WIFI_OTA_RESUME_FILE "0:ota.pos"    ///< Resume point of an unfinished download
+#define WIFI_OTA_FLAG_FILE "0:boot_flag.txt"    ///< Tells the bootloader a verified image is on the card, must match boot_file_name there
+#define WIFI_OTA_RESUME_MAGIC 0x4D534552    ///< "RESM"
+#define WIFI_OTA_CHECKPOINT_BYTES (16 * 1024UL)  ///< The resume point is saved after this many new bytes
+#define WIFI_OTA_MAX_RETRIES 5      ///< Reconnects without new data before the download gives up
+
 /** Wi-Fi AP Settings. */
 // Note: you can register your WiFi PCBAs with AirPennNet-Device and use the credentials below to connect to the Internet:
 // https://device.upenn.edu/
@@ -54,6 +79,13 @@ extern "C" {
 /** Content URI for download. */
 ///< Change me to the URL to download your OTAU binary file from!
 #define MAIN_HTTP_FILE_URL "http://172.178.45.14/Application.bin"
+/** Manifest with the length and CRC32 of the file above, fetched first. See OtaVerify.h. */
+#define MAIN_HTTP_MANIFEST_URL "http://172.178.45.14/Application.manifest"
+/** Delta patch against the running image, fetched instead of the file above when the manifest says "format patch". See Tools/DeltaPatch. */
+#define MAIN_HTTP_PATCH_URL "http://172.178.45.14/Application.patch"
+/** Names the two files get on the card, the bootloader reads them under these names. */
+#define MAIN_SD_FILE_NAME "0:Application.bin"
+#define MAIN_SD_PATCH_NAME "0:Application.patch"
 
 /** Maximum size for packet buffer. */
 #define MAIN_BUFFER_MAX_SIZE (512)
@@ -140,6 +172,16 @@ static const char main_mqtt_broker[] = "broker.hivemq.com";
 /******************************************************************************
  * Structures and Enumerations
  ******************************************************************************/
+/// Contents of WIFI_OTA_RESUME_FILE
+struct DownloadResume {
+    uint32_t magic;                     ///< WIFI_OTA_RESUME_MAGIC
+    uint32_t offset;                    ///< Bytes of the file that are safely on the card
+    uint32_t total;                     ///< Length of the complete file
+    char etag[HTTP_MAX_ETAG_LENGTH];    ///< Validator the server sent for the file, empty if none
+    uint32_t crc;                       ///< CRC32 of the first offset bytes, the digest continues from here
+    uint32_t image_crc;                 ///< Manifest CRC32 of the image the partial file belongs to
+    uint32_t check;                     ///< See DownloadResumeCheck()
+};
 
 /******************************************************************************
  * Global Function Declaration
@@ -147,6 +189,9 @@ static const char main_mqtt_broker[] = "broker.hivemq.com";
 void vWifiTask(void *pvParameters);
 void init_storage(void);
 void WifiHandlerSetState(uint8_t state);
+void WifiSetDownloadShare(uint8_t percent);
+bool WifiDownloadInProgress(void);
+bool WifiDownloadSucceeded(void);
 int WifiAddDistanceDataToQueue(uint16_t *distance);
 int WifiAddImuDataToQueue(struct ImuDataPacket_float *imuPacket);
 int WifiAddAirDataToQueue(float *air_ms);
@@ -205,9 +205,15 @@
 /* A header file that defines sync object types on the O/S, such as
 /  windows.h, ucos_ii.h and semphr.h, must be included prior to ff.h. */
 
-#define _FS_REENTRANT    0        /* 0:Disable or 1:Enable */
-#define _FS_TIMEOUT        1000    /* Timeout period in unit of time ticks */
-#define    _SYNC_t            HANDLE    /* O/S dependent type of sync object. e.g. HANDLE, OS_EVENT*, ID and etc.. */
+#include "FreeRTOS.h"
+#include "semphr.h"
+
+#define _FS_REENTRANT    1        /* 0:Disable or 1:Enable */
+#define _FS_TIMEOUT        5000    /* Timeout period in milliseconds, see ff_sync.c */
+#define    _SYNC_t            SemaphoreHandle_t    /* O/S dependent type of sync object. e.g. HANDLE, OS_EVENT*, ID and etc.. */
+/* The Wifi task (telemetry journal, downloads, boot profile) and the CLI task
+/  both use the card, so every FatFs call holds a FreeRTOS mutex for the volume,
+/  see fatfs-port-r0.09/ff_sync.c. The sector cache under diskio relies on it. */
 
 /* The _FS_REENTRANT option switches the reentrancy (thread safe) of the FatFs module.
 /
@@ -224,4 +230,17 @@
 
 #endif /* _FFCONFIG */
 
+/* Sector cache under diskio, see disk_cache.h in the FatFs port;
+   DISK_CACHE_LINES * DISK_CACHE_LINE_SECTORS * 512 bytes of RAM. The
+   telemetry journal moves between four sectors on every record (directory,
+   FAT, record and position file), so the lines are single sectors and there
+   is no read ahead. Download stages of two sectors go straight through as
+   one multiple block write. 0 lines turns the cache off. */
+#ifndef DISK_CACHE_LINES
+#define DISK_CACHE_LINES          4
+#endif
+#ifndef DISK_CACHE_LINE_SECTORS
+#define DISK_CACHE_LINE_SECTORS   1
+#endif
+
 #endif /* CONF_FATFS_H_INCLUDED */
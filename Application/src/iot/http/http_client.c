@@ -37,6 +37,7 @@
 #include "iot/stream_writer.h"
 #include <stdio.h>
 #include <errno.h>
+#include <stdlib.h>
 
 #define DEFAULT_USER_AGENT "atmel/1.0.2"
 
@@ -322,8 +323,12 @@ void http_client_socket_event_handler(SOCKET sock, uint8_t msg_type, void *msg_d
 			/* Socket was occurred errors. Close this session. */
 			_http_client_clear_conn(module, _hwerr_to_stderr(msg_recv->s16BufferSize));
 		}
-		/* COntinue to receive the packet. */
-		_http_client_recv_packet(module);
+		/* COntinue to receive the packet, unless the application holds the transfer back. */
+		if (module->recv_hold) {
+			module->recv_pending = 1;
+		} else {
+			_http_client_recv_packet(module);
+		}
 		break;
 	case SOCKET_MSG_SEND:
 		send_ret = *(int16_t*)msg_data;
@@ -530,6 +535,22 @@ int http_client_close(struct http_client_module *const module)
 	return 0;
 }
 
+void http_client_hold_recv(struct http_client_module *const module, uint8_t hold)
+{
+	if (module == NULL) {
+		return;
+	}
+
+	module->recv_hold = hold;
+	if (!hold && module->recv_pending) {
+		module->recv_pending = 0;
+		/* The session may have been closed while the receive was held. */
+		if (module->req.state >= STATE_SOCK_CONNECTED) {
+			_http_client_recv_packet(module);
+		}
+	}
+}
+
 void _http_client_clear_conn(struct http_client_module *const module, int reason)
 {
 	union http_client_data data;
@@ -552,6 +573,7 @@ void _http_client_clear_conn(struct http_client_module *const module, int reason
 
 	module->sending = 0;
 	module->permanent = 0;
+	module->recv_pending = 0;
 	data.disconnected.reason = reason;
 	if (module->cb) {
 		module->cb(module, HTTP_CLIENT_CALLBACK_DISCONNECTED, &data);
@@ -834,6 +856,9 @@ int _http_client_handle_header(struct http_client_module *const module)
 			/* Check validation first. */
 			if (module->cb && module->resp.response_code) {
 				/* Chunked transfer */
+				data.recv_response.etag = module->resp.etag;
+				data.recv_response.range_start = module->resp.range_start;
+				data.recv_response.range_total = module->resp.range_total;
 				if (module->resp.content_length < 0) {
 					data.recv_response.response_code = module->resp.response_code;
 					data.recv_response.is_chunked = 1;
@@ -843,6 +868,7 @@ int _http_client_handle_header(struct http_client_module *const module)
 				} else if (module->resp.content_length > (int)module->config.recv_buffer_size) {
 					/* Entity is bigger than receive buffer. Sending the buffer to user like chunked transfer. */
 					data.recv_response.response_code = module->resp.response_code;
+					data.recv_response.is_chunked = 0;
 					data.recv_response.content_length = module->resp.content_length;
 					data.recv_response.content = NULL;
 					module->resp.read_length = 0;
@@ -854,6 +880,21 @@ int _http_client_handle_header(struct http_client_module *const module)
 			return 1;
 		} else if (!strncmp(ptr, "Content-Length: ", strlen("Content-Length: "))) {
 			module->resp.content_length = atoi(ptr + strlen("Content-Length: "));
+		} else if (!strncmp(ptr, "ETag: ", strlen("ETag: "))) {
+			char *value = ptr + strlen("ETag: ");
+			int len = ptr_line_end - value;
+			if (len > 0 && len < HTTP_MAX_ETAG_LENGTH) {
+				memcpy(module->resp.etag, value, len);
+				module->resp.etag[len] = '\0';
+			}
+		} else if (!strncmp(ptr, "Content-Range: bytes ", strlen("Content-Range: bytes "))) {
+			/* Content-Range: bytes {First}-{Last}/{Complete length or *} */
+			char *value = ptr + strlen("Content-Range: bytes ");
+			module->resp.range_start = strtoul(value, NULL, 10);
+			for (; value < ptr_line_end && *value != '/'; value++);
+			if (value < ptr_line_end && value[1] != '*') {
+				module->resp.range_total = strtoul(value + 1, NULL, 10);
+			}
 		} else if (!strncmp(ptr, "Transfer-Encoding: ", strlen("Transfer-Encoding: "))) {
 			/* Currently does not support gzip or deflate encoding. If received this header, disconnect session immediately*/
 			char *type_ptr = ptr + strlen("Transfer-Encoding: ");
@@ -885,6 +926,9 @@ int _http_client_handle_header(struct http_client_module *const module)
 			module->resp.response_code = atoi(ptr + 9); /* HTTP/{Ver} {Code} {Desc} : HTTP/1.1 200 OK */
 			/* Initializing the variables */
 			module->resp.content_length = 0;
+			module->resp.etag[0] = '\0';
+			module->resp.range_start = 0;
+			module->resp.range_total = 0;
 			/* persistent connection is turn on in the HTTP 1.1 or above version of protocols. */  
 			if (ptr [5] > '1' || ptr[7] > '0') {
 				module->permanent = 1;
@@ -989,6 +1033,9 @@ int _http_client_handle_entity(struct http_client_module *const module)
 				data.recv_response.is_chunked = 0;
 				data.recv_response.content_length = module->resp.content_length;
 				data.recv_response.content = buffer;
+				data.recv_response.etag = module->resp.etag;
+				data.recv_response.range_start = module->resp.range_start;
+				data.recv_response.range_total = module->resp.range_total;
 				module->cb(module, HTTP_CLIENT_CALLBACK_RECV_RESPONSE, &data);
 			}
 			module->resp.state = STATE_PARSE_HEADER;
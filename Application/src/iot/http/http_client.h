@@ -63,6 +63,8 @@ extern "C" {
 #define HTTP_PROTO_NAME               "HTTP/1.1"
 /** Max size of URI. */
 #define HTTP_MAX_URI_LENGTH           64
+/** Max size of the ETag response header value, quotes included. */
+#define HTTP_MAX_ETAG_LENGTH          48
 
 /**
  * \brief A type of HTTP method.
@@ -153,6 +155,12 @@ struct http_client_data_recv_response {
 	 * In this situation, Data will be transmitted through HTTP_CLIENT_CALLBACK_RECV_CHUNKED_DATA callback.
 	 */
 	char *content;
+	/** ETag header of the response, empty string if there was none. */
+	const char *etag;
+	/** First byte of a 206 Partial Content response (Content-Range header). */
+	uint32_t range_start;
+	/** Complete length of the resource in the Content-Range header, 0 if unknown. */
+	uint32_t range_total;
 };
 
 /**
@@ -307,6 +315,12 @@ struct http_client_resp {
 	int read_length;
 	/** Response code of this response. */
 	uint16_t response_code;
+	/** ETag header of this response. */
+	char etag[HTTP_MAX_ETAG_LENGTH];
+	/** First byte position of the Content-Range header. */
+	uint32_t range_start;
+	/** Complete length of the Content-Range header. */
+	uint32_t range_total;
 };
 
 /**
@@ -324,6 +338,10 @@ struct http_client_module {
 	uint8_t permanent       : 1;
 	/** A flag for the receive buffer located in the heap. */
 	uint8_t alloc_buffer    : 1;
+	/** A flag that the application holds the next receive back. */
+	uint8_t recv_hold       : 1;
+	/** A flag that a receive was held back and is posted on release. */
+	uint8_t recv_pending    : 1;
 
 	/** Size that received. */
 	uint32_t recved_size;
@@ -524,6 +542,18 @@ int http_client_send_request(struct http_client_module *const module, const char
  */
 int http_client_close(struct http_client_module *const module);
 
+/**
+ * \brief Hold back or release the receiving of the response.
+ *
+ * While held, the next receive is not posted after a packet was handled, so the
+ * data stays in the network controller and TCP flow control slows the server down.
+ * Releasing posts the held receive. Used to pace a download next to other sockets.
+ *
+ * \param[in]  module_inst     Instance of HTTP client module.
+ * \param[in]  hold            1 to hold, 0 to release.
+ */
+void http_client_hold_recv(struct http_client_module *const module, uint8_t hold);
+
 
 #ifdef __cplusplus
 }
@@ -20,6 +20,9 @@
 #include "IMU\lsm6dso_reg.h"
 #include "SerialConsole.h"
 #include "WifiHandlerThread/WifiHandler.h"
+#include "WifiHandlerThread/CommandDispatch.h"
+#include "WifiHandlerThread/OtaBoot.h"
+#include "SerialConsole/FastFormat.h"
 #include "asf.h"
 #include "driver/include/m2m_wifi.h"
 #include "I2cDriver\I2cDriver.h"
@@ -60,6 +63,7 @@ void vApplicationTickHook(void);
 static TaskHandle_t cliTaskHandle = NULL;      //!< CLI task handle
 static TaskHandle_t daemonTaskHandle = NULL;   //!< Daemon task handle
 static TaskHandle_t wifiTaskHandle = NULL;     //!< Wifi task handle
+static TaskHandle_t commandTaskHandle = NULL;  //!< MQTT command task handle
 
 static TaskHandle_t accelTaskHandle = NULL;    //!< Accelerometer task handle
 static TaskHandle_t airTaskHandle = NULL;      //!< Air Velocity task handle
@@ -103,6 +107,9 @@ void app_gpio_config(void)
  */
 int main(void)
 {
+    /* Read the bootloader's SysTick count before the clocks change. */
+    OtaBootCaptureTime();
+
     /* Initialize the board. */
     system_init();
 
@@ -133,6 +140,12 @@ void vApplicationDaemonTaskStartupHook(void)
 	int result;
 	
     SerialConsoleWriteString("\r\n\r\n----- Wind Cheaters: V1 -----\r\n");
+    if (OtaBootGetTimeUs() != 0) {
+        FmtPrintf(bufferPrint, sizeof(bufferPrint), "Bootloader to application: %lu us\r\n", (unsigned long)OtaBootGetTimeUs());
+    } else {
+        FmtPrintf(bufferPrint, sizeof(bufferPrint), "Bootloader to application: not timed (update boot)\r\n");
+    }
+    SerialConsoleWriteString(bufferPrint);
 
     // Initialize HW that needs FreeRTOS Initialization
     SerialConsoleWriteString("\r\n\r\nInitialize HW...\r\n");
@@ -176,6 +189,26 @@ void vApplicationDaemonTaskStartupHook(void)
 
     StartTasks();
 
+    // Everything is up: confirm the boot before the bootloader's watchdog rolls a new image back
+    struct OtaBootState bootState;
+    if (OtaBootGetState(&bootState)) {
+        bool onTrial = (bootState.trial == OTA_BOOT_TRIAL_PENDING);
+        if (!OtaBootConfirm()) {
+            SerialConsoleWriteString("ERR: Could not confirm the boot!\r\n");
+        } else if (onTrial) {
+            FmtPrintf(bufferPrint, sizeof(bufferPrint), "Image %lu confirmed on trial boot %lu\r\n", (unsigned long)bootState.generation,
+                      (unsigned long)bootState.trialBoots);
+            SerialConsoleWriteString(bufferPrint);
+        }
+        OtaBootGetState(&bootState);
+        FmtPrintf(bufferPrint, sizeof(bufferPrint), "Installs %lu, rollbacks %lu, WDT resets %lu\r\n", (unsigned long)bootState.installs,
+                  (unsigned long)bootState.rollbacks, (unsigned long)bootState.watchdogResets);
+        SerialConsoleWriteString(bufferPrint);
+        FmtPrintf(bufferPrint, sizeof(bufferPrint), "Last confirm %lu ms, last rollback %lu ms\r\n", (unsigned long)bootState.confirmMs,
+                  (unsigned long)bootState.rollbackMs);
+        SerialConsoleWriteString(bufferPrint);
+    }
+
     vTaskSuspend(daemonTaskHandle);
 }
 
@@ -199,6 +232,10 @@ static void StartTasks(void)
     if (xTaskCreate(vWifiTask, "WIFI_TASK", WIFI_TASK_SIZE, NULL, WIFI_PRIORITY, &wifiTaskHandle) != pdPASS) {
         SerialConsoleWriteString("ERR: WIFI task could not be initialized!\r\n");
     }
+
+    if (xTaskCreate(vCommandTask, "CMD_TASK", COMMAND_TASK_SIZE, NULL, COMMAND_PRIORITY, &commandTaskHandle) != pdPASS) {
+        SerialConsoleWriteString("ERR: Command task could not be initialized!\r\n");
+    }
 	
 	if (xTaskCreate(vImuTask, "ACCEL_TASK", IMU_TASK_SIZE, NULL, AIR_TASK_PRIORITY, &accelTaskHandle) != pdPASS) {
 		SerialConsoleWriteString("ERR: IMU task could not be initialized!\r\n");
@@ -0,0 +1,80 @@
+/**
+ * \file
+ *
+ * \brief Sector cache between the FatFs disk I/O port and the memory driver.
+ *
+ * FatFs built with _FS_TINY keeps a single sector window, so every move
+ * between a file, its directory entry and the FAT goes back to the card,
+ * one sector and one command at a time. This cache keeps DISK_CACHE_LINES
+ * lines of up to DISK_CACHE_LINE_SECTORS consecutive sectors:
+ *
+ * - A read miss fills a line with one multi block transfer. When the read
+ *   carries on where the last one ended the whole line is read ahead,
+ *   otherwise only the sectors asked for.
+ * - Writes stay in the lines and a sector written right after the end of a
+ *   line is appended to it, so sequential writes go out as one multi block
+ *   transfer. Dirty lines are written back when they are evicted and on
+ *   disk_cache_sync(), which disk_ioctl(CTRL_SYNC) calls: f_sync(),
+ *   f_close(), f_unlink() and f_rename() all end there. Lines go back in
+ *   the order they were last written, so the FAT still reaches the card
+ *   before the directory entry that points into it.
+ * - A run of more than DISK_CACHE_LINE_SECTORS uncached sectors goes
+ *   straight between the caller's buffer and the card.
+ *
+ * RAM is DISK_CACHE_LINES * DISK_CACHE_LINE_SECTORS * 512 bytes, set in
+ * conf_fatfs.h. With DISK_CACHE_LINES 0 every request goes straight through.
+ *
+ * Data not yet written back is lost on a reset, as it would be in the
+ * FatFs window; only what was synced is on the card.
+ *
+ * The lines have no lock of their own. FatFs calls the cache with the
+ * volume held, so with more than one task using the card FatFs has to be
+ * built with _FS_REENTRANT, as the application is.
+ */
+
+#ifndef _DISK_CACHE_H_
+#define _DISK_CACHE_H_
+
+#include <stdint.h>
+#include "diskio.h"
+#include "conf_fatfs.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef DISK_CACHE_LINES
+# define DISK_CACHE_LINES         0
+#endif
+#ifndef DISK_CACHE_LINE_SECTORS
+# define DISK_CACHE_LINE_SECTORS  1
+#endif
+
+/** Counters since disk_cache_init() or disk_cache_clear_stats(), in sectors unless noted */
+struct disk_cache_stats {
+	uint32_t reads;          /**< Sectors FatFs read */
+	uint32_t read_hits;      /**< Of those, served from a line */
+	uint32_t writes;         /**< Sectors FatFs wrote */
+	uint32_t write_hits;     /**< Of those, written over a sector still waiting in a line */
+	uint32_t media_reads;    /**< Read transfers sent to the card */
+	uint32_t media_read_sectors;
+	uint32_t media_writes;   /**< Write transfers sent to the card */
+	uint32_t media_write_sectors;
+};
+
+void disk_cache_init(BYTE drv, DWORD sector_count);
+DRESULT disk_cache_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count);
+DRESULT disk_cache_write(BYTE drv, BYTE const *buff, DWORD sector, BYTE count);
+DRESULT disk_cache_sync(BYTE drv);
+void disk_cache_get_stats(struct disk_cache_stats *stats);
+void disk_cache_clear_stats(void);
+
+/* Provided by the port: one transfer of count consecutive sectors. */
+DRESULT disk_media_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count);
+DRESULT disk_media_write(BYTE drv, BYTE const *buff, DWORD sector, BYTE count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DISK_CACHE_H_ */
@@ -40,7 +40,9 @@ extern "C" {
 
 #include "compiler.h"
 #include "diskio.h"
+#include "disk_cache.h"
 #include "ctrl_access.h"
+#include "sd_mmc.h"
 
 #include <string.h>
 #include <stdio.h>
@@ -148,6 +150,13 @@ DSTATUS disk_initialize(BYTE drv)
 		return STA_PROTECT;
 	}
 
+	/* A new mount, or a new card: nothing cached is valid any more */
+	uint32_t ul_last_sector_num;
+	if (mem_read_capacity(drv, &ul_last_sector_num) != CTRL_GOOD) {
+		return STA_NOINIT;
+	}
+	disk_cache_init(drv, ul_last_sector_num + 1);
+
 	/* The memory should already be initialized */
 	return 0;
 }
@@ -186,7 +195,6 @@ DRESULT disk_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count)
 {
 #if ACCESS_MEM_TO_RAM
 	uint8_t uc_sector_size = mem_sector_size(drv);
-	uint32_t i;
 	uint32_t ul_last_sector_num;
 
 	if (uc_sector_size == 0) {
@@ -200,6 +208,40 @@ DRESULT disk_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count)
 		return RES_PARERR;
 	}
 
+	return disk_cache_read(drv, buff, sector, count);
+
+#else
+	return RES_ERROR;
+#endif
+}
+
+/**
+ * \brief  Read consecutive sectors from the memory in one transfer.
+ * Called by the sector cache, see disk_cache.h. The SD card gets a single
+ * multiple block read (CMD18) rather than a CMD17 per sector.
+ * \param drv Physical drive number (0..).
+ * \param buff Data buffer to store read data.
+ * \param sector Sector address (LBA).
+ * \param count Number of sectors to read (1..255).
+ * \return RES_OK for success, otherwise DRESULT error code.
+ */
+DRESULT disk_media_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count)
+{
+#if ACCESS_MEM_TO_RAM
+	uint8_t uc_sector_size = mem_sector_size(drv);
+	uint32_t i;
+
+#ifdef LUN_ID_SD_MMC_0_MEM
+	if (drv == LUN_ID_SD_MMC_0_MEM && uc_sector_size == SECTOR_SIZE_512) {
+		if (sd_mmc_init_read_blocks(0, sector, count) != SD_MMC_OK ||
+				sd_mmc_start_read_blocks(buff, count) != SD_MMC_OK ||
+				sd_mmc_wait_end_of_read_blocks(false) != SD_MMC_OK) {
+			return RES_ERROR;
+		}
+		return RES_OK;
+	}
+#endif
+
 	/* Read the data */
 	for (i = 0; i < count; i++) {
 		if (memory_2_ram(drv, sector + uc_sector_size * i,
@@ -236,7 +278,6 @@ DRESULT disk_write(BYTE drv, BYTE const *buff, DWORD sector, BYTE count)
 {
 #if ACCESS_MEM_TO_RAM
 	uint8_t uc_sector_size = mem_sector_size(drv);
-	uint32_t i;
 	uint32_t ul_last_sector_num;
 
 	if (uc_sector_size == 0) {
@@ -250,6 +291,40 @@ DRESULT disk_write(BYTE drv, BYTE const *buff, DWORD sector, BYTE count)
 		return RES_PARERR;
 	}
 
+	return disk_cache_write(drv, buff, sector, count);
+
+#else
+	return RES_ERROR;
+#endif
+}
+
+/**
+ * \brief  Write consecutive sectors to the memory in one transfer.
+ * Called by the sector cache, see disk_cache.h. The SD card gets a single
+ * multiple block write (CMD25) rather than a CMD24 per sector.
+ * \param drv Physical drive number (0..).
+ * \param buff Data to be written.
+ * \param sector Sector address (LBA).
+ * \param count Number of sectors to write (1..255).
+ * \return RES_OK for success, otherwise DRESULT error code.
+ */
+DRESULT disk_media_write(BYTE drv, BYTE const *buff, DWORD sector, BYTE count)
+{
+#if ACCESS_MEM_TO_RAM
+	uint8_t uc_sector_size = mem_sector_size(drv);
+	uint32_t i;
+
+#ifdef LUN_ID_SD_MMC_0_MEM
+	if (drv == LUN_ID_SD_MMC_0_MEM && uc_sector_size == SECTOR_SIZE_512) {
+		if (sd_mmc_init_write_blocks(0, sector, count) != SD_MMC_OK ||
+				sd_mmc_start_write_blocks(buff, count) != SD_MMC_OK ||
+				sd_mmc_wait_end_of_write_blocks(false) != SD_MMC_OK) {
+			return RES_ERROR;
+		}
+		return RES_OK;
+	}
+#endif
+
 	/* Write the data */
 	for (i = 0; i < count; i++) {
 		if (ram_2_memory(drv, sector + uc_sector_size * i,
@@ -338,7 +413,9 @@ DRESULT disk_ioctl(BYTE drv, BYTE ctrl, void *buff)
 
 	/* Make sure that data has been written */
 	case CTRL_SYNC:
-		if (mem_test_unit_ready(drv) == CTRL_GOOD) {
+		if (disk_cache_sync(drv) != RES_OK) {
+			res = RES_ERROR;
+		} else if (mem_test_unit_ready(drv) == CTRL_GOOD) {
 			res = RES_OK;
 		} else {
 			res = RES_NOTRDY;
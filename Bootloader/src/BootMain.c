@@ -13,6 +13,7 @@
 ******************************************************************************/
 #include <asf.h>
 #include "conf_example.h"
+#include <stdio.h>
 #include <string.h>
 #include "sd_mmc_spi.h"
 
@@ -20,16 +21,15 @@
 #include "Systick/Systick.h"
 #include "SerialConsole/SerialConsole.h"
 #include "ASF/sam0/drivers/dsu/crc32/crc32.h"
+#include "BootUpdate/BootUpdate.h"
+#include "BootProfile/BootProfile.h"
+#include "ASF/thirdparty/fatfs/fatfs-port-r0.09/disk_cache.h"
 
 /******************************************************************************
 * Defines
 ******************************************************************************/
-#define APP_START_ADDRESS  ((uint32_t)0x12000) ///<Start of main application. Must be address of start of main application
-#define APP_START_RESET_VEC_ADDRESS (APP_START_ADDRESS+(uint32_t)0x04) ///< Main application reset vector address
 //#define MEM_EXAMPLE 1 //COMMENT ME TO REMOVE THE MEMORY WRITE EXAMPLE BELOW
-#define NVM_ROW_FACTOR              256
-#define NVM_PAGE_FACTOR             64
-#define NVM_WRITE_PER_ROW           4
+#define DSU_ERRATA_REG              (*((volatile unsigned int*) 0x41007058)) ///< Touched around every DSU CRC of a RAM source, see SAM D21 errata 1.8.3
 
 /******************************************************************************
 * Structures and Enumerations
@@ -43,6 +43,15 @@ struct usart_module cdc_uart_module;
 static void jumpToApplication(void);
 static bool StartFilesystemAndTest(void);
 static void configure_nvm(void);
+static const uint8_t *BootFlash(uint32_t address);
+static bool BootEraseRow(uint32_t address);
+static bool BootWritePage(uint32_t address, const uint8_t *data);
+static uint32_t BootCrc32(uint32_t crc, const uint8_t *data, uint32_t len);
+static void BootTimerStart(void);
+static uint32_t BootTimerMs(void);
+static void BootTimerStop(void);
+static void BootPrint(const char *text);
+static void BootStartWatchdog(void);
 
 /******************************************************************************
 * Global Variables
@@ -57,104 +66,15 @@ FATFS fs; //Holds the File System of the SD CARD
 FIL file_object; //FILE OBJECT used on main for the SD Card Test
 FIL file_object_boot; //FILE OBJECT used for rest Test B flags
 
-char boot_file_name[] ="0:boot_flag.txt";
-char boot_bin_file[] = "0:Application.bin";
+static struct BootState bootState;	///<Trial state and boot counters, see BootState/BootState.h
+static uint32_t bootTimerStart;	///<Tick of the last BootTimerStart()
 
-/******************************************************************************/
-
-/**************************************************************************//**
-* @fn		nvm_update
-* @brief	The function takes input as memory offset and bytes to read, and
-*           reads the specified bytes from the SDcard and writes it into the
-*           nvm memory.
-* @param    row_no - row number where the data would be written.
-* @param    bytes_to_read - number of bytes to be read from the SDcard.
-* @return	Unused (ANSI-C compatibility).
-* @note
-*****************************************************************************/
-FRESULT nvm_update(uint32_t row_no, uint32_t bytes_to_read)
-{
-	uint8_t readBuffer[256]; //Buffer the size of one row
-	int numBytesRead = 0;
-	int numberBytesTotal = 0;
-
-	enum status_code nvmError = nvm_erase_row(APP_START_ADDRESS + (row_no)*NVM_ROW_FACTOR);
-	if(nvmError != STATUS_OK)
-	{
-		SerialConsoleWriteString("Erase error");
-		goto error_exit;
-	}
-
-	//Make sure it got erased - we read the page. Erasure in NVM is an 0xFF
-	for(int iter = 0; iter < NVM_ROW_FACTOR; iter++)
-	{
-		char *a = (char *)(APP_START_ADDRESS + row_no*NVM_ROW_FACTOR + iter); //Pointer pointing to address APP_START_ADDRESS
-		if(*a != 0xFF)
-		{
-			SerialConsoleWriteString("Error - test page is not erased!");
-			break;
-		}
-	}
-
-	res = f_read(&file_object, readBuffer, bytes_to_read, &numBytesRead);
-	if (res != FR_OK)
-	{
-		SerialConsoleWriteString("Couldn't read from!\r\n");
-		goto error_exit;
-	}
-
-	//Write data to first row. Writes are per page, so we need four writes to write a complete row
-	numberBytesTotal += numBytesRead;
-
-	for (int i = 0; i < NVM_ROW_FACTOR/NVM_PAGE_FACTOR; i++ ) {
-		res = nvm_write_buffer (APP_START_ADDRESS + (row_no * NVM_ROW_FACTOR) + (i * NVM_PAGE_FACTOR),
-		&readBuffer[i*NVM_PAGE_FACTOR], NVM_PAGE_FACTOR);
-		if (res != FR_OK)
-		{
-			SerialConsoleWriteString("Couldn't write in the NVM memory!\r\n");
-			goto error_exit;
-		}
-	}
-
-	//Check out the NVM API at http://asf.atmel.com/docs/latest/samd21/html/group__asfdoc__sam0__nvm__group.html#asfdoc_sam0_nvm_examples . It provides important information too!
-	//We will ask the NVM driver for information on the MCU (SAMD21)
-	struct nvm_parameters parameters;
-	char helpStr[64]; //Used to help print values
-	nvm_get_parameters (&parameters); //Get NVM parameters
-
-	////CRC32 Calculation example: Please read http://asf.atmel.com/docs/latest/samd21/html/group__asfdoc__sam0__drivers__crc32__group.html
-	snprintf(helpStr, 63,"NVM Info: Number of Pages %d. Size of a page: %d bytes. \r\n", parameters.nvm_number_of_pages, parameters.page_size);
-	SerialConsoleWriteString(helpStr);
-
-	//ERRATA Part 1 - To be done before RAM CRC
-	//CRC of SD Card. Errata 1.8.3 determines we should run this code every time we do CRC32 from a RAM source.
-	// See http://ww1.microchip.com/downloads/en/DeviceDoc/SAM-D21-Family-Silicon-Errata-and-DataSheet-Clarification-DS80000760D.pdf Section 1.8.3
-	uint32_t resultCrcSd = 0;
-	*((volatile unsigned int*) 0x41007058) &= ~0x30000UL;
-
-	//CRC of SD Card
-	//Instructor note: Was it the third parameter used for? Please check how you can use the third parameter to do the CRC of a long data stream in chunks - you will need it!
-	enum status_code crcres = dsu_crc32_cal	(readBuffer	,256, &resultCrcSd);
-
-	//Errata Part 2 - To be done after RAM CRC
-	*((volatile unsigned int*) 0x41007058) |= 0x20000UL;
-
-	//CRC of memory (NVM)
-	uint32_t resultCrcNvm = 0;
-	crcres |= dsu_crc32_cal	(APP_START_ADDRESS	,256, &resultCrcNvm);
-
-	if (crcres != STATUS_OK)
-	{
-		SerialConsoleWriteString("Could not calculate CRC!!\r\n");
-	} else {
-		snprintf(helpStr, 63,"CRC SD CARD: %d  CRC NVM: %d \r\n", resultCrcSd, resultCrcNvm);
-		SerialConsoleWriteString(helpStr);
-	}
-
-	error_exit:
-	return res;
-}
+///< The SAMD21 under the update engine, see BootUpdate/BootPlatform.h
+static const struct BootPlatform bootPlatform = {
+	BootFlash, BootEraseRow, BootWritePage, BootCrc32, BootTimerStart, BootTimerMs, BootTimerStop, BootPrint
+};
 
+/******************************************************************************/
 
 /******************************************************************************
 * Global Functions
@@ -171,9 +91,30 @@ FRESULT nvm_update(uint32_t row_no, uint32_t bytes_to_read)
 int main(void)
 {
 
+/*0.) FAST PATH: NO UPDATE REQUESTED, JUMP BEFORE ANY INITIALIZATION*/
+//SysTick counts down at the reset clock from here. On the fast path it is left running and the application
+//reads it back first thing to report the boot time, see OtaBoot.h in the application.
+SysTick->CTRL = 0;
+SysTick->LOAD = SysTick_LOAD_RELOAD_Msk;
+SysTick->VAL = 0;
+SysTick->CTRL = SysTick_CTRL_CLKSOURCE_Msk | SysTick_CTRL_ENABLE_Msk;
+
+BootStateRead(&bootPlatform, &bootState);
+if (BootUpdateFastPath(&bootPlatform, &bootState)) {
+	configure_nvm();
+	if (BootStateArmTrial(&bootPlatform, &bootState, (PM->RCAUSE.reg & PM_RCAUSE_WDT) != 0)) {
+		BootStartWatchdog();
+	}
+	jumpToApplication();
+}
+SysTick->CTRL = 0;
+
 /*1.) INIT SYSTEM PERIPHERALS INITIALIZATION*/
 system_init();
 delay_init();
+//Millisecond tick from here to the jump, for SD_CARD_TIMEOUT, the update engine and the boot profile
+InitSystick();
+BootProfileStart();
 InitializeSerialConsole();
 system_interrupt_enable_global();
 /* Initialize SD MMC stack */
@@ -187,6 +128,7 @@ cpu_irq_enable();
 
 //Configure CRC32
 dsu_crc32_init();
+BootProfileMark(BOOT_PHASE_PERIPHERALS);
 
 SerialConsoleWriteString("ESE516 - ENTER BOOTLOADER");	//Order to add string to TX Buffer
 
@@ -210,56 +152,26 @@ SerialConsoleWriteString("ESE516 - ENTER BOOTLOADER");	//Order to add string to
 	/*END SIMPLE SD CARD MOUNTING AND TEST!*/
 	
 	/*3.) STARTS BOOTLOADER HERE!*/
-	uint8_t readBuffer[256]; //Buffer the size of one row
-
-	//resA = f_open(&file_object_A, (char const *)testA_file_name, FA_READ);
-	//boot_res = f_open(&file_object_boot, (char const *)boot_file_name, FA_READ);
-	//
-	//// Checking if the the flag txt files are present.
-	//resA = f_open(&file_object_A, (char const *)testA_file_name, FA_READ);
-	boot_res = f_open(&file_object_boot, (char const *)boot_file_name, FA_READ);
-
-	if (boot_res == FR_OK) {
-		f_unlink(boot_file_name);
-		SerialConsoleWriteString("Found boot flag !\r\n Now Updating firmware \r\n");
+	//Installs, resumes or rolls back, see BootUpdate/BootUpdate.h. Never start a half written application.
+	enum BootUpdateResult bootResult = BootUpdateRun(&bootPlatform, &bootState);
+	BootProfileMark(BOOT_PHASE_UPDATE);
+	if (!BootProfileSave(bootState.generation, bootResult)) {
+		SerialConsoleWriteString("Could not save the boot profile\r\n");
 	}
-
-	//// We flash file only if it was download properly.
-	if (boot_res == FR_OK) {
-		boot_bin_file[0] = LUN_ID_SD_MMC_0_MEM + '0';
-		if(f_open(&file_object, (char const *)boot_bin_file, FA_READ) != FR_OK) {
-			SerialConsoleWriteString("Couldn't find the file !\r\n");
-			goto exit_boot;
-		}
-		
-		// Calculating the multiple of read/write for the files.
-		int loop_factor = file_object.fsize / 256;
-		int remaining_data = file_object.fsize % 256;
-		
-		for(int iter = 0; iter < loop_factor; iter++)
-		{
-			res = nvm_update(iter, NVM_ROW_FACTOR);
-		}
-		
-		if (remaining_data) {
-			res = nvm_update(loop_factor, NVM_ROW_FACTOR);
-		}
-
-		if (res != FR_OK)
-		{
-			SerialConsoleWriteString("Test write to NVM failed!\r\n");
-		} else {
-			SerialConsoleWriteString("Test write to NVM succeeded!\r\n");
-		}
-		
-		SerialConsoleWriteString("Update Complete! \r\n");
+	//Sector cache counters since the card was mounted, see conf_fatfs.h
+	struct disk_cache_stats cacheStats;
+	char cacheStr[80];
+	disk_cache_get_stats(&cacheStats);
+	snprintf(cacheStr, sizeof(cacheStr), "SD cache: %lu of %lu sector reads hit, %lu read and %lu write transfers\r\n",
+			 (unsigned long)cacheStats.read_hits, (unsigned long)cacheStats.reads,
+			 (unsigned long)cacheStats.media_reads, (unsigned long)cacheStats.media_writes);
+	SerialConsoleWriteString(cacheStr);
+	if (bootResult != BOOT_UPDATE_START) {
+		SerialConsoleWriteString("System will restart in 5 seconds...\r\n");
+		delay_cycles_ms(5000);
+		system_reset();
 	}
-
 	/*END BOOTLOADER HERE!*/
-
-exit_boot:
-	f_unlink(boot_file_name);
-	f_unlink(boot_bin_file);
 	
 	//4.) DEINITIALIZE HW AND JUMP TO MAIN APPLICATION!
 	SerialConsoleWriteString("ESE516 - EXIT BOOTLOADER\r\n");	//Order to add string to TX Buffer
@@ -268,8 +180,12 @@ exit_boot:
 	//Deinitialize HW - deinitialize started HW here!
 	DeinitializeSerialConsole(); //Deinitializes UART
 	sd_mmc_deinit(); //Deinitialize SD CARD
+	SysTick->CTRL = 0; //Used by the delay driver, the application only reads it after a fast path boot
 
 	//Jump to application
+	if (BootStateArmTrial(&bootPlatform, &bootState, (PM->RCAUSE.reg & PM_RCAUSE_WDT) != 0)) {
+		BootStartWatchdog();
+	}
 	jumpToApplication();
 
 //Should not reach here! The device should have jumped to the main FW.
@@ -302,6 +218,7 @@ static bool StartFilesystemAndTest(void)
 
 	//MOUNT SD CARD
 	Ctrl_status sdStatus= SdCard_Initiate();
+	BootProfileMark(BOOT_PHASE_SD_INIT);
 	if(sdStatus == CTRL_GOOD) //If the SD card is good we continue mounting the system!
 	{
 		SerialConsoleWriteString("SD Card initiated correctly!\n\r");
@@ -310,6 +227,7 @@ static bool StartFilesystemAndTest(void)
 		SerialConsoleWriteString("Mount disk (f_mount)...\r\n");
 		memset(&fs, 0, sizeof(FATFS));
 		res = f_mount(LUN_ID_SD_MMC_0_MEM, &fs); //Order FATFS Mount
+		BootProfileMark(BOOT_PHASE_MOUNT);
 		if (FR_INVALID_DRIVE == res)
 		{
 			LogMessage(LOG_INFO_LVL ,"[FAIL] res %d\r\n", res);
@@ -380,6 +298,7 @@ static bool StartFilesystemAndTest(void)
 		SerialConsoleWriteString("Test is successful.\n\r");
 
 		main_end_of_test:
+		BootProfileMark(BOOT_PHASE_SELF_TEST);
 		SerialConsoleWriteString("End of Test.\n\r");
 	} else {
 		SerialConsoleWriteString("SD Card failed initiation! Check connections!\n\r");
@@ -416,6 +335,146 @@ applicationCodeEntry =
 applicationCodeEntry();
 }
 
+/**************************************************************************//**
+* function      static const uint8_t *BootFlash(uint32_t address)
+* @brief        Flash hook of bootPlatform, the flash is memory mapped
+******************************************************************************/
+static const uint8_t *BootFlash(uint32_t address)
+{
+	return (const uint8_t *)address;
+}
+
+/**************************************************************************//**
+* function      static bool BootEraseRow(uint32_t address)
+* @brief        Row erase hook of bootPlatform, waits while the controller is busy
+******************************************************************************/
+static bool BootEraseRow(uint32_t address)
+{
+	enum status_code nvmError;
+
+	do {
+		nvmError = nvm_erase_row(address);
+	} while (nvmError == STATUS_BUSY);
+	return nvmError == STATUS_OK;
+}
+
+/**************************************************************************//**
+* function      static bool BootWritePage(uint32_t address, const uint8_t *data)
+* @brief        Page write hook of bootPlatform, returns once the page is programmed
+******************************************************************************/
+static bool BootWritePage(uint32_t address, const uint8_t *data)
+{
+	enum status_code nvmError;
+
+	do {
+		nvmError = nvm_write_buffer(address, data, NVM_PAGE_FACTOR);
+	} while (nvmError == STATUS_BUSY);
+	while (!nvm_is_ready()) {
+	}
+	return nvmError == STATUS_OK;
+}
+
+/**************************************************************************//**
+* function      static uint32_t BootCrc32(uint32_t crc, const uint8_t *data, uint32_t len)
+* @brief        Continues a CRC32 over len bytes of flash or RAM, 0 starts a new one
+* @details      Whole words go through the DSU, which needs a word aligned address;
+*				the bytes around them are done in software.
+******************************************************************************/
+static uint32_t BootCrc32(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	crc32_t soft = crc;
+	uint32_t head = (4 - ((uintptr_t)data & 3)) & 3;
+
+	if (head > len) {
+		head = len;
+	}
+	if (head > 0) {
+		crc32_recalculate(data, head, &soft);
+		data += head;
+		len -= head;
+	}
+
+	uint32_t words = len & ~3UL;
+	if (words > 0) {
+		uint32_t state = ~soft;
+
+		DSU_ERRATA_REG &= ~0x30000UL;
+		enum status_code crcres = dsu_crc32_cal((uint32_t)data, words, &state);
+		DSU_ERRATA_REG |= 0x20000UL;
+
+		if (crcres == STATUS_OK) {
+			soft = ~state;
+		} else {
+			crc32_recalculate(data, words, &soft);
+		}
+		data += words;
+		len -= words;
+	}
+
+	if (len > 0) {
+		crc32_recalculate(data, len, &soft);
+	}
+	return soft;
+}
+
+/**************************************************************************//**
+* function      static void BootTimerStart(void)
+* @brief        Timer start hook of bootPlatform, SysTick already ticks since InitSystick() in main()
+******************************************************************************/
+static void BootTimerStart(void)
+{
+	bootTimerStart = GetSystick();
+}
+
+/**************************************************************************//**
+* function      static uint32_t BootTimerMs(void)
+* @brief        Timer hook of bootPlatform, milliseconds since BootTimerStart()
+******************************************************************************/
+static uint32_t BootTimerMs(void)
+{
+	return GetSystick() - bootTimerStart;
+}
+
+/**************************************************************************//**
+* function      static void BootTimerStop(void)
+* @brief        Timer stop hook of bootPlatform, SysTick keeps ticking for the boot profile
+******************************************************************************/
+static void BootTimerStop(void)
+{
+}
+
+/**************************************************************************//**
+* function      static void BootPrint(const char *text)
+* @brief        Console hook of bootPlatform
+******************************************************************************/
+static void BootPrint(const char *text)
+{
+	SerialConsoleWriteString((char *)text);
+}
+
+/**************************************************************************//**
+* function      static void BootStartWatchdog(void)
+* @brief        Clocks the watchdog from OSCULP32K / 32 and starts it with BOOT_WDT_PERIOD
+* @details      The generator is set up as the application's conf_clocks.h sets it up, so
+*				system_init() in the application does not change the period. The
+*				watchdog is not always-on, the application stops it once it confirms.
+******************************************************************************/
+static void BootStartWatchdog(void)
+{
+	GCLK->GENDIV.reg = GCLK_GENDIV_ID(BOOT_WDT_GCLK) | GCLK_GENDIV_DIV(32);
+	GCLK->GENCTRL.reg = GCLK_GENCTRL_ID(BOOT_WDT_GCLK) | GCLK_GENCTRL_SRC_OSCULP32K | GCLK_GENCTRL_GENEN;
+	while (GCLK->STATUS.reg & GCLK_STATUS_SYNCBUSY) {
+	}
+	GCLK->CLKCTRL.reg = GCLK_CLKCTRL_ID_WDT | GCLK_CLKCTRL_GEN(BOOT_WDT_GCLK) | GCLK_CLKCTRL_CLKEN;
+
+	WDT->CONFIG.reg = BOOT_WDT_PERIOD;
+	while (WDT->STATUS.reg & WDT_STATUS_SYNCBUSY) {
+	}
+	WDT->CTRL.reg = WDT_CTRL_ENABLE;
+	while (WDT->STATUS.reg & WDT_STATUS_SYNCBUSY) {
+	}
+}
+
 /**************************************************************************//**
 * function      static void configure_nvm(void)
 * @brief        Configures the NVM driver
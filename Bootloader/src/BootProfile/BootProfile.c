@@ -0,0 +1,91 @@
+/**************************************************************************//**
+* @file      BootProfile.c
+* @brief     Time the bootloader spent in each phase of a boot that used the SD card
+* @details   Counts on GetSystick(), so InitSystick() has to run before
+*            BootProfileStart(). The delay driver reloads SysTick with the same
+*            millisecond period, the tick keeps counting through its delays.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "BootProfile.h"
+#include "Systick/Systick.h"
+#include <stddef.h>
+#include <string.h>
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static struct BootProfile profile;	///<Record being filled in
+static uint32_t profileStart;		///<Tick of BootProfileStart()
+static uint32_t phaseStart;			///<Tick the running phase started on
+static char profile_file[] = BOOT_PROFILE_FILE;
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		void BootProfileStart(void)
+ * @brief	Clears the record and starts the first phase
+ */
+void BootProfileStart(void)
+{
+	memset(&profile, 0, sizeof(profile));
+	profileStart = GetSystick();
+	phaseStart = profileStart;
+}
+
+/**
+ * @fn		void BootProfileMark(enum BootProfilePhase phase)
+ * @brief	Ends phase and starts the next one
+ * @details	A phase marked twice adds up, one that is never marked stays 0.
+ */
+void BootProfileMark(enum BootProfilePhase phase)
+{
+	uint32_t now = GetSystick();
+
+	if (phase < BOOT_PHASE_COUNT) {
+		profile.phaseMs[phase] += now - phaseStart;
+	}
+	phaseStart = now;
+}
+
+/**
+ * @fn		bool BootProfileSave(uint32_t generation, enum BootUpdateResult result)
+ * @brief	Writes the record to BOOT_PROFILE_FILE, call with the card still mounted
+ * @details	Replaces the record of an earlier boot the application has not
+ *			published yet, only the latest slow boot is kept.
+ * @return	true if the whole record was written
+ */
+bool BootProfileSave(uint32_t generation, enum BootUpdateResult result)
+{
+	struct BootUpdateStats stats;
+	crc32_t crc = 0;
+	FIL file;
+	UINT written = 0;
+	FRESULT res;
+
+	BootUpdateGetStats(&stats);
+	profile.magic = BOOT_PROFILE_MAGIC;
+	profile.generation = generation;
+	profile.result = result;
+	profile.totalMs = GetSystick() - profileStart;
+	profile.bytesFlashed = stats.rowsWritten * NVM_ROW_FACTOR;
+	profile.bytesUnchanged = stats.rowsSkipped * NVM_ROW_FACTOR;
+	profile.flashMs = stats.flashMs;
+	crc32_recalculate(&profile, offsetof(struct BootProfile, recordCrc), &crc);
+	profile.recordCrc = crc;
+
+	profile_file[0] = LUN_ID_SD_MMC_0_MEM + '0';
+	if (f_open(&file, (char const *)profile_file, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+		return false;
+	}
+	res = f_write(&file, &profile, sizeof(profile), &written);
+	if (f_close(&file) != FR_OK || res != FR_OK || written != sizeof(profile)) {
+		f_unlink(profile_file);
+		return false;
+	}
+	return true;
+}
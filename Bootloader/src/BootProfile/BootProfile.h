@@ -0,0 +1,68 @@
+/**************************************************************************//**
+* @file      BootProfile.h
+* @brief     Time the bootloader spent in each phase of a boot that used the SD card
+* @details   Only the slow path is profiled: the fast path never starts the
+*            card and its whole time reaches the application through SysTick,
+*            see OtaBoot.h there. On the slow path SysTick ticks every
+*            millisecond from right after system_init() until the jump, and
+*            BootProfileMark() closes one phase at a time. Before the jump the
+*            record goes to BOOT_PROFILE_FILE, where the application picks it
+*            up once it has mounted the card, publishes it and removes it.
+*
+*            The file is used rather than a reserved RAM section because both
+*            images would need their linker scripts changed for that, and the
+*            card already carries everything else the two exchange.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "BootUpdate/BootUpdate.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define BOOT_PROFILE_FILE           "0:boot_profile.bin"    ///< Must match OTA_BOOT_PROFILE_FILE in the application
+#define BOOT_PROFILE_MAGIC          0x464F5250UL    ///< "PROF"
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Phases of a slow path boot, in the order they run
+enum BootProfilePhase {
+	BOOT_PHASE_PERIPHERALS = 0,	///< Console, SD/MMC stack, NVM and DSU set up
+	BOOT_PHASE_SD_INIT,			///< SdCard_Initiate(), up to SD_CARD_TIMEOUT
+	BOOT_PHASE_MOUNT,			///< f_mount(), FatFs reads the card on the first f_open() that follows
+	BOOT_PHASE_SELF_TEST,		///< Test files written, includes the real mount
+	BOOT_PHASE_UPDATE,			///< BootUpdateRun(): install, resume, verify or roll back
+	BOOT_PHASE_COUNT
+};
+
+/// Record in BOOT_PROFILE_FILE, must match struct OtaBootProfile in the application
+struct BootProfile {
+	uint32_t magic;				///< BOOT_PROFILE_MAGIC
+	uint32_t generation;		///< Image the bootloader went on to start, BootState.generation
+	uint32_t result;			///< enum BootUpdateResult of the boot
+	uint32_t phaseMs[BOOT_PHASE_COUNT];
+	uint32_t totalMs;			///< From the first tick to the record being written
+	uint32_t bytesFlashed;		///< Bytes erased and programmed, see BootUpdateGetStats()
+	uint32_t bytesUnchanged;	///< Bytes the update did not have to program
+	uint32_t flashMs;			///< Part of BOOT_PHASE_UPDATE spent flashing
+	uint32_t recordCrc;			///< CRC32 of the fields above
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+void BootProfileStart(void);
+void BootProfileMark(enum BootProfilePhase phase);
+bool BootProfileSave(uint32_t generation, enum BootUpdateResult result);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,143 @@
+/**************************************************************************//**
+* @file      BootState.c
+* @brief     Trial boots of a new application, the watchdog that guards them and their counters
+* @details   Runs on the fast path too, before system_init(), so it only relies
+*            on the flash hooks of struct BootPlatform and the software CRC32.
+*            Starting the watchdog is left to the caller, see BootStateArmTrial().
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "BootState.h"
+#include <stddef.h>
+#include <string.h>
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static int BootStateCurrent(const struct BootPlatform *platform, struct BootState *state);
+static bool BootStateRow(const struct BootPlatform *platform, int row, struct BootState *state);
+static uint32_t BootStateCrc(const struct BootState *state);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		bool BootStateRead(const struct BootPlatform *platform, struct BootState *state)
+ * @brief	Reads the current record, or starts a blank one if both rows are erased or corrupt
+ * @details	A blank record knows nothing about the image in flash and has no trial.
+ * @return	true if a row held a valid record
+ */
+bool BootStateRead(const struct BootPlatform *platform, struct BootState *state)
+{
+	if (BootStateCurrent(platform, state) >= 0) {
+		return true;
+	}
+
+	memset(state, 0, sizeof(*state));
+	state->magic = BOOT_STATE_MAGIC;
+	return false;
+}
+
+/**
+ * @fn		bool BootStateWrite(const struct BootPlatform *platform, struct BootState *state)
+ * @brief	Programs the record with the next sequence and a fresh CRC into the row not holding the current one
+ * @details	The record fits one page, the rest of the page stays erased. A reset
+ *			between the erase and the write leaves the current record in the other
+ *			row, the write is simply lost.
+ * @return	true if the record reads back
+ */
+bool BootStateWrite(const struct BootPlatform *platform, struct BootState *state)
+{
+	struct BootState current;
+	uint8_t page[NVM_PAGE_FACTOR];
+	int row = BootStateCurrent(platform, &current);
+	uint32_t address = BOOT_STATE_ADDRESS + ((row == 0) ? NVM_ROW_FACTOR : 0);
+
+	state->sequence = (row >= 0) ? current.sequence + 1 : 1;
+	state->recordCrc = BootStateCrc(state);
+	memset(page, 0xFF, sizeof(page));
+	memcpy(page, state, sizeof(*state));
+
+	if (!platform->eraseRow(address) || !platform->writePage(address, page)) {
+		return false;
+	}
+	return memcmp(platform->flash(address), state, sizeof(*state)) == 0;
+}
+
+/**
+ * @fn		bool BootStateRollbackDue(const struct BootState *state)
+ * @brief	True once the image on trial has used up its boots without a confirmation
+ */
+bool BootStateRollbackDue(const struct BootState *state)
+{
+	return state->trial == BOOT_TRIAL_PENDING && state->trialBoots >= BOOT_TRIAL_ATTEMPTS;
+}
+
+/**
+ * @fn		bool BootStateArmTrial(const struct BootPlatform *platform, struct BootState *state, bool watchdogReset)
+ * @brief	Counts a boot of the image on trial, call just before the jump
+ * @details	Does nothing for a confirmed image. A watchdog reset on the way here
+ *			means the last trial boot did not confirm in time, it is counted too.
+ * @param[in]	watchdogReset The watchdog caused the last reset
+ * @return	true if the caller has to start the watchdog, BOOT_WDT_PERIOD from BOOT_WDT_GCLK
+ */
+bool BootStateArmTrial(const struct BootPlatform *platform, struct BootState *state, bool watchdogReset)
+{
+	if (state->trial != BOOT_TRIAL_PENDING) {
+		return false;
+	}
+
+	if (watchdogReset) {
+		state->watchdogResets++;
+	}
+	state->trialBoots++;
+	BootStateWrite(platform, state);
+	return true;
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static int BootStateCurrent(const struct BootPlatform *platform, struct BootState *state)
+ * @brief	Reads the valid record with the higher sequence
+ * @return	Its row, -1 if neither row holds a valid record
+ */
+static int BootStateCurrent(const struct BootPlatform *platform, struct BootState *state)
+{
+	struct BootState other;
+	bool valid = BootStateRow(platform, 0, state);
+
+	if (BootStateRow(platform, 1, &other) && (!valid || (int32_t)(other.sequence - state->sequence) > 0)) {
+		memcpy(state, &other, sizeof(*state));
+		return 1;
+	}
+	return valid ? 0 : -1;
+}
+
+/**
+ * @fn		static bool BootStateRow(const struct BootPlatform *platform, int row, struct BootState *state)
+ * @brief	Reads the record in one of the BOOT_STATE_ROWS rows
+ * @return	true if it is intact
+ */
+static bool BootStateRow(const struct BootPlatform *platform, int row, struct BootState *state)
+{
+	memcpy(state, platform->flash(BOOT_STATE_ADDRESS + row * NVM_ROW_FACTOR), sizeof(*state));
+	return state->magic == BOOT_STATE_MAGIC && BootStateCrc(state) == state->recordCrc;
+}
+
+/**
+ * @fn		static uint32_t BootStateCrc(const struct BootState *state)
+ * @brief	CRC32 of the record without its last word, in software so it works before the DSU is set up
+ */
+static uint32_t BootStateCrc(const struct BootState *state)
+{
+	crc32_t crc = 0;
+
+	crc32_recalculate(state, offsetof(struct BootState, recordCrc), &crc);
+	return crc;
+}
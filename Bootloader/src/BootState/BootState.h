@@ -0,0 +1,75 @@
+/**************************************************************************//**
+* @file      BootState.h
+* @brief     Trial boots of a new application, the watchdog that guards them and their counters
+* @details   A record in the NVM row below the update request row says which
+*            image is in flash and whether it is on trial. After an install the
+*            image is on trial: every boot of it counts, starts the watchdog and
+*            must be confirmed by the application (OtaBootConfirm() in
+*            OtaBoot.c) before the watchdog runs out. An image that reaches
+*            BOOT_TRIAL_ATTEMPTS boots without a confirmation is replaced by the
+*            last confirmed one, which the bootloader saves to the SD card before
+*            it installs an update.
+*
+*            The record is rewritten only on installs, trial boots, confirmations
+*            and rollbacks, never on a normal boot, so the rows wear with updates
+*            rather than with resets. Writes alternate between two rows and the
+*            record with the higher sequence wins, so a reset while one row is
+*            erased or half programmed leaves the previous record in the other.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "BootUpdate/BootPlatform.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define BOOT_STATE_MAGIC            0x32545342UL    ///< "BST2"
+#define BOOT_TRIAL_ATTEMPTS         3       ///< Unconfirmed boots of a new image before it is rolled back
+#define BOOT_WDT_GCLK               4       ///< Generator the watchdog runs from, the application clocks it the same way
+#define BOOT_WDT_PERIOD             WDT_CONFIG_PER_16K  ///< 16384 cycles of 1024 Hz, the application has 16 s to confirm
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Whether the image in flash has proven itself
+enum BootTrial {
+	BOOT_TRIAL_NONE = 0,		///< Confirmed, or the image that was running before trials existed
+	BOOT_TRIAL_PENDING = 1		///< Installed but not confirmed yet
+};
+
+/// Record in one of the rows at BOOT_STATE_ADDRESS, see BootPlatform.h, must match struct OtaBootState in the application
+struct BootState {
+	uint32_t magic;				///< BOOT_STATE_MAGIC
+	uint32_t generation;		///< Version of the image in flash, the install that wrote it
+	uint32_t imageLength;		///< Length of the image in flash, 0 until it is known
+	uint32_t imageCrc;			///< CRC32 of the image in flash
+	uint32_t trial;				///< enum BootTrial
+	uint32_t trialBoots;		///< Boots of the image on trial so far
+	uint32_t installs;			///< Updates installed, never goes back
+	uint32_t confirms;			///< Trials the application confirmed
+	uint32_t rollbacks;			///< Trials given up and restored from the saved image
+	uint32_t watchdogResets;	///< Watchdog resets while an image was on trial
+	uint32_t confirmMs;			///< Scheduler start to confirmation in the last trial
+	uint32_t rollbackMs;		///< Time the last rollback spent flashing
+	uint32_t sequence;			///< Counts writes, the row with the higher one holds the current record
+	uint32_t recordCrc;			///< CRC32 of the fields above
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+bool BootStateRead(const struct BootPlatform *platform, struct BootState *state);
+bool BootStateWrite(const struct BootPlatform *platform, struct BootState *state);
+bool BootStateRollbackDue(const struct BootState *state);
+bool BootStateArmTrial(const struct BootPlatform *platform, struct BootState *state, bool watchdogReset);
+
+#ifdef __cplusplus
+}
+#endif
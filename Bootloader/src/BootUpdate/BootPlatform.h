@@ -0,0 +1,57 @@
+/**************************************************************************//**
+* @file      BootPlatform.h
+* @brief     Flash layout and the hardware hooks the update engine runs on
+* @details   BootUpdate.c and BootState.c reach the flash, the CRC unit, the
+*            millisecond timer and the console only through struct
+*            BootPlatform. BootMain.c fills it with the NVM driver, the DSU,
+*            SysTick and the serial console; Tools/BootSim fills it with a
+*            simulated NVM that keeps the SAMD21 row and page rules and their
+*            timing. The SD card is reached through FatFs in both cases, the
+*            simulator runs it on a disk image file.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <asf.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define APP_START_ADDRESS           ((uint32_t)0x12000) ///< Start of main application. Must be address of start of main application
+#define APP_START_RESET_VEC_ADDRESS (APP_START_ADDRESS + (uint32_t)0x04) ///< Main application reset vector address
+#define BOOT_STATE_ADDRESS          ((uint32_t)0x3FD00) ///< BOOT_STATE_ROWS trial state rows, must match OTA_BOOT_STATE_ADDRESS in the application
+#define BOOT_STATE_ROWS             2
+#define BOOT_REQUEST_ADDRESS        ((uint32_t)0x3FF00) ///< Last NVM row, the application writes BOOT_REQUEST_PENDING here after a verified download
+#define BOOT_REQUEST_PENDING        0x54445055UL ///< "UPDT", must match OTA_BOOT_REQUEST_PENDING in the application
+#define APP_MAX_SIZE                (BOOT_STATE_ADDRESS - APP_START_ADDRESS) ///< Flash left for the application
+#define APP_RAM_START               ((uint32_t)0x20000000) ///< Valid range of the application's initial stack pointer
+#define APP_RAM_END                 ((uint32_t)0x20008000)
+#define BOOT_FLASH_SIZE             ((uint32_t)0x40000) ///< SAMD21J18
+#define NVM_ROW_FACTOR              256
+#define NVM_PAGE_FACTOR             64
+#define NVM_WRITE_PER_ROW           4
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Hardware the update engine runs on
+struct BootPlatform {
+	const uint8_t *(*flash)(uint32_t address);		///< Where flash address can be read, memory mapped on the target
+	bool (*eraseRow)(uint32_t address);				///< Erases the NVM_ROW_FACTOR bytes at a row aligned address
+	bool (*writePage)(uint32_t address, const uint8_t *data);	///< Programs NVM_PAGE_FACTOR bytes into an erased page
+	uint32_t (*crc32)(uint32_t crc, const uint8_t *data, uint32_t len);	///< Continues a CRC32, 0 starts a new one
+	void (*timerStart)(void);						///< Starts counting milliseconds from 0
+	uint32_t (*timerMs)(void);						///< Milliseconds since timerStart
+	void (*timerStop)(void);
+	void (*print)(const char *text);				///< Console output
+};
+
+#ifdef __cplusplus
+}
+#endif
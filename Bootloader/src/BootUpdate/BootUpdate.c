@@ -0,0 +1,1104 @@
+/**************************************************************************//**
+* @file      BootUpdate.c
+* @brief     Update engine of the bootloader: installs, journals, verifies and rolls back application images
+* @details   Plain C on struct BootPlatform and FatFs, see BootUpdate.h. The
+*            order of the steps matters more than their speed: every NVM or SD
+*            write may be the last one before a power cut, and the next boot has
+*            to finish the job or undo it from what is on the card and in flash.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "BootUpdate.h"
+#include <stdio.h>
+#include <string.h>
+
+#include "DeltaPatch/DeltaPatch.h"
+#include "LzImage/LzImage.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define FLASH_CHUNK_SIZE            4096 ///< Bytes read from the SD card per f_read when flashing Application.bin, whole sectors go straight into the buffer
+#define FLASH_ATTEMPTS              3 ///< Passes over Application.bin before the update is given up for this boot
+#define VERIFY_CHUNK_SIZE           8192 ///< Bytes per DSU run when checking the programmed image
+#define UPDATE_JOURNAL_MAGIC        0x4C4E524AUL ///< "JRNL"
+#define GOOD_IMAGE_MAGIC            0x444F4F47UL ///< "GOOD"
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+///< What the update journal on the SD card says was being written
+enum UpdateJournalKind {
+	UPDATE_JOURNAL_IMAGE = 1,	///< Application.bin, done is the end of the last chunk flashed
+	UPDATE_JOURNAL_PATCH = 2,	///< A delta patch was being applied in place, it cannot be resumed
+	UPDATE_JOURNAL_LZ = 3		///< An LZ packed Application.bin was being decoded, it starts over
+};
+
+///< Update journal record, written to the SD card as is
+struct UpdateJournal {
+	uint32_t magic;				///< UPDATE_JOURNAL_MAGIC
+	uint32_t kind;				///< enum UpdateJournalKind
+	uint32_t length;			///< Length of the image being written
+	uint32_t done;				///< Bytes flashed so far
+	uint32_t crc;				///< IMAGE: CRC32 of the file up to done. PATCH, LZ: CRC32 of the image being written
+	uint32_t recordCrc;			///< CRC32 of the fields above
+};
+
+///< Trailer of the last confirmed image saved on the SD card, after the image itself
+struct GoodImageTrailer {
+	uint32_t magic;				///< GOOD_IMAGE_MAGIC
+	uint32_t generation;		///< BootState generation of the image
+	uint32_t length;			///< Image bytes before the trailer
+	uint32_t crc;				///< CRC32 of the image
+	uint32_t recordCrc;			///< CRC32 of the fields above
+};
+
+/******************************************************************************
+* Local Function Declaration
+******************************************************************************/
+static bool BootUpdateRequested(void);
+static bool ApplicationPresent(void);
+static void ClearUpdateRequest(void);
+static bool ApplyDeltaPatch(FIL *patch);
+static bool FlashImage(FIL *image, uint32_t length);
+static bool IsCompressedImage(FIL *image);
+static bool FlashCompressedImage(FIL *image);
+static bool FlashImagePass(FIL *image, uint32_t length, uint32_t offset, uint32_t *fileCrc);
+static uint32_t JournalResume(FIL *image, uint32_t length, uint32_t *fileCrc);
+static bool JournalComplete(const struct UpdateJournal *journal);
+static void ImageVerified(uint32_t length, uint32_t crc);
+static void RecordInstall(void);
+static void SaveGoodImage(void);
+static bool RollbackImage(void);
+static bool RestoreGoodImage(struct GoodImageTrailer *trailer);
+static bool GoodImageRead(FIL *good, struct GoodImageTrailer *trailer);
+static uint32_t ApplicationExtent(void);
+static uint32_t FileCrc32(FIL *file, uint32_t length);
+static uint32_t FlashCrc32(uint32_t length);
+static bool FlashRow(uint32_t address, const uint8_t *data);
+static void FlashStatsStart(void);
+static void FlashStatsReport(uint32_t length);
+static bool JournalRead(struct UpdateJournal *journal);
+static void JournalWrite(struct UpdateJournal *journal);
+static int32_t PatchRead(void *ctx, uint8_t *buffer, uint32_t len);
+static bool PatchWriteRow(void *ctx, uint32_t row, const uint8_t *data);
+static const uint8_t *BootFlash(uint32_t address);
+static uint32_t BootRead32(uint32_t address);
+static uint32_t BootCrc32(uint32_t crc, const uint8_t *data, uint32_t len);
+static void BootPrint(const char *text);
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static char boot_file_name[] = "0:boot_flag.txt";
+static char boot_bin_file[] = "0:Application.bin";
+static char boot_patch_file[] = "0:Application.patch";	///<Delta patch against the running application, tried first
+static char update_journal_file[] = "0:update_journal.bin";	///<Progress of an update, removed once the new application is verified
+static char good_image_file[] = "0:Application.good";	///<Last confirmed application with a GoodImageTrailer, restored when a new one fails its trial
+static char good_image_temp[] = "0:Application.tmp";	///<good_image_file while it is being written
+static FIL file_object;	///<Update file being installed
+static uint8_t flashChunk[FLASH_CHUNK_SIZE] __attribute__((aligned(4)));	///<Chunk of Application.bin being flashed
+static uint32_t flashRowsWritten;	///<Rows erased and programmed since FlashStatsStart()
+static uint32_t flashRowsSkipped;	///<Rows that already held the new data since FlashStatsStart()
+static bool applicationDamaged;	///<A row was erased and the new image has not been verified yet
+static uint32_t flashMsTotal;	///<Milliseconds reported by FlashStatsReport() since it was last cleared
+static struct BootUpdateStats updateStats;	///<Flash work since BootUpdateRun() was entered, see BootUpdateGetStats()
+static uint32_t verifiedLength;	///<Length of the image last verified in flash, 0 if none
+static uint32_t verifiedCrc;	///<CRC32 of that image
+static const struct BootPlatform *platform;	///<Hooks passed to BootUpdateFastPath() or BootUpdateRun()
+static struct BootState *bootState;	///<Trial state and boot counters, see BootState/BootState.h
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**************************************************************************//**
+* function      bool BootUpdateFastPath(const struct BootPlatform *hooks, const struct BootState *state)
+* @brief        True if the application can be started without looking at the SD card
+* @details      Runs before system_init(), the flash is readable straight after reset. The
+*				card is only needed when the application asked for an update, when the
+*				vector table does not look like an application, or when an image on trial
+*				has used up its boots.
+******************************************************************************/
+bool BootUpdateFastPath(const struct BootPlatform *hooks, const struct BootState *state)
+{
+	platform = hooks;
+	return !BootUpdateRequested() && ApplicationPresent() && !BootStateRollbackDue(state);
+}
+
+/**************************************************************************//**
+* function      enum BootUpdateResult BootUpdateRun(const struct BootPlatform *hooks, struct BootState *state)
+* @brief        Installs a waiting update, finishes or repairs an interrupted one, or rolls back a failed trial
+* @details      Call with the SD card mounted. Before the application is started its flash
+*				has to match the CRC32 in the boot state; a damaged application is replaced
+*				by the saved one if it can be. The update files, the journal and the update
+*				request are only removed once the application is whole, so a reset at any
+*				point leaves enough behind for the next boot to carry on.
+* @param[in]    hooks Flash, CRC, timer and console of the platform
+* @param[in,out] state Boot state read at reset, updated and written back here
+* @return       BOOT_UPDATE_START if the application may be started
+******************************************************************************/
+enum BootUpdateResult BootUpdateRun(const struct BootPlatform *hooks, struct BootState *state)
+{
+	struct UpdateJournal journal;
+	FRESULT bootRes;
+	char helpStr[64];
+
+	platform = hooks;
+	bootState = state;
+	applicationDamaged = false;
+	flashMsTotal = 0;
+	verifiedLength = 0;
+	memset(&updateStats, 0, sizeof(updateStats));
+
+	boot_file_name[0] = LUN_ID_SD_MMC_0_MEM + '0';
+	bootRes = f_open(&file_object, (char const *)boot_file_name, FA_READ);
+	if (bootRes == FR_OK) {
+		f_close(&file_object);
+		BootPrint("Found boot flag !\r\n Now Updating firmware \r\n");
+	}
+
+	//// A journal means power was lost during an update: the application is not whole until the update completes.
+	//// If the new image was already verified only the clean up was cut off.
+	if (JournalRead(&journal)) {
+		BootPrint("Found the journal of an interrupted update!\r\n");
+		if (JournalComplete(&journal)) {
+			ImageVerified(journal.length, journal.crc);
+		} else {
+			applicationDamaged = true;
+		}
+	}
+
+	//// A patch needs the image it was made for. If a patch or the restore before it was cut off, the saved image goes back first.
+	if (applicationDamaged && bootRes == FR_OK) {
+		struct GoodImageTrailer trailer;
+		boot_patch_file[0] = LUN_ID_SD_MMC_0_MEM + '0';
+		if (f_open(&file_object, (char const *)boot_patch_file, FA_READ) == FR_OK) {
+			f_close(&file_object);
+			if (RestoreGoodImage(&trailer)) {
+				BootPrint("Restored the application the patch was made for\r\n");
+				verifiedLength = 0;
+			}
+		}
+	}
+
+	//// An image on trial that never confirmed a boot is replaced by the last confirmed one.
+	if (BootStateRollbackDue(bootState)) {
+		BootPrint("New application was never confirmed, rolling back\r\n");
+		if (!RollbackImage() && !applicationDamaged) {
+			//Nothing to go back to and the image is still whole, starting it beats never starting anything
+			BootPrint("No saved application, keeping the new one\r\n");
+			bootState->trial = BOOT_TRIAL_NONE;
+			BootStateWrite(platform, bootState);
+		}
+		verifiedLength = 0;
+		goto exit_boot;
+	}
+
+	//// Keep the running application on the card before anything replaces it.
+	if (bootRes == FR_OK) {
+		SaveGoodImage();
+	}
+
+	//// A delta patch rebuilds the application in place. If it does not fit the running image we fall back to the whole file.
+	if (bootRes == FR_OK) {
+		boot_patch_file[0] = LUN_ID_SD_MMC_0_MEM + '0';
+		if (f_open(&file_object, (char const *)boot_patch_file, FA_READ) == FR_OK) {
+			bool patched = ApplyDeltaPatch(&file_object);
+			f_close(&file_object);
+			if (patched) {
+				BootPrint("Update Complete! \r\n");
+				goto exit_boot;
+			}
+		}
+	}
+
+	//// We flash file only if it was download properly.
+	if (bootRes == FR_OK) {
+		boot_bin_file[0] = LUN_ID_SD_MMC_0_MEM + '0';
+		if (f_open(&file_object, (char const *)boot_bin_file, FA_READ) != FR_OK) {
+			BootPrint("Couldn't find the file !\r\n");
+			goto exit_boot;
+		}
+
+		//An LZ packed image is recognised by its header, it is downloaded under the same name
+		bool flashed;
+		if (IsCompressedImage(&file_object)) {
+			flashed = FlashCompressedImage(&file_object);
+		} else {
+			flashed = FlashImage(&file_object, file_object.fsize);
+		}
+		f_close(&file_object);
+
+		if (!flashed) {
+			BootPrint("Test write to NVM failed!\r\n");
+		} else {
+			BootPrint("Test write to NVM succeeded!\r\n");
+			BootPrint("Update Complete! \r\n");
+		}
+	}
+
+exit_boot:
+	//The boot state is written before any file is removed: a reset from here on finds the journal
+	//complete and the state already recording the install.
+	RecordInstall();
+
+	if (!applicationDamaged && bootState->imageLength != 0 && FlashCrc32(bootState->imageLength) != bootState->imageCrc) {
+		BootPrint("Application does not match its CRC!\r\n");
+		applicationDamaged = true;
+	}
+	if (applicationDamaged) {
+		BootPrint("Update did not complete, restoring the saved application\r\n");
+		RollbackImage();
+	}
+
+	//Never start a half written application. The flag, the files and the request stay, so the next boot tries again.
+	if (applicationDamaged) {
+		BootPrint("Application is incomplete, not starting it!\r\n");
+		return BOOT_UPDATE_RESET;
+	}
+
+	f_unlink(boot_file_name);
+	f_unlink(boot_bin_file);
+	f_unlink(boot_patch_file);
+	f_unlink(update_journal_file);
+	ClearUpdateRequest();
+
+	snprintf(helpStr, 63, "Image %lu, trial %lu/%d, installs %lu, rollbacks %lu\r\n", (unsigned long)bootState->generation,
+			 (unsigned long)(bootState->trial == BOOT_TRIAL_PENDING ? bootState->trialBoots + 1 : 0), BOOT_TRIAL_ATTEMPTS,
+			 (unsigned long)bootState->installs, (unsigned long)bootState->rollbacks);
+	BootPrint(helpStr);
+	return BOOT_UPDATE_START;
+}
+
+/**************************************************************************//**
+* function      void BootUpdateGetStats(struct BootUpdateStats *stats)
+* @brief        Rows and time the last BootUpdateRun() spent flashing, for the boot profile
+******************************************************************************/
+void BootUpdateGetStats(struct BootUpdateStats *stats)
+{
+	memcpy(stats, &updateStats, sizeof(*stats));
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**************************************************************************//**
+* function      static bool BootUpdateRequested(void)
+* @brief        Reads the request row the application writes after a verified download
+* @return       true if the SD card should be checked for an update
+******************************************************************************/
+static bool BootUpdateRequested(void)
+{
+	return BootRead32(BOOT_REQUEST_ADDRESS) == BOOT_REQUEST_PENDING;
+}
+
+/**************************************************************************//**
+* function      static bool ApplicationPresent(void)
+* @brief        Checks that the vector table at APP_START_ADDRESS looks like an application
+* @details      An erased or half written application would fault on the jump, in that case
+*				the SD card is checked for an image even without a request.
+* @return       true if the stack pointer lies in RAM and the reset vector in the application
+******************************************************************************/
+static bool ApplicationPresent(void)
+{
+	uint32_t stack = BootRead32(APP_START_ADDRESS);
+	uint32_t reset = BootRead32(APP_START_RESET_VEC_ADDRESS);
+
+	return stack > APP_RAM_START && stack <= APP_RAM_END && (reset & 1) != 0 &&
+		   reset > APP_START_ADDRESS && reset < APP_START_ADDRESS + APP_MAX_SIZE;
+}
+
+/**************************************************************************//**
+* function      static void ClearUpdateRequest(void)
+* @brief        Erases the request row so the next boot takes the fast path again
+******************************************************************************/
+static void ClearUpdateRequest(void)
+{
+	if (BootRead32(BOOT_REQUEST_ADDRESS) == 0xFFFFFFFF) {
+		return;
+	}
+	if (!platform->eraseRow(BOOT_REQUEST_ADDRESS)) {
+		BootPrint("Could not clear the update request!\r\n");
+	}
+}
+
+/**************************************************************************//**
+* function      static bool FlashImage(FIL *image, uint32_t length)
+* @brief        Copies Application.bin from the SD card into the application rows and verifies it
+* @details      Each pass computes the CRC32 of the file while reading it, then the CRC32 of
+*				the programmed region is compared with it. On a mismatch the file is flashed
+*				again; rows that came out right are skipped by FlashRow(), so a retry only
+*				rewrites the bad ones. A pass that was cut off by a reset carries on from
+*				the last chunk the journal recorded, see JournalResume().
+* @param[in]    image Open image file
+* @param[in]    length Bytes to flash
+* @return       true if the flash matches the file
+******************************************************************************/
+static bool FlashImage(FIL *image, uint32_t length)
+{
+	uint32_t resumeCrc = 0;
+	uint32_t resumeOffset = JournalResume(image, length, &resumeCrc);
+	char helpStr[64];
+
+	if (length > APP_MAX_SIZE) {
+		BootPrint("Image does not fit the application region!\r\n");
+		return false;
+	}
+
+	for (int attempt = 1; attempt <= FLASH_ATTEMPTS; attempt++) {
+		uint32_t fileCrc = resumeCrc;
+
+		if (f_lseek(image, resumeOffset) != FR_OK) {
+			return false;
+		}
+		if (!FlashImagePass(image, length, resumeOffset, &fileCrc)) {
+			resumeOffset = 0;
+			resumeCrc = 0;
+			continue;
+		}
+		resumeOffset = 0;
+		resumeCrc = 0;
+
+		uint32_t flashCrc = FlashCrc32(length);
+		snprintf(helpStr, 63, "CRC32 file %08lx flash %08lx\r\n", (unsigned long)fileCrc, (unsigned long)flashCrc);
+		BootPrint(helpStr);
+		if (flashCrc == fileCrc) {
+			ImageVerified(length, flashCrc);
+			return true;
+		}
+		snprintf(helpStr, 63, "Verify failed, attempt %d of %d\r\n", attempt, FLASH_ATTEMPTS);
+		BootPrint(helpStr);
+	}
+	return false;
+}
+
+/**************************************************************************//**
+* function      static bool FlashImagePass(FIL *image, uint32_t length, uint32_t offset, uint32_t *fileCrc)
+* @brief        One pass of FlashImage() from offset to the end of the file
+* @details      The file is read FLASH_CHUNK_SIZE bytes at a time, FatFs then reads whole
+*				sectors straight into flashChunk instead of going through its own sector
+*				buffer 256 bytes at a time. Each row of the chunk is then erased and
+*				programmed; the tail of the last row is left erased (0xFF). The journal is
+*				written before the first erase and after every finished chunk. Prints the time spent on the card and
+*				in total, the throughput and the rows skipped.
+* @param[in]    image Open image file, positioned at offset
+* @param[in]    length Bytes to flash
+* @param[in]    offset First byte to flash, a multiple of FLASH_CHUNK_SIZE
+* @param[in,out] fileCrc CRC32 of the file before offset; of the whole file on return
+* @return       true if every row was written
+******************************************************************************/
+static bool FlashImagePass(FIL *image, uint32_t length, uint32_t offset, uint32_t *fileCrc)
+{
+	struct UpdateJournal journal = {UPDATE_JOURNAL_MAGIC, UPDATE_JOURNAL_IMAGE, length, offset, *fileCrc, 0};
+	uint32_t start = offset;
+	uint32_t readMs = 0;
+	bool passed = true;
+	char helpStr[64];
+
+	JournalWrite(&journal);
+	FlashStatsStart();
+	while (passed && offset < length) {
+		uint32_t want = length - offset;
+		uint32_t readStart = platform->timerMs();
+		UINT numBytesRead = 0;
+		FRESULT readRes;
+
+		if (want > FLASH_CHUNK_SIZE) {
+			want = FLASH_CHUNK_SIZE;
+		}
+		readRes = f_read(image, flashChunk, want, &numBytesRead);
+		readMs += platform->timerMs() - readStart;
+		if (readRes != FR_OK || numBytesRead != want) {
+			BootPrint("Couldn't read from!\r\n");
+			passed = false;
+			break;
+		}
+		*fileCrc = BootCrc32(*fileCrc, flashChunk, want);
+
+		uint32_t rowsEnd = (want + NVM_ROW_FACTOR - 1) & ~(uint32_t)(NVM_ROW_FACTOR - 1);
+		memset(&flashChunk[want], 0xFF, rowsEnd - want);
+		for (uint32_t pos = 0; pos < rowsEnd; pos += NVM_ROW_FACTOR) {
+			if (!FlashRow(APP_START_ADDRESS + offset + pos, &flashChunk[pos])) {
+				BootPrint("Couldn't write in the NVM memory!\r\n");
+				passed = false;
+				break;
+			}
+		}
+		offset += want;
+
+		if (passed) {
+			journal.done = offset;
+			journal.crc = *fileCrc;
+			JournalWrite(&journal);
+		}
+	}
+
+	FlashStatsReport(offset - start);
+	snprintf(helpStr, 63, "Reading the SD card took %lu ms, %lu KB/s\r\n", (unsigned long)readMs,
+			 (unsigned long)(readMs ? (offset - start) * 1000ULL / 1024 / readMs : 0));
+	BootPrint(helpStr);
+	return passed;
+}
+
+/**************************************************************************//**
+* function      static bool IsCompressedImage(FIL *image)
+* @brief        Checks whether image starts with the LZ image magic, leaves it at its start
+* @details      The magic can not be the initial stack pointer of a plain image.
+******************************************************************************/
+static bool IsCompressedImage(FIL *image)
+{
+	uint8_t magic[4];
+	UINT numBytesRead = 0;
+	bool compressed = false;
+
+	if (f_read(image, magic, sizeof(magic), &numBytesRead) == FR_OK && numBytesRead == sizeof(magic)) {
+		uint32_t word = (uint32_t)magic[0] | ((uint32_t)magic[1] << 8) | ((uint32_t)magic[2] << 16) | ((uint32_t)magic[3] << 24);
+		compressed = (word == LZ_IMAGE_MAGIC);
+	}
+	f_lseek(image, 0);
+	return compressed;
+}
+
+/**************************************************************************//**
+* function      static bool FlashCompressedImage(FIL *image)
+* @brief        Decodes an LZ packed Application.bin straight into the application rows
+* @details      The body is read once to check its CRC32 before anything is erased, so a
+*				truncated or corrupt download leaves the application untouched. Decoding
+*				then hands each finished row to FlashRow() and reads matches back from the
+*				rows already programmed, see LzImage/LzImage.h. The programmed region is
+*				checked against the image CRC32 in the header and the decode is repeated
+*				on a mismatch; unchanged rows are skipped, so a retry only rewrites the
+*				bad ones. A decode cut off by a reset starts over on the next boot.
+* @param[in]    image Open image file, positioned at its start
+* @return       true if the flash matches the image the file was packed from
+******************************************************************************/
+static bool FlashCompressedImage(FIL *image)
+{
+	uint8_t raw[LZ_IMAGE_HEADER_SIZE];
+	struct LzImageHeader header;
+	struct LzImageIo io = {BootFlash(APP_START_ADDRESS), PatchRead, PatchWriteRow, BootCrc32, image};
+	enum LzImageResult result = LZ_IMAGE_ERR_READ;
+	UINT numBytesRead = 0;
+	char helpStr[64];
+
+	BootPrint("Found compressed image\r\n");
+	if (f_read(image, raw, sizeof(raw), &numBytesRead) == FR_OK && numBytesRead == sizeof(raw)) {
+		result = LzImageReadHeader(raw, BootCrc32, &header);
+	}
+	if (result != LZ_IMAGE_OK) {
+		BootPrint("Compressed image header is corrupt!\r\n");
+		return false;
+	}
+	if (header.rawLength > APP_MAX_SIZE || header.bodyLength != image->fsize - LZ_IMAGE_HEADER_SIZE) {
+		BootPrint("Compressed image does not fit or is truncated!\r\n");
+		return false;
+	}
+
+	//Check the whole body while the flash is still untouched
+	if (FileCrc32(image, header.bodyLength) != header.bodyCrc32) {
+		BootPrint("Compressed image body is corrupt!\r\n");
+		return false;
+	}
+
+	struct UpdateJournal journal = {UPDATE_JOURNAL_MAGIC, UPDATE_JOURNAL_LZ, header.rawLength, 0, header.rawCrc32, 0};
+	JournalWrite(&journal);
+
+	for (int attempt = 1; attempt <= FLASH_ATTEMPTS; attempt++) {
+		if (f_lseek(image, LZ_IMAGE_HEADER_SIZE) != FR_OK) {
+			return false;
+		}
+		FlashStatsStart();
+		result = LzImageDecode(&header, &io);
+		FlashStatsReport(header.rawLength);
+		snprintf(helpStr, 63, "Decoded %lu into %lu bytes (%d)\r\n", (unsigned long)header.bodyLength,
+				 (unsigned long)header.rawLength, (int)result);
+		BootPrint(helpStr);
+
+		if (result == LZ_IMAGE_OK || result == LZ_IMAGE_ERR_RESULT) {
+			uint32_t flashCrc = FlashCrc32(header.rawLength);
+			snprintf(helpStr, 63, "CRC32 image %08lx flash %08lx\r\n", (unsigned long)header.rawCrc32, (unsigned long)flashCrc);
+			BootPrint(helpStr);
+			if (flashCrc == header.rawCrc32) {
+				ImageVerified(header.rawLength, flashCrc);
+				return true;
+			}
+		}
+		snprintf(helpStr, 63, "Verify failed, attempt %d of %d\r\n", attempt, FLASH_ATTEMPTS);
+		BootPrint(helpStr);
+	}
+	return false;
+}
+
+/**************************************************************************//**
+* function      static void ImageVerified(uint32_t length, uint32_t crc)
+* @brief        Records that the flash now holds a whole image with this length and CRC32
+******************************************************************************/
+static void ImageVerified(uint32_t length, uint32_t crc)
+{
+	applicationDamaged = false;
+	verifiedLength = length;
+	verifiedCrc = crc;
+}
+
+/**************************************************************************//**
+* function      static void RecordInstall(void)
+* @brief        Puts a newly verified image on trial, it has to confirm its first boots
+* @details      An image the boot state already records is not counted again, that is
+*				the case when only the clean up after an install was cut off.
+******************************************************************************/
+static void RecordInstall(void)
+{
+	if (verifiedLength == 0 ||
+		(bootState->imageLength == verifiedLength && bootState->imageCrc == verifiedCrc)) {
+		return;
+	}
+	bootState->installs++;
+	bootState->generation = bootState->installs;
+	bootState->imageLength = verifiedLength;
+	bootState->imageCrc = verifiedCrc;
+	bootState->trial = BOOT_TRIAL_PENDING;
+	bootState->trialBoots = 0;
+	BootStateWrite(platform, bootState);
+}
+
+/**************************************************************************//**
+* function      static void SaveGoodImage(void)
+* @brief        Copies the running application to good_image_file if it is confirmed and not saved yet
+* @details      Only a confirmed image is saved, so a rollback never goes back to one that
+*				failed or was never tried. The image that was running before the boot
+*				state existed is adopted as confirmed; its length is where the
+*				programmed flash ends. The copy is written under a temporary name and
+*				renamed once complete, so a reset never leaves half a fallback behind.
+******************************************************************************/
+static void SaveGoodImage(void)
+{
+	struct GoodImageTrailer trailer;
+	FIL good;
+	UINT numBytesWritten = 0;
+	bool written = true;
+	char helpStr[64];
+
+	if (applicationDamaged || !ApplicationPresent()) {
+		return;
+	}
+	if (bootState->imageLength == 0) {
+		bootState->imageLength = ApplicationExtent();
+		bootState->imageCrc = FlashCrc32(bootState->imageLength);
+		bootState->trial = BOOT_TRIAL_NONE;
+		BootStateWrite(platform, bootState);
+	}
+	if (bootState->trial != BOOT_TRIAL_NONE) {
+		return;
+	}
+
+	good_image_file[0] = LUN_ID_SD_MMC_0_MEM + '0';
+	if (f_open(&good, (char const *)good_image_file, FA_READ) == FR_OK) {
+		bool saved = GoodImageRead(&good, &trailer) && trailer.generation == bootState->generation &&
+					 trailer.crc == bootState->imageCrc;
+		f_close(&good);
+		if (saved) {
+			return;
+		}
+	}
+	if (FlashCrc32(bootState->imageLength) != bootState->imageCrc) {
+		BootPrint("Running application does not match its CRC, not saving it\r\n");
+		return;
+	}
+
+	platform->timerStart();
+	good_image_temp[0] = LUN_ID_SD_MMC_0_MEM + '0';
+	if (f_open(&good, (char const *)good_image_temp, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+		BootPrint("Could not save the running application!\r\n");
+		return;
+	}
+	for (uint32_t offset = 0; written && offset < bootState->imageLength; offset += FLASH_CHUNK_SIZE) {
+		uint32_t len = bootState->imageLength - offset;
+		if (len > FLASH_CHUNK_SIZE) {
+			len = FLASH_CHUNK_SIZE;
+		}
+		written = f_write(&good, BootFlash(APP_START_ADDRESS + offset), len, &numBytesWritten) == FR_OK &&
+				  numBytesWritten == len;
+	}
+	trailer.magic = GOOD_IMAGE_MAGIC;
+	trailer.generation = bootState->generation;
+	trailer.length = bootState->imageLength;
+	trailer.crc = bootState->imageCrc;
+	trailer.recordCrc = BootCrc32(0, (const uint8_t *)&trailer, sizeof(trailer) - 4);
+	written = written && f_write(&good, &trailer, sizeof(trailer), &numBytesWritten) == FR_OK &&
+			  numBytesWritten == sizeof(trailer);
+	written = (f_close(&good) == FR_OK) && written;
+
+	//f_rename() takes the new name without the drive
+	if (written) {
+		f_unlink(good_image_file);
+		written = f_rename(good_image_temp, &good_image_file[2]) == FR_OK;
+	}
+	uint32_t ms = platform->timerMs();
+	platform->timerStop();
+
+	if (written) {
+		snprintf(helpStr, 63, "Saved application %lu (%lu bytes) in %lu ms\r\n", (unsigned long)bootState->generation,
+				 (unsigned long)bootState->imageLength, (unsigned long)ms);
+	} else {
+		f_unlink(good_image_temp);
+		snprintf(helpStr, 63, "Could not save the running application!\r\n");
+	}
+	BootPrint(helpStr);
+}
+
+/**************************************************************************//**
+* function      static bool RollbackImage(void)
+* @brief        Flashes good_image_file back and ends the trial of the image it replaces
+* @return       true if the saved image is in flash again
+******************************************************************************/
+static bool RollbackImage(void)
+{
+	struct GoodImageTrailer trailer;
+	char helpStr[64];
+
+	if (!RestoreGoodImage(&trailer)) {
+		return false;
+	}
+
+	bootState->generation = trailer.generation;
+	bootState->imageLength = trailer.length;
+	bootState->imageCrc = trailer.crc;
+	bootState->trial = BOOT_TRIAL_NONE;
+	bootState->trialBoots = 0;
+	bootState->rollbacks++;
+	bootState->rollbackMs = flashMsTotal;
+	BootStateWrite(platform, bootState);
+	verifiedLength = 0; //Not a new install, no trial
+
+	snprintf(helpStr, 63, "Rolled back to application %lu in %lu ms\r\n", (unsigned long)trailer.generation,
+			 (unsigned long)flashMsTotal);
+	BootPrint(helpStr);
+	return true;
+}
+
+/**************************************************************************//**
+* function      static bool RestoreGoodImage(struct GoodImageTrailer *trailer)
+* @brief        Flashes good_image_file back, the boot state is left to the caller
+* @details      The saved image is checked against its trailer before the first erase, a
+*				missing or corrupt copy leaves the flash as it is. Flashing goes through
+*				FlashImage(), so it is verified, retried and journalled like an update.
+* @param[out]   trailer Trailer of the saved image
+* @return       true if the saved image is in flash again
+******************************************************************************/
+static bool RestoreGoodImage(struct GoodImageTrailer *trailer)
+{
+	FIL good;
+	bool restored;
+
+	good_image_file[0] = LUN_ID_SD_MMC_0_MEM + '0';
+	if (f_open(&good, (char const *)good_image_file, FA_READ) != FR_OK) {
+		return false;
+	}
+	if (!GoodImageRead(&good, trailer) || f_lseek(&good, 0) != FR_OK ||
+		FileCrc32(&good, trailer->length) != trailer->crc) {
+		BootPrint("Saved application is corrupt!\r\n");
+		f_close(&good);
+		return false;
+	}
+
+	flashMsTotal = 0;
+	restored = FlashImage(&good, trailer->length);
+	f_close(&good);
+	return restored;
+}
+
+/**************************************************************************//**
+* function      static bool GoodImageRead(FIL *good, struct GoodImageTrailer *trailer)
+* @brief        Reads and checks the trailer at the end of an open good_image_file
+* @return       true if the trailer is intact and the image fits the application region
+******************************************************************************/
+static bool GoodImageRead(FIL *good, struct GoodImageTrailer *trailer)
+{
+	UINT numBytesRead = 0;
+
+	if (good->fsize < sizeof(*trailer) || f_lseek(good, good->fsize - sizeof(*trailer)) != FR_OK ||
+		f_read(good, trailer, sizeof(*trailer), &numBytesRead) != FR_OK || numBytesRead != sizeof(*trailer)) {
+		return false;
+	}
+	return trailer->magic == GOOD_IMAGE_MAGIC &&
+		   BootCrc32(0, (const uint8_t *)trailer, sizeof(*trailer) - 4) == trailer->recordCrc &&
+		   trailer->length == good->fsize - sizeof(*trailer) && trailer->length <= APP_MAX_SIZE;
+}
+
+/**************************************************************************//**
+* function      static uint32_t ApplicationExtent(void)
+* @brief        Length of the application region up to its last programmed word
+* @details      Only for an image installed before its length was recorded. Rows left
+*				over from a longer image before it are included, which costs space on
+*				the card but nothing else.
+******************************************************************************/
+static uint32_t ApplicationExtent(void)
+{
+	uint32_t words = APP_MAX_SIZE / 4;
+
+	while (words > 0 && BootRead32(APP_START_ADDRESS + (words - 1) * 4) == 0xFFFFFFFF) {
+		words--;
+	}
+	return words * 4;
+}
+
+/**************************************************************************//**
+* function      static uint32_t FileCrc32(FIL *file, uint32_t length)
+* @brief        CRC32 of the next length bytes of file, read through flashChunk
+* @details      A short read ends early, its CRC then does not match what the caller expects.
+******************************************************************************/
+static uint32_t FileCrc32(FIL *file, uint32_t length)
+{
+	uint32_t crc = 0;
+
+	for (uint32_t offset = 0; offset < length; offset += FLASH_CHUNK_SIZE) {
+		uint32_t want = length - offset;
+		UINT numBytesRead = 0;
+
+		if (want > FLASH_CHUNK_SIZE) {
+			want = FLASH_CHUNK_SIZE;
+		}
+		if (f_read(file, flashChunk, want, &numBytesRead) != FR_OK || numBytesRead != want) {
+			BootPrint("Couldn't read from!\r\n");
+			break;
+		}
+		crc = BootCrc32(crc, flashChunk, want);
+	}
+	return crc;
+}
+
+/**************************************************************************//**
+* function      static uint32_t JournalResume(FIL *image, uint32_t length, uint32_t *fileCrc)
+* @brief        Where to carry on flashing image after an interrupted update
+* @details      The journal names the image by its length and the CRC32 of the part
+*				already flashed. That part is read back from the card and must give the
+*				same CRC before it is skipped, so a different file with the same length
+*				starts over. Reading the card is much cheaper than programming rows.
+* @param[in]    image Open image file
+* @param[in]    length Length of the image
+* @param[out]   fileCrc CRC32 of the file before the returned offset
+* @return       Offset to resume at, 0 to start over
+******************************************************************************/
+static uint32_t JournalResume(FIL *image, uint32_t length, uint32_t *fileCrc)
+{
+	struct UpdateJournal journal;
+	uint32_t crc = 0;
+	uint32_t offset = 0;
+	char helpStr[64];
+
+	*fileCrc = 0;
+	if (!JournalRead(&journal) || journal.kind != UPDATE_JOURNAL_IMAGE || journal.length != length ||
+		journal.done > length || (journal.done % FLASH_CHUNK_SIZE) != 0 || f_lseek(image, 0) != FR_OK) {
+		return 0;
+	}
+
+	while (offset < journal.done) {
+		UINT numBytesRead = 0;
+		if (f_read(image, flashChunk, FLASH_CHUNK_SIZE, &numBytesRead) != FR_OK || numBytesRead != FLASH_CHUNK_SIZE) {
+			return 0;
+		}
+		crc = BootCrc32(crc, flashChunk, FLASH_CHUNK_SIZE);
+		offset += FLASH_CHUNK_SIZE;
+	}
+	if (crc != journal.crc) {
+		BootPrint("Journal belongs to another image, starting over\r\n");
+		return 0;
+	}
+
+	snprintf(helpStr, 63, "Resuming interrupted update at byte %lu\r\n", (unsigned long)offset);
+	BootPrint(helpStr);
+	*fileCrc = crc;
+	return offset;
+}
+
+/**************************************************************************//**
+* function      static bool JournalComplete(const struct UpdateJournal *journal)
+* @brief        True if the update the journal describes is already whole in flash
+* @details      Power was lost after the new image was verified but before the journal
+*				was removed. An Application.bin journal must also have reached the end
+*				of the file, its CRC only covers the part flashed so far.
+******************************************************************************/
+static bool JournalComplete(const struct UpdateJournal *journal)
+{
+	if (journal->length == 0 || journal->length > APP_MAX_SIZE ||
+		(journal->kind == UPDATE_JOURNAL_IMAGE && journal->done != journal->length)) {
+		return false;
+	}
+	return FlashCrc32(journal->length) == journal->crc;
+}
+
+/**************************************************************************//**
+* function      static bool JournalRead(struct UpdateJournal *journal)
+* @brief        Reads the journal left by an update that did not finish
+* @return       true if a journal exists and its record is intact
+******************************************************************************/
+static bool JournalRead(struct UpdateJournal *journal)
+{
+	FIL file;
+	UINT numBytesRead = 0;
+	FRESULT readRes;
+
+	update_journal_file[0] = LUN_ID_SD_MMC_0_MEM + '0';
+	if (f_open(&file, (char const *)update_journal_file, FA_READ) != FR_OK) {
+		return false;
+	}
+	readRes = f_read(&file, journal, sizeof(*journal), &numBytesRead);
+	f_close(&file);
+
+	return readRes == FR_OK && numBytesRead == sizeof(*journal) && journal->magic == UPDATE_JOURNAL_MAGIC &&
+		   BootCrc32(0, (const uint8_t *)journal, sizeof(*journal) - 4) == journal->recordCrc;
+}
+
+/**************************************************************************//**
+* function      static void JournalWrite(struct UpdateJournal *journal)
+* @brief        Records progress; closing the file commits it to the card
+* @details      A record torn by a power cut fails its CRC and the update starts over,
+*				which compare-before-erase makes cheap for rows already written.
+******************************************************************************/
+static void JournalWrite(struct UpdateJournal *journal)
+{
+	FIL file;
+	UINT numBytesWritten = 0;
+
+	journal->recordCrc = BootCrc32(0, (const uint8_t *)journal, sizeof(*journal) - 4);
+	update_journal_file[0] = LUN_ID_SD_MMC_0_MEM + '0';
+	if (f_open(&file, (char const *)update_journal_file, FA_OPEN_ALWAYS | FA_WRITE) != FR_OK) {
+		return;
+	}
+	f_write(&file, journal, sizeof(*journal), &numBytesWritten);
+	f_close(&file);
+}
+
+/**************************************************************************//**
+* function      static uint32_t FlashCrc32(uint32_t length)
+* @brief        CRC32 of the first length bytes of the application region
+* @details      Streams VERIFY_CHUNK_SIZE bytes per DSU run and carries the CRC over, the
+*				DSU runs with interrupts off and this keeps each run short.
+******************************************************************************/
+static uint32_t FlashCrc32(uint32_t length)
+{
+	uint32_t crc = 0;
+
+	for (uint32_t offset = 0; offset < length; offset += VERIFY_CHUNK_SIZE) {
+		uint32_t len = length - offset;
+		if (len > VERIFY_CHUNK_SIZE) {
+			len = VERIFY_CHUNK_SIZE;
+		}
+		crc = BootCrc32(crc, BootFlash(APP_START_ADDRESS + offset), len);
+	}
+	return crc;
+}
+
+/**************************************************************************//**
+* function      static bool FlashRow(uint32_t address, const uint8_t *data)
+* @brief        Erases one row, checks it reads back erased and programs its four pages
+* @details      A row that already holds data is left alone, which saves the erase and
+*				its wear for every row a release did not change.
+* @return       true if the row holds data afterwards
+******************************************************************************/
+static bool FlashRow(uint32_t address, const uint8_t *data)
+{
+	if (memcmp(BootFlash(address), data, NVM_ROW_FACTOR) == 0) {
+		flashRowsSkipped++;
+		updateStats.rowsSkipped++;
+		return true;
+	}
+	flashRowsWritten++;
+	updateStats.rowsWritten++;
+	applicationDamaged = true;
+
+	if (!platform->eraseRow(address)) {
+		return false;
+	}
+
+	for (int i = 0; i < NVM_ROW_FACTOR / 4; i++) {
+		if (BootRead32(address + i * 4) != 0xFFFFFFFF) {
+			BootPrint("Error - row is not erased!\r\n");
+			return false;
+		}
+	}
+
+	for (int i = 0; i < NVM_WRITE_PER_ROW; i++) {
+		if (!platform->writePage(address + i * NVM_PAGE_FACTOR, &data[i * NVM_PAGE_FACTOR])) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**************************************************************************//**
+* function      static void FlashStatsStart(void)
+* @brief        Starts the millisecond tick and clears the row counters of FlashRow()
+******************************************************************************/
+static void FlashStatsStart(void)
+{
+	flashRowsWritten = 0;
+	flashRowsSkipped = 0;
+	platform->timerStart();
+}
+
+/**************************************************************************//**
+* function      static void FlashStatsReport(uint32_t length)
+* @brief        Prints time, throughput and skipped rows since FlashStatsStart()
+* @details      The time saved assumes a skipped row would have cost as much as the
+*				rows that were written, the compare itself is included in the total.
+******************************************************************************/
+static void FlashStatsReport(uint32_t length)
+{
+	uint32_t totalMs = platform->timerMs();
+	uint32_t savedMs = 0;
+	char helpStr[64];
+
+	platform->timerStop();
+	flashMsTotal += totalMs;
+	updateStats.flashMs += totalMs;
+	if (flashRowsWritten > 0) {
+		savedMs = (uint32_t)((uint64_t)totalMs * flashRowsSkipped / flashRowsWritten);
+	}
+
+	snprintf(helpStr, 63, "Flashed %lu bytes in %lu ms, %lu bytes/s\r\n", (unsigned long)length, (unsigned long)totalMs,
+			 (unsigned long)(totalMs ? (uint64_t)length * 1000 / totalMs : 0));
+	BootPrint(helpStr);
+	snprintf(helpStr, 63, "Rows written %lu, unchanged %lu (~%lu ms saved)\r\n", (unsigned long)flashRowsWritten,
+			 (unsigned long)flashRowsSkipped, (unsigned long)savedMs);
+	BootPrint(helpStr);
+}
+
+/**************************************************************************//**
+* function      static bool ApplyDeltaPatch(FIL *patch)
+* @brief        Rebuilds the application in place from the running image and a delta patch
+* @details      The patch must have been made for the image in flash. A dry run reads the
+*				whole patch and checks its result before the first row is erased, so a
+*				patch for another image, or a truncated or corrupt one, leaves the
+*				application untouched and the caller falls back to Application.bin.
+*				See DeltaPatch/DeltaPatch.h for the format.
+* @param[in]    patch Patch file, open for reading at its start
+* @return       true if the new image is in flash and matches the CRC in the header
+******************************************************************************/
+static bool ApplyDeltaPatch(FIL *patch)
+{
+	uint8_t raw[DELTA_PATCH_HEADER_SIZE];
+	struct DeltaPatchHeader header;
+	struct DeltaPatchIo io = {BootFlash(APP_START_ADDRESS), PatchRead, NULL, BootCrc32, patch};
+	enum DeltaPatchResult result = DELTA_PATCH_ERR_READ;
+	bool written = false;
+	UINT numBytesRead = 0;
+	char helpStr[64];
+
+	BootPrint("Found delta patch, checking it against the running image\r\n");
+	if (f_read(patch, raw, sizeof(raw), &numBytesRead) == FR_OK && numBytesRead == sizeof(raw)) {
+		result = DeltaPatchReadHeader(raw, BootCrc32, &header);
+	}
+
+	if (result == DELTA_PATCH_OK) {
+		if (header.oldLength > APP_MAX_SIZE || header.newLength > APP_MAX_SIZE ||
+			FlashCrc32(header.oldLength) != header.oldCrc32) {
+			result = DELTA_PATCH_ERR_BASE;
+		}
+	}
+
+	//Dry run, nothing is written yet
+	if (result == DELTA_PATCH_OK) {
+		result = DeltaPatchApply(&header, &io);
+	}
+
+	if (result == DELTA_PATCH_OK) {
+		if (f_lseek(patch, DELTA_PATCH_HEADER_SIZE) != FR_OK) {
+			result = DELTA_PATCH_ERR_READ;
+		} else {
+			BootPrint("Patch fits, rebuilding the application\r\n");
+			struct UpdateJournal journal = {UPDATE_JOURNAL_MAGIC, UPDATE_JOURNAL_PATCH, header.newLength, 0, header.newCrc32, 0};
+			JournalWrite(&journal);
+			io.writeRow = PatchWriteRow;
+			written = true;
+			FlashStatsStart();
+			result = DeltaPatchApply(&header, &io);
+			FlashStatsReport(header.newLength);
+		}
+	}
+
+	if (result == DELTA_PATCH_OK && FlashCrc32(header.newLength) != header.newCrc32) {
+		result = DELTA_PATCH_ERR_RESULT;
+	}
+
+	if (result == DELTA_PATCH_OK) {
+		ImageVerified(header.newLength, header.newCrc32);
+		snprintf(helpStr, 63, "Patched application: %lu bytes\r\n", (unsigned long)header.newLength);
+	} else if (written) {
+		//The old image is partly overwritten, only a whole Application.bin can repair it now
+		snprintf(helpStr, 63, "Patch failed while writing (%d)!\r\n", (int)result);
+	} else {
+		snprintf(helpStr, 63, "Patch not applied (%d), flash untouched\r\n", (int)result);
+	}
+	BootPrint(helpStr);
+	return result == DELTA_PATCH_OK;
+}
+
+/**************************************************************************//**
+* function      static int32_t PatchRead(void *ctx, uint8_t *buffer, uint32_t len)
+* @brief        DeltaPatchRead and LzImageRead hook, reads the file passed as ctx
+******************************************************************************/
+static int32_t PatchRead(void *ctx, uint8_t *buffer, uint32_t len)
+{
+	UINT numBytesRead = 0;
+
+	if (f_read((FIL *)ctx, buffer, len, &numBytesRead) != FR_OK) {
+		return -1;
+	}
+	return (int32_t)numBytesRead;
+}
+
+/**************************************************************************//**
+* function      static bool PatchWriteRow(void *ctx, uint32_t row, const uint8_t *data)
+* @brief        DeltaPatchWriteRow and LzImageWriteRow hook, see FlashRow()
+******************************************************************************/
+static bool PatchWriteRow(void *ctx, uint32_t row, const uint8_t *data)
+{
+	uint32_t address = APP_START_ADDRESS + row * NVM_ROW_FACTOR;
+
+	(void)ctx;
+	return FlashRow(address, data);
+}
+
+/**************************************************************************//**
+* function      static const uint8_t *BootFlash(uint32_t address)
+* @brief        Where the flash at address can be read
+******************************************************************************/
+static const uint8_t *BootFlash(uint32_t address)
+{
+	return platform->flash(address);
+}
+
+/**************************************************************************//**
+* function      static uint32_t BootRead32(uint32_t address)
+* @brief        Reads the little endian word at a word aligned flash address
+******************************************************************************/
+static uint32_t BootRead32(uint32_t address)
+{
+	uint32_t word;
+
+	memcpy(&word, BootFlash(address), sizeof(word));
+	return word;
+}
+
+/**************************************************************************//**
+* function      static uint32_t BootCrc32(uint32_t crc, const uint8_t *data, uint32_t len)
+* @brief        DeltaPatchCrc32 and LzImageCrc32 hook, see struct BootPlatform
+******************************************************************************/
+static uint32_t BootCrc32(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	return platform->crc32(crc, data, len);
+}
+
+/**************************************************************************//**
+* function      static void BootPrint(const char *text)
+* @brief        Writes text to the console of the platform
+******************************************************************************/
+static void BootPrint(const char *text)
+{
+	platform->print(text);
+}
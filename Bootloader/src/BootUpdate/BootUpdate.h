@@ -0,0 +1,53 @@
+/**************************************************************************//**
+* @file      BootUpdate.h
+* @brief     Update engine of the bootloader: installs, journals, verifies and rolls back application images
+* @details   Everything the bootloader decides between mounting the SD card and
+*            jumping to the application lives here, written against struct
+*            BootPlatform and FatFs only. BootMain.c runs it on the SAMD21;
+*            Tools/BootSim builds the same file on Linux and runs it on a
+*            simulated flash and a FAT disk image, with power cuts injected at
+*            every NVM and SD write.
+*
+*            Files on the card: boot_flag.txt (an update waits), Application.bin
+*            (a plain or LZ packed image), Application.patch (a delta patch),
+*            update_journal.bin (progress of an update) and Application.good
+*            (the last confirmed image, for rollbacks).
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "BootUpdate/BootPlatform.h"
+#include "BootState/BootState.h"
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// What the bootloader does after BootUpdateRun()
+enum BootUpdateResult {
+	BOOT_UPDATE_START = 0,		///< The application is whole, jump to it
+	BOOT_UPDATE_RESET			///< The application is not whole, reset and try again
+};
+
+/// Flash work of the last BootUpdateRun(), over all passes, retries and rollbacks
+struct BootUpdateStats {
+	uint32_t rowsWritten;		///< Rows erased and programmed
+	uint32_t rowsSkipped;		///< Rows that already held the data
+	uint32_t flashMs;			///< Time spent in the flashing passes
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+bool BootUpdateFastPath(const struct BootPlatform *hooks, const struct BootState *state);
+enum BootUpdateResult BootUpdateRun(const struct BootPlatform *hooks, struct BootState *state);
+void BootUpdateGetStats(struct BootUpdateStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
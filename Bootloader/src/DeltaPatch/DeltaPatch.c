@@ -0,0 +1,252 @@
+/**************************************************************************//**
+* @file      DeltaPatch.c
+* @brief     Rebuilds the application in place from the running image and a delta patch
+* @details   Plain C without hardware access, so Tools/DeltaPatch builds the same
+*            file on the host to test what the bootloader runs.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "DeltaPatch.h"
+#include <string.h>
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Buffered reader over DeltaPatchIo.read
+struct DeltaPatchInput {
+	const struct DeltaPatchIo *io;
+	uint8_t buffer[DELTA_PATCH_READ_CHUNK];
+	uint8_t pos;
+	uint8_t len;
+	bool failed;				///< The read hook returned an error
+};
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static uint8_t rowBuffer[DELTA_PATCH_ROW_SIZE] __attribute__((aligned(4)));	///< Row being rebuilt, word aligned for the compare and CRC
+static struct DeltaPatchInput input;
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static bool DeltaPatchNextByte(uint8_t *value);
+static bool DeltaPatchNextBytes(uint8_t *data, uint32_t len);
+static bool DeltaPatchNextDistance(int32_t *distance);
+static uint32_t DeltaPatchGet32(const uint8_t *raw);
+static void DeltaPatchPut32(uint8_t *raw, uint32_t value);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		enum DeltaPatchResult DeltaPatchReadHeader(const uint8_t *raw, DeltaPatchCrc crc, struct DeltaPatchHeader *header)
+ * @brief	Parses and checks the DELTA_PATCH_HEADER_SIZE bytes at the start of a patch
+ */
+enum DeltaPatchResult DeltaPatchReadHeader(const uint8_t *raw, DeltaPatchCrc crc, struct DeltaPatchHeader *header)
+{
+	header->magic = DeltaPatchGet32(&raw[0]);
+	header->version = (uint16_t)(raw[4] | (raw[5] << 8));
+	header->flags = (uint16_t)(raw[6] | (raw[7] << 8));
+	header->oldLength = DeltaPatchGet32(&raw[8]);
+	header->oldCrc32 = DeltaPatchGet32(&raw[12]);
+	header->newLength = DeltaPatchGet32(&raw[16]);
+	header->newCrc32 = DeltaPatchGet32(&raw[20]);
+	header->streamCrc32 = DeltaPatchGet32(&raw[24]);
+	header->headerCrc32 = DeltaPatchGet32(&raw[28]);
+
+	if (header->magic != DELTA_PATCH_MAGIC || header->version != DELTA_PATCH_VERSION || header->newLength == 0 ||
+		crc(0, raw, DELTA_PATCH_HEADER_SIZE - 4) != header->headerCrc32) {
+		return DELTA_PATCH_ERR_HEADER;
+	}
+	return DELTA_PATCH_OK;
+}
+
+/**
+ * @fn		void DeltaPatchWriteHeader(const struct DeltaPatchHeader *header, DeltaPatchCrc crc, uint8_t *raw)
+ * @brief	Serializes a header, magic, version and header CRC are filled in here
+ */
+void DeltaPatchWriteHeader(const struct DeltaPatchHeader *header, DeltaPatchCrc crc, uint8_t *raw)
+{
+	DeltaPatchPut32(&raw[0], DELTA_PATCH_MAGIC);
+	raw[4] = DELTA_PATCH_VERSION & 0xFF;
+	raw[5] = DELTA_PATCH_VERSION >> 8;
+	raw[6] = header->flags & 0xFF;
+	raw[7] = header->flags >> 8;
+	DeltaPatchPut32(&raw[8], header->oldLength);
+	DeltaPatchPut32(&raw[12], header->oldCrc32);
+	DeltaPatchPut32(&raw[16], header->newLength);
+	DeltaPatchPut32(&raw[20], header->newCrc32);
+	DeltaPatchPut32(&raw[24], header->streamCrc32);
+	DeltaPatchPut32(&raw[28], crc(0, raw, DELTA_PATCH_HEADER_SIZE - 4));
+}
+
+/**
+ * @fn		enum DeltaPatchResult DeltaPatchApply(const struct DeltaPatchHeader *header, const struct DeltaPatchIo *io)
+ * @brief	Rebuilds every row of the new image and hands it to io->writeRow
+ * @details	The caller checks the running image against oldLength and oldCrc32 first.
+ *			Bytes of the last row past newLength are 0xFF, as after an erase.
+ * @return	DELTA_PATCH_OK if the body was well formed and the rows match streamCrc32.
+ *			Without writeRow nothing is written and the result tells whether a real
+ *			run would succeed.
+ */
+enum DeltaPatchResult DeltaPatchApply(const struct DeltaPatchHeader *header, const struct DeltaPatchIo *io)
+{
+	bool backward = (header->flags & DELTA_PATCH_BACKWARD) != 0;
+	uint32_t rows = (header->newLength + DELTA_PATCH_ROW_SIZE - 1) / DELTA_PATCH_ROW_SIZE;
+	uint32_t crc = 0;
+	uint8_t extra;
+
+	memset(&input, 0, sizeof(input));
+	input.io = io;
+
+	for (uint32_t i = 0; i < rows; i++) {
+		uint32_t row = backward ? rows - 1 - i : i;
+		uint32_t rowStart = row * DELTA_PATCH_ROW_SIZE;
+		uint32_t rowLen = header->newLength - rowStart;
+		uint32_t fill = 0;
+
+		if (rowLen > DELTA_PATCH_ROW_SIZE) {
+			rowLen = DELTA_PATCH_ROW_SIZE;
+		}
+		memset(&rowBuffer[rowLen], 0xFF, DELTA_PATCH_ROW_SIZE - rowLen);
+
+		while (fill < rowLen) {
+			uint8_t op;
+			if (!DeltaPatchNextByte(&op)) {
+				return input.failed ? DELTA_PATCH_ERR_READ : DELTA_PATCH_ERR_FORMAT;
+			}
+			uint32_t len = (uint32_t)(op & (DELTA_PATCH_OP_MAX_LEN - 1)) + 1;
+			if (fill + len > rowLen) {
+				return DELTA_PATCH_ERR_FORMAT;
+			}
+
+			if (op & DELTA_PATCH_OP_COPY) {
+				int32_t distance;
+				if (!DeltaPatchNextDistance(&distance)) {
+					return input.failed ? DELTA_PATCH_ERR_READ : DELTA_PATCH_ERR_FORMAT;
+				}
+				int32_t src = (int32_t)(rowStart + fill) + distance;
+				if (src < 0 || (uint32_t)src + len > header->oldLength) {
+					return DELTA_PATCH_ERR_SOURCE;
+				}
+				// Rows already rebuilt hold new data: earlier rows going forward, later ones going backward
+				if (backward ? ((uint32_t)src + len > rowStart + DELTA_PATCH_ROW_SIZE) : ((uint32_t)src < rowStart)) {
+					return DELTA_PATCH_ERR_SOURCE;
+				}
+				memcpy(&rowBuffer[fill], &io->oldImage[src], len);
+			} else if (!DeltaPatchNextBytes(&rowBuffer[fill], len)) {
+				return input.failed ? DELTA_PATCH_ERR_READ : DELTA_PATCH_ERR_FORMAT;
+			}
+			fill += len;
+		}
+
+		crc = io->crc(crc, rowBuffer, rowLen);
+		if (io->writeRow != NULL && !io->writeRow(io->ctx, row, rowBuffer)) {
+			return DELTA_PATCH_ERR_WRITE;
+		}
+	}
+
+	if (DeltaPatchNextByte(&extra) || input.failed) {
+		return input.failed ? DELTA_PATCH_ERR_READ : DELTA_PATCH_ERR_FORMAT;
+	}
+	return (crc == header->streamCrc32) ? DELTA_PATCH_OK : DELTA_PATCH_ERR_RESULT;
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static bool DeltaPatchNextByte(uint8_t *value)
+ * @brief	Next body byte, refills the buffer from the read hook
+ * @return	false at the end of the patch or on a read error (input.failed)
+ */
+static bool DeltaPatchNextByte(uint8_t *value)
+{
+	if (input.pos == input.len) {
+		int32_t got = input.io->read(input.io->ctx, input.buffer, sizeof(input.buffer));
+		if (got <= 0) {
+			input.failed = (got < 0);
+			return false;
+		}
+		input.pos = 0;
+		input.len = (uint8_t)got;
+	}
+	*value = input.buffer[input.pos++];
+	return true;
+}
+
+/**
+ * @fn		static bool DeltaPatchNextBytes(uint8_t *data, uint32_t len)
+ * @brief	Next len body bytes
+ */
+static bool DeltaPatchNextBytes(uint8_t *data, uint32_t len)
+{
+	while (len > 0) {
+		if (input.pos == input.len) {
+			// Refills the buffer and takes its first byte
+			if (!DeltaPatchNextByte(data)) {
+				return false;
+			}
+			data++;
+			len--;
+			continue;
+		}
+		uint32_t n = (uint32_t)(input.len - input.pos);
+		if (n > len) {
+			n = len;
+		}
+		memcpy(data, &input.buffer[input.pos], n);
+		input.pos += n;
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+ * @fn		static bool DeltaPatchNextDistance(int32_t *distance)
+ * @brief	Reads a zigzag LEB128 varint of at most five bytes
+ */
+static bool DeltaPatchNextDistance(int32_t *distance)
+{
+	uint32_t value = 0;
+
+	for (uint8_t shift = 0; shift < 35; shift += 7) {
+		uint8_t byte;
+		if (!DeltaPatchNextByte(&byte)) {
+			return false;
+		}
+		value |= (uint32_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			*distance = (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @fn		static uint32_t DeltaPatchGet32(const uint8_t *raw)
+ * @brief	Little endian load, the header is read from a byte buffer of any alignment
+ */
+static uint32_t DeltaPatchGet32(const uint8_t *raw)
+{
+	return (uint32_t)raw[0] | ((uint32_t)raw[1] << 8) | ((uint32_t)raw[2] << 16) | ((uint32_t)raw[3] << 24);
+}
+
+/**
+ * @fn		static void DeltaPatchPut32(uint8_t *raw, uint32_t value)
+ * @brief	Little endian store
+ */
+static void DeltaPatchPut32(uint8_t *raw, uint32_t value)
+{
+	raw[0] = (uint8_t)value;
+	raw[1] = (uint8_t)(value >> 8);
+	raw[2] = (uint8_t)(value >> 16);
+	raw[3] = (uint8_t)(value >> 24);
+}
@@ -0,0 +1,105 @@
+/**************************************************************************//**
+* @file      DeltaPatch.h
+* @brief     Rebuilds the application in place from the running image and a delta patch
+* @details   A patch describes the new image one flash row at a time. Each row is
+*            a run of ops: a copy of up to 128 bytes from the old image at a
+*            distance from the output position, or up to 128 literal bytes. Code
+*            that only moved costs one op byte and a one byte distance per 128
+*            bytes, so a typical patch release is a few KB instead of the whole
+*            Application.bin.
+*
+*            The old image is overwritten while it is read, so the generator
+*            only copies from rows that are still intact. In forward patches rows
+*            are rebuilt from the first one up and copies come from the current
+*            row or later; in backward patches (DELTA_PATCH_BACKWARD) rows are
+*            rebuilt from the last one down and copies come from the current row
+*            or earlier. DeltaPatchApply() checks every copy against that rule.
+*
+*            RAM use is one row and a small read buffer. A dry run (no writeRow)
+*            checks the patch against the running image without touching flash.
+*            Tools/DeltaPatch builds patches and round-trips them on the host.
+*
+*            Header, little endian: magic "DLT1", u16 version, u16 flags, u32 old
+*            length, u32 old CRC32, u32 new length, u32 new CRC32, u32 CRC32 of
+*            the rows in the order they are rebuilt, u32 CRC32 of the header.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <asf.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define DELTA_PATCH_MAGIC           0x31544C44UL    ///< "DLT1"
+#define DELTA_PATCH_VERSION         1
+#define DELTA_PATCH_HEADER_SIZE     32
+#define DELTA_PATCH_ROW_SIZE        256     ///< NVM row, the unit that is erased and rebuilt
+#define DELTA_PATCH_BACKWARD        0x0001  ///< Header flag: rows are rebuilt from the last one down
+#define DELTA_PATCH_OP_COPY         0x80    ///< Op byte flag: copy from the old image, a zigzag varint distance follows
+#define DELTA_PATCH_OP_MAX_LEN      128     ///< Bytes per op, the low 7 bits of the op byte hold length - 1
+#define DELTA_PATCH_READ_CHUNK      64      ///< Patch bytes read per call of the read hook
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Outcome of DeltaPatchReadHeader() and DeltaPatchApply()
+enum DeltaPatchResult {
+	DELTA_PATCH_OK = 0,
+	DELTA_PATCH_ERR_HEADER,		///< Not a patch, unknown version or corrupt header
+	DELTA_PATCH_ERR_BASE,		///< Made for another image than the running one
+	DELTA_PATCH_ERR_FORMAT,		///< Truncated body, or an op runs past its row
+	DELTA_PATCH_ERR_SOURCE,		///< A copy reads outside the old image or from an overwritten row
+	DELTA_PATCH_ERR_READ,		///< The read hook failed
+	DELTA_PATCH_ERR_WRITE,		///< The write hook failed
+	DELTA_PATCH_ERR_RESULT		///< The rebuilt rows do not match the CRC in the header
+};
+
+/// Parsed patch header
+struct DeltaPatchHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;				///< DELTA_PATCH_BACKWARD
+	uint32_t oldLength;			///< Image the patch applies to
+	uint32_t oldCrc32;
+	uint32_t newLength;			///< Image the patch produces
+	uint32_t newCrc32;
+	uint32_t streamCrc32;		///< CRC32 of the rebuilt rows in the order they are rebuilt, equals newCrc32 for forward patches
+	uint32_t headerCrc32;		///< CRC32 of the 28 bytes before it
+};
+
+/**
+ * Reads the next len patch body bytes.
+ * @return Bytes read, less than len only at the end of the patch, negative on error
+ */
+typedef int32_t (*DeltaPatchRead)(void *ctx, uint8_t *buffer, uint32_t len);
+/// Erases and programs one row of the new image, row 0 is the image start
+typedef bool (*DeltaPatchWriteRow)(void *ctx, uint32_t row, const uint8_t *data);
+/// Continues a CRC32 over len bytes, 0 starts a new one
+typedef uint32_t (*DeltaPatchCrc)(uint32_t crc, const uint8_t *data, uint32_t len);
+
+/// Where DeltaPatchApply() reads and writes
+struct DeltaPatchIo {
+	const uint8_t *oldImage;		///< Running image, read in place; the flash is memory mapped
+	DeltaPatchRead read;			///< Patch body, positioned just after the header
+	DeltaPatchWriteRow writeRow;	///< NULL for a dry run
+	DeltaPatchCrc crc;
+	void *ctx;						///< Passed to read and writeRow
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+enum DeltaPatchResult DeltaPatchReadHeader(const uint8_t *raw, DeltaPatchCrc crc, struct DeltaPatchHeader *header);
+enum DeltaPatchResult DeltaPatchApply(const struct DeltaPatchHeader *header, const struct DeltaPatchIo *io);
+void DeltaPatchWriteHeader(const struct DeltaPatchHeader *header, DeltaPatchCrc crc, uint8_t *raw);
+
+#ifdef __cplusplus
+}
+#endif
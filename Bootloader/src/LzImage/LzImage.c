@@ -0,0 +1,323 @@
+/**************************************************************************//**
+* @file      LzImage.c
+* @brief     Decompresses an LZ packed application image straight into flash rows
+* @details   Plain C without hardware access, so Tools/LzPack builds the same
+*            file on the host to test and time what the bootloader runs.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include "LzImage.h"
+#include <string.h>
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Buffered reader over LzImageIo.read
+struct LzImageInput {
+	const struct LzImageIo *io;
+	uint8_t buffer[LZ_IMAGE_READ_CHUNK];
+	uint16_t pos;
+	uint16_t len;
+	bool failed;				///< The read hook returned an error
+};
+
+/// Output position and the row being filled
+struct LzImageOutput {
+	const struct LzImageIo *io;
+	uint32_t pos;				///< Bytes decoded so far
+	uint32_t rowStart;			///< Image offset of rowBuffer[0]
+	uint32_t crc;				///< CRC32 of the decoded bytes
+	bool failed;				///< The write hook returned an error
+};
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static uint8_t rowBuffer[LZ_IMAGE_ROW_SIZE] __attribute__((aligned(4)));	///< Row being filled, word aligned for the compare and CRC
+static struct LzImageInput input;
+static struct LzImageOutput output;
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static bool LzImageNextByte(uint8_t *value);
+static bool LzImageNextLength(uint32_t *length);
+static bool LzImageLiterals(uint32_t len);
+static bool LzImageMatch(uint32_t offset, uint32_t len);
+static bool LzImageFlushRow(uint32_t len);
+static uint32_t LzImageGet32(const uint8_t *raw);
+static void LzImagePut32(uint8_t *raw, uint32_t value);
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+/**
+ * @fn		enum LzImageResult LzImageReadHeader(const uint8_t *raw, LzImageCrc crc, struct LzImageHeader *header)
+ * @brief	Parses and checks the LZ_IMAGE_HEADER_SIZE bytes at the start of an image
+ */
+enum LzImageResult LzImageReadHeader(const uint8_t *raw, LzImageCrc crc, struct LzImageHeader *header)
+{
+	header->magic = LzImageGet32(&raw[0]);
+	header->version = (uint16_t)(raw[4] | (raw[5] << 8));
+	header->flags = (uint16_t)(raw[6] | (raw[7] << 8));
+	header->rawLength = LzImageGet32(&raw[8]);
+	header->rawCrc32 = LzImageGet32(&raw[12]);
+	header->bodyLength = LzImageGet32(&raw[16]);
+	header->bodyCrc32 = LzImageGet32(&raw[20]);
+	header->reserved = LzImageGet32(&raw[24]);
+	header->headerCrc32 = LzImageGet32(&raw[28]);
+
+	if (header->magic != LZ_IMAGE_MAGIC || header->version != LZ_IMAGE_VERSION || header->rawLength == 0 ||
+		crc(0, raw, LZ_IMAGE_HEADER_SIZE - 4) != header->headerCrc32) {
+		return LZ_IMAGE_ERR_HEADER;
+	}
+	return LZ_IMAGE_OK;
+}
+
+/**
+ * @fn		void LzImageWriteHeader(const struct LzImageHeader *header, LzImageCrc crc, uint8_t *raw)
+ * @brief	Serializes a header, magic, version and header CRC are filled in here
+ */
+void LzImageWriteHeader(const struct LzImageHeader *header, LzImageCrc crc, uint8_t *raw)
+{
+	LzImagePut32(&raw[0], LZ_IMAGE_MAGIC);
+	raw[4] = LZ_IMAGE_VERSION & 0xFF;
+	raw[5] = LZ_IMAGE_VERSION >> 8;
+	raw[6] = header->flags & 0xFF;
+	raw[7] = header->flags >> 8;
+	LzImagePut32(&raw[8], header->rawLength);
+	LzImagePut32(&raw[12], header->rawCrc32);
+	LzImagePut32(&raw[16], header->bodyLength);
+	LzImagePut32(&raw[20], header->bodyCrc32);
+	LzImagePut32(&raw[24], 0);
+	LzImagePut32(&raw[28], crc(0, raw, LZ_IMAGE_HEADER_SIZE - 4));
+}
+
+/**
+ * @fn		enum LzImageResult LzImageDecode(const struct LzImageHeader *header, const struct LzImageIo *io)
+ * @brief	Decodes the body and hands every finished row to io->writeRow
+ * @details	Bytes of the last row past rawLength are 0xFF, as after an erase.
+ * @return	LZ_IMAGE_OK if the body was well formed and decodes to rawCrc32
+ */
+enum LzImageResult LzImageDecode(const struct LzImageHeader *header, const struct LzImageIo *io)
+{
+	uint8_t extra;
+
+	memset(&input, 0, sizeof(input));
+	memset(&output, 0, sizeof(output));
+	input.io = io;
+	output.io = io;
+
+	// Every body ends with a sequence of literals only, even if that is empty
+	for (;;) {
+		uint8_t token;
+		uint32_t literals;
+		uint32_t matchLen;
+		uint8_t offsetLow;
+		uint8_t offsetHigh;
+
+		if (!LzImageNextByte(&token)) {
+			break;
+		}
+		literals = token >> 4;
+		if (literals == 15 && !LzImageNextLength(&literals)) {
+			break;
+		}
+		if (literals > header->rawLength - output.pos) {
+			return LZ_IMAGE_ERR_FORMAT;
+		}
+		if (!LzImageLiterals(literals)) {
+			break;
+		}
+		if (output.pos == header->rawLength) {
+			break;
+		}
+
+		if (!LzImageNextByte(&offsetLow) || !LzImageNextByte(&offsetHigh)) {
+			break;
+		}
+		uint32_t offset = (uint32_t)offsetLow | ((uint32_t)offsetHigh << 8);
+		matchLen = token & 0x0F;
+		if (matchLen == 15 && !LzImageNextLength(&matchLen)) {
+			break;
+		}
+		matchLen += LZ_IMAGE_MIN_MATCH;
+		if (offset == 0 || offset > output.pos || matchLen > header->rawLength - output.pos) {
+			return LZ_IMAGE_ERR_FORMAT;
+		}
+		if (!LzImageMatch(offset, matchLen)) {
+			break;
+		}
+	}
+
+	if (input.failed) {
+		return LZ_IMAGE_ERR_READ;
+	}
+	if (output.failed) {
+		return LZ_IMAGE_ERR_WRITE;
+	}
+	if (output.pos != header->rawLength || LzImageNextByte(&extra) || input.failed) {
+		return input.failed ? LZ_IMAGE_ERR_READ : LZ_IMAGE_ERR_FORMAT;
+	}
+
+	// The last row is only partly filled unless the image ends on a row boundary
+	if (output.pos > output.rowStart && !LzImageFlushRow(output.pos - output.rowStart)) {
+		return LZ_IMAGE_ERR_WRITE;
+	}
+	return (output.crc == header->rawCrc32) ? LZ_IMAGE_OK : LZ_IMAGE_ERR_RESULT;
+}
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static bool LzImageNextByte(uint8_t *value)
+ * @brief	Next body byte, refills the buffer from the read hook
+ * @return	false at the end of the body or on a read error (input.failed)
+ */
+static bool LzImageNextByte(uint8_t *value)
+{
+	if (input.pos == input.len) {
+		int32_t got = input.io->read(input.io->ctx, input.buffer, sizeof(input.buffer));
+		if (got <= 0) {
+			input.failed = (got < 0);
+			return false;
+		}
+		input.pos = 0;
+		input.len = (uint16_t)got;
+	}
+	*value = input.buffer[input.pos++];
+	return true;
+}
+
+/**
+ * @fn		static bool LzImageNextLength(uint32_t *length)
+ * @brief	Adds the continuation bytes of a length nibble that read 15
+ */
+static bool LzImageNextLength(uint32_t *length)
+{
+	uint8_t byte;
+
+	do {
+		if (!LzImageNextByte(&byte)) {
+			return false;
+		}
+		*length += byte;
+		// No image is this long, stop a corrupt body before the sum wraps
+		if (*length > 0x00FFFFFFUL) {
+			return false;
+		}
+	} while (byte == 255);
+	return true;
+}
+
+/**
+ * @fn		static bool LzImageLiterals(uint32_t len)
+ * @brief	Copies len body bytes to the output, a buffer's worth at a time
+ */
+static bool LzImageLiterals(uint32_t len)
+{
+	while (len > 0) {
+		uint32_t fill = output.pos - output.rowStart;
+		uint32_t n = LZ_IMAGE_ROW_SIZE - fill;
+
+		if (input.pos == input.len) {
+			uint8_t first;
+			if (!LzImageNextByte(&first)) {
+				return false;
+			}
+			input.pos--;
+		}
+		if (n > len) {
+			n = len;
+		}
+		if (n > (uint32_t)(input.len - input.pos)) {
+			n = (uint32_t)(input.len - input.pos);
+		}
+		memcpy(&rowBuffer[fill], &input.buffer[input.pos], n);
+		input.pos += n;
+		output.pos += n;
+		len -= n;
+		if (output.pos - output.rowStart == LZ_IMAGE_ROW_SIZE && !LzImageFlushRow(LZ_IMAGE_ROW_SIZE)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @fn		static bool LzImageMatch(uint32_t offset, uint32_t len)
+ * @brief	Repeats len bytes from offset bytes back, from flash or from the row in RAM
+ * @details	Byte by byte, an offset shorter than the length repeats a pattern.
+ */
+static bool LzImageMatch(uint32_t offset, uint32_t len)
+{
+	while (len > 0) {
+		uint32_t src = output.pos - offset;
+		uint32_t fill = output.pos - output.rowStart;
+		uint32_t n = LZ_IMAGE_ROW_SIZE - fill;
+
+		if (n > len) {
+			n = len;
+		}
+		if (src >= output.rowStart) {
+			uint8_t *from = &rowBuffer[src - output.rowStart];
+			for (uint32_t i = 0; i < n; i++) {
+				rowBuffer[fill + i] = from[i];
+			}
+		} else {
+			// Only the part of the match still in programmed rows comes from flash
+			if (n > output.rowStart - src) {
+				n = output.rowStart - src;
+			}
+			memcpy(&rowBuffer[fill], &output.io->output[src], n);
+		}
+		output.pos += n;
+		len -= n;
+		if (output.pos - output.rowStart == LZ_IMAGE_ROW_SIZE && !LzImageFlushRow(LZ_IMAGE_ROW_SIZE)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * @fn		static bool LzImageFlushRow(uint32_t len)
+ * @brief	Pads the row with 0xFF past len, adds it to the CRC and writes it
+ */
+static bool LzImageFlushRow(uint32_t len)
+{
+	memset(&rowBuffer[len], 0xFF, LZ_IMAGE_ROW_SIZE - len);
+	output.crc = output.io->crc(output.crc, rowBuffer, len);
+	if (!output.io->writeRow(output.io->ctx, output.rowStart / LZ_IMAGE_ROW_SIZE, rowBuffer)) {
+		output.failed = true;
+		return false;
+	}
+	output.rowStart += LZ_IMAGE_ROW_SIZE;
+	return true;
+}
+
+/**
+ * @fn		static uint32_t LzImageGet32(const uint8_t *raw)
+ * @brief	Little endian load, the header is read from a byte buffer of any alignment
+ */
+static uint32_t LzImageGet32(const uint8_t *raw)
+{
+	return (uint32_t)raw[0] | ((uint32_t)raw[1] << 8) | ((uint32_t)raw[2] << 16) | ((uint32_t)raw[3] << 24);
+}
+
+/**
+ * @fn		static void LzImagePut32(uint8_t *raw, uint32_t value)
+ * @brief	Little endian store
+ */
+static void LzImagePut32(uint8_t *raw, uint32_t value)
+{
+	raw[0] = (uint8_t)value;
+	raw[1] = (uint8_t)(value >> 8);
+	raw[2] = (uint8_t)(value >> 16);
+	raw[3] = (uint8_t)(value >> 24);
+}
@@ -0,0 +1,100 @@
+/**************************************************************************//**
+* @file      LzImage.h
+* @brief     Decompresses an LZ packed application image straight into flash rows
+* @details   The body is a run of LZ4 style sequences: a token byte whose high
+*            nibble is the literal count and low nibble the match length - 4,
+*            15 in either nibble continues the count in bytes of 255, then the
+*            literals, then a 16 bit little endian offset back into the output.
+*            The last sequence ends after its literals.
+*
+*            Matches are read back from the output, and the output is the
+*            flash: rows already programmed are memory mapped, only the row
+*            being filled sits in RAM. The 64 KB window therefore costs one row
+*            and a read buffer, and decoding needs writeRow to program each row
+*            before the next one refers to it. There is no dry run; the caller
+*            checks bodyCrc32 while the file is still on the card and the CRC of
+*            the programmed image afterwards.
+*
+*            Header, little endian: magic "LZI1", u16 version, u16 flags (0),
+*            u32 image length, u32 image CRC32, u32 body length, u32 body CRC32,
+*            u32 reserved (0), u32 CRC32 of the header.
+*
+*            Tools/LzPack packs images and benchmarks the ratio and decoding.
+******************************************************************************/
+
+#pragma once
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <asf.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define LZ_IMAGE_MAGIC              0x31495A4CUL    ///< "LZI1", never a valid initial stack pointer
+#define LZ_IMAGE_VERSION            1
+#define LZ_IMAGE_HEADER_SIZE        32
+#define LZ_IMAGE_ROW_SIZE           256     ///< NVM row, the unit handed to writeRow
+#define LZ_IMAGE_MIN_MATCH          4
+#define LZ_IMAGE_MAX_OFFSET         65535
+#define LZ_IMAGE_READ_CHUNK         512     ///< Body bytes read per call of the read hook, one SD sector
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// Outcome of LzImageReadHeader() and LzImageDecode()
+enum LzImageResult {
+	LZ_IMAGE_OK = 0,
+	LZ_IMAGE_ERR_HEADER,		///< Not an LZ image, unknown version or corrupt header
+	LZ_IMAGE_ERR_FORMAT,		///< Truncated body, a sequence runs past the image or refers before its start
+	LZ_IMAGE_ERR_READ,			///< The read hook failed
+	LZ_IMAGE_ERR_WRITE,			///< The write hook failed
+	LZ_IMAGE_ERR_RESULT			///< The decoded image does not match the CRC in the header
+};
+
+/// Parsed header
+struct LzImageHeader {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t flags;
+	uint32_t rawLength;			///< Decoded image
+	uint32_t rawCrc32;
+	uint32_t bodyLength;		///< Compressed bytes after the header
+	uint32_t bodyCrc32;
+	uint32_t reserved;
+	uint32_t headerCrc32;		///< CRC32 of the 28 bytes before it
+};
+
+/**
+ * Reads the next len body bytes.
+ * @return Bytes read, less than len only at the end of the body, negative on error
+ */
+typedef int32_t (*LzImageRead)(void *ctx, uint8_t *buffer, uint32_t len);
+/// Erases and programs one row of the image, row 0 is the image start
+typedef bool (*LzImageWriteRow)(void *ctx, uint32_t row, const uint8_t *data);
+/// Continues a CRC32 over len bytes, 0 starts a new one
+typedef uint32_t (*LzImageCrc)(uint32_t crc, const uint8_t *data, uint32_t len);
+
+/// Where LzImageDecode() reads and writes
+struct LzImageIo {
+	const uint8_t *output;			///< Where writeRow puts row 0, read back for matches
+	LzImageRead read;				///< Body, positioned just after the header
+	LzImageWriteRow writeRow;
+	LzImageCrc crc;
+	void *ctx;						///< Passed to read and writeRow
+};
+
+/******************************************************************************
+* Global Function Declaration
+******************************************************************************/
+enum LzImageResult LzImageReadHeader(const uint8_t *raw, LzImageCrc crc, struct LzImageHeader *header);
+enum LzImageResult LzImageDecode(const struct LzImageHeader *header, const struct LzImageIo *io);
+void LzImageWriteHeader(const struct LzImageHeader *header, LzImageCrc crc, uint8_t *raw);
+
+#ifdef __cplusplus
+}
+#endif
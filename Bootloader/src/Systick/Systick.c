@@ -47,7 +47,7 @@ void InitSystick(void)
 
 	// Configure SysTick to trigger every millisecond using the CPU Clock
 	SysTick->CTRL = 0;					// Disable SysTick
-	SysTick->LOAD = 999UL;				// Set reload register for 1mS interrupts
+	SysTick->LOAD = system_cpu_clock_get_hz() / 1000 - 1;	// Set reload register for 1mS interrupts
 	NVIC_SetPriority(SysTick_IRQn, 3);	// Set interrupt priority to least urgency
 	SysTick->VAL = 0;					// Reset the SysTick counter value
 	SysTick->CTRL = 0x00000007;			// Enable SysTick, Enable SysTick Exceptions, Use CPU Clock
@@ -227,4 +227,17 @@
 
 #endif /* _FFCONF */
 
+/* Sector cache under diskio, see disk_cache.h in the FatFs port. Lines are
+   read and written back in one multiple block transfer each; DISK_CACHE_LINES
+   * DISK_CACHE_LINE_SECTORS * 512 bytes of RAM. Image files are read in
+   FLASH_CHUNK_SIZE pieces that go straight through; the lines hold the FAT,
+   the directories, the update journal and the read ahead for the small
+   reads of the patch and LZ decoders. 0 lines turns the cache off. */
+#ifndef DISK_CACHE_LINES
+#define DISK_CACHE_LINES          4
+#endif
+#ifndef DISK_CACHE_LINE_SECTORS
+#define DISK_CACHE_LINE_SECTORS   4
+#endif
+
 #endif /* CONF_FATFS_H_INCLUDED */
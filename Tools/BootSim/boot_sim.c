@@ -0,0 +1,1115 @@
+/**************************************************************************//**
+* @file      boot_sim.c
+* @brief     Runs the bootloader's update engine on a simulated SAMD21 flash and SD card
+* @details   Builds the unmodified Bootloader/src/BootUpdate/BootUpdate.c and
+*            BootState.c, with DeltaPatch.c, LzImage.c and FatFs, against a
+*            struct BootPlatform that keeps the SAMD21J18 NVM rules: rows of 256
+*            bytes are erased to 0xFF, pages of 64 bytes are programmed once per
+*            erase and can only clear bits, and the bootloader rows can not be
+*            touched. Breaking a rule is reported as a violation. The SD card is a
+*            FAT disk image file, boot_sim.img in the current directory, behind
+*            the FatFs diskio functions and the same sector cache as the target
+*            (disk_cache.c of the FatFs port, sized by the bootloader's
+*            conf_fatfs.h). A transfer of several sectors costs one command, as
+*            a multiple block transfer does.
+*
+*            Time is virtual, charged per operation from the datasheet maximums
+*            (row erase 6 ms, page write 2.5 ms) and a 12 MHz SPI SD card
+*            (0.35 ms per sector read, 1.5 ms per sector written, 0.2 ms per
+*            command), so the numbers track the target rather than the host.
+*
+*            A simulated boot mirrors main() in BootMain.c: the fast path, the card
+*            test, BootUpdateRun() and the trial arming. The simulated application
+*            checks the image it was started on and confirms its trial like
+*            OtaBootConfirm(), or, as a bad release, never confirms and gets reset
+*            by the watchdog.
+*
+*            "bench" installs each update on a device running the old image and
+*            reports the time, the throughput and the work done, then installs
+*            the same update again to show what the unchanged rows save.
+*            "powercut" cuts the power at random NVM erases, page writes and SD
+*            sector writes, each kind as likely as the others, up to three times
+*            per run; a cut erase leaves random
+*            bytes, a cut page write a partial page and a cut multi sector write
+*            only its first sectors. Every run must settle on the new image (on
+*            the old one for odd seeds, which install a bad release) within 30
+*            boots and must never start anything but a whole old or new image.
+*            "rollback" installs a bad release and follows it back.
+*            "journal" runs the application's telemetry journal file pattern on
+*            a fresh card, appending records and replaying them, and reports
+*            the SD time and cache hits of each.
+*
+*            Build and run from the repository root:
+*
+*              S=Bootloader/src/ASF/thirdparty/fatfs/fatfs-r0.09/src
+*              P=Bootloader/src/ASF/thirdparty/fatfs/fatfs-port-r0.09
+*              gcc -O2 -std=gnu99 -ITools/BootSim/host -IBootloader/src -IBootloader/src/config -I$S -I$P \
+*                  Tools/BootSim/boot_sim.c Bootloader/src/BootUpdate/BootUpdate.c \
+*                  Bootloader/src/BootState/BootState.c Bootloader/src/DeltaPatch/DeltaPatch.c \
+*                  Bootloader/src/LzImage/LzImage.c $P/disk_cache.c $S/ff.c $S/option/ccsbcs.c -o boot_sim
+*              ./boot_sim bench Application/Debug/Application.bin new/Application.bin Application.patch
+*              ./boot_sim powercut Application/Debug/Application.bin Application.bin.lzi 1000
+*              ./boot_sim rollback Application/Debug/Application.bin new/Application.bin
+*              ./boot_sim journal 200
+*
+*            Add -DDISK_CACHE_LINES=0 to compare without the cache, and
+*            -DDISK_CACHE_LINES=4 -DDISK_CACHE_LINE_SECTORS=1 for the
+*            application's cache.
+*
+*            An update named *.patch is staged as Application.patch, anything
+*            else as Application.bin. -v prints the bootloader's console.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <fcntl.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "BootUpdate/BootUpdate.h"
+#include "DeltaPatch/DeltaPatch.h"
+#include "LzImage/LzImage.h"
+#include "diskio.h"
+#include "disk_cache.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define CRC32_POLYNOMIAL    0xEDB88320UL    ///< Reflected IEEE 802.3 polynomial
+#define DISK_FILE           "boot_sim.img"
+#define DISK_SECTORS        8192    ///< 4 MB card
+#define SECTOR_SIZE         512
+#define NVM_ERASE_US        6000    ///< Row erase, SAMD21 datasheet maximum
+#define NVM_WRITE_US        2500    ///< Page programming, datasheet maximum
+#define SD_COMMAND_US       200     ///< Command, response and token wait of one transfer
+#define SD_READ_US          350     ///< One sector at 12 MHz SPI
+#define SD_WRITE_US         1500    ///< One sector plus the card's programming busy time
+#define JOURNAL_RECORD      512     ///< TELEMETRY_JOURNAL_SECTOR_SIZE of the application
+#define JOURNAL_POS_LEN     24      ///< sizeof(struct JournalPosition) of the application
+#define CRC_BYTES_PER_US    32      ///< DSU over flash
+#define BOOT_MAX            30      ///< Boots a power cut run may take to settle
+#define CUTS_MAX            3       ///< Power cuts per run
+#define LOG_LINES           64      ///< Console lines kept for a failure report
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// A file in memory
+struct Blob {
+	uint8_t *data;
+	uint32_t len;
+};
+
+/// How a simulated power on ended
+enum SimBoot {
+	SIM_FAST = 0,	///< Fast path, jumped without the card
+	SIM_JUMP,		///< Update path, jumped
+	SIM_RESET,		///< BootUpdateRun() refused to start the application
+	SIM_CUT			///< Power was cut
+};
+
+/// Where the power was cut
+enum SimCut {
+	CUT_ERASE = 0,
+	CUT_PAGE,
+	CUT_SECTOR,
+	CUT_KINDS
+};
+
+/// Work done on the simulated hardware
+struct SimStats {
+	uint32_t erases;
+	uint32_t pages;
+	uint32_t sectorsRead;
+	uint32_t sectorsWritten;
+	uint64_t nvmUs;
+	uint64_t sdUs;
+	uint64_t sdReadUs;
+};
+
+/******************************************************************************
+* Local Function Declaration
+******************************************************************************/
+static const uint8_t *SimFlash(uint32_t address);
+static bool SimEraseRow(uint32_t address);
+static bool SimWritePage(uint32_t address, const uint8_t *data);
+static uint32_t SimCrc32(uint32_t crc, const uint8_t *data, uint32_t len);
+static void SimTimerStart(void);
+static uint32_t SimTimerMs(void);
+static void SimTimerStop(void);
+static void SimPrint(const char *text);
+static void CacheReport(void);
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static uint8_t nvm[BOOT_FLASH_SIZE];
+static bool pageProgrammed[BOOT_FLASH_SIZE / NVM_PAGE_FACTOR];	///< Programmed since the last erase of its row
+static uint64_t clockUs;		///< Virtual time
+static uint64_t timerStartUs;
+static struct SimStats stats;
+static uint32_t violations;		///< NVM rules broken by the engine
+static uint64_t events[CUT_KINDS];	///< NVM erases, page writes and SD writes so far
+static uint64_t cutAt;			///< Event of kind cutKind the power is cut at, 0 for never
+static enum SimCut cutKind;
+static jmp_buf powerCut;
+static int diskFd = -1;
+static uint8_t *diskPristine;	///< Disk image with the update staged, restored for every run
+static uint64_t rng = 1;
+static bool verbose;
+static char logLines[LOG_LINES][128];
+static uint32_t logNext;
+static FATFS fs;
+static struct Blob oldImage;	///< Running before the update
+static struct Blob newImage;	///< What the update installs, taken from a clean install
+
+///< The simulated SAMD21 under the update engine
+static const struct BootPlatform simPlatform = {
+	SimFlash, SimEraseRow, SimWritePage, SimCrc32, SimTimerStart, SimTimerMs, SimTimerStop, SimPrint
+};
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static uint32_t Random(void)
+ * @brief	xorshift64*, seeded per run so a failing run can be repeated alone
+ */
+static uint32_t Random(void)
+{
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return (uint32_t)((rng * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/**
+ * @fn		static bool PowerFails(enum SimCut kind)
+ * @brief	Counts an event that a power cut can interrupt, true if this one is cut
+ */
+static bool PowerFails(enum SimCut kind)
+{
+	events[kind]++;
+	return cutAt != 0 && kind == cutKind && events[kind] == cutAt;
+	return false;
+}
+
+/**
+ * @fn		static void Violation(const char *what, uint32_t address)
+ * @brief	Reports a broken NVM rule, the run fails
+ */
+static void Violation(const char *what, uint32_t address)
+{
+	violations++;
+	fprintf(stderr, "NVM violation: %s at 0x%05lx\n", what, (unsigned long)address);
+}
+
+/**
+ * @fn		static const uint8_t *SimFlash(uint32_t address)
+ * @brief	BootPlatform flash hook
+ */
+static const uint8_t *SimFlash(uint32_t address)
+{
+	if (address >= BOOT_FLASH_SIZE) {
+		Violation("read outside the flash", address);
+		return nvm;
+	}
+	return &nvm[address];
+}
+
+/**
+ * @fn		static bool SimEraseRow(uint32_t address)
+ * @brief	BootPlatform erase hook, a cut erase leaves random bytes in the row
+ */
+static bool SimEraseRow(uint32_t address)
+{
+	if ((address % NVM_ROW_FACTOR) != 0 || address >= BOOT_FLASH_SIZE) {
+		Violation("row erase not on a row", address);
+		return false;
+	}
+	if (address < APP_START_ADDRESS) {
+		Violation("row erase in the bootloader", address);
+		return false;
+	}
+
+	stats.erases++;
+	stats.nvmUs += NVM_ERASE_US;
+	clockUs += NVM_ERASE_US;
+	if (PowerFails(CUT_ERASE)) {
+		for (uint32_t i = 0; i < NVM_ROW_FACTOR; i++) {
+			nvm[address + i] = (uint8_t)Random();
+		}
+		longjmp(powerCut, 1);
+	}
+
+	memset(&nvm[address], 0xFF, NVM_ROW_FACTOR);
+	for (uint32_t i = 0; i < NVM_WRITE_PER_ROW; i++) {
+		pageProgrammed[address / NVM_PAGE_FACTOR + i] = false;
+	}
+	return true;
+}
+
+/**
+ * @fn		static bool SimWritePage(uint32_t address, const uint8_t *data)
+ * @brief	BootPlatform page write hook, programming only clears bits and a cut one stops part way
+ */
+static bool SimWritePage(uint32_t address, const uint8_t *data)
+{
+	uint32_t len = NVM_PAGE_FACTOR;
+
+	if ((address % NVM_PAGE_FACTOR) != 0 || address >= BOOT_FLASH_SIZE) {
+		Violation("page write not on a page", address);
+		return false;
+	}
+	if (address < APP_START_ADDRESS) {
+		Violation("page write in the bootloader", address);
+		return false;
+	}
+	if (pageProgrammed[address / NVM_PAGE_FACTOR]) {
+		Violation("page programmed twice without an erase", address);
+	}
+
+	stats.pages++;
+	stats.nvmUs += NVM_WRITE_US;
+	clockUs += NVM_WRITE_US;
+	if (PowerFails(CUT_PAGE)) {
+		len = Random() % NVM_PAGE_FACTOR;
+	}
+	for (uint32_t i = 0; i < len; i++) {
+		nvm[address + i] &= data[i];
+	}
+	if (len != NVM_PAGE_FACTOR) {
+		longjmp(powerCut, 1);
+	}
+	pageProgrammed[address / NVM_PAGE_FACTOR] = true;
+	return true;
+}
+
+/**
+ * @fn		static uint32_t SimCrc32(uint32_t crc, const uint8_t *data, uint32_t len)
+ * @brief	BootPlatform CRC hook, continues a CRC32, 0 starts a new one
+ */
+static uint32_t SimCrc32(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	static uint32_t table[256];
+
+	if (table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int bit = 0; bit < 8; bit++) {
+				c = (c & 1) ? (c >> 1) ^ CRC32_POLYNOMIAL : c >> 1;
+			}
+			table[i] = c;
+		}
+	}
+
+	clockUs += len / CRC_BYTES_PER_US;
+	crc = ~crc;
+	while (len-- > 0) {
+		crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/**
+ * @fn		enum status_code crc32_recalculate(const void *data, size_t length, crc32_t *crc)
+ * @brief	The ASF software CRC32 service, BootState.c uses it for its record
+ */
+enum status_code crc32_recalculate(const void *data, size_t length, crc32_t *crc)
+{
+	*crc = SimCrc32(*crc, (const uint8_t *)data, (uint32_t)length);
+	return STATUS_OK;
+}
+
+/**
+ * @fn		static void SimTimerStart(void)
+ * @brief	BootPlatform timer hooks, on the virtual clock
+ */
+static void SimTimerStart(void)
+{
+	timerStartUs = clockUs;
+}
+
+static uint32_t SimTimerMs(void)
+{
+	return (uint32_t)((clockUs - timerStartUs) / 1000);
+}
+
+static void SimTimerStop(void)
+{
+}
+
+/**
+ * @fn		static void SimPrint(const char *text)
+ * @brief	BootPlatform console hook, kept for failure reports and printed with -v
+ */
+static void SimPrint(const char *text)
+{
+	if (verbose) {
+		printf("  | %s", text);
+	}
+	snprintf(logLines[logNext % LOG_LINES], sizeof(logLines[0]), "%s", text);
+	logNext++;
+}
+
+/**
+ * @fn		static void LogDump(void)
+ * @brief	Prints the console lines kept by SimPrint()
+ */
+static void LogDump(void)
+{
+	uint32_t first = (logNext > LOG_LINES) ? logNext - LOG_LINES : 0;
+
+	for (uint32_t i = first; i < logNext; i++) {
+		fprintf(stderr, "  | %s", logLines[i % LOG_LINES]);
+	}
+}
+
+/******************************************************************************
+* FatFs disk functions on DISK_FILE
+******************************************************************************/
+
+DSTATUS disk_initialize(BYTE drv)
+{
+	if (drv != 0 || diskFd < 0) {
+		return STA_NOINIT;
+	}
+	disk_cache_init(drv, DISK_SECTORS);
+	return 0;
+}
+
+DSTATUS disk_status(BYTE drv)
+{
+	return (drv == 0 && diskFd >= 0) ? 0 : STA_NOINIT;
+}
+
+DRESULT disk_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count)
+{
+	if (drv != 0 || sector + count > DISK_SECTORS) {
+		return RES_PARERR;
+	}
+	return disk_cache_read(drv, buff, sector, count);
+}
+
+DRESULT disk_write(BYTE drv, const BYTE *buff, DWORD sector, BYTE count)
+{
+	if (drv != 0 || sector + count > DISK_SECTORS) {
+		return RES_PARERR;
+	}
+	return disk_cache_write(drv, buff, sector, count);
+}
+
+DRESULT disk_media_read(BYTE drv, BYTE *buff, DWORD sector, BYTE count)
+{
+	(void)drv;
+	stats.sectorsRead += count;
+	stats.sdUs += SD_COMMAND_US + (uint64_t)SD_READ_US * count;
+	stats.sdReadUs += SD_COMMAND_US + (uint64_t)SD_READ_US * count;
+	clockUs += SD_COMMAND_US + (uint64_t)SD_READ_US * count;
+	return pread(diskFd, buff, (size_t)count * SECTOR_SIZE, (off_t)sector * SECTOR_SIZE) ==
+		   (ssize_t)count * SECTOR_SIZE ? RES_OK : RES_ERROR;
+}
+
+DRESULT disk_media_write(BYTE drv, const BYTE *buff, DWORD sector, BYTE count)
+{
+	BYTE written = count;
+
+	(void)drv;
+	stats.sectorsWritten += count;
+	stats.sdUs += SD_COMMAND_US + (uint64_t)SD_WRITE_US * count;
+	clockUs += SD_COMMAND_US + (uint64_t)SD_WRITE_US * count;
+	if (PowerFails(CUT_SECTOR)) {
+		written = (BYTE)(Random() % count);
+	}
+	if (pwrite(diskFd, buff, (size_t)written * SECTOR_SIZE, (off_t)sector * SECTOR_SIZE) != (ssize_t)written * SECTOR_SIZE) {
+		return RES_ERROR;
+	}
+	if (written != count) {
+		longjmp(powerCut, 1);
+	}
+	return RES_OK;
+}
+
+DRESULT disk_ioctl(BYTE drv, BYTE ctrl, void *buff)
+{
+	if (drv != 0) {
+		return RES_PARERR;
+	}
+	switch (ctrl) {
+	case CTRL_SYNC:
+		return disk_cache_sync(drv);
+	case GET_SECTOR_COUNT:
+		*(DWORD *)buff = DISK_SECTORS;
+		return RES_OK;
+	case GET_SECTOR_SIZE:
+		*(WORD *)buff = SECTOR_SIZE;
+		return RES_OK;
+	case GET_BLOCK_SIZE:
+		*(DWORD *)buff = 1;
+		return RES_OK;
+	default:
+		return RES_PARERR;
+	}
+}
+
+DWORD get_fattime(void)
+{
+	return ((DWORD)(2024 - 1980) << 25) | ((DWORD)1 << 21) | ((DWORD)1 << 16);
+}
+
+/******************************************************************************
+* Device and card set up
+******************************************************************************/
+
+/**
+ * @fn		static bool LoadFile(const char *path, struct Blob *blob)
+ * @brief	Reads a whole file into memory
+ */
+static bool LoadFile(const char *path, struct Blob *blob)
+{
+	FILE *file = fopen(path, "rb");
+	long len;
+
+	if (file == NULL) {
+		fprintf(stderr, "Can not open %s\n", path);
+		return false;
+	}
+	fseek(file, 0, SEEK_END);
+	len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	blob->data = malloc(len > 0 ? (size_t)len : 1);
+	blob->len = (uint32_t)len;
+	if (blob->data == NULL || fread(blob->data, 1, (size_t)len, file) != (size_t)len) {
+		fclose(file);
+		fprintf(stderr, "Can not read %s\n", path);
+		return false;
+	}
+	fclose(file);
+	return true;
+}
+
+/**
+ * @fn		static bool WriteCardFile(const char *name, const uint8_t *data, uint32_t len)
+ * @brief	Puts a file on the card through FatFs, as the application's download does
+ */
+static bool WriteCardFile(const char *name, const uint8_t *data, uint32_t len)
+{
+	FIL file;
+	UINT written = 0;
+
+	if (f_open(&file, name, FA_CREATE_ALWAYS | FA_WRITE) != FR_OK) {
+		return false;
+	}
+	if (len > 0 && (f_write(&file, data, len, &written) != FR_OK || written != len)) {
+		f_close(&file);
+		return false;
+	}
+	return f_close(&file) == FR_OK;
+}
+
+/**
+ * @fn		static const char *UpdateName(const char *path)
+ * @brief	Card file an update is staged as
+ */
+static const char *UpdateName(const char *path)
+{
+	size_t len = strlen(path);
+
+	if (len > 6 && strcmp(&path[len - 6], ".patch") == 0) {
+		return "0:Application.patch";
+	}
+	return "0:Application.bin";
+}
+
+/**
+ * @fn		static bool StageUpdate(const struct Blob *update, const char *path)
+ * @brief	Stages update and the boot flag on the card and sets the request row, as the application does
+ */
+static bool StageUpdate(const struct Blob *update, const char *path)
+{
+	uint32_t request = BOOT_REQUEST_PENDING;
+
+	memset(&fs, 0, sizeof(fs));
+	if (f_mount(0, &fs) != FR_OK || !WriteCardFile(UpdateName(path), update->data, update->len) ||
+		!WriteCardFile("0:boot_flag.txt", (const uint8_t *)"1", 1)) {
+		fprintf(stderr, "Can not stage the update on the card\n");
+		return false;
+	}
+	memset(&nvm[BOOT_REQUEST_ADDRESS], 0xFF, NVM_ROW_FACTOR);
+	memcpy(&nvm[BOOT_REQUEST_ADDRESS], &request, sizeof(request));
+	return true;
+}
+
+/**
+ * @fn		static bool DiskFormat(void)
+ * @brief	Creates DISK_FILE if needed and puts an empty FAT volume on it
+ */
+static bool DiskFormat(void)
+{
+	if (diskFd < 0) {
+		diskFd = open(DISK_FILE, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (diskFd < 0 || ftruncate(diskFd, (off_t)DISK_SECTORS * SECTOR_SIZE) != 0) {
+			fprintf(stderr, "Can not create %s\n", DISK_FILE);
+			return false;
+		}
+	}
+	memset(&fs, 0, sizeof(fs));
+	if (f_mount(0, &fs) != FR_OK || f_mkfs(0, 1, 0) != FR_OK) {
+		fprintf(stderr, "Can not format %s\n", DISK_FILE);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @fn		static bool DeviceCreate(const struct Blob *update, const char *path)
+ * @brief	A device running oldImage with no boot state yet, a fresh card and the update staged
+ * @details	The card is formatted once and kept in diskPristine, DeviceRestore() puts
+ *			it back for every run.
+ */
+static bool DeviceCreate(const struct Blob *update, const char *path)
+{
+	if (!DiskFormat()) {
+		return false;
+	}
+
+	memset(nvm, 0xFF, sizeof(nvm));
+	memset(nvm, 0xB0, APP_START_ADDRESS);	//The bootloader, never touched
+	memcpy(&nvm[APP_START_ADDRESS], oldImage.data, oldImage.len);
+	memset(pageProgrammed, 1, sizeof(pageProgrammed));
+	if (!StageUpdate(update, path)) {
+		return false;
+	}
+
+	free(diskPristine);
+	diskPristine = malloc((size_t)DISK_SECTORS * SECTOR_SIZE);
+	return diskPristine != NULL &&
+		   pread(diskFd, diskPristine, (size_t)DISK_SECTORS * SECTOR_SIZE, 0) == (ssize_t)DISK_SECTORS * SECTOR_SIZE;
+}
+
+/**
+ * @fn		static void DeviceRestore(void)
+ * @brief	Back to the device DeviceCreate() made
+ */
+static void DeviceRestore(void)
+{
+	uint32_t request = BOOT_REQUEST_PENDING;
+
+	memset(nvm, 0xFF, sizeof(nvm));
+	memset(nvm, 0xB0, APP_START_ADDRESS);
+	memcpy(&nvm[APP_START_ADDRESS], oldImage.data, oldImage.len);
+	memcpy(&nvm[BOOT_REQUEST_ADDRESS], &request, sizeof(request));
+	memset(pageProgrammed, 1, sizeof(pageProgrammed));
+	if (pwrite(diskFd, diskPristine, (size_t)DISK_SECTORS * SECTOR_SIZE, 0) != (ssize_t)DISK_SECTORS * SECTOR_SIZE) {
+		fprintf(stderr, "Can not restore %s\n", DISK_FILE);
+		exit(1);
+	}
+}
+
+/**
+ * @fn		static bool ExpectedImage(const struct Blob *update, uint32_t *len, uint32_t *crc)
+ * @brief	Length and CRC32 of the image update installs, from its header or the file itself
+ */
+static bool ExpectedImage(const struct Blob *update, uint32_t *len, uint32_t *crc)
+{
+	struct DeltaPatchHeader patch;
+	struct LzImageHeader lz;
+
+	if (update->len >= DELTA_PATCH_HEADER_SIZE && DeltaPatchReadHeader(update->data, SimCrc32, &patch) == DELTA_PATCH_OK) {
+		*len = patch.newLength;
+		*crc = patch.newCrc32;
+		return true;
+	}
+	if (update->len >= LZ_IMAGE_HEADER_SIZE && LzImageReadHeader(update->data, SimCrc32, &lz) == LZ_IMAGE_OK) {
+		*len = lz.rawLength;
+		*crc = lz.rawCrc32;
+		return true;
+	}
+	*len = update->len;
+	*crc = SimCrc32(0, update->data, update->len);
+	return update->len > 0 && update->len <= APP_MAX_SIZE;
+}
+
+/******************************************************************************
+* Simulated boots
+******************************************************************************/
+
+/**
+ * @fn		static bool ImageIs(const struct Blob *image)
+ * @brief	True if the application region starts with image
+ */
+static bool ImageIs(const struct Blob *image)
+{
+	return image->len > 0 && memcmp(&nvm[APP_START_ADDRESS], image->data, image->len) == 0;
+}
+
+/**
+ * @fn		static enum SimBoot SimBootloader(bool watchdogReset, bool *armed)
+ * @brief	main() of BootMain.c from reset to the jump
+ * @param[out]	armed The watchdog was started for a trial boot
+ */
+static enum SimBoot SimBootloader(bool watchdogReset, bool *armed)
+{
+	struct BootState state;
+
+	*armed = false;
+	BootStateRead(&simPlatform, &state);
+	if (BootUpdateFastPath(&simPlatform, &state)) {
+		*armed = BootStateArmTrial(&simPlatform, &state, watchdogReset);
+		return SIM_FAST;
+	}
+
+	//StartFilesystemAndTest() writes two small files on every slow boot
+	memset(&fs, 0, sizeof(fs));
+	f_mount(0, &fs);
+	WriteCardFile("0:sd_mmc_test.txt", (const uint8_t *)"Test SD/MMC stack\n", 18);
+	WriteCardFile("0:sd_binary.bin", nvm, 256);
+
+	if (BootUpdateRun(&simPlatform, &state) != BOOT_UPDATE_START) {
+		return SIM_RESET;
+	}
+	*armed = BootStateArmTrial(&simPlatform, &state, watchdogReset);
+	return SIM_JUMP;
+}
+
+/**
+ * @fn		static void SimApplication(bool bad)
+ * @brief	OtaBootConfirm() of the application, a bad new image never gets there
+ */
+static void SimApplication(bool bad)
+{
+	struct BootState state;
+
+	if (bad && ImageIs(&newImage) && !ImageIs(&oldImage)) {
+		return;
+	}
+	if (BootStateRead(&simPlatform, &state) && state.trial == BOOT_TRIAL_PENDING) {
+		state.trial = BOOT_TRIAL_NONE;
+		state.confirms++;
+		BootStateWrite(&simPlatform, &state);
+	}
+}
+
+/**
+ * @fn		static enum SimBoot SimPowerOn(bool bad, bool *watchdogReset, bool *brick)
+ * @brief	One power on: the bootloader, then the application if it was started
+ * @param[in,out]	watchdogReset In: the watchdog caused this reset. Out: it will cause the next one
+ * @param[out]	brick Something other than a whole old or new image was started
+ */
+static enum SimBoot SimPowerOn(bool bad, bool *watchdogReset, bool *brick)
+{
+	static bool armed;
+	static enum SimBoot result;
+
+	*brick = false;
+	if (setjmp(powerCut) != 0) {
+		*watchdogReset = false;
+		return SIM_CUT;
+	}
+
+	result = SimBootloader(*watchdogReset, &armed);
+	*watchdogReset = false;
+	if (result == SIM_RESET) {
+		return result;
+	}
+
+	//Before InstallReference() knows the new image anything whole is fine
+	if (newImage.len != 0 && !ImageIs(&oldImage) && !ImageIs(&newImage)) {
+		*brick = true;
+		return result;
+	}
+	SimApplication(bad);
+
+	//An armed watchdog that nobody stopped resets the device
+	struct BootState state;
+	*watchdogReset = armed && BootStateRead(&simPlatform, &state) && state.trial == BOOT_TRIAL_PENDING;
+	return result;
+}
+
+/******************************************************************************
+* Commands
+******************************************************************************/
+
+/**
+ * @fn		static bool InstallReference(const struct Blob *update, const char *path)
+ * @brief	Installs update once without power cuts and keeps the result as newImage
+ */
+static bool InstallReference(const struct Blob *update, const char *path)
+{
+	uint32_t len;
+	uint32_t crc;
+	bool watchdogReset = false;
+	bool brick;
+
+	if (!ExpectedImage(update, &len, &crc)) {
+		fprintf(stderr, "%s is not an application image\n", path);
+		return false;
+	}
+	cutAt = 0;
+	if (SimPowerOn(false, &watchdogReset, &brick) != SIM_JUMP || SimCrc32(0, &nvm[APP_START_ADDRESS], len) != crc) {
+		fprintf(stderr, "%s does not install on a device running the old image\n", path);
+		LogDump();
+		return false;
+	}
+	newImage.data = malloc(len);
+	newImage.len = len;
+	memcpy(newImage.data, &nvm[APP_START_ADDRESS], len);
+	return true;
+}
+
+/**
+ * @fn		static void BenchReport(const char *what, uint32_t bytes, uint64_t startUs, double hostMs)
+ * @brief	Prints the virtual time and the work of one boot, the throughput is of the installed image
+ */
+static void BenchReport(const char *what, uint32_t bytes, uint64_t startUs, double hostMs)
+{
+	uint64_t us = clockUs - startUs;
+
+	printf("  %-10s %7.0f ms (NVM %6.0f ms, SD %5.0f ms) %6.1f KB/s  rows %4lu pages %4lu  sectors %4lu read %3lu written  host %.1f ms\n",
+		   what, us / 1000.0, stats.nvmUs / 1000.0, stats.sdUs / 1000.0, us ? bytes * 1000000.0 / us / 1024.0 : 0.0,
+		   (unsigned long)stats.erases, (unsigned long)stats.pages, (unsigned long)stats.sectorsRead,
+		   (unsigned long)stats.sectorsWritten, hostMs);
+	CacheReport();
+}
+
+/**
+ * @fn		static void CacheReport(void)
+ * @brief	Prints the sector cache counters and the read rate FatFs saw
+ */
+static void CacheReport(void)
+{
+	struct disk_cache_stats cache;
+
+	disk_cache_get_stats(&cache);
+	printf("  %-10s %lu of %lu sector reads hit (%lu%%), %lu read / %lu write transfers, reads %.2f MB/s\n", "SD cache",
+		   (unsigned long)cache.read_hits, (unsigned long)cache.reads,
+		   (unsigned long)(cache.reads ? cache.read_hits * 100ULL / cache.reads : 0), (unsigned long)cache.media_reads,
+		   (unsigned long)cache.media_writes,
+		   stats.sdReadUs ? cache.reads * (double)SECTOR_SIZE / stats.sdReadUs : 0.0);
+}
+
+/**
+ * @fn		static int Bench(int count, char **paths)
+ * @brief	Installs each update on the old image, then the same update again
+ */
+static int Bench(int count, char **paths)
+{
+	int failed = 0;
+
+	for (int i = 0; i < count; i++) {
+		struct Blob update;
+		bool watchdogReset = false;
+		bool brick;
+		uint32_t imageLen;
+		uint32_t imageCrc;
+
+		if (!LoadFile(paths[i], &update) || !ExpectedImage(&update, &imageLen, &imageCrc) ||
+			!DeviceCreate(&update, paths[i])) {
+			return 1;
+		}
+		printf("%s: %lu bytes, staged as %s, installs %lu bytes\n", paths[i], (unsigned long)update.len,
+			   &UpdateName(paths[i])[2], (unsigned long)imageLen);
+
+		for (int pass = 0; pass < 2; pass++) {
+			struct timespec t0;
+			struct timespec t1;
+			uint64_t startUs = clockUs;
+
+			memset(&stats, 0, sizeof(stats));
+			disk_cache_clear_stats();
+			cutAt = 0;
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			enum SimBoot result = SimPowerOn(false, &watchdogReset, &brick);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			if (result != SIM_JUMP || brick || violations != 0) {
+				fprintf(stderr, "%s: install failed\n", paths[i]);
+				LogDump();
+				failed = 1;
+				break;
+			}
+			BenchReport(pass == 0 ? "install" : "unchanged", imageLen, startUs,
+						(t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+			if (pass == 0 && !StageUpdate(&update, paths[i])) {
+				return 1;
+			}
+		}
+		free(update.data);
+	}
+	return failed;
+}
+
+/**
+ * @fn		static void PowerCutPlan(const uint64_t *total)
+ * @brief	Picks the next cut: a kind with equal odds, then one of its events
+ * @details	SD writes are rare next to page writes, picking among all events alike
+ *			would hardly ever tear a FAT sector.
+ */
+static void PowerCutPlan(const uint64_t *total)
+{
+	do {
+		cutKind = (enum SimCut)(Random() % CUT_KINDS);
+	} while (total[cutKind] == 0);
+	cutAt = events[cutKind] + 1 + Random() % total[cutKind];
+}
+
+/**
+ * @fn		static int PowerCut(const char *path, uint32_t runs, uint64_t seed)
+ * @brief	Installs update runs times with the power cut at random points
+ * @details	Run r is seeded with seed + r, "powercut old update 1 <seed + r>" repeats it.
+ */
+static int PowerCut(const char *path, uint32_t runs, uint64_t seed)
+{
+	struct Blob update;
+	uint64_t totalEvents[2][CUT_KINDS];
+	uint32_t cutsByKind[CUT_KINDS] = {0};
+	uint32_t failures = 0;
+	uint32_t bootsMax = 0;
+	uint64_t bootsTotal = 0;
+
+	if (!LoadFile(path, &update) || !DeviceCreate(&update, path) || !InstallReference(&update, path)) {
+		return 1;
+	}
+
+	//Events of an uninterrupted run decide where the cuts can land
+	for (int bad = 0; bad < 2; bad++) {
+		bool watchdogReset = false;
+		bool brick;
+
+		DeviceRestore();
+		memset(events, 0, sizeof(events));
+		cutAt = 0;
+		for (int boot = 0; boot < BOOT_MAX; boot++) {
+			enum SimBoot result = SimPowerOn(bad, &watchdogReset, &brick);
+			if (result == SIM_FAST && !watchdogReset) {
+				break;
+			}
+		}
+		memcpy(totalEvents[bad], events, sizeof(events));
+	}
+	printf("%s: %lu bytes, cut points %llu erase %llu page %llu SD, %llu %llu %llu with a bad release\n", path,
+		   (unsigned long)update.len, (unsigned long long)totalEvents[0][CUT_ERASE],
+		   (unsigned long long)totalEvents[0][CUT_PAGE], (unsigned long long)totalEvents[0][CUT_SECTOR],
+		   (unsigned long long)totalEvents[1][CUT_ERASE], (unsigned long long)totalEvents[1][CUT_PAGE],
+		   (unsigned long long)totalEvents[1][CUT_SECTOR]);
+
+	for (uint32_t run = 0; run < runs; run++) {
+		bool bad = ((seed + run) & 1) != 0;
+		bool watchdogReset = false;
+		bool settled = false;
+		const char *failure = NULL;
+		uint32_t cuts = 0;
+		uint32_t cutsWanted;
+		uint32_t boot;
+
+		rng = (seed + run) * 2654435761ULL + 1;
+		cutsWanted = 1 + Random() % CUTS_MAX;
+		DeviceRestore();
+		violations = 0;
+		logNext = 0;
+		memset(events, 0, sizeof(events));
+		PowerCutPlan(totalEvents[bad]);
+
+		for (boot = 1; boot <= BOOT_MAX && failure == NULL; boot++) {
+			bool brick;
+			enum SimBoot result = SimPowerOn(bad, &watchdogReset, &brick);
+
+			if (result == SIM_CUT) {
+				cutsByKind[cutKind]++;
+				cuts++;
+				cutAt = 0;
+				if (cuts < cutsWanted) {
+					PowerCutPlan(totalEvents[bad]);
+				}
+				continue;
+			}
+			if (brick) {
+				failure = "started an image that is neither the old nor the new one";
+			} else if (violations != 0) {
+				failure = "broke an NVM rule";
+			} else if (result == SIM_FAST && !watchdogReset) {
+				settled = true;
+				break;
+			}
+		}
+
+		if (failure == NULL && !settled) {
+			failure = "did not settle";
+		} else if (failure == NULL && !ImageIs(bad ? &oldImage : &newImage)) {
+			failure = bad ? "settled on the bad release" : "settled without the update";
+		}
+		if (boot > bootsMax) {
+			bootsMax = boot;
+		}
+		bootsTotal += boot;
+
+		if (failure != NULL) {
+			failures++;
+			if (failures <= 5) {
+				fprintf(stderr, "Run %lu (seed %llu, %s release, %lu cuts): %s after %lu boots\n", (unsigned long)run,
+						(unsigned long long)(seed + run), bad ? "bad" : "good", (unsigned long)cuts, failure,
+						(unsigned long)boot);
+				LogDump();
+			}
+		}
+	}
+
+	printf("%lu runs, %lu failed; cuts in erase %lu, page write %lu, SD write %lu; boots to settle avg %.1f max %lu\n",
+		   (unsigned long)runs, (unsigned long)failures, (unsigned long)cutsByKind[CUT_ERASE],
+		   (unsigned long)cutsByKind[CUT_PAGE], (unsigned long)cutsByKind[CUT_SECTOR],
+		   runs ? (double)bootsTotal / runs : 0.0, (unsigned long)bootsMax);
+	return failures != 0;
+}
+
+/**
+ * @fn		static int Rollback(const char *path)
+ * @brief	Installs update as a release that never confirms and follows it back to the old image
+ */
+static int Rollback(const char *path)
+{
+	struct Blob update;
+	struct BootState state;
+	bool watchdogReset = false;
+	bool brick;
+
+	if (!LoadFile(path, &update) || !DeviceCreate(&update, path) || !InstallReference(&update, path)) {
+		return 1;
+	}
+	DeviceRestore();
+	cutAt = 0;
+
+	for (int boot = 1; boot <= BOOT_TRIAL_ATTEMPTS + 2; boot++) {
+		bool wasWatchdog = watchdogReset;
+		uint64_t startUs = clockUs;
+		enum SimBoot result = SimPowerOn(true, &watchdogReset, &brick);
+
+		BootStateRead(&simPlatform, &state);
+		printf("  boot %d%s: %s, running %s, generation %lu, trial boots %lu, rollbacks %lu, %.0f ms\n", boot,
+			   wasWatchdog ? " (watchdog)" : "", result == SIM_FAST ? "fast path" : "update path",
+			   ImageIs(&newImage) ? "new" : ImageIs(&oldImage) ? "old" : "???", (unsigned long)state.generation,
+			   (unsigned long)state.trialBoots, (unsigned long)state.rollbacks, (clockUs - startUs) / 1000.0);
+		if (brick || violations != 0) {
+			LogDump();
+			return 1;
+		}
+		if (result == SIM_FAST && !watchdogReset && ImageIs(&oldImage) && state.rollbacks == 1) {
+			printf("Back on the old image after %d boots, rollback flashed in %lu ms\n", boot,
+				   (unsigned long)state.rollbackMs);
+			return 0;
+		}
+	}
+	fprintf(stderr, "Not back on the old image after %d boots\n", BOOT_TRIAL_ATTEMPTS + 2);
+	LogDump();
+	return 1;
+}
+
+/**
+ * @fn		static bool JournalFileIo(const char *name, BYTE mode, uint32_t offset, void *data, UINT len)
+ * @brief	One access of TelemetryJournal.c: open, seek, read or write, close
+ */
+static bool JournalFileIo(const char *name, BYTE mode, uint32_t offset, void *data, UINT len)
+{
+	FIL file;
+	UINT done = 0;
+	FRESULT res = f_open(&file, name, mode);
+
+	if (res != FR_OK) {
+		return false;
+	}
+	res = f_lseek(&file, offset);
+	if (res == FR_OK) {
+		res = (mode & FA_WRITE) ? f_write(&file, data, len, &done) : f_read(&file, data, len, &done);
+	}
+	return (f_close(&file) == FR_OK) && res == FR_OK && done == len;
+}
+
+/**
+ * @fn		static int Journal(uint32_t records)
+ * @brief	The application's telemetry journal on a fresh card: records appended offline, then replayed
+ * @details	As JournalWriteSector() and JournalReadSector() do, every record is a
+ *			whole sector written or read with its own open and close, and the
+ *			position file is rewritten after each one by JournalSavePosition().
+ */
+static int Journal(uint32_t records)
+{
+	uint8_t record[JOURNAL_RECORD];
+	uint8_t position[JOURNAL_POS_LEN];
+
+	if (!DiskFormat()) {
+		return 1;
+	}
+	memset(&fs, 0, sizeof(fs));
+	f_mount(0, &fs);
+
+	for (int phase = 0; phase < 2; phase++) {
+		uint64_t startUs = clockUs;
+
+		memset(&stats, 0, sizeof(stats));
+		disk_cache_clear_stats();
+		for (uint32_t r = 0; r < records; r++) {
+			bool ok;
+
+			memset(record, (int)r, sizeof(record));
+			if (phase == 0) {
+				ok = JournalFileIo("0:telem.jnl", FA_OPEN_ALWAYS | FA_WRITE, r * JOURNAL_RECORD, record, JOURNAL_RECORD);
+			} else {
+				ok = JournalFileIo("0:telem.jnl", FA_OPEN_EXISTING | FA_READ, r * JOURNAL_RECORD, record, JOURNAL_RECORD) &&
+					 record[0] == (uint8_t)r && record[JOURNAL_RECORD - 1] == (uint8_t)r;
+			}
+			memset(position, (int)r, sizeof(position));
+			if (!ok || !JournalFileIo("0:telem.pos", FA_CREATE_ALWAYS | FA_WRITE, 0, position, sizeof(position))) {
+				fprintf(stderr, "Journal %s failed at record %lu\n", phase == 0 ? "append" : "replay", (unsigned long)r);
+				return 1;
+			}
+		}
+
+		uint64_t us = clockUs - startUs;
+		printf("  %-10s %7.0f ms for %lu records, %.1f ms each, %6.1f KB/s  sectors %4lu read %4lu written\n",
+			   phase == 0 ? "append" : "replay", us / 1000.0, (unsigned long)records, records ? us / 1000.0 / records : 0.0,
+			   us ? records * (double)JOURNAL_RECORD * 1000000.0 / us / 1024.0 : 0.0, (unsigned long)stats.sectorsRead,
+			   (unsigned long)stats.sectorsWritten);
+		CacheReport();
+	}
+	return 0;
+}
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+
+int main(int argc, char **argv)
+{
+	if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+		verbose = true;
+		argc--;
+		argv++;
+	}
+	if (argc >= 2 && strcmp(argv[1], "journal") == 0) {
+		return Journal(argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 0) : 200);
+	}
+	if (argc < 4 || !LoadFile(argv[2], &oldImage) || oldImage.len > APP_MAX_SIZE) {
+		fprintf(stderr, "usage: boot_sim [-v] bench <old.bin> <update>...\n"
+						"       boot_sim [-v] powercut <old.bin> <update> [runs] [seed]\n"
+						"       boot_sim [-v] rollback <old.bin> <update>\n"
+						"       boot_sim journal [records]\n");
+		return 2;
+	}
+
+	if (strcmp(argv[1], "bench") == 0) {
+		return Bench(argc - 3, &argv[3]);
+	}
+	if (strcmp(argv[1], "powercut") == 0) {
+		return PowerCut(argv[3], argc > 4 ? (uint32_t)strtoul(argv[4], NULL, 0) : 200,
+						argc > 5 ? strtoull(argv[5], NULL, 0) : 1);
+	}
+	if (strcmp(argv[1], "rollback") == 0) {
+		return Rollback(argv[3]);
+	}
+	fprintf(stderr, "Unknown command %s\n", argv[1]);
+	return 2;
+}
@@ -0,0 +1,25 @@
+/**************************************************************************//**
+* @file      asf.h
+* @brief     Host stand-in for the ASF umbrella header used by the bootloader simulator
+* @details   Only what BootUpdate.c, BootState.c, DeltaPatch.c and LzImage.c use:
+*            FatFs, the software CRC32 service and the SD card LUN.
+******************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "ff.h"
+
+#define LUN_ID_SD_MMC_0_MEM         0
+
+enum status_code {
+	STATUS_OK = 0
+};
+
+typedef uint32_t crc32_t;
+
+enum status_code crc32_recalculate(const void *data, size_t length, crc32_t *crc);
@@ -0,0 +1,568 @@
+/**************************************************************************//**
+* @file      delta_patch.c
+* @brief     Builds delta patches for the bootloader and round-trips them on the host
+* @details   The generator greedily covers each row of the new image with copies
+*            from the old image and literals, preferring the distance of the
+*            previous copy because code that only moved keeps it for long runs.
+*            Copies only come from rows that are still intact when the bootloader
+*            rebuilds the row; the patch is built in both directions and the
+*            smaller one is kept (see DeltaPatch.h).
+*
+*            "apply" and "test" run the unmodified Bootloader/src/DeltaPatch/DeltaPatch.c
+*            on a simulated flash that starts with the old image and is overwritten
+*            row by row in place, exactly as the bootloader does. "test" also checks
+*            that a corrupted patch is refused by the dry run before anything is
+*            written. "selftest" derives patch releases from one real build by
+*            inserting, removing and changing code and round-trips each of them.
+*
+*            Build and run from the repository root:
+*
+*              gcc -O2 -std=gnu99 -ITools/DeltaPatch/host -IBootloader/src \
+*                  Tools/DeltaPatch/delta_patch.c Bootloader/src/DeltaPatch/DeltaPatch.c -o delta_patch
+*              ./delta_patch diff old/Application.bin new/Application.bin Application.patch
+*              ./delta_patch test Bootloader/Debug/Bootloader.bin Bootloader/Debug/Bootloader_REPLACE_ME.bin
+*              ./delta_patch selftest Application/Debug/Application.bin
+*
+*            Upload Application.patch with its manifest (Tools/OtaManifest) and
+*            "format patch" added to the manifest.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "DeltaPatch/DeltaPatch.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define CRC32_POLYNOMIAL    0xEDB88320UL    ///< Reflected IEEE 802.3 polynomial
+#define HASH_BITS           16
+#define HASH_MIN_MATCH      4       ///< Bytes hashed to find copy candidates
+#define HASH_MAX_TRIES      64      ///< Candidates compared per position
+#define IMAGE_MAX           (256 * 1024UL)  ///< SAMD21J18 flash
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// A file in memory
+struct Blob {
+	uint8_t *data;
+	uint32_t len;
+};
+
+/// Growing output buffer
+struct Output {
+	uint8_t *data;
+	uint32_t len;
+	uint32_t cap;
+};
+
+/// Patch body reader and simulated flash for DeltaPatchApply()
+struct HostIo {
+	const uint8_t *body;
+	uint32_t bodyLen;
+	uint32_t pos;
+	uint8_t *flash;
+	uint32_t rowsWritten;		///< Rows erased and programmed, unchanged rows are skipped as in the bootloader
+};
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static int32_t hashHead[1 << HASH_BITS];
+static int32_t *hashPrev;
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static uint32_t Crc32Update(uint32_t crc, const uint8_t *data, uint32_t len)
+ * @brief	Continues a CRC32 over len bytes, 0 starts a new one
+ */
+static uint32_t Crc32Update(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	static uint32_t table[256];
+
+	if (table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int bit = 0; bit < 8; bit++) {
+				c = (c & 1) ? (c >> 1) ^ CRC32_POLYNOMIAL : c >> 1;
+			}
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len-- > 0) {
+		crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static void OutputByte(struct Output *out, uint8_t value)
+{
+	if (out->len == out->cap) {
+		out->cap = out->cap ? out->cap * 2 : 4096;
+		out->data = realloc(out->data, out->cap);
+		if (out->data == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	out->data[out->len++] = value;
+}
+
+static uint32_t VarintSize(int32_t distance)
+{
+	uint32_t value = ((uint32_t)distance << 1) ^ (uint32_t)(distance >> 31);
+	uint32_t size = 1;
+
+	while (value >= 0x80) {
+		value >>= 7;
+		size++;
+	}
+	return size;
+}
+
+static void OutputCopy(struct Output *out, uint32_t len, int32_t distance)
+{
+	while (len > 0) {
+		uint32_t n = len > DELTA_PATCH_OP_MAX_LEN ? DELTA_PATCH_OP_MAX_LEN : len;
+		uint32_t value = ((uint32_t)distance << 1) ^ (uint32_t)(distance >> 31);
+
+		OutputByte(out, (uint8_t)(DELTA_PATCH_OP_COPY | (n - 1)));
+		while (value >= 0x80) {
+			OutputByte(out, (uint8_t)(value | 0x80));
+			value >>= 7;
+		}
+		OutputByte(out, (uint8_t)value);
+		len -= n;
+	}
+}
+
+static void OutputLiteral(struct Output *out, const uint8_t *data, uint32_t len)
+{
+	while (len > 0) {
+		uint32_t n = len > DELTA_PATCH_OP_MAX_LEN ? DELTA_PATCH_OP_MAX_LEN : len;
+
+		OutputByte(out, (uint8_t)(n - 1));
+		for (uint32_t i = 0; i < n; i++) {
+			OutputByte(out, data[i]);
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+static uint32_t Hash(const uint8_t *p)
+{
+	uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	return (uint32_t)(v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static void BuildIndex(const struct Blob *old)
+{
+	free(hashPrev);
+	hashPrev = malloc((old->len + 1) * sizeof(*hashPrev));
+	memset(hashHead, 0xFF, sizeof(hashHead));
+	for (uint32_t i = 0; i + HASH_MIN_MATCH <= old->len; i++) {
+		uint32_t h = Hash(&old->data[i]);
+		hashPrev[i] = hashHead[h];
+		hashHead[h] = (int32_t)i;
+	}
+}
+
+/**
+ * @fn		static uint32_t MatchLength(...)
+ * @brief	Length of the copy from old at src to new at p, within the bytes the bootloader may still read
+ */
+static uint32_t MatchLength(const struct Blob *old, const struct Blob *new, int64_t src, uint32_t p, uint32_t rowStart, uint32_t rowEnd, int backward)
+{
+	uint32_t limit = old->len;
+	uint32_t n = 0;
+
+	if (src < 0 || src >= old->len) {
+		return 0;
+	}
+	if (backward) {
+		if (limit > rowStart + DELTA_PATCH_ROW_SIZE) {
+			limit = rowStart + DELTA_PATCH_ROW_SIZE;
+		}
+	} else if (src < rowStart) {
+		return 0;
+	}
+	while (p + n < rowEnd && src + n < limit && old->data[src + n] == new->data[p + n]) {
+		n++;
+	}
+	return n;
+}
+
+/**
+ * @fn		static void Diff(const struct Blob *old, const struct Blob *new, int backward, struct Output *out)
+ * @brief	Writes header and body of a patch in one direction
+ */
+static void Diff(const struct Blob *old, const struct Blob *new, int backward, struct Output *out)
+{
+	uint32_t rows = (new->len + DELTA_PATCH_ROW_SIZE - 1) / DELTA_PATCH_ROW_SIZE;
+	struct DeltaPatchHeader header = {0};
+	uint8_t row[DELTA_PATCH_ROW_SIZE];
+	int32_t lastDistance = 0;
+	uint32_t streamCrc = 0;
+
+	out->len = 0;
+	for (int i = 0; i < DELTA_PATCH_HEADER_SIZE; i++) {
+		OutputByte(out, 0);
+	}
+
+	for (uint32_t i = 0; i < rows; i++) {
+		uint32_t r = backward ? rows - 1 - i : i;
+		uint32_t rowStart = r * DELTA_PATCH_ROW_SIZE;
+		uint32_t rowEnd = rowStart + DELTA_PATCH_ROW_SIZE < new->len ? rowStart + DELTA_PATCH_ROW_SIZE : new->len;
+		uint32_t literalStart = rowStart;
+		uint32_t p = rowStart;
+
+		while (p < rowEnd) {
+			int32_t bestDistance = lastDistance;
+			uint32_t best = MatchLength(old, new, (int64_t)p + lastDistance, p, rowStart, rowEnd, backward);
+			int32_t bestGain = (int32_t)best - (int32_t)VarintSize(lastDistance) - 1;
+
+			if (p + HASH_MIN_MATCH <= new->len) {
+				int tries = 0;
+				for (int32_t c = hashHead[Hash(&new->data[p])]; c >= 0 && tries < HASH_MAX_TRIES; c = hashPrev[c], tries++) {
+					uint32_t n = MatchLength(old, new, c, p, rowStart, rowEnd, backward);
+					int32_t distance = c - (int32_t)p;
+					int32_t gain = (int32_t)n - (int32_t)VarintSize(distance) - 1;
+					if (gain > bestGain) {
+						best = n;
+						bestDistance = distance;
+						bestGain = gain;
+					}
+				}
+			}
+
+			// A copy must save more than the literal op byte it may split
+			if (bestGain > 1 || (best > 0 && bestDistance == lastDistance && bestGain > 0)) {
+				OutputLiteral(out, &new->data[literalStart], p - literalStart);
+				OutputCopy(out, best, bestDistance);
+				lastDistance = bestDistance;
+				p += best;
+				literalStart = p;
+			} else {
+				p++;
+			}
+		}
+		OutputLiteral(out, &new->data[literalStart], rowEnd - literalStart);
+
+		memset(row, 0xFF, sizeof(row));
+		memcpy(row, &new->data[rowStart], rowEnd - rowStart);
+		streamCrc = Crc32Update(streamCrc, row, rowEnd - rowStart);
+	}
+
+	header.flags = backward ? DELTA_PATCH_BACKWARD : 0;
+	header.oldLength = old->len;
+	header.oldCrc32 = Crc32Update(0, old->data, old->len);
+	header.newLength = new->len;
+	header.newCrc32 = Crc32Update(0, new->data, new->len);
+	header.streamCrc32 = streamCrc;
+	DeltaPatchWriteHeader(&header, Crc32Update, out->data);
+}
+
+/**
+ * @fn		static void DiffBest(const struct Blob *old, const struct Blob *new, struct Output *out)
+ * @brief	Builds the patch in both directions and keeps the smaller one
+ */
+static void DiffBest(const struct Blob *old, const struct Blob *new, struct Output *out)
+{
+	struct Output backward = {0};
+
+	BuildIndex(old);
+	Diff(old, new, 0, out);
+	Diff(old, new, 1, &backward);
+	if (backward.len < out->len) {
+		free(out->data);
+		*out = backward;
+	} else {
+		free(backward.data);
+	}
+}
+
+static int32_t HostRead(void *ctx, uint8_t *buffer, uint32_t len)
+{
+	struct HostIo *io = ctx;
+	uint32_t n = io->bodyLen - io->pos;
+
+	if (n > len) {
+		n = len;
+	}
+	memcpy(buffer, &io->body[io->pos], n);
+	io->pos += n;
+	return (int32_t)n;
+}
+
+static bool HostWriteRow(void *ctx, uint32_t row, const uint8_t *data)
+{
+	struct HostIo *io = ctx;
+
+	if (memcmp(&io->flash[row * DELTA_PATCH_ROW_SIZE], data, DELTA_PATCH_ROW_SIZE) == 0) {
+		return true;
+	}
+	memcpy(&io->flash[row * DELTA_PATCH_ROW_SIZE], data, DELTA_PATCH_ROW_SIZE);
+	io->rowsWritten++;
+	return true;
+}
+
+/**
+ * @fn		static enum DeltaPatchResult Apply(uint8_t *flash, const uint8_t *patch, uint32_t patchLen, uint32_t *newLength, uint32_t *rowsWritten)
+ * @brief	Does what the bootloader does: header, base check, dry run, then the rows in place
+ * @param	flash Simulated application flash holding the old image, IMAGE_MAX bytes
+ * @param	rowsWritten Rows that had to be erased, the others already held their new data
+ */
+static enum DeltaPatchResult Apply(uint8_t *flash, const uint8_t *patch, uint32_t patchLen, uint32_t *newLength, uint32_t *rowsWritten)
+{
+	struct DeltaPatchHeader header;
+	struct HostIo host = {0};
+	struct DeltaPatchIo io = {flash, HostRead, NULL, Crc32Update, &host};
+	enum DeltaPatchResult result;
+
+	if (patchLen < DELTA_PATCH_HEADER_SIZE) {
+		return DELTA_PATCH_ERR_HEADER;
+	}
+	result = DeltaPatchReadHeader(patch, Crc32Update, &header);
+	if (result != DELTA_PATCH_OK) {
+		return result;
+	}
+	if (header.oldLength > IMAGE_MAX || header.newLength > IMAGE_MAX || Crc32Update(0, flash, header.oldLength) != header.oldCrc32) {
+		return DELTA_PATCH_ERR_BASE;
+	}
+
+	host.body = patch + DELTA_PATCH_HEADER_SIZE;
+	host.bodyLen = patchLen - DELTA_PATCH_HEADER_SIZE;
+	host.flash = flash;
+	result = DeltaPatchApply(&header, &io);
+	if (result != DELTA_PATCH_OK) {
+		return result;
+	}
+
+	host.pos = 0;
+	io.writeRow = HostWriteRow;
+	result = DeltaPatchApply(&header, &io);
+	if (result == DELTA_PATCH_OK && Crc32Update(0, flash, header.newLength) != header.newCrc32) {
+		result = DELTA_PATCH_ERR_RESULT;
+	}
+	*newLength = header.newLength;
+	*rowsWritten = host.rowsWritten;
+	return result;
+}
+
+static int ReadBlob(const char *path, struct Blob *blob)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	blob->data = malloc(IMAGE_MAX + 1);
+	blob->len = (uint32_t)fread(blob->data, 1, IMAGE_MAX + 1, f);
+	fclose(f);
+	if (blob->len == 0 || blob->len > IMAGE_MAX) {
+		fprintf(stderr, "%s: empty or larger than the flash\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int WriteFile(const char *path, const uint8_t *data, uint32_t len)
+{
+	FILE *f = fopen(path, "wb");
+
+	if (f == NULL || fwrite(data, 1, len, f) != len) {
+		perror(path);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+/**
+ * @fn		static int RoundTrip(const char *name, const struct Blob *old, const struct Blob *new)
+ * @brief	Diffs, applies in place, compares, then checks a corrupted patch leaves the flash alone
+ * @return	0 on success
+ */
+static int RoundTrip(const char *name, const struct Blob *old, const struct Blob *new)
+{
+	struct Output patch = {0};
+	uint8_t *flash = malloc(IMAGE_MAX);
+	uint32_t newLength = 0;
+	uint32_t rowsWritten = 0;
+	int failed = 0;
+
+	DiffBest(old, new, &patch);
+
+	memset(flash, 0xFF, IMAGE_MAX);
+	memcpy(flash, old->data, old->len);
+	enum DeltaPatchResult result = Apply(flash, patch.data, patch.len, &newLength, &rowsWritten);
+	uint32_t rowsErased = rowsWritten;
+	if (result != DELTA_PATCH_OK || newLength != new->len || memcmp(flash, new->data, new->len) != 0) {
+		printf("FAIL %s: result %d\n", name, result);
+		failed = 1;
+	}
+
+	// Flip one body byte in the middle: the dry run must refuse it with the old image untouched
+	if (patch.len > DELTA_PATCH_HEADER_SIZE) {
+		patch.data[DELTA_PATCH_HEADER_SIZE + (patch.len - DELTA_PATCH_HEADER_SIZE) / 2] ^= 0x5A;
+		memset(flash, 0xFF, IMAGE_MAX);
+		memcpy(flash, old->data, old->len);
+		result = Apply(flash, patch.data, patch.len, &newLength, &rowsWritten);
+		if (result == DELTA_PATCH_OK || memcmp(flash, old->data, old->len) != 0) {
+			printf("FAIL %s: corrupted patch was applied (result %d)\n", name, result);
+			failed = 1;
+		}
+	}
+
+	printf("%-28s old %6lu new %6lu patch %6lu (%5.1f%% of the image, %s), rows erased %lu/%lu\n", name, (unsigned long)old->len,
+		   (unsigned long)new->len, (unsigned long)patch.len, 100.0 * patch.len / new->len,
+		   (patch.data[6] & DELTA_PATCH_BACKWARD) ? "backward" : "forward", (unsigned long)rowsErased,
+		   (unsigned long)((new->len + DELTA_PATCH_ROW_SIZE - 1) / DELTA_PATCH_ROW_SIZE));
+	free(patch.data);
+	free(flash);
+	return failed;
+}
+
+/**
+ * @fn		static int SelfTest(const struct Blob *base)
+ * @brief	Patch releases made from one real build: code inserted, removed, changed in place
+ * @details	Inserting or removing code shifts everything after it, so branch offsets and
+ *			literal pool addresses past the edit change too. That is imitated by adjusting
+ *			every word that looks like a flash address past the edit by the shift.
+ */
+static int SelfTest(const struct Blob *base)
+{
+	static const struct {
+		const char *name;
+		uint32_t atPercent;
+		int32_t shift;		///< Bytes inserted (>0) or removed (<0)
+		uint32_t tweaks;	///< Scattered single byte changes
+	} cases[] = {
+		{"identical", 0, 0, 0},
+		{"constant tweak", 50, 0, 4},
+		{"insert 64 at 20%", 20, 64, 8},
+		{"insert 1 KB at 70%", 70, 1024, 16},
+		{"remove 96 at 35%", 35, -96, 8},
+		{"remove 2 KB at 10%", 10, -2048, 16},
+		{"insert 4 KB at 5%", 5, 4096, 64},
+	};
+	int failed = 0;
+	uint32_t seed = 12345;
+
+	for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+		struct Blob new;
+		uint32_t at = (uint32_t)((uint64_t)base->len * cases[c].atPercent / 100) & ~3UL;
+		int32_t shift = cases[c].shift;
+
+		new.data = malloc(IMAGE_MAX);
+		if (shift >= 0) {
+			memcpy(new.data, base->data, at);
+			for (int32_t i = 0; i < shift; i++) {
+				seed = seed * 1103515245 + 12345;
+				new.data[at + i] = (uint8_t)(seed >> 16);
+			}
+			memcpy(&new.data[at + shift], &base->data[at], base->len - at);
+		} else {
+			memcpy(new.data, base->data, at);
+			memcpy(&new.data[at], &base->data[at - shift], base->len - at + shift);
+		}
+		new.len = base->len + shift;
+
+		// Addresses past the edit move with it
+		for (uint32_t i = 0; shift != 0 && i + 4 <= new.len; i += 4) {
+			uint32_t word = new.data[i] | (new.data[i + 1] << 8) | (new.data[i + 2] << 16) | ((uint32_t)new.data[i + 3] << 24);
+			uint32_t addr = word & ~1UL;
+			if (addr >= 0x12000 + at && addr < 0x12000 + base->len) {
+				word += shift;
+				new.data[i] = (uint8_t)word;
+				new.data[i + 1] = (uint8_t)(word >> 8);
+				new.data[i + 2] = (uint8_t)(word >> 16);
+				new.data[i + 3] = (uint8_t)(word >> 24);
+			}
+		}
+		for (uint32_t t = 0; t < cases[c].tweaks; t++) {
+			seed = seed * 1103515245 + 12345;
+			new.data[(seed >> 8) % new.len] ^= 0x24;
+		}
+
+		failed |= RoundTrip(cases[c].name, base, &new);
+		free(new.data);
+	}
+	return failed;
+}
+
+static void Usage(const char *self)
+{
+	fprintf(stderr,
+			"usage: %s diff old.bin new.bin out.patch\n"
+			"       %s apply old.bin in.patch out.bin\n"
+			"       %s test old.bin new.bin [old.bin new.bin ...]\n"
+			"       %s selftest build.bin\n",
+			self, self, self, self);
+}
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+int main(int argc, char **argv)
+{
+	struct Blob a, b;
+
+	if (argc == 5 && strcmp(argv[1], "diff") == 0) {
+		struct Output patch = {0};
+		if (ReadBlob(argv[2], &a) || ReadBlob(argv[3], &b)) {
+			return 1;
+		}
+		DiffBest(&a, &b, &patch);
+		printf("%lu bytes, %.1f%% of %s\n", (unsigned long)patch.len, 100.0 * patch.len / b.len, argv[3]);
+		return WriteFile(argv[4], patch.data, patch.len) ? 1 : 0;
+	}
+	if (argc == 5 && strcmp(argv[1], "apply") == 0) {
+		uint8_t *flash = malloc(IMAGE_MAX);
+		uint32_t newLength = 0;
+		uint32_t rowsWritten = 0;
+		if (ReadBlob(argv[2], &a) || ReadBlob(argv[3], &b)) {
+			return 1;
+		}
+		memset(flash, 0xFF, IMAGE_MAX);
+		memcpy(flash, a.data, a.len);
+		enum DeltaPatchResult result = Apply(flash, b.data, b.len, &newLength, &rowsWritten);
+		if (result != DELTA_PATCH_OK) {
+			fprintf(stderr, "patch refused, result %d\n", result);
+			return 1;
+		}
+		return WriteFile(argv[4], flash, newLength) ? 1 : 0;
+	}
+	if (argc >= 4 && argc % 2 == 0 && strcmp(argv[1], "test") == 0) {
+		int failed = 0;
+		for (int i = 2; i < argc; i += 2) {
+			if (ReadBlob(argv[i], &a) || ReadBlob(argv[i + 1], &b)) {
+				return 1;
+			}
+			failed |= RoundTrip("old -> new", &a, &b);
+			failed |= RoundTrip("new -> old", &b, &a);
+		}
+		return failed;
+	}
+	if (argc == 3 && strcmp(argv[1], "selftest") == 0) {
+		if (ReadBlob(argv[2], &a)) {
+			return 1;
+		}
+		return SelfTest(&a);
+	}
+
+	Usage(argv[0]);
+	return 2;
+}
@@ -0,0 +1,10 @@
+/**************************************************************************//**
+* @file      asf.h
+* @brief     Host stand-in for the ASF umbrella header used by the delta patch tool
+******************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
@@ -0,0 +1,187 @@
+/**************************************************************************//**
+* @file      format_bench.c
+* @brief     Host benchmark of SerialConsole/FastFormat.c against the C library printf
+* @details   Runs the format strings the firmware actually uses (telemetry, CLI and
+*            log lines) through FmtPrintf() and snprintf(), checks that both produce
+*            the same text, and reports time per call and the peak stack each path
+*            touches. Stack use is measured by running every formatter on its own
+*            thread whose stack is painted with a pattern beforehand, the same way
+*            FreeRTOS computes uxTaskGetStackHighWaterMark(), minus what the same
+*            loop uses with a formatter that does nothing.
+*
+*            Build and run from the repository root:
+*
+*              gcc -O2 -std=gnu99 -IApplication/src \
+*                  Tools/FormatBench/format_bench.c \
+*                  Application/src/SerialConsole/FastFormat.c -lpthread -o format_bench
+*              ./format_bench [iterations]
+*
+*            The host library is glibc, not newlib-nano, and the core has an FPU,
+*            so both ratios understate the gap on the SAMD21. On target, compare
+*            the CLI "stack" output of a normal build and an FMT_USE_NEWLIB build.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "SerialConsole/FastFormat.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define BENCH_STACK_SIZE    (256 * 1024)
+#define BENCH_STACK_PAINT   0xA5
+#define BENCH_OUT_SIZE      128
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+typedef int (*FormatFunc)(char *buffer, size_t size, const char *format, ...);
+
+struct BenchJob {
+	FormatFunc func;
+	long iterations;
+	double nsPerCall;
+	unsigned char *stackTop;	///< Address of a local at job entry, below the thread descriptor
+};
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static const char *caseNames[] = {"IMU CLI", "env CLI", "air CLI", "log int", "log str"};
+static volatile float sampleX = -12.0f, sampleY = 31.5f, sampleZ = 1002.25f;
+static volatile float sampleT = 23.41f, sampleH = 41.87f, sampleP = 100832.42f, sampleAir = 4.37f;
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+static double NowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/// Formats case i with func, the same arguments the firmware call sites pass
+static int FormatCase(FormatFunc func, int i, char *out)
+{
+	switch (i) {
+		case 0:
+			return func(out, BENCH_OUT_SIZE, "Acc [mg]: %0.2f %0.2f %0.2f\r\n", sampleX, sampleY, sampleZ);
+		case 1:
+			return func(out, BENCH_OUT_SIZE, "T: %0.2f H: %0.2f P: %0.2f \r\n", sampleT, sampleH, sampleP);
+		case 2:
+			return func(out, BENCH_OUT_SIZE, "AirFlow: %0.2f m/s \r\n", sampleAir);
+		case 3:
+			return func(out, BENCH_OUT_SIZE, "store_file_packet: received[%lu], file size[%lu]\r\n", 123456ul, 229376ul);
+		default:
+			return func(out, BENCH_OUT_SIZE, "Connect fail to server(%s)! retry it automatically.\r\n", "broker.hivemq.com");
+	}
+}
+
+/// Does nothing, measures what the thread and the benchmark loop itself put on the stack
+static int NoFormat(char *buffer, size_t size, const char *format, ...)
+{
+	(void)size;
+	(void)format;
+	buffer[0] = '\0';
+	return 0;
+}
+
+static void *RunJob(void *arg)
+{
+	struct BenchJob *job = arg;
+	unsigned char marker;
+	char out[BENCH_OUT_SIZE];
+	int cases = sizeof(caseNames) / sizeof(caseNames[0]);
+
+	job->stackTop = &marker;
+	double start = NowNs();
+	for (long n = 0; n < job->iterations; n++) {
+		FormatCase(job->func, (int)(n % cases), out);
+	}
+	job->nsPerCall = (NowNs() - start) / job->iterations;
+	return NULL;
+}
+
+/// Runs job on a painted stack and returns the number of bytes it touched
+static size_t RunOnPaintedStack(struct BenchJob *job)
+{
+	unsigned char *stack = malloc(BENCH_STACK_SIZE);
+	pthread_attr_t attr;
+	pthread_t thread;
+	size_t used = 0;
+
+	memset(stack, BENCH_STACK_PAINT, BENCH_STACK_SIZE);
+	pthread_attr_init(&attr);
+	pthread_attr_setstack(&attr, stack, BENCH_STACK_SIZE);
+	if (pthread_create(&thread, &attr, RunJob, job) == 0) {
+		pthread_join(thread, NULL);
+		/* The stack grows down, so the untouched paint is at the low end */
+		size_t untouched = 0;
+		while (untouched < BENCH_STACK_SIZE && stack[untouched] == BENCH_STACK_PAINT) {
+			untouched++;
+		}
+		used = (size_t)(job->stackTop - &stack[untouched]);
+	}
+	pthread_attr_destroy(&attr);
+	free(stack);
+	return used;
+}
+
+static int CheckOutputs(void)
+{
+	int mismatches = 0;
+
+	for (int i = 0; i < (int)(sizeof(caseNames) / sizeof(caseNames[0])); i++) {
+		char fast[BENCH_OUT_SIZE], libc[BENCH_OUT_SIZE];
+		FormatCase(FmtPrintf, i, fast);
+		FormatCase(snprintf, i, libc);
+		if (strcmp(fast, libc) != 0) {
+			printf("mismatch in %s:\n  fast: %s  libc: %s", caseNames[i], fast, libc);
+			mismatches++;
+		}
+	}
+	return mismatches;
+}
+
+/******************************************************************************
+* Main
+******************************************************************************/
+int main(int argc, char **argv)
+{
+	long iterations = (argc > 1) ? atol(argv[1]) : 500000;
+	struct BenchJob fast = {FmtPrintf, iterations, 0, NULL};
+	struct BenchJob libc = {snprintf, iterations, 0, NULL};
+	struct BenchJob none = {NoFormat, iterations, 0, NULL};
+
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 2;
+	}
+
+	/* Resolve every library call once here so lazy binding does not land on the measured stacks */
+	NowNs();
+	if (CheckOutputs() != 0) {
+		return 1;
+	}
+	printf("outputs identical for %zu call sites\n\n", sizeof(caseNames) / sizeof(caseNames[0]));
+
+	size_t baseStack = RunOnPaintedStack(&none);
+	size_t fastStack = RunOnPaintedStack(&fast) - baseStack;
+	size_t libcStack = RunOnPaintedStack(&libc) - baseStack;
+
+	printf("%-12s %10s %12s\n", "formatter", "ns/call", "stack bytes");
+	printf("%-12s %10.0f %12zu\n", "FmtPrintf", fast.nsPerCall, fastStack);
+	printf("%-12s %10.0f %12zu\n", "snprintf", libc.nsPerCall, libcStack);
+	printf("\nFmtPrintf: %.1fx faster, %.1fx less stack\n", libc.nsPerCall / fast.nsPerCall, (double)libcStack / fastStack);
+	return 0;
+}
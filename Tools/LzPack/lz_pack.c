@@ -0,0 +1,468 @@
+/**************************************************************************//**
+* @file      lz_pack.c
+* @brief     Packs application images for the bootloader's LZ decoder and benchmarks it
+* @details   The packer is a hash chain LZ77 with a 64 KB window and one step of
+*            lazy matching, written as the LZ4 style sequences LzImage.h
+*            describes. The bootloader reads matches back from flash, so the
+*            window costs it no RAM.
+*
+*            "unpack" and "bench" run the unmodified Bootloader/src/LzImage/LzImage.c
+*            into a simulated flash. "bench" packs every image given, checks the
+*            round trip, checks that a corrupted body is refused, and reports the
+*            ratio and the host decode speed. The speed on the target, decode plus
+*            programming, is printed by the bootloader after each update.
+*
+*            Build and run from the repository root:
+*
+*              gcc -O2 -std=gnu99 -ITools/LzPack/host -IBootloader/src \
+*                  Tools/LzPack/lz_pack.c Bootloader/src/LzImage/LzImage.c -o lz_pack
+*              ./lz_pack pack Application/Debug/Application.bin Application.bin.lzi
+*              ./lz_pack bench Application/Debug/Application.bin Bootloader/Debug/Bootloader.bin
+*
+*            The packed file is uploaded as Application.bin with its own manifest
+*            (Tools/OtaManifest), the bootloader recognizes it by its magic.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "LzImage/LzImage.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define CRC32_POLYNOMIAL    0xEDB88320UL    ///< Reflected IEEE 802.3 polynomial
+#define HASH_BITS           16
+#define HASH_MAX_TRIES      128     ///< Candidates compared per position
+#define IMAGE_MAX           (256 * 1024UL)  ///< SAMD21J18 flash
+#define BENCH_MIN_SECONDS   0.5     ///< Decode repeatedly for at least this long
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+/// A file in memory
+struct Blob {
+	uint8_t *data;
+	uint32_t len;
+};
+
+/// Growing output buffer
+struct Output {
+	uint8_t *data;
+	uint32_t len;
+	uint32_t cap;
+};
+
+/// Body reader and simulated flash for LzImageDecode()
+struct HostIo {
+	const uint8_t *body;
+	uint32_t bodyLen;
+	uint32_t pos;
+	uint8_t *flash;
+};
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+static int32_t hashHead[1 << HASH_BITS];
+static int32_t *hashPrev;
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static uint32_t Crc32Update(uint32_t crc, const uint8_t *data, uint32_t len)
+ * @brief	Continues a CRC32 over len bytes, 0 starts a new one
+ */
+static uint32_t Crc32Update(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	static uint32_t table[256];
+
+	if (table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int bit = 0; bit < 8; bit++) {
+				c = (c & 1) ? (c >> 1) ^ CRC32_POLYNOMIAL : c >> 1;
+			}
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len-- > 0) {
+		crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static void OutputByte(struct Output *out, uint8_t value)
+{
+	if (out->len == out->cap) {
+		out->cap = out->cap ? out->cap * 2 : 4096;
+		out->data = realloc(out->data, out->cap);
+		if (out->data == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	out->data[out->len++] = value;
+}
+
+/**
+ * @fn		static void OutputLength(struct Output *out, uint32_t rest)
+ * @brief	Continuation bytes of a length whose nibble read 15
+ */
+static void OutputLength(struct Output *out, uint32_t rest)
+{
+	while (rest >= 255) {
+		OutputByte(out, 255);
+		rest -= 255;
+	}
+	OutputByte(out, (uint8_t)rest);
+}
+
+/**
+ * @fn		static void OutputSequence(struct Output *out, const uint8_t *literals, uint32_t count, uint32_t offset, uint32_t matchLen)
+ * @brief	One sequence; matchLen 0 writes the final literals-only sequence
+ */
+static void OutputSequence(struct Output *out, const uint8_t *literals, uint32_t count, uint32_t offset, uint32_t matchLen)
+{
+	uint32_t matchCode = matchLen ? matchLen - LZ_IMAGE_MIN_MATCH : 0;
+	uint8_t token = (uint8_t)(((count < 15 ? count : 15) << 4) | (matchCode < 15 ? matchCode : 15));
+
+	OutputByte(out, token);
+	if (count >= 15) {
+		OutputLength(out, count - 15);
+	}
+	for (uint32_t i = 0; i < count; i++) {
+		OutputByte(out, literals[i]);
+	}
+	if (matchLen == 0) {
+		return;
+	}
+	OutputByte(out, (uint8_t)offset);
+	OutputByte(out, (uint8_t)(offset >> 8));
+	if (matchCode >= 15) {
+		OutputLength(out, matchCode - 15);
+	}
+}
+
+static uint32_t Hash(const uint8_t *p)
+{
+	uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	return (uint32_t)(v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/**
+ * @fn		static uint32_t LongestMatch(const struct Blob *in, uint32_t p, uint32_t *offset)
+ * @brief	Longest earlier occurrence of the bytes at p within the window
+ */
+static uint32_t LongestMatch(const struct Blob *in, uint32_t p, uint32_t *offset)
+{
+	uint32_t best = 0;
+	int tries = 0;
+
+	if (p + LZ_IMAGE_MIN_MATCH > in->len) {
+		return 0;
+	}
+	for (int32_t c = hashHead[Hash(&in->data[p])]; c >= 0 && tries < HASH_MAX_TRIES; c = hashPrev[c], tries++) {
+		uint32_t n = 0;
+
+		if (p - (uint32_t)c > LZ_IMAGE_MAX_OFFSET) {
+			break;
+		}
+		while (p + n < in->len && in->data[c + n] == in->data[p + n]) {
+			n++;
+		}
+		if (n > best) {
+			best = n;
+			*offset = p - (uint32_t)c;
+		}
+	}
+	return best >= LZ_IMAGE_MIN_MATCH ? best : 0;
+}
+
+static void Insert(const struct Blob *in, uint32_t p)
+{
+	if (p + LZ_IMAGE_MIN_MATCH <= in->len) {
+		uint32_t h = Hash(&in->data[p]);
+		hashPrev[p] = hashHead[h];
+		hashHead[h] = (int32_t)p;
+	}
+}
+
+/**
+ * @fn		static void Pack(const struct Blob *in, struct Output *out)
+ * @brief	Writes header and body of a packed image
+ */
+static void Pack(const struct Blob *in, struct Output *out)
+{
+	struct LzImageHeader header = {0};
+	uint32_t literalStart = 0;
+	uint32_t p = 0;
+
+	free(hashPrev);
+	hashPrev = malloc((in->len + 1) * sizeof(*hashPrev));
+	memset(hashHead, 0xFF, sizeof(hashHead));
+
+	out->len = 0;
+	for (int i = 0; i < LZ_IMAGE_HEADER_SIZE; i++) {
+		OutputByte(out, 0);
+	}
+
+	while (p < in->len) {
+		uint32_t offset = 0;
+		uint32_t len = LongestMatch(in, p, &offset);
+
+		if (len > 0) {
+			// Lazy step: a longer match one byte on is worth a literal
+			uint32_t nextOffset = 0;
+			Insert(in, p);
+			uint32_t next = LongestMatch(in, p + 1, &nextOffset);
+			if (next > len + 1) {
+				p++;
+				continue;
+			}
+			OutputSequence(out, &in->data[literalStart], p - literalStart, offset, len);
+			for (uint32_t i = 1; i < len; i++) {
+				Insert(in, p + i);
+			}
+			p += len;
+			literalStart = p;
+		} else {
+			Insert(in, p);
+			p++;
+		}
+	}
+	OutputSequence(out, &in->data[literalStart], in->len - literalStart, 0, 0);
+
+	header.rawLength = in->len;
+	header.rawCrc32 = Crc32Update(0, in->data, in->len);
+	header.bodyLength = out->len - LZ_IMAGE_HEADER_SIZE;
+	header.bodyCrc32 = Crc32Update(0, out->data + LZ_IMAGE_HEADER_SIZE, header.bodyLength);
+	LzImageWriteHeader(&header, Crc32Update, out->data);
+}
+
+static int32_t HostRead(void *ctx, uint8_t *buffer, uint32_t len)
+{
+	struct HostIo *io = ctx;
+	uint32_t n = io->bodyLen - io->pos;
+
+	if (n > len) {
+		n = len;
+	}
+	memcpy(buffer, &io->body[io->pos], n);
+	io->pos += n;
+	return (int32_t)n;
+}
+
+static bool HostWriteRow(void *ctx, uint32_t row, const uint8_t *data)
+{
+	struct HostIo *io = ctx;
+
+	if ((row + 1) * LZ_IMAGE_ROW_SIZE > IMAGE_MAX) {
+		return false;
+	}
+	memcpy(&io->flash[row * LZ_IMAGE_ROW_SIZE], data, LZ_IMAGE_ROW_SIZE);
+	return true;
+}
+
+/**
+ * @fn		static enum LzImageResult Unpack(uint8_t *flash, const uint8_t *packed, uint32_t packedLen, uint32_t *rawLength)
+ * @brief	Does what the bootloader does: header, body CRC, then decode into flash
+ * @param	flash Simulated application flash, IMAGE_MAX bytes
+ */
+static enum LzImageResult Unpack(uint8_t *flash, const uint8_t *packed, uint32_t packedLen, uint32_t *rawLength)
+{
+	struct LzImageHeader header;
+	struct HostIo host = {0};
+	struct LzImageIo io = {flash, HostRead, HostWriteRow, Crc32Update, &host};
+	enum LzImageResult result;
+
+	if (packedLen < LZ_IMAGE_HEADER_SIZE) {
+		return LZ_IMAGE_ERR_HEADER;
+	}
+	result = LzImageReadHeader(packed, Crc32Update, &header);
+	if (result != LZ_IMAGE_OK) {
+		return result;
+	}
+	if (header.rawLength > IMAGE_MAX || header.bodyLength != packedLen - LZ_IMAGE_HEADER_SIZE ||
+		Crc32Update(0, packed + LZ_IMAGE_HEADER_SIZE, header.bodyLength) != header.bodyCrc32) {
+		return LZ_IMAGE_ERR_FORMAT;
+	}
+
+	host.body = packed + LZ_IMAGE_HEADER_SIZE;
+	host.bodyLen = header.bodyLength;
+	host.flash = flash;
+	result = LzImageDecode(&header, &io);
+	*rawLength = header.rawLength;
+	return result;
+}
+
+/**
+ * @fn		static enum LzImageResult DecodeOnly(uint8_t *flash, const uint8_t *packed, uint32_t packedLen)
+ * @brief	Decode without the body CRC, to check the decoder alone copes with corrupt input
+ */
+static enum LzImageResult DecodeOnly(uint8_t *flash, const uint8_t *packed, uint32_t packedLen)
+{
+	struct LzImageHeader header;
+	struct HostIo host = {packed + LZ_IMAGE_HEADER_SIZE, packedLen - LZ_IMAGE_HEADER_SIZE, 0, flash};
+	struct LzImageIo io = {flash, HostRead, HostWriteRow, Crc32Update, &host};
+
+	if (LzImageReadHeader(packed, Crc32Update, &header) != LZ_IMAGE_OK) {
+		return LZ_IMAGE_ERR_HEADER;
+	}
+	return LzImageDecode(&header, &io);
+}
+
+static int ReadBlob(const char *path, struct Blob *blob)
+{
+	FILE *f = fopen(path, "rb");
+
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	blob->data = malloc(IMAGE_MAX + 1);
+	blob->len = (uint32_t)fread(blob->data, 1, IMAGE_MAX + 1, f);
+	fclose(f);
+	if (blob->len == 0 || blob->len > IMAGE_MAX) {
+		fprintf(stderr, "%s: empty or larger than the flash\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int WriteFile(const char *path, const uint8_t *data, uint32_t len)
+{
+	FILE *f = fopen(path, "wb");
+
+	if (f == NULL || fwrite(data, 1, len, f) != len) {
+		perror(path);
+		return -1;
+	}
+	fclose(f);
+	return 0;
+}
+
+static double Seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @fn		static int Bench(const char *name, const struct Blob *in)
+ * @brief	Packs, round-trips, times the decoder and feeds it corrupted bodies
+ * @return	0 on success
+ */
+static int Bench(const char *name, const struct Blob *in)
+{
+	struct Output packed = {0};
+	uint8_t *flash = malloc(IMAGE_MAX);
+	uint32_t rawLength = 0;
+	uint32_t runs = 0;
+	uint32_t seed = 12345;
+	int failed = 0;
+
+	double start = Seconds();
+	Pack(in, &packed);
+	double packSeconds = Seconds() - start;
+
+	memset(flash, 0xFF, IMAGE_MAX);
+	enum LzImageResult result = Unpack(flash, packed.data, packed.len, &rawLength);
+	if (result != LZ_IMAGE_OK || rawLength != in->len || memcmp(flash, in->data, in->len) != 0) {
+		printf("FAIL %s: result %d\n", name, result);
+		failed = 1;
+	}
+
+	start = Seconds();
+	do {
+		Unpack(flash, packed.data, packed.len, &rawLength);
+		runs++;
+	} while (Seconds() - start < BENCH_MIN_SECONDS);
+	double decodeSeconds = (Seconds() - start) / runs;
+
+	// Corrupt bodies must be refused by the decoder itself, without the body CRC
+	for (int i = 0; i < 200; i++) {
+		uint8_t *copy = malloc(packed.len);
+		memcpy(copy, packed.data, packed.len);
+		seed = seed * 1103515245 + 12345;
+		copy[LZ_IMAGE_HEADER_SIZE + (seed >> 8) % (packed.len - LZ_IMAGE_HEADER_SIZE)] ^= (uint8_t)(1 + (seed >> 24) % 255);
+		result = DecodeOnly(flash, copy, packed.len);
+		free(copy);
+		if (result == LZ_IMAGE_OK) {
+			printf("FAIL %s: corrupted body %d decoded\n", name, i);
+			failed = 1;
+			break;
+		}
+	}
+
+	printf("%-36s %6lu -> %6lu bytes (%5.1f%%), pack %4.0f ms, host decode %6.1f MB/s\n", name, (unsigned long)in->len,
+		   (unsigned long)packed.len, 100.0 * packed.len / in->len, packSeconds * 1000, in->len / decodeSeconds / 1e6);
+	free(packed.data);
+	free(flash);
+	return failed;
+}
+
+static void Usage(const char *self)
+{
+	fprintf(stderr,
+			"usage: %s pack in.bin out.lzi\n"
+			"       %s unpack in.lzi out.bin\n"
+			"       %s bench image.bin [image.bin ...]\n",
+			self, self, self);
+}
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+int main(int argc, char **argv)
+{
+	struct Blob a;
+
+	if (argc == 4 && strcmp(argv[1], "pack") == 0) {
+		struct Output packed = {0};
+		if (ReadBlob(argv[2], &a)) {
+			return 1;
+		}
+		Pack(&a, &packed);
+		printf("%lu bytes, %.1f%% of %s\n", (unsigned long)packed.len, 100.0 * packed.len / a.len, argv[2]);
+		return WriteFile(argv[3], packed.data, packed.len) ? 1 : 0;
+	}
+	if (argc == 4 && strcmp(argv[1], "unpack") == 0) {
+		uint8_t *flash = malloc(IMAGE_MAX);
+		uint32_t rawLength = 0;
+		if (ReadBlob(argv[2], &a)) {
+			return 1;
+		}
+		memset(flash, 0xFF, IMAGE_MAX);
+		enum LzImageResult result = Unpack(flash, a.data, a.len, &rawLength);
+		if (result != LZ_IMAGE_OK) {
+			fprintf(stderr, "image refused, result %d\n", result);
+			return 1;
+		}
+		return WriteFile(argv[3], flash, rawLength) ? 1 : 0;
+	}
+	if (argc >= 3 && strcmp(argv[1], "bench") == 0) {
+		int failed = 0;
+		for (int i = 2; i < argc; i++) {
+			if (ReadBlob(argv[i], &a)) {
+				return 1;
+			}
+			failed |= Bench(argv[i], &a);
+			free(a.data);
+		}
+		return failed;
+	}
+	Usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,89 @@
+/**************************************************************************//**
+* @file      ota_manifest.c
+* @brief     Writes the manifest the firmware checks a downloaded Application.bin against
+* @details   Computes the length and IEEE 802.3 CRC32 of the image (the same value
+*            zlib's crc32() and the DSU give) and prints them in the format read by
+*            OtaManifestParse(). Upload the output next to the image, under the
+*            name in MAIN_HTTP_MANIFEST_URL.
+*
+*            Build and run from the repository root:
+*
+*              gcc -O2 -std=gnu99 Tools/OtaManifest/ota_manifest.c -o ota_manifest
+*              ./ota_manifest Application.bin > Application.manifest
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <stdint.h>
+#include <stdio.h>
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define CRC32_POLYNOMIAL    0xEDB88320UL    ///< Reflected IEEE 802.3 polynomial
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+/**
+ * @fn		static uint32_t Crc32Update(uint32_t crc, const uint8_t *data, size_t len)
+ * @brief	Continues a CRC32 over len bytes, 0 starts a new one
+ */
+static uint32_t Crc32Update(uint32_t crc, const uint8_t *data, size_t len)
+{
+	static uint32_t table[256];
+
+	if (table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int bit = 0; bit < 8; bit++) {
+				c = (c & 1) ? (c >> 1) ^ CRC32_POLYNOMIAL : c >> 1;
+			}
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len-- > 0) {
+		crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+/******************************************************************************
+* Global Functions
+******************************************************************************/
+int main(int argc, char **argv)
+{
+	uint8_t buffer[4096];
+	uint32_t crc = 0;
+	uint32_t length = 0;
+	size_t got;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s Application.bin > Application.manifest\n", argv[0]);
+		return 2;
+	}
+
+	FILE *image = fopen(argv[1], "rb");
+	if (image == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	while ((got = fread(buffer, 1, sizeof(buffer), image)) > 0) {
+		crc = Crc32Update(crc, buffer, got);
+		length += (uint32_t)got;
+	}
+	if (ferror(image) || length == 0) {
+		fprintf(stderr, "%s: empty or unreadable\n", argv[1]);
+		fclose(image);
+		return 1;
+	}
+	fclose(image);
+
+	printf("length %lu\n", (unsigned long)length);
+	printf("crc32 %08lx\n", (unsigned long)crc);
+	return 0;
+}
@@ -0,0 +1,14 @@
+/**************************************************************************//**
+* @file      FreeRTOS.h
+* @brief     Host stand-in for the FreeRTOS types the telemetry code uses
+* @details   The firmware runs a 1 ms tick, so ticks and milliseconds are the same.
+******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+
+#define pdMS_TO_TICKS(xTimeInMs) ((TickType_t)(xTimeInMs))
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
@@ -0,0 +1,6 @@
+/**************************************************************************//**
+* @file      task.h
+* @brief     Host stand-in for FreeRTOS task.h, nothing from it is needed on the host
+******************************************************************************/
+
+#pragma once
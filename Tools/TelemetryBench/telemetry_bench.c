@@ -0,0 +1,225 @@
+/**************************************************************************//**
+* @file      telemetry_bench.c
+* @brief     Host benchmark of the telemetry encoders: per-sample JSON, batched JSON and binary
+* @details   Builds the unmodified WifiHandlerThread/TelemetryBatch.c,
+*            iot/stream_writer.c and SerialConsole/FastFormat.c against the
+*            stand-in headers in host/, fills a batch with a representative mix of
+*            IMU, environmental and air velocity samples and times each encoder. It also decodes the binary frame the
+*            same way the Node-RED decoder does and reports the worst rounding error
+*            per value, so a scale factor change that loses precision shows up here.
+*
+*            Build and run from the repository root:
+*
+*              gcc -O2 -std=gnu99 -ITools/TelemetryBench/host -IApplication/src \
+*                  Tools/TelemetryBench/telemetry_bench.c \
+*                  Application/src/WifiHandlerThread/TelemetryBatch.c \
+*                  Application/src/iot/stream_writer.c \
+*                  Application/src/SerialConsole/FastFormat.c -o telemetry_bench -lm
+*              ./telemetry_bench [iterations]
+*
+*            Timings are host numbers. The SAMD21 has no FPU, so on target the
+*            float paths are slower by a larger factor than shown here; the byte
+*            counts are exact.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "WifiHandlerThread/TelemetryBatch.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define BENCH_BUFFER_SIZE   500     ///< MAIN_MQTT_BUFFER_SIZE minus the PUBLISH header
+#define BENCH_TCPIP_HEADER  40      ///< IPv4 + TCP header per segment, no options
+#define BENCH_MQTT_HEADER(topicLen) (2 + 2 + (topicLen) + 2)   ///< fixed header, topic length, topic, packet id
+#define BENCH_PUBACK_BYTES  (4 + BENCH_TCPIP_HEADER)           ///< PUBACK segment coming back per QoS 1 publish
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+struct BenchResult {
+	const char *name;
+	double nsPerBatch;
+	size_t payloadBytes;
+	int messages;
+	size_t wireBytes;
+};
+
+/******************************************************************************
+* Variables
+******************************************************************************/
+/// Inputs for one 5 s window: IMU and environment at 1 Hz, two air velocity reads
+static const struct {
+	uint8_t channel;
+	float value[TELEMETRY_MAX_VALUES];
+} window[] = {
+	{TELEMETRY_IMU, {-12.0f, 31.0f, 1002.0f}},
+	{TELEMETRY_ENV, {23.41f, 41.87f, 100832.42f}},
+	{TELEMETRY_AIR, {4.37f}},
+	{TELEMETRY_IMU, {-15.0f, 29.0f, 998.0f}},
+	{TELEMETRY_ENV, {23.43f, 41.80f, 100831.97f}},
+	{TELEMETRY_IMU, {-9.0f, 35.0f, 1004.0f}},
+	{TELEMETRY_ENV, {23.44f, 41.76f, 100832.61f}},
+	{TELEMETRY_IMU, {-11.0f, 30.0f, 1001.0f}},
+	{TELEMETRY_ENV, {23.46f, 41.71f, 100833.05f}},
+	{TELEMETRY_AIR, {5.02f}},
+	{TELEMETRY_IMU, {-13.0f, 33.0f, 999.0f}},
+	{TELEMETRY_ENV, {23.47f, 41.69f, 100832.88f}},
+};
+#define WINDOW_SAMPLES (sizeof(window) / sizeof(window[0]))
+
+static const char *legacyTopic[TELEMETRY_CHANNELS] = {"IMU_Data", "Environmental_Data", "Air_Velocity_Data"};
+
+/******************************************************************************
+* Local Functions
+******************************************************************************/
+
+static double NowNs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void FillBatch(void)
+{
+	TelemetryBatchInit();
+	for (size_t i = 0; i < WINDOW_SAMPLES; i++) {
+		TelemetryBatchAdd(window[i].channel, window[i].value, 1000 + (TickType_t)i * 400);
+	}
+}
+
+/// The pre-batching path: one sprintf and one publish per sample
+static size_t EncodeLegacy(char *buffer, size_t *wire)
+{
+	size_t payload = 0;
+
+	*wire = 0;
+	for (size_t i = 0; i < WINDOW_SAMPLES; i++) {
+		const float *v = window[i].value;
+		int n;
+
+		if (window[i].channel == TELEMETRY_IMU) {
+			n = sprintf(buffer, "{\"X\":%f, \"Y\":%f, \"Z\": %f}", v[0], v[1], v[2]);
+		} else if (window[i].channel == TELEMETRY_ENV) {
+			n = sprintf(buffer, "{\"T\":%0.2f, \"H\":%0.2f, \"P\":%0.2f}", v[0], v[1], v[2]);
+		} else {
+			n = sprintf(buffer, "%0.2f", v[0]);
+		}
+		payload += n;
+		*wire += n + BENCH_MQTT_HEADER(strlen(legacyTopic[window[i].channel])) + BENCH_TCPIP_HEADER + BENCH_PUBACK_BYTES;
+	}
+	return payload;
+}
+
+static void Run(struct BenchResult *r, int which, long iterations)
+{
+	static char buffer[BENCH_BUFFER_SIZE];
+	uint8_t consumed = 0;
+	size_t wire = 0;
+	int len = 0;
+
+	FillBatch();
+	double start = NowNs();
+	for (long i = 0; i < iterations; i++) {
+		if (which == 0) {
+			len = (int)EncodeLegacy(buffer, &wire);
+		} else if (which == 1) {
+			len = TelemetryBatchEncode(buffer, sizeof(buffer), &consumed);
+		} else {
+			len = TelemetryBatchEncodeBinary(buffer, sizeof(buffer), &consumed);
+		}
+	}
+	r->nsPerBatch = (NowNs() - start) / iterations;
+	r->payloadBytes = (size_t)len;
+	r->messages = (which == 0) ? (int)WINDOW_SAMPLES : 1;
+	r->wireBytes = (which == 0) ? wire : len + BENCH_MQTT_HEADER(strlen(TELEMETRY_TOPIC)) + BENCH_TCPIP_HEADER + BENCH_PUBACK_BYTES;
+}
+
+static uint16_t Read16(const unsigned char *p)
+{
+	return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+/// Decodes a binary frame like the Node-RED node and returns the worst error against the inputs
+static int CheckBinaryRoundTrip(double worst[TELEMETRY_CHANNELS][TELEMETRY_MAX_VALUES])
+{
+	static const double unscale[TELEMETRY_CHANNELS][TELEMETRY_MAX_VALUES] = {{1, 1, 1}, {0.01, 0.01, 10}, {0.01, 0, 0}};
+	unsigned char buffer[BENCH_BUFFER_SIZE];
+	uint8_t consumed = 0;
+
+	FillBatch();
+	int len = TelemetryBatchEncodeBinary((char *)buffer, sizeof(buffer), &consumed);
+	if (len < TELEMETRY_BIN_HEADER_LEN || buffer[0] != TELEMETRY_SCHEMA_ID || buffer[1] != WINDOW_SAMPLES) {
+		return -1;
+	}
+
+	int off = TELEMETRY_BIN_HEADER_LEN;
+	for (size_t i = 0; i < WINDOW_SAMPLES; i++) {
+		uint8_t ch = buffer[off];
+		if (ch != window[i].channel) {
+			return -1;
+		}
+		for (uint8_t v = 0; v < TelemetryChannelValues(ch); v++) {
+			double decoded = (int16_t)Read16(&buffer[off + 3 + 2 * v]) * unscale[ch][v];
+			double err = fabs(decoded - window[i].value[v]);
+			if (err > worst[ch][v]) {
+				worst[ch][v] = err;
+			}
+		}
+		off += TELEMETRY_BIN_SAMPLE_LEN(TelemetryChannelValues(ch));
+	}
+	return (off == len) ? 0 : -1;
+}
+
+/******************************************************************************
+* Main
+******************************************************************************/
+int main(int argc, char **argv)
+{
+	static const char *names[] = {"per-sample JSON", "batched JSON", "batched binary"};
+	struct BenchResult results[3];
+	double worst[TELEMETRY_CHANNELS][TELEMETRY_MAX_VALUES] = {{0}};
+	long iterations = (argc > 1) ? atol(argv[1]) : 200000;
+
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 2;
+	}
+
+	printf("%zu samples per window, %ld iterations\n\n", WINDOW_SAMPLES, iterations);
+	printf("%-16s %10s %9s %5s %10s\n", "encoder", "ns/batch", "payload", "msgs", "wire est.");
+	for (int i = 0; i < 3; i++) {
+		results[i].name = names[i];
+		Run(&results[i], i, iterations);
+		printf("%-16s %10.0f %9zu %5d %10zu\n",
+		       results[i].name,
+		       results[i].nsPerBatch,
+		       results[i].payloadBytes,
+		       results[i].messages,
+		       results[i].wireBytes);
+	}
+
+	printf("\nbinary vs batched JSON: %.1fx smaller, %.1fx faster\n",
+	       (double)results[1].payloadBytes / results[2].payloadBytes,
+	       results[1].nsPerBatch / results[2].nsPerBatch);
+
+	if (CheckBinaryRoundTrip(worst) != 0) {
+		printf("binary round trip: FAILED\n");
+		return 1;
+	}
+	printf("binary round trip: ok, worst error IMU %.3f mg, T %.4f C, H %.4f %%, P %.2f Pa, air %.4f m/s\n",
+	       fmax(worst[0][0], fmax(worst[0][1], worst[0][2])),
+	       worst[1][0],
+	       worst[1][1],
+	       worst[1][2],
+	       worst[2][0]);
+	return 0;
+}
@@ -0,0 +1,23 @@
+/**************************************************************************//**
+* @file      I2cDriver.h
+* @brief     Host stand-in for the FreeRTOS I2C driver. Reads are answered by
+*            the simulated FS3000 in yaw_sim.c.
+******************************************************************************/
+
+#ifndef I2C_DRIVER_H_
+#define I2C_DRIVER_H_
+
+#include "i2c_master.h"
+
+typedef struct I2C_Data
+{
+	uint8_t address;
+	const uint8_t *msgOut;
+	uint8_t	*msgIn;
+	uint16_t lenIn;
+	uint16_t lenOut;
+}I2C_Data;
+
+int32_t I2cOnlyReadWait(I2C_Data *data, const TickType_t xMaxBlockTime);
+
+#endif /* I2C_DRIVER_H_ */
@@ -0,0 +1,30 @@
+/**************************************************************************//**
+* @file      asf.h
+* @brief     Host stand-in for the ASF umbrella header used by the yaw simulator
+* @details   Only the handful of port/delay calls the stepper code needs. The
+*            implementations live in yaw_sim.c and drive the simulated plant.
+*            The stepper sleeps through vTaskDelay(), which maps to delay_ms()
+*            here at the firmware's 1 ms tick.
+******************************************************************************/
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define PIN_PA02 2
+#define PIN_PA03 3
+#define PIN_PA10 10
+
+typedef uint32_t TickType_t;
+
+void port_pin_set_output_level(const uint8_t gpio_pin, const bool level);
+void delay_ms(uint32_t delay);
+
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+
+static inline void vTaskDelay(TickType_t ticks)
+{
+	delay_ms(ticks);
+}
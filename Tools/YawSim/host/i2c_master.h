@@ -0,0 +1,21 @@
+/**************************************************************************//**
+* @file      i2c_master.h
+* @brief     Host stand-in for the ASF SERCOM I2C master header
+******************************************************************************/
+
+#pragma once
+
+#include "asf.h"
+
+struct i2c_master_module {
+	int dummy;
+};
+
+struct i2c_master_packet {
+	uint16_t address;
+	uint16_t data_length;
+	uint8_t *data;
+	bool ten_bit_address;
+	bool high_speed;
+	uint8_t hs_master_code;
+};
@@ -0,0 +1,8 @@
+/**************************************************************************//**
+* @file      i2c_master_interrupt.h
+* @brief     Host stand-in for the ASF I2C callback header (nothing needed)
+******************************************************************************/
+
+#pragma once
+
+#include "i2c_master.h"
@@ -0,0 +1,457 @@
+/**************************************************************************//**
+* @file      yaw_sim.c
+* @brief     Host-side yaw simulation harness for the A4988 stepper logic
+* @details   Builds the unmodified Stepper_control/A4988_StepperMD.c and
+*            AirVelocity/FS_3000.c against the stand-in headers in host/. STEP and
+*            DIR edges drive a second-order nacelle model, delay_ms() advances
+*            simulated time, and every FS3000 I2C read is answered with raw counts
+*            generated from a scripted wind field (direction drift, gusts and
+*            sensor noise) pushed back through the sensor's calibration table.
+*
+*            Build and run from the repository root:
+*
+*              gcc -O2 -std=gnu99 -ITools/YawSim/host -IApplication/src \
+*                  Tools/YawSim/yaw_sim.c \
+*                  Application/src/Stepper_control/A4988_StepperMD.c \
+*                  Application/src/AirVelocity/FS_3000.c -lm -o yaw_sim
+*              ./yaw_sim --seeds 200 --strategy all
+*
+*            Batch mode prints one summary line per strategy; --csv adds one row
+*            per seed. --max-ewm makes the exit code fail when a strategy's mean
+*            energy-weighted misalignment exceeds the limit, for CI-style gating.
+******************************************************************************/
+
+/******************************************************************************
+* Includes
+******************************************************************************/
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "Stepper_control/A4988_StepperMD.h"
+#include "I2cDriver/I2cDriver.h"
+
+/******************************************************************************
+* Defines
+******************************************************************************/
+#define SIM_DT_S            0.001   ///< Plant integration step, one per simulated ms
+#define MOTOR_WN_HZ         6.0     ///< Natural frequency of rotor + nacelle on the step command
+#define MOTOR_ZETA          0.35    ///< Damping ratio of the same
+#define FS3000_RAW_MIN      409
+#define FS3000_RAW_MAX      3686
+#define I2C_READ_MS         1       ///< Time one FS3000 transaction costs on the bus
+#define ALIGN_TOL_DEG       5.0     ///< |error| considered aligned
+#define ALIGN_HOLD_S        5.0     ///< Aligned this long before the clock stops
+#define MAX_RUNS_PER_STRAT  100000
+
+/******************************************************************************
+* Structures and Enumerations
+******************************************************************************/
+enum yaw_strategy {
+	STRATEGY_NONE = 0,
+	STRATEGY_SWEEP,
+	STRATEGY_TRACK,
+	STRATEGY_COUNT
+};
+
+static const char *const strategy_names[STRATEGY_COUNT] = {"none", "sweep", "track"};
+
+/// Parameters of the scripted wind field and schedule
+struct sim_config {
+	double duration_s;
+	double mean_speed;        ///< m/s
+	double drift_deg_per_s;   ///< deterministic veer rate
+	double drift_sigma;       ///< random walk, deg/sqrt(s)
+	double gust_rate_per_min; ///< Poisson arrival rate of gusts
+	double gust_amplitude;    ///< peak extra m/s of a gust
+	double gust_duration_s;
+	double noise_sigma;       ///< sensor noise, m/s
+	double initial_offset;    ///< max |initial misalignment|, deg
+	int sweep_deg;
+	double sweep_period_s;
+	int track_steps;
+	double track_period_s;
+};
+
+/// Metrics of one run
+struct sim_result {
+	double time_to_align_s;   ///< negative if never aligned
+	double ew_misalign_deg;   ///< sum(v^3 |err| dt) / sum(v^3 dt)
+	double duty;              ///< fraction of time the motor was stepping
+	long steps;
+};
+
+/// Simulated plant state, touched by the stand-in ASF/I2C calls
+static struct {
+	const struct sim_config *cfg;
+	uint64_t rng;
+	uint32_t now_ms;
+	bool dir_level;
+	bool step_level;
+	bool moved_since_delay;
+	double cmd_deg;
+	double theta_deg;
+	double omega_dps;
+	double wind_dir_deg;
+	double wind_speed;
+	double gust_left_s;
+	double gust_len_s;
+	/* metrics */
+	double weighted_err;
+	double weight;
+	double aligned_since_s;
+	double time_to_align_s;
+	uint32_t busy_ms;
+	long steps;
+} sim;
+
+/******************************************************************************
+* Forward Declarations
+******************************************************************************/
+static void sim_advance_ms(uint32_t ms);
+
+/******************************************************************************
+* Random numbers (xorshift64*, deterministic per seed)
+******************************************************************************/
+static double rng_uniform(void)
+{
+	sim.rng ^= sim.rng >> 12;
+	sim.rng ^= sim.rng << 25;
+	sim.rng ^= sim.rng >> 27;
+	return (double)((sim.rng * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
+static double rng_normal(void)
+{
+	double u1 = rng_uniform();
+	double u2 = rng_uniform();
+	if (u1 < 1e-12) {
+		u1 = 1e-12;
+	}
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static double wrap_deg(double a)
+{
+	while (a > 180.0) {
+		a -= 360.0;
+	}
+	while (a < -180.0) {
+		a += 360.0;
+	}
+	return a;
+}
+
+/******************************************************************************
+* Stand-ins for the ASF and I2C driver calls made by the firmware
+******************************************************************************/
+void port_pin_set_output_level(const uint8_t gpio_pin, const bool level)
+{
+	if (gpio_pin == DIRECTION) {
+		sim.dir_level = level;
+	} else if (gpio_pin == STEP) {
+		// the A4988 steps on the rising edge
+		if (level && !sim.step_level) {
+			sim.cmd_deg += (sim.dir_level == CLOCK_WISE) ? STEP_ANGLE_DEG : -STEP_ANGLE_DEG;
+			sim.moved_since_delay = true;
+			sim.steps++;
+		}
+		sim.step_level = level;
+	}
+}
+
+void delay_ms(uint32_t delay)
+{
+	if (sim.moved_since_delay) {
+		sim.busy_ms += delay;
+		if (!sim.step_level) {
+			sim.moved_since_delay = false;
+		}
+	}
+	sim_advance_ms(delay);
+}
+
+/// Inverse of the FS3000-1005 calibration used by FS3000_readMetersPerSecond()
+static int speed_to_raw(double mps)
+{
+	static const double mps_points[9] = {0, 1.07, 2.01, 3.00, 3.97, 4.96, 5.98, 6.99, 7.23};
+	static const int raw_points[9] = {409, 915, 1522, 2066, 2523, 2908, 3256, 3572, 3686};
+
+	if (mps <= 0) {
+		return FS3000_RAW_MIN;
+	}
+	for (int i = 0; i < 8; i++) {
+		if (mps <= mps_points[i + 1]) {
+			double frac = (mps - mps_points[i]) / (mps_points[i + 1] - mps_points[i]);
+			return (int)lround(raw_points[i] + frac * (raw_points[i + 1] - raw_points[i]));
+		}
+	}
+	return FS3000_RAW_MAX;
+}
+
+int32_t I2cOnlyReadWait(I2C_Data *data, const TickType_t xMaxBlockTime)
+{
+	(void)xMaxBlockTime;
+	double err = wrap_deg(sim.wind_dir_deg - sim.theta_deg) * M_PI / 180.0;
+	double seen = sim.wind_speed * (cos(err) > 0 ? cos(err) : 0) + sim.cfg->noise_sigma * rng_normal();
+	int raw = speed_to_raw(seen);
+
+	if (data->msgIn != NULL && data->lenIn >= 3) {
+		uint8_t hi = (uint8_t)((raw >> 8) & 0x0F);
+		uint8_t lo = (uint8_t)(raw & 0xFF);
+		memset(data->msgIn, 0, data->lenIn);
+		data->msgIn[1] = hi;
+		data->msgIn[2] = lo;
+		data->msgIn[0] = (uint8_t)(-(hi + lo));
+	}
+	sim_advance_ms(I2C_READ_MS);
+	return 0;
+}
+
+/******************************************************************************
+* Plant
+******************************************************************************/
+static void sim_step_1ms(void)
+{
+	const struct sim_config *cfg = sim.cfg;
+	const double wn = 2.0 * M_PI * MOTOR_WN_HZ;
+
+	// nacelle follows the commanded step position as a damped second-order system
+	double accel = wn * wn * (sim.cmd_deg - sim.theta_deg) - 2.0 * MOTOR_ZETA * wn * sim.omega_dps;
+	sim.omega_dps += accel * SIM_DT_S;
+	sim.theta_deg += sim.omega_dps * SIM_DT_S;
+
+	// wind direction: steady veer plus a random walk
+	sim.wind_dir_deg += cfg->drift_deg_per_s * SIM_DT_S + cfg->drift_sigma * sqrt(SIM_DT_S) * rng_normal();
+
+	// wind speed: mean plus raised-cosine gusts arriving as a Poisson process
+	if (sim.gust_left_s <= 0 && rng_uniform() < cfg->gust_rate_per_min / 60.0 * SIM_DT_S) {
+		sim.gust_len_s = cfg->gust_duration_s * (0.5 + rng_uniform());
+		sim.gust_left_s = sim.gust_len_s;
+	}
+	double gust = 0;
+	if (sim.gust_left_s > 0) {
+		double phase = 1.0 - sim.gust_left_s / sim.gust_len_s;
+		gust = cfg->gust_amplitude * 0.5 * (1.0 - cos(2.0 * M_PI * phase));
+		sim.gust_left_s -= SIM_DT_S;
+	}
+	sim.wind_speed = cfg->mean_speed + gust;
+
+	// metrics
+	double t = sim.now_ms * SIM_DT_S;
+	double err = fabs(wrap_deg(sim.wind_dir_deg - sim.theta_deg));
+	double power = sim.wind_speed * sim.wind_speed * sim.wind_speed;
+	sim.weighted_err += power * err * SIM_DT_S;
+	sim.weight += power * SIM_DT_S;
+	if (err < ALIGN_TOL_DEG) {
+		if (sim.aligned_since_s < 0) {
+			sim.aligned_since_s = t;
+		}
+		if (sim.time_to_align_s < 0 && t - sim.aligned_since_s >= ALIGN_HOLD_S) {
+			sim.time_to_align_s = sim.aligned_since_s;
+		}
+	} else {
+		sim.aligned_since_s = -1;
+	}
+
+	sim.now_ms++;
+}
+
+static void sim_advance_ms(uint32_t ms)
+{
+	for (uint32_t i = 0; i < ms; i++) {
+		sim_step_1ms();
+	}
+}
+
+/******************************************************************************
+* Runs
+******************************************************************************/
+static void run_once(const struct sim_config *cfg, enum yaw_strategy strategy, uint64_t seed, struct sim_result *out)
+{
+	memset(&sim, 0, sizeof(sim));
+	sim.cfg = cfg;
+	sim.rng = seed * 0x9E3779B97F4A7C15ULL + 1;
+	sim.aligned_since_s = -1;
+	sim.time_to_align_s = -1;
+	sim.wind_speed = cfg->mean_speed;
+	sim.wind_dir_deg = (2.0 * rng_uniform() - 1.0) * cfg->initial_offset;
+
+	uint32_t end_ms = (uint32_t)(cfg->duration_s * 1000.0);
+	uint32_t next_sweep_ms = 0;
+	uint32_t next_track_ms = 0;
+
+	while (sim.now_ms < end_ms) {
+		if (strategy == STRATEGY_SWEEP && sim.now_ms >= next_sweep_ms) {
+			next_sweep_ms = sim.now_ms + (uint32_t)(cfg->sweep_period_s * 1000.0);
+			AutomateTurbine(cfg->sweep_deg);
+		} else if (strategy == STRATEGY_TRACK && sim.now_ms >= next_track_ms) {
+			next_track_ms = sim.now_ms + (uint32_t)(cfg->track_period_s * 1000.0);
+			YawTrackWind(cfg->track_steps);
+		} else {
+			sim_advance_ms(100);
+		}
+	}
+
+	out->time_to_align_s = sim.time_to_align_s;
+	out->ew_misalign_deg = (sim.weight > 0) ? sim.weighted_err / sim.weight : 0;
+	out->duty = (double)sim.busy_ms / sim.now_ms;
+	out->steps = sim.steps;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double da = *(const double *)a;
+	double db = *(const double *)b;
+	return (da > db) - (da < db);
+}
+
+static void usage(const char *prog)
+{
+	printf("usage: %s [options]\n"
+	       "  --seeds N            runs per strategy (default 50)\n"
+	       "  --first-seed N       first seed (default 1)\n"
+	       "  --strategy S         none|sweep|track|all (default all)\n"
+	       "  --duration S         simulated seconds per run (default 600)\n"
+	       "  --speed V            mean wind speed m/s (default 4)\n"
+	       "  --drift D            steady veer deg/s (default 0.02)\n"
+	       "  --drift-sigma D      direction random walk deg/sqrt(s) (default 0.5)\n"
+	       "  --gusts R            gusts per minute (default 2)\n"
+	       "  --gust-amp V         gust peak m/s (default 2)\n"
+	       "  --noise V            sensor noise m/s (default 0.15)\n"
+	       "  --offset D           max initial misalignment deg (default 90)\n"
+	       "  --sweep-deg D        AutomateTurbine() width (default 120)\n"
+	       "  --sweep-period S     seconds between sweeps (default 120)\n"
+	       "  --track-steps N      YawTrackWind() probe budget (default 10)\n"
+	       "  --track-period S     seconds between tracker calls (default 5)\n"
+	       "  --csv                print one row per run\n"
+	       "  --max-ewm D          exit 1 if a strategy's mean EWM exceeds D deg\n",
+	       prog);
+}
+
+int main(int argc, char **argv)
+{
+	struct sim_config cfg = {
+	    .duration_s = 600,
+	    .mean_speed = 4.0,
+	    .drift_deg_per_s = 0.02,
+	    .drift_sigma = 0.5,
+	    .gust_rate_per_min = 2,
+	    .gust_amplitude = 2.0,
+	    .gust_duration_s = 8,
+	    .noise_sigma = 0.15,
+	    .initial_offset = 90,
+	    .sweep_deg = 120,
+	    .sweep_period_s = 120,
+	    .track_steps = 10,
+	    .track_period_s = 5,
+	};
+	int seeds = 50;
+	long first_seed = 1;
+	int strategy_mask = (1 << STRATEGY_COUNT) - 1;
+	bool csv = false;
+	double max_ewm = -1;
+
+	static const struct option options[] = {
+	    {"seeds", required_argument, NULL, 'n'},
+	    {"first-seed", required_argument, NULL, 'f'},
+	    {"strategy", required_argument, NULL, 's'},
+	    {"duration", required_argument, NULL, 'd'},
+	    {"speed", required_argument, NULL, 'v'},
+	    {"drift", required_argument, NULL, 'r'},
+	    {"drift-sigma", required_argument, NULL, 'R'},
+	    {"gusts", required_argument, NULL, 'g'},
+	    {"gust-amp", required_argument, NULL, 'G'},
+	    {"noise", required_argument, NULL, 'z'},
+	    {"offset", required_argument, NULL, 'o'},
+	    {"sweep-deg", required_argument, NULL, 'w'},
+	    {"sweep-period", required_argument, NULL, 'W'},
+	    {"track-steps", required_argument, NULL, 't'},
+	    {"track-period", required_argument, NULL, 'T'},
+	    {"csv", no_argument, NULL, 'c'},
+	    {"max-ewm", required_argument, NULL, 'm'},
+	    {"help", no_argument, NULL, 'h'},
+	    {NULL, 0, NULL, 0},
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+		switch (opt) {
+			case 'n': seeds = atoi(optarg); break;
+			case 'f': first_seed = atol(optarg); break;
+			case 's':
+				strategy_mask = 0;
+				for (int i = 0; i < STRATEGY_COUNT; i++) {
+					if (strcmp(optarg, strategy_names[i]) == 0 || strcmp(optarg, "all") == 0) {
+						strategy_mask |= 1 << i;
+					}
+				}
+				break;
+			case 'd': cfg.duration_s = atof(optarg); break;
+			case 'v': cfg.mean_speed = atof(optarg); break;
+			case 'r': cfg.drift_deg_per_s = atof(optarg); break;
+			case 'R': cfg.drift_sigma = atof(optarg); break;
+			case 'g': cfg.gust_rate_per_min = atof(optarg); break;
+			case 'G': cfg.gust_amplitude = atof(optarg); break;
+			case 'z': cfg.noise_sigma = atof(optarg); break;
+			case 'o': cfg.initial_offset = atof(optarg); break;
+			case 'w': cfg.sweep_deg = atoi(optarg); break;
+			case 'W': cfg.sweep_period_s = atof(optarg); break;
+			case 't': cfg.track_steps = atoi(optarg); break;
+			case 'T': cfg.track_period_s = atof(optarg); break;
+			case 'c': csv = true; break;
+			case 'm': max_ewm = atof(optarg); break;
+			default: usage(argv[0]); return (opt == 'h') ? 0 : 2;
+		}
+	}
+	if (seeds < 1 || seeds > MAX_RUNS_PER_STRAT || strategy_mask == 0 || cfg.duration_s <= 0) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	static double tta[MAX_RUNS_PER_STRAT];
+	int failed = 0;
+
+	if (csv) {
+		printf("strategy,seed,time_to_align_s,ew_misalign_deg,duty,steps\n");
+	}
+	for (int s = 0; s < STRATEGY_COUNT; s++) {
+		if (!(strategy_mask & (1 << s))) {
+			continue;
+		}
+
+		double sum_ewm = 0, sum_duty = 0, sum_steps = 0;
+		int aligned = 0;
+		for (int i = 0; i < seeds; i++) {
+			struct sim_result r;
+			run_once(&cfg, (enum yaw_strategy)s, (uint64_t)(first_seed + i), &r);
+			if (csv) {
+				printf("%s,%ld,%.1f,%.2f,%.4f,%ld\n", strategy_names[s], first_seed + i, r.time_to_align_s, r.ew_misalign_deg, r.duty, r.steps);
+			}
+			sum_ewm += r.ew_misalign_deg;
+			sum_duty += r.duty;
+			sum_steps += r.steps;
+			if (r.time_to_align_s >= 0) {
+				tta[aligned++] = r.time_to_align_s;
+			}
+		}
+
+		double p50 = -1, p90 = -1;
+		if (aligned > 0) {
+			qsort(tta, aligned, sizeof(tta[0]), compare_double);
+			p50 = tta[aligned / 2];
+			p90 = tta[(aligned * 9) / 10 < aligned ? (aligned * 9) / 10 : aligned - 1];
+		}
+		double mean_ewm = sum_ewm / seeds;
+		printf("# %-5s runs=%d aligned=%.0f%% tta_p50=%.1fs tta_p90=%.1fs ewm=%.2fdeg duty=%.2f%% steps=%.0f\n",
+		       strategy_names[s], seeds, 100.0 * aligned / seeds, p50, p90, mean_ewm, 100.0 * sum_duty / seeds, sum_steps / seeds);
+
+		if (max_ewm >= 0 && s != STRATEGY_NONE && mean_ewm > max_ewm) {
+			failed = 1;
+		}
+	}
+
+	return failed;
+}